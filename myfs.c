@@ -11,1088 +11,10587 @@
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#ifdef MYFS_ZSTD
+#include <zstd.h>
+#endif
 
 #include "myfs.h"
 
-//We treat the root as if it was a directory, and store it here
+//We treat the root as if it was a directory, and store it here. Only its
+//meta_data_id is used once the file system is running; the root's meta data
+//is looked up like any other file's.
 file* root_directory;
-file* requested_file;
 
+/*
+ ***************
+	Locking
+ ***************
+
+	Every FUSE callback works on its own copies of the files it needs, so
+	callbacks can run on many threads at once. What they share is protected as
+	follows, and locks are always taken in this order:
+
+	0. The transaction gate, held shared by callbacks that change the DB for as
+		 long as they run, and exclusively to commit.
+	1. The rename lock, held by renames that move a file to another directory,
+		 so that two of them cannot each move a directory into the other.
+	2. Inode locks. Readers and writers of a file's meta data or data hold its
+		 inode lock shared or exclusive. Callbacks that need two (create and unlink
+		 lock the parent and the child) take them through inode_lock_pair(), which
+		 orders them by lock index. Rename needs up to four, and takes them through
+		 inode_lock_set() in the same order. Rolling back a failed commit takes
+		 every one of them, in the same order, while holding the gate.
+	3. The dedup lock, then the segment lock, held around the DB calls that
+		 change shared chunks and the data log.
+	4. The control files' lock, held while the counts are taken together.
+	5. The dentry cache lock, the paged directory cache lock, the write-back
+		 cache lock, the readahead lock, the statistics lock and the DB lock. These
+		 are leaves: nothing else is acquired while holding any of them.
+
+	Writing back another file's dirty data to make room in the write-back cache
+	only ever try-locks that file, so it cannot break the order either. A reader
+	only waits for the readahead thread to read a block once the thread holds the
+	inode lock it needs, and the thread never waits for a reader.
+
+	Looking a path up takes no inode locks at all. It reads whatever is in the
+	DB, and the dentry cache makes sure a lookup racing with a writer can never
+	cache what it read over the writer's newer copy.
+*/
 
 /*
  ***************
-	Helper Methods
+	Logging
  ***************
+
+	write_log() is for tracing and compiles to nothing unless MYFS_LOG_LEVEL
+	is raised to MYFS_LOG_DEBUG; log_info() and log_error() are kept. Records at
+	or below both that and the level set at mount time go into a ring, without
+	taking a lock or formatting anything: a record is the format string and the
+	raw arguments, with any strings copied in. A background thread formats
+	them and hands them on to the log. When the ring is full records are
+	dropped and counted rather than making the caller wait.
 */
 
+#define MYFS_LOG_ERROR 0
+#define MYFS_LOG_INFO 1
+#define MYFS_LOG_DEBUG 2
+
+#ifndef MYFS_LOG_LEVEL
+#define MYFS_LOG_LEVEL MYFS_LOG_INFO
+#endif
+
+#define LOG_RING_SIZE 4096 //Must be a power of two
+#define LOG_MAX_ARGS 12
+#define LOG_TEXT_SIZE 256
+#define LOG_LINE_SIZE 1024
+#define LOG_IDLE_NS 1000000 //How long the logger sleeps when there is nothing to do
+
+static int log_level = MYFS_LOG_INFO;
+
+#define log_at(level, ...) do { \
+		if ((level) <= MYFS_LOG_LEVEL && (level) <= log_level){ \
+			log_record(__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define log_error(...) log_at(MYFS_LOG_ERROR, __VA_ARGS__)
+#define log_info(...) log_at(MYFS_LOG_INFO, __VA_ARGS__)
+#define write_log(...) log_at(MYFS_LOG_DEBUG, __VA_ARGS__)
+
+typedef union log_arg {
+	long long i;
+	unsigned long long u;
+	double d;
+	const void* p;
+} log_arg;
+
+typedef struct log_entry {
+	unsigned long seq; //Which lap of the ring this slot is ready for
+	const char* format;
+	int nargs;
+	log_arg args[LOG_MAX_ARGS]; //For strings, where they are in text
+	int text_used;
+	char text[LOG_TEXT_SIZE];
+} log_entry;
+
+static log_entry log_ring[LOG_RING_SIZE];
+static unsigned long log_head = 0; //The next slot to write
+static unsigned long log_tail = 0; //The next slot to read (logger only)
+static unsigned long log_dropped = 0;
+static int log_started = 0; //Whether the logger has been started in this process
+static int log_running = 0;
+static int log_stopping = 0;
+static pthread_t log_thread;
+
+//A conversion from a format string
+typedef struct log_spec {
+	char flags[8];
+	int width; //-1 if none, -2 if given as an argument
+	int precision; //As width
+	int length; //'l' for long, 'L' for long long, 'z' for size_t, etc.
+	char conversion;
+} log_spec;
+
 /**
- * Find's the number in the array where this parent holds its child
- *
- * @param path the path of the file to be found
- * @param dir the parent directory (exact parent)
- *
- * @return the number in data structure that the child is located at. or a < 0
- *				 number if the child cannot be located.
- */
-int find_child_number(const char* path, file* dir){
-	write_log("-- Finding child number --\n");
-	//We do not want compiler warnings about 'const' becoming omitted when used
-	//Later and this avoids that
-	char file_path[MY_MAX_PATH];
-	memset(file_path,0,MY_MAX_PATH);
-	strcat(file_path, path);
-	write_log("File path to find: %s\n", file_path);
-	write_log("Parent path: %s ID: %x\n", dir->path, dir->meta_data_id);
-	int number_children = dir->number_children;
-	write_log("Trying to find %s, total children to consider: %d\n", path, \
-						number_children);
-
-	//This is a simple iteration through all children in the structure to see if
-	//any of them have the path we are looking for
-	for (int i=REST_POS; i<number_children; i++){
-			file* child = malloc(sizeof(file));
-			unqlite_int64 size = sizeof(file);
-			write_log("Check ID: %x\n", dir->children[i]);
-			int rc = unqlite_kv_fetch(pDb,&dir->children[i], KEY_SIZE, child,&size);
-			if (rc != UNQLITE_OK){
-				write_log("DB error in finding child number");
-				return rc;
-			}
-			char* fpath = (char*)&(child->path);
-			write_log("Comparing %s to path: %s which is position: %d\n",path,\
-			 					fpath, i);
+ * Parses the conversion starting just after a '%'.
+ *
+ * @return where the conversion ends
+ */
+static const char* log_parse(const char* p, log_spec* spec){
+	int flags = 0;
+	while (*p != '\0' && strchr("-+ #0", *p) != NULL){
+		if (flags < (int)sizeof(spec->flags) - 1){
+			spec->flags[flags++] = *p;
+		}
+		p++;
+	}
+	spec->flags[flags] = '\0';
+
+	spec->width = -1;
+	if (*p == '*'){
+		spec->width = -2;
+		p++;
+	}else if (isdigit((unsigned char)*p)){
+		spec->width = strtol(p, (char**)&p, 10);
+	}
+	spec->precision = -1;
+	if (*p == '.'){
+		p++;
+		if (*p == '*'){
+			spec->precision = -2;
+			p++;
+		}else{
+			spec->precision = strtol(p, (char**)&p, 10);
+		}
+	}
 
-			if(strcmp(file_path, fpath)==0) {
-				write_log("File found at index: %d\n", i);
-				return i;
-			}
+	spec->length = 0;
+	if (p[0] == 'l' && p[1] == 'l'){
+		spec->length = 'L';
+		p += 2;
+	}else if (p[0] == 'h' && p[1] == 'h'){
+		spec->length = 'H';
+		p += 2;
+	}else if (*p != '\0' && strchr("hlLjzt", *p) != NULL){
+		spec->length = *p++;
 	}
-	//If we exit this loop we did not find the file. Return -1.
-	return -1;
+	spec->conversion = *p;
+	return (*p != '\0') ? p + 1 : p;
 }
 
 /**
- * Retrieves the file object for a specific
-	init_fs(); path.
- *
- * @param the path to find the file struct for
- *
- * @return will place the file into the requested_file cache, if not found
- * will place < 0 as the size of the current requested_file.
+ * Copies a record's arguments off the caller's stack, the way the format
+ * string says printf would read them.
  */
-void traverse_to_file(const char* path, uuid_t parent){
-	int len = strlen(path);
-	char i_path[len]; //Sometimes weird things happen as described below
-	memcpy(i_path, path, len);
-	i_path[len] = '\0';
-	write_log("-- Traversing to File --\n");
-	write_log("Internal path: %s path: %s length: %d\n",i_path, path, len);
+static void log_capture(log_entry* e, va_list ap){
+	e->nargs = 0;
+	e->text_used = 0;
+	for (const char* p = e->format; *p != '\0';){
+		if (*p++ != '%'){
+			continue;
+		}
+		log_spec spec;
+		p = log_parse(p, &spec);
+		if (spec.conversion == '%' || spec.conversion == '\0'){
+			continue;
+		}
 
-	//Special case
-	if (strcmp(path,"/")==0){
-		write_log("Returning root!\n");
-		unqlite_int64 size = sizeof(file);
-		int rc = unqlite_kv_fetch(pDb, &root_directory->meta_data_id, KEY_SIZE, \
-															requested_file, &size);
-		//For this cae we need to ensure that both the cache and the root directory
-		//are consistent.
-		memcpy(root_directory, requested_file, sizeof(file));
-		write_log("Root ID: %x\n", root_directory->meta_data_id);
-		write_log("Requested file ID: %x\n", requested_file->meta_data_id);
-		return;
+		//Each argument is read even when there is no room left for it
+		log_arg arg[3];
+		int n = 0;
+		if (spec.width == -2){
+			arg[n++].i = va_arg(ap, int);
+		}
+		if (spec.precision == -2){
+			arg[n++].i = va_arg(ap, int);
+		}
+		char c = spec.conversion;
+		if (c == 'd' || c == 'i'){
+			switch (spec.length){
+				case 'l': arg[n].i = va_arg(ap, long); break;
+				case 'L': arg[n].i = va_arg(ap, long long); break;
+				case 'z': arg[n].i = va_arg(ap, ssize_t); break;
+				case 'j': arg[n].i = va_arg(ap, intmax_t); break;
+				case 't': arg[n].i = va_arg(ap, ptrdiff_t); break;
+				default: arg[n].i = va_arg(ap, int); break;
+			}
+		}else if (strchr("uxXoc", c) != NULL){
+			switch (spec.length){
+				case 'l': arg[n].u = va_arg(ap, unsigned long); break;
+				case 'L': arg[n].u = va_arg(ap, unsigned long long); break;
+				case 'z': arg[n].u = va_arg(ap, size_t); break;
+				case 'j': arg[n].u = va_arg(ap, uintmax_t); break;
+				case 't': arg[n].u = va_arg(ap, ptrdiff_t); break;
+				default: arg[n].u = va_arg(ap, unsigned int); break;
+			}
+		}else if (strchr("fFeEgGaA", c) != NULL){
+			arg[n].d = (spec.length == 'L') ? va_arg(ap, long double) : va_arg(ap, double);
+		}else if (c == 's'){
+			const char* s = va_arg(ap, const char*);
+			if (s == NULL){
+				s = "(null)";
+			}
+			int room = LOG_TEXT_SIZE - e->text_used - 1;
+			int len = strnlen(s, (room > 0) ? room : 0);
+			memcpy(e->text + e->text_used, s, len);
+			e->text[e->text_used + len] = '\0';
+			arg[n].i = e->text_used;
+			e->text_used += len + 1;
+			if (e->text_used > LOG_TEXT_SIZE - 1){
+				e->text_used = LOG_TEXT_SIZE - 1;
+			}
+		}else{
+			arg[n].p = va_arg(ap, void*);
+		}
+		n++;
+		for (int i = 0; i < n && e->nargs < LOG_MAX_ARGS; i++){
+			e->args[e->nargs++] = arg[i];
+		}
+	}
+}
 
-	}else{
-		//Sometimes /b can be passed in as /b/ which will skew results. This fixes
-		//that occurrence.
-		write_log("Char to consider: %c\n",(char)(i_path[len-1]));
-		if ((i_path[len-1]) == '/') {
-			write_log("Replacing character\n");
-			i_path[len-1] = '\0';
+/**
+ * Formats a record taken from the ring.
+ */
+static void log_format(const log_entry* e, char* out, size_t size){
+	size_t used = 0;
+	int next = 0;
+	for (const char* p = e->format; *p != '\0' && used < size - 1;){
+		if (*p != '%'){
+			out[used++] = *p++;
+			continue;
+		}
+		log_spec spec;
+		p = log_parse(p + 1, &spec);
+		if (spec.conversion == '%' || spec.conversion == '\0'){
+			if (spec.conversion == '%'){
+				out[used++] = '%';
+			}
+			continue;
 		}
-		write_log("New path: %s\n", i_path);
 
-	}
+		//The conversion is rebuilt with everything from the record filled in
+		int width = spec.width;
+		int precision = spec.precision;
+		if (width == -2){
+			width = (next < e->nargs) ? (int)e->args[next++].i : -1;
+		}
+		if (precision == -2){
+			precision = (next < e->nargs) ? (int)e->args[next++].i : -1;
+		}
+		if (next >= e->nargs){
+			continue; //It had more arguments than a record holds
+		}
+		log_arg arg = e->args[next++];
 
-	write_log("Non-root requested, parent ID: %x\n", parent);
-	//We know it was not the root that was requested now
-	//We want to iterate from our parent directory throughout the tree which it
-	//is the head of to see if we can find our file
-	file* current_file = malloc(sizeof(file));
-	unqlite_int64 size = sizeof(file);
-	//Because we start from the parent UUID  we do not always need to traverse
-	//the entire tree
-	int rc = unqlite_kv_fetch(pDb, parent, KEY_SIZE, current_file, &size);
+		char fmt[48];
+		int len = snprintf(fmt, sizeof(fmt), "%%%s", spec.flags);
+		if (width >= 0){
+			len += snprintf(fmt + len, sizeof(fmt) - len, "%d", width);
+		}
+		if (precision >= 0){
+			len += snprintf(fmt + len, sizeof(fmt) - len, ".%d", precision);
+		}
 
-	//Sanity check
-	if (rc != UNQLITE_OK){
-		write_log("DB error in traversing to file\n");
-		return;
+		char c = spec.conversion;
+		int wrote;
+		if (c == 'd' || c == 'i' || (strchr("uxXo", c) != NULL)){
+			snprintf(fmt + len, sizeof(fmt) - len, "ll%c", c);
+			wrote = snprintf(out + used, size - used, fmt, arg.i);
+		}else if (strchr("fFeEgGaA", c) != NULL){
+			snprintf(fmt + len, sizeof(fmt) - len, "%c", c);
+			wrote = snprintf(out + used, size - used, fmt, arg.d);
+		}else if (c == 's'){
+			snprintf(fmt + len, sizeof(fmt) - len, "s");
+			wrote = snprintf(out + used, size - used, fmt, e->text + arg.i);
+		}else if (c == 'c'){
+			snprintf(fmt + len, sizeof(fmt) - len, "c");
+			wrote = snprintf(out + used, size - used, fmt, (int)arg.u);
+		}else{
+			wrote = snprintf(out + used, size - used, "%p", arg.p);
+		}
+		if (wrote > 0){
+			used += ((size_t)wrote < size - used) ? (size_t)wrote : size - used - 1;
+		}
 	}
+	out[used] = '\0';
+}
 
-	//This will hold the sub directory we are current in eg: when we split
-	//a/b/c/d.txt we will b e in sub directories: a, b, c and d.txt. This holds
-	//where which one we are currently on.
-	char* subdir = malloc(MY_MAX_PATH);
-	memset(subdir, 0, MY_MAX_PATH);
-
-	char delim[2] = "/\0"; //Standard deliminator on UNIX systems
+/**
+ * Takes the next record off the ring.
+ *
+ * @return 1 if there was one, 0 if the ring is empty
+ */
+static int log_take(char* line, size_t size){
+	log_entry* e = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+	if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != log_tail + 1){
+		return 0;
+	}
+	log_format(e, line, size);
+	__atomic_store_n(&e->seq, log_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	log_tail++;
+	return 1;
+}
 
-	//We also want to avoid warnings about const char* path with the const being
-	//omitted, so we have to create our own copy.
-	char internal_path[MY_MAX_PATH];
-	strcpy(internal_path, i_path);
+static void* log_main(void* arg){
+	(void) arg;
+	char* line = malloc(LOG_LINE_SIZE);
+	unsigned long reported = 0;
+	for (;;){
+		if (line != NULL && log_take(line, LOG_LINE_SIZE)){
+			(write_log)("%s", line);
+			continue;
+		}
+		unsigned long dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+		if (dropped != reported){
+			(write_log)("%lu log records dropped\n", dropped - reported);
+			reported = dropped;
+		}
+		if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE)){
+			while (line != NULL && log_take(line, LOG_LINE_SIZE)){
+				(write_log)("%s", line);
+			}
+			break;
+		}
+		struct timespec idle = {0, LOG_IDLE_NS};
+		nanosleep(&idle, NULL);
+	}
+	free(line);
+	return NULL;
+}
 
-	//Split the path based on the deliminator into sections
-	subdir = strtok(internal_path, delim);
+//A forked child (fuse_daemonize() forks after we may have started logging)
+//has no logger thread, so it starts its own
+static void log_forked(){
+	log_started = 0;
+	log_running = 0;
+	log_stopping = 0;
+	log_head = 0;
+	log_tail = 0;
+}
 
-	//We need to build up the directory as we go.
-	//eg: for a/b/c/d.txt we need to traverse through a to find b, then b to find
-	//c and finally c to find d.txt. We are unable to jump from a -> d.txt.
-	char current_path[MY_MAX_PATH];
-	memset(current_path,'\0', MY_MAX_PATH);
+static void log_start(){
+	static int forks_watched = 0;
+	int started = 0;
+	if (!__atomic_compare_exchange_n(&log_started, &started, 1, 0, \
+																	__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		return;
+	}
+	if (!forks_watched){
+		pthread_atfork(NULL, NULL, log_forked);
+		forks_watched = 1;
+	}
+	for (unsigned long i = 0; i < LOG_RING_SIZE; i++){
+		log_ring[i].seq = i;
+	}
+	if (pthread_create(&log_thread, NULL, log_main, NULL) == 0){
+		__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+	}
+}
 
-	int position; //position of current child we need to move to.
+/**
+ * Logs a record. Only the logging macros call this, once they have checked
+ * its level.
+ *
+ * @param format a printf format, which must be a string literal
+ */
+void log_record(const char* format, ...){
+	if (!__atomic_load_n(&log_started, __ATOMIC_ACQUIRE)){
+		log_start();
+	}
+	va_list ap;
+	va_start(ap, format);
+
+	//Without the logger thread (before it could start, or after unmounting)
+	//records are written straight out
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+		char line[LOG_LINE_SIZE];
+		vsnprintf(line, sizeof(line), format, ap);
+		va_end(ap);
+		(write_log)("%s", line);
+		return;
+	}
 
-	while (subdir != NULL){
-		write_log("Current token: %s \n", subdir);
-		write_log("Current file path: %s\n", current_file->path);
-		if (strcmp(path, current_file->path)==0){
-			//We have found the file
-			rc = unqlite_kv_fetch(pDb, current_file->meta_data_id, KEY_SIZE,  \
-													requested_file, &size);
-			write_log("Req ID: %x CF ID: %x\n", requested_file->meta_data_id, \
-								current_file->meta_data_id);
+	//Claim the next slot, unless the logger has not emptied it yet
+	unsigned long pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	log_entry* e;
+	for (;;){
+		e = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		long diff = (long)(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0){
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1, \
+																			__ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}else if (diff < 0){
+			__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+			va_end(ap);
 			return;
-		 }
+		}else{
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
 
-		//We need to add our deliminator to our current path (/) and then add
-		//the current directory we are looking at (eg a,b etc.) so we can build up
-		//as we traverse through the tree
-		strcat(current_path, delim);
-		strcat(current_path, subdir);
-		write_log("Current path: %s\n", current_path);
+	e->format = format;
+	log_capture(e, ap);
+	va_end(ap);
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+}
 
-		position = find_child_number(current_path, current_file);
+/**
+ * Sets which records are kept. Levels above MYFS_LOG_LEVEL are always
+ * compiled out.
+ *
+ * @param level MYFS_LOG_ERROR, MYFS_LOG_INFO or MYFS_LOG_DEBUG
+ */
+void log_set_level(int level){
+	__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
 
-		//Safety first
-		if (position < 0){
-			write_log("File not found (traverse to file)\n");
-			requested_file->size = -1;
-			return;
-		 }
+/**
+ * Writes out everything still in the ring and stops the logger. Anything
+ * logged afterwards is written straight out.
+ */
+void log_stop(){
+	if (__atomic_exchange_n(&log_running, 0, __ATOMIC_ACQ_REL)){
+		__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+		pthread_join(log_thread, NULL);
+	}
+}
 
-		//Update and allow us to traverse further down the tree
-		int rc = unqlite_kv_fetch(pDb, &(current_file->children[position]), \
-															KEY_SIZE, current_file, &size);
-		write_log("Found and updated current_file\n");
+/*
+ ***************
+	Statistics
+ ***************
 
-		if (rc != UNQLITE_OK){
-			write_log("DB error in traversing to file\n");
-			requested_file->size = -1;
-			return;
-		}
+	Every callback and every call into the backend is counted and timed: how
+	many there were, how many failed, how many bytes they moved, and how long
+	they took as a histogram with a bucket per power of two nanoseconds. Each
+	thread counts into a block of its own, so counting takes no locks, and a
+	report adds the blocks up. Blocks are never freed; one left by a thread that
+	has exited is taken over by the next thread to start counting. Resetting
+	keeps the totals at that moment to take off later reports, so that nothing
+	but its own thread ever writes to a block.
+*/
 
-		write_log("Compare: %s to %s\n", current_file->path, i_path);
-		if (strcmp(current_file->path, i_path)== 0){
-			//Copy it to cache
-			memcpy(requested_file, current_file, sizeof(file));
-			requested_file->size = current_file->size;
-			write_log("Ensuring files are sized correctly: %d\n", \
-										requested_file->size);
-			write_log("File found! %x Requested ID: %x\n", \
-										current_file->meta_data_id, requested_file->meta_data_id);
-			write_log("Cache file's path: %s\n", current_file->path);
-			return;
-		}
+//Bucket i holds latencies from 2^(i-1) up to 2^i ns, and the last one holds
+//everything longer
+#define STATS_BUCKETS 40
+
+typedef enum stats_op {
+	STATS_LOOKUP,
+	STATS_GETATTR,
+	STATS_READDIR,
+	STATS_OPEN,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_CREATE,
+	STATS_MKDIR,
+	STATS_UNLINK,
+	STATS_RMDIR,
+	STATS_RENAME,
+	STATS_SETATTR,
+	STATS_TRUNCATE,
+	STATS_CHMOD,
+	STATS_CHOWN,
+	STATS_UTIME,
+	STATS_FALLOCATE,
+	STATS_FLUSH,
+	STATS_RELEASE,
+	STATS_FSYNC,
+	STATS_FSYNCDIR,
+	STATS_OPENDIR,
+	STATS_RELEASEDIR,
+	STATS_KV_FETCH,
+	STATS_KV_STORE,
+	STATS_KV_APPEND,
+	STATS_KV_DELETE,
+	STATS_KV_COMMIT,
+	STATS_OPS
+} stats_op;
+
+static const char* stats_names[STATS_OPS] = {
+	"lookup", "getattr", "readdir", "open", "read", "write", "create", "mkdir", \
+	"unlink", "rmdir", "rename", "setattr", "truncate", "chmod", "chown", \
+	"utime", "fallocate", "flush", "release", "fsync", "fsyncdir", "opendir", \
+	"releasedir", "kv_fetch", "kv_store", "kv_append", "kv_delete", "kv_commit"
+};
 
-		//We haven't found the file so iteratively traverse the tree until we have
-		write_log("New directory: %s\n", current_file->path);
-		subdir = strtok(NULL, delim); //Split again until we cannot any longer
-		write_log("Subdir: %s\n", subdir);
+typedef struct stats_counter {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t buckets[STATS_BUCKETS];
+} stats_counter;
+
+typedef struct stats_block {
+	stats_counter ops[STATS_OPS];
+	int taken; //Whether a thread is counting into it
+	struct stats_block* next;
+} stats_block;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_block* stats_blocks = NULL;
+//The totals when they were last reset
+static stats_counter stats_base[STATS_OPS];
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread stats_block* stats_mine = NULL;
+
+//Called as a thread exits, to let go of its block
+static void stats_release(void* block){
+	pthread_mutex_lock(&stats_lock);
+	((stats_block*)block)->taken = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
 
-	}
+static void stats_init(){
+	pthread_key_create(&stats_key, stats_release);
+}
 
-	free(subdir); //Tidying up
-	free(current_file);
-	write_log("Traverse to file with UUID: %x\n", current_file->meta_data_id);
+/**
+ * @return the calling thread's block, or NULL if there is no memory for one
+ */
+static stats_block* stats_get(){
+	if (stats_mine != NULL){
+		return stats_mine;
+	}
+	pthread_once(&stats_once, stats_init);
+	pthread_mutex_lock(&stats_lock);
+	stats_block* b = stats_blocks;
+	while (b != NULL && b->taken){
+		b = b->next;
+	}
+	if (b == NULL && (b = calloc(1, sizeof(stats_block))) != NULL){
+		b->next = stats_blocks;
+		stats_blocks = b;
+	}
+	if (b != NULL){
+		b->taken = 1;
+	}
+	pthread_mutex_unlock(&stats_lock);
+	if (b != NULL){
+		pthread_setspecific(stats_key, b);
+	}
+	stats_mine = b;
+	return b;
 }
 
 /**
- * Returns the path of the parent folder
- *
- * @param path the path we want to find the parent of
- * @param file_dir the buffer we want to place the parent's path into
+ * @return a monotonic time in ns, for timing something (eg: with stats_record())
  */
-void traverse_to_folder(const char* path, char* file_dir){
-	write_log("-- Attempting to find folder --\n");
-	memset(file_dir, 0, MY_MAX_PATH); //Avoids weird errors
-	char delim = '/';
-	char* fname = strrchr(path,(int)delim);
-	write_log("fname %s\n", fname);
-	int length_fname = strlen(fname);
-	int length_dname = strlen(path) - strlen(fname) +1; //Offset for null
-	 																										//terminator
-	strncpy(file_dir, path, length_dname);
-	write_log("Path: %s File Name: %s Searching for: %s\n", path, fname, \
-						file_dir);
+uint64_t stats_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//Only the owning thread writes to a block, but reports read it as it goes
+static inline void stats_add(uint64_t* counter, uint64_t n){
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
 }
 
 /**
- * Loads the parent of a file into the cache
- *
- * @param child the child whose parent should be found
+ * Counts one operation.
  *
- * @return places the parent into the cache, or makes the cache's file size < 0
- * if the file could not be located (generally this should never happen).
+ * @param op which operation it was
+ * @param start stats_now() when it started
+ * @param failed non-0 if it failed
+ * @param bytes how much data it read or wrote
  */
-void cache_parent(file* child){
-	write_log("--Attempting to cache parent --\n");
-
-	if(strcmp(child->children[PARENT_POS], zero_uuid)==0){
-		requested_file->size = -1;
-		write_log("File has no parent!\n");
+void stats_record(stats_op op, uint64_t start, int failed, uint64_t bytes){
+	uint64_t ns = stats_now() - start;
+	stats_block* b = stats_get();
+	if (b == NULL){
 		return;
-	}else{
-		unqlite_int64 size = sizeof(file);
-		int rc = unqlite_kv_fetch(pDb, &child->children[PARENT_POS], KEY_SIZE, \
-			 												requested_file, &size);
-		write_log("Parent should be in cache: %s\n", requested_file->path);
+	}
+	stats_counter* c = &b->ops[op];
+	int bucket = (ns > 0) ? 64 - __builtin_clzll(ns) : 0;
+	stats_add(&c->count, 1);
+	stats_add(&c->errors, failed != 0);
+	stats_add(&c->bytes, bytes);
+	stats_add(&c->ns, ns);
+	stats_add(&c->buckets[(bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1], 1);
+}
 
-		if (rc != UNQLITE_OK){
-			write_log("Problem with caching parent\n");
-			requested_file->size = -1;
-			return;
+/**
+ * Adds every thread's counters up. The caller holds stats_lock.
+ */
+static void stats_total(stats_counter* out){
+	memset(out, 0, STATS_OPS * sizeof(stats_counter));
+	for (stats_block* b = stats_blocks; b != NULL; b = b->next){
+		for (int op = 0; op < STATS_OPS; op++){
+			uint64_t* from = (uint64_t*)&b->ops[op];
+			uint64_t* to = (uint64_t*)&out[op];
+			for (size_t i = 0; i < sizeof(stats_counter) / sizeof(uint64_t); i++){
+				to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+			}
 		}
-
 	}
 }
 
 /**
- * Deletes a child from its parent, also updates the number of children that
- * the parent has.
+ * Gets the totals since mounting or since they were last reset.
  *
- * @param path the path of the node to be deleted
- * @param dir the parent directory
+ * @param out STATS_OPS counters to fill in
  */
-void delete_child(const char* path, file* parent){
-	write_log("-- Attempting to delete a child --\n");
-	int child_number = find_child_number(path, parent);
-
-	if (child_number < 0) {
-		//Hopefully this never actually happens.
-		write_log("Child not found\n");
-		return; //Child has not been found, so nothing to delete
-	}else{
-		for (int i = child_number + 1; i < parent->number_children; i++){
-			memcpy(parent->children[i-1], parent->children[i], sizeof(uuid_t));
+void stats_snapshot(stats_counter* out){
+	pthread_mutex_lock(&stats_lock);
+	stats_total(out);
+	for (int op = 0; op < STATS_OPS; op++){
+		uint64_t* to = (uint64_t*)&out[op];
+		const uint64_t* base = (const uint64_t*)&stats_base[op];
+		for (size_t i = 0; i < sizeof(stats_counter) / sizeof(uint64_t); i++){
+			to[i] -= base[i];
 		}
 	}
+	pthread_mutex_unlock(&stats_lock);
+}
 
-	parent->number_children = parent->number_children - 1;
-	write_log("Parent should now have: %d children\n", parent->number_children);
+/**
+ * Starts counting again from 0.
+ */
+void stats_reset(){
+	pthread_mutex_lock(&stats_lock);
+	stats_total(stats_base);
+	pthread_mutex_unlock(&stats_lock);
 }
 
 /**
- * Attempts to cache a file for ease of use. Should minimise DB calls.
+ * Estimates a percentile from a histogram, assuming latencies are spread
+ * evenly within a bucket.
  *
- * @param path the path of the file we wish to cache
+ * @param c the counter
+ * @param q which percentile, from 0 to 1
  *
- * @return 0 on success, -ENOENT on file not found
+ * @return the latency in ns, or 0 if nothing was counted
  */
-int do_caching(const char* path){
-	write_log("-- Attempting to cache--\n");
-	//Checks to see if it is cached already making checking cache effectively
-	//"free" in comparison to making a DB call.
-	if (strcmp(requested_file->path, path)==0){
-		write_log("%s is already cached\n", path);
-		return 0; //Do nothing
-	}else{
-		write_log("%s is not cached\n", path);
-		traverse_to_file(path, root_directory->meta_data_id);
-		write_log("Attempted to traverse\n");
-
-		//Safety first
-		if (requested_file->size < 0){
-			write_log("Do caching: File not found\n");
-			return -ENOENT;
-		}else{
-			write_log("File exists at: %s and %x\n", requested_file->path, \
-																								requested_file->meta_data_id);
-			return 0;
+double stats_percentile(const stats_counter* c, double q){
+	uint64_t total = 0;
+	for (int i = 0; i < STATS_BUCKETS; i++){
+		total += c->buckets[i];
+	}
+	double target = q * total;
+	double below = 0;
+	for (int i = 0; i < STATS_BUCKETS && total > 0; i++){
+		if (below + c->buckets[i] >= target && c->buckets[i] > 0){
+			double lo = (i > 0) ? (double)(1ULL << (i - 1)) : 0;
+			double hi = (double)(1ULL << i);
+			return lo + (hi - lo) * (target - below) / c->buckets[i];
 		}
-
+		below += c->buckets[i];
 	}
+	return 0;
+}
+
+/*
+ ***************
+	Database Access
+ ***************
+*/
+
+//Everything is kept in a key value store behind the backend below, chosen at
+//mount time: unqlite on disk (the default) or a hash table in memory, for
+//scratch mounts and for timing the file system without a DB under it. Return
+//codes are unqlite's whichever backend is in use.
+//
+//Backends need not be thread safe: every call goes through the kv_ functions
+//below, which serialise them. Backends whose fetches only read (ie: memory)
+//let fetches and scans share the lock, so that readers on several cores do not
+//queue behind each other.
+static pthread_rwlock_t db_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+//Whether the calling thread's operation has changed the DB, and how many bytes
+//it has stored (see Transactions)
+static __thread int txn_wrote = 0;
+static __thread uint64_t txn_bytes = 0;
+
+//How many fetches have been made, for the benchmarks
+static long kv_fetches = 0;
+
+//Called for each record a scan finds, with the DB lock held, so it must not
+//call back into the DB. Returns non-0 to stop the scan.
+typedef int (*kv_visitor)(const void* key, int key_len, const void* data, \
+													unqlite_int64 len, void* ctx);
+
+typedef struct kv_backend {
+	const char* name;
+	//Fetches a record. With buf NULL *len is set to the record's length,
+	//otherwise up to *len bytes are copied and *len is set to how many were.
+	int (*fetch)(const void* key, int key_len, void* buf, unqlite_int64* len);
+	int (*store)(const void* key, int key_len, const void* data, \
+							 unqlite_int64 len);
+	int (*append)(const void* key, int key_len, const void* data, \
+								unqlite_int64 len);
+	int (*remove)(const void* key, int key_len);
+	//Visits every record whose key starts with prefix, in no particular order
+	int (*scan)(const void* prefix, int prefix_len, kv_visitor visit, void* ctx);
+	//Starts a batch of changes, which are applied together by commit or thrown
+	//away by rollback
+	int (*begin)();
+	int (*commit)();
+	int (*rollback)();
+	//Non-0 if fetch and scan may run alongside each other
+	int shared_reads;
+} kv_backend;
+
+/*
+	The unqlite backend, on the handle the support code opened
+*/
 
-	return -ENOENT; //should never happen
+static int unqlite_backend_fetch(const void* key, int key_len, void* buf, \
+																 unqlite_int64* len){
+	return unqlite_kv_fetch(pDb, key, key_len, buf, len);
 }
 
-/**
- * Formats the path recieved to an appropriate format
- *
- * @param the path to be formatted
- *
- * @return the correctly formatted path in the path variable
- */
-void format_path(char* path){
-	write_log("Path recieved %s\n", path);
-	char delim[2] = "/\0";
-	char* new_path = malloc(MY_MAX_PATH);
+static int unqlite_backend_store(const void* key, int key_len, \
+																 const void* data, unqlite_int64 len){
+	return unqlite_kv_store(pDb, key, key_len, data, len);
+}
+
+static int unqlite_backend_append(const void* key, int key_len, \
+																	const void* data, unqlite_int64 len){
+	return unqlite_kv_append(pDb, key, key_len, data, len);
+}
+
+static int unqlite_backend_remove(const void* key, int key_len){
+	return unqlite_kv_delete(pDb, key, key_len);
+}
 
-	new_path = strtok(path, delim);
-	write_log("New path: %d\n", new_path);
+//unqlite's hash store keeps no order, so this walks every record
+static int unqlite_backend_scan(const void* prefix, int prefix_len, \
+																kv_visitor visit, void* ctx){
+	unqlite_kv_cursor* cursor;
+	int rc = unqlite_kv_cursor_init(pDb, &cursor);
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+	unsigned char* key = NULL;
+	unsigned char* data = NULL;
+	unqlite_int64 data_room = 0;
+	int stop = 0;
+	for (unqlite_kv_cursor_first_entry(cursor); \
+			 !stop && unqlite_kv_cursor_valid_entry(cursor); \
+			 unqlite_kv_cursor_next_entry(cursor)){
+		int key_len;
+		unqlite_kv_cursor_key(cursor, NULL, &key_len);
+		if (key_len < prefix_len){
+			continue;
+		}
+		unsigned char* grown = realloc(key, key_len);
+		if (grown == NULL){
+			rc = UNQLITE_NOMEM;
+			break;
+		}
+		key = grown;
+		unqlite_kv_cursor_key(cursor, key, &key_len);
+		if (prefix_len > 0 && memcmp(key, prefix, prefix_len) != 0){
+			continue;
+		}
 
-	while (new_path != NULL){
-		strcpy(path, new_path);
-		write_log("Copied to path: %s\n", path);
-		new_path = strtok(NULL, delim);
-		write_log("New path: %s", delim);
+		unqlite_int64 len;
+		unqlite_kv_cursor_data(cursor, NULL, &len);
+		if (len > data_room){
+			grown = realloc(data, len);
+			if (grown == NULL){
+				rc = UNQLITE_NOMEM;
+				break;
+			}
+			data = grown;
+			data_room = len;
+		}
+		unqlite_kv_cursor_data(cursor, data, &len);
+		stop = visit(key, key_len, data, len, ctx);
 	}
+	free(key);
+	free(data);
+	unqlite_kv_cursor_release(pDb, cursor);
+	return rc;
+}
 
-	write_log("Returning: %s\n", path);
-	free(new_path);
+static int unqlite_backend_begin(){
+	return unqlite_begin(pDb);
 }
 
+static int unqlite_backend_commit(){
+	return unqlite_commit(pDb);
+}
+
+static int unqlite_backend_rollback(){
+	return unqlite_rollback(pDb);
+}
+
+static const kv_backend unqlite_backend = {
+	"unqlite",
+	unqlite_backend_fetch,
+	unqlite_backend_store,
+	unqlite_backend_append,
+	unqlite_backend_remove,
+	unqlite_backend_scan,
+	unqlite_backend_begin,
+	unqlite_backend_commit,
+	unqlite_backend_rollback,
+	0,
+};
 
 /*
- *************************
-	Myfs System Call Methods
- *************************
+	The memory backend: a chained hash table that doubles as it fills.
+	Nothing outlives the mount, so there is nothing to commit, and a commit
+	never fails, so there is never anything to roll back.
 */
 
-// Get file and directory attributes (meta-data).
-// Read 'man 2 stat' and 'man 2 chmod'.
+#define MEM_MIN_BUCKETS 1024
+
+typedef struct mem_record {
+	struct mem_record* next;
+	uint64_t hash;
+	unqlite_int64 len;
+	unqlite_int64 room;
+	unsigned char* data;
+	int key_len;
+	unsigned char key[];
+} mem_record;
+
+static mem_record** mem_buckets = NULL;
+static size_t mem_bucket_count = 0;
+static size_t mem_record_count = 0;
+
+uint64_t hash_bytes(const void* data, size_t len);
+
 /**
- * Gets the attributes of a file (its inode)
- * @param path the path of the file
- * @param stbuf the stat struct its data has to be put into
- * @return 0 on success, non-0 on failure
+ * @param key the record's key
+ * @param key_len how long the key is
+ * @param hash the key's hash_bytes()
+ *
+ * @return where the record is linked from, which points to NULL if there is no
+ *				 such record
  */
-static int myfs_getattr(const char *path, struct stat* stbuf){
-	write_log("\n== ATTEMPTING GETATTR ==\n");
-	write_log("myfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
-	write_log("Requested file's path: %s\n", requested_file->path);
-
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("Getattr file not found\n");
-		return -ENOENT;
+static mem_record** mem_find(const void* key, int key_len, uint64_t hash){
+	mem_record** link = &mem_buckets[hash % mem_bucket_count];
+	while (*link != NULL && ((*link)->hash != hash || \
+				 (*link)->key_len != key_len || memcmp((*link)->key, key, key_len) != 0)){
+		link = &(*link)->next;
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
-
-	//At this point the file we want should be in the cache
-	//Set all of the data in stbuf to zero
-	memset(stbuf, 0, sizeof(struct stat));
-	//Then transfer all of it to the buffer
-	write_log("Reading child with UUID: %x\n", requested_file->file_data_id);
-	stbuf->st_mode = requested_file->mode;
-	write_log("Mode (IS DIR) %d\n", (stbuf->st_mode & S_IFMT) == S_IFDIR);
-	stbuf->st_nlink = requested_file->number_children - 1; //Include itself
-	stbuf->st_uid = requested_file->uid;
-	stbuf->st_gid = requested_file->gid;
-	stbuf->st_mtime = requested_file->mtime;
-	stbuf->st_ctime = requested_file->ctime;
-	stbuf->st_size = requested_file->size;
-	write_log("size: %d\n", requested_file->size);
-	return 0;
+	return link;
+}
+
+/**
+ * Doubles the hash table once it holds more records than buckets.
+ *
+ * @return UNQLITE_OK, or UNQLITE_NOMEM
+ */
+static int mem_grow(){
+	if (mem_record_count < mem_bucket_count){
+		return UNQLITE_OK;
+	}
+	size_t count = (mem_bucket_count == 0) ? MEM_MIN_BUCKETS : 2 * mem_bucket_count;
+	mem_record** buckets = calloc(count, sizeof(mem_record*));
+	if (buckets == NULL){
+		//Longer chains are slower, not wrong, once there is a table at all
+		return (mem_bucket_count == 0) ? UNQLITE_NOMEM : UNQLITE_OK;
+	}
+	for (size_t i = 0; i < mem_bucket_count; i++){
+		while (mem_buckets[i] != NULL){
+			mem_record* r = mem_buckets[i];
+			mem_buckets[i] = r->next;
+			r->next = buckets[r->hash % count];
+			buckets[r->hash % count] = r;
+		}
+	}
+	free(mem_buckets);
+	mem_buckets = buckets;
+	mem_bucket_count = count;
+	return UNQLITE_OK;
+}
+
+static int mem_fetch(const void* key, int key_len, void* buf, \
+										 unqlite_int64* len){
+	if (mem_bucket_count == 0){
+		return UNQLITE_NOTFOUND;
+	}
+	mem_record* r = *mem_find(key, key_len, hash_bytes(key, key_len));
+	if (r == NULL){
+		return UNQLITE_NOTFOUND;
+	}
+	if (buf != NULL){
+		if (r->len < *len){
+			*len = r->len;
+		}
+		memcpy(buf, r->data, *len);
+	}else{
+		*len = r->len;
+	}
+	return UNQLITE_OK;
+}
+
+/**
+ * Stores a record, making it if need be.
+ *
+ * @param append non-0 to add the data after what the record already has, 0 to
+ *				replace it
+ *
+ * @return UNQLITE_OK, or UNQLITE_NOMEM
+ */
+static int mem_put(const void* key, int key_len, const void* data, \
+									 unqlite_int64 len, int append){
+	int rc = mem_grow();
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+	uint64_t hash = hash_bytes(key, key_len);
+	mem_record** link = mem_find(key, key_len, hash);
+	mem_record* r = *link;
+	if (r == NULL){
+		r = calloc(1, sizeof(mem_record) + key_len);
+		if (r == NULL){
+			return UNQLITE_NOMEM;
+		}
+		r->hash = hash;
+		r->key_len = key_len;
+		memcpy(r->key, key, key_len);
+		*link = r;
+		mem_record_count++;
+	}
+
+	unqlite_int64 keep = append ? r->len : 0;
+	if (keep + len > r->room){
+		unqlite_int64 room = (keep + len > 2 * r->room) ? keep + len : 2 * r->room;
+		unsigned char* grown = realloc(r->data, room);
+		if (grown == NULL){
+			return UNQLITE_NOMEM;
+		}
+		r->data = grown;
+		r->room = room;
+	}
+	if (len > 0){
+		memcpy(r->data + keep, data, len);
+	}
+	r->len = keep + len;
+	return UNQLITE_OK;
+}
+
+static int mem_store(const void* key, int key_len, const void* data, \
+										 unqlite_int64 len){
+	return mem_put(key, key_len, data, len, 0);
+}
+
+static int mem_append(const void* key, int key_len, const void* data, \
+											unqlite_int64 len){
+	return mem_put(key, key_len, data, len, 1);
+}
+
+static int mem_remove(const void* key, int key_len){
+	if (mem_bucket_count == 0){
+		return UNQLITE_NOTFOUND;
+	}
+	mem_record** link = mem_find(key, key_len, hash_bytes(key, key_len));
+	mem_record* r = *link;
+	if (r == NULL){
+		return UNQLITE_NOTFOUND;
+	}
+	*link = r->next;
+	mem_record_count--;
+	free(r->data);
+	free(r);
+	return UNQLITE_OK;
+}
+
+static int mem_scan(const void* prefix, int prefix_len, kv_visitor visit, \
+										void* ctx){
+	for (size_t i = 0; i < mem_bucket_count; i++){
+		for (mem_record* r = mem_buckets[i]; r != NULL; r = r->next){
+			if (r->key_len >= prefix_len && \
+					(prefix_len == 0 || memcmp(r->key, prefix, prefix_len) == 0) && \
+					visit(r->key, r->key_len, r->data, r->len, ctx)){
+				return UNQLITE_OK;
+			}
+		}
+	}
+	return UNQLITE_OK;
+}
+
+static int mem_begin(){
+	return UNQLITE_OK;
+}
+
+static int mem_commit(){
+	return UNQLITE_OK;
+}
+
+static int mem_rollback(){
+	return UNQLITE_OK;
+}
+
+static const kv_backend memory_backend = {
+	"memory",
+	mem_fetch,
+	mem_store,
+	mem_append,
+	mem_remove,
+	mem_scan,
+	mem_begin,
+	mem_commit,
+	mem_rollback,
+	1,
+};
+
+static const kv_backend* kv = &unqlite_backend;
+
+/**
+ * Chooses where everything is kept. This must be done before anything is
+ * read or written.
+ *
+ * @param name "unqlite" or "memory"
+ *
+ * @return 0 upon success, -1 if there is no such backend
+ */
+int kv_set_backend(const char* name){
+	if (strcmp(name, unqlite_backend.name) == 0){
+		kv = &unqlite_backend;
+	}else if (strcmp(name, memory_backend.name) == 0){
+		kv = &memory_backend;
+	}else{
+		log_error("Unknown backend \"%s\"\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+//Not finding a record is an answer rather than a failure
+#define kv_failed(rc) ((rc) != UNQLITE_OK && (rc) != UNQLITE_NOTFOUND)
+
+/**
+ * Takes the DB lock to read, shared if the backend allows it.
+ */
+static void kv_lock_read(){
+	if (kv->shared_reads){
+		pthread_rwlock_rdlock(&db_lock);
+	}else{
+		pthread_rwlock_wrlock(&db_lock);
+	}
+}
+
+int kv_fetch(const void* key, int key_len, void* buf, unqlite_int64* len){
+	uint64_t start = stats_now();
+	kv_lock_read();
+	__atomic_add_fetch(&kv_fetches, 1, __ATOMIC_RELAXED);
+	int rc = kv->fetch(key, key_len, buf, len);
+	pthread_rwlock_unlock(&db_lock);
+	stats_record(STATS_KV_FETCH, start, kv_failed(rc), \
+							 (rc == UNQLITE_OK && buf != NULL) ? *len : 0);
+	return rc;
+}
+
+int kv_store(const void* key, int key_len, const void* data, unqlite_int64 len){
+	uint64_t start = stats_now();
+	txn_wrote = 1;
+	txn_bytes += len;
+	pthread_rwlock_wrlock(&db_lock);
+	int rc = kv->store(key, key_len, data, len);
+	pthread_rwlock_unlock(&db_lock);
+	stats_record(STATS_KV_STORE, start, kv_failed(rc), len);
+	return rc;
+}
+
+int kv_append(const void* key, int key_len, const void* data, unqlite_int64 len){
+	uint64_t start = stats_now();
+	txn_wrote = 1;
+	txn_bytes += len;
+	pthread_rwlock_wrlock(&db_lock);
+	int rc = kv->append(key, key_len, data, len);
+	pthread_rwlock_unlock(&db_lock);
+	stats_record(STATS_KV_APPEND, start, kv_failed(rc), len);
+	return rc;
+}
+
+int kv_delete(const void* key, int key_len){
+	uint64_t start = stats_now();
+	txn_wrote = 1;
+	pthread_rwlock_wrlock(&db_lock);
+	int rc = kv->remove(key, key_len);
+	pthread_rwlock_unlock(&db_lock);
+	stats_record(STATS_KV_DELETE, start, kv_failed(rc), 0);
+	return rc;
+}
+
+/**
+ * Visits every record whose key starts with a prefix. Nothing may be read or
+ * written from the visitor.
+ *
+ * @param prefix what the keys start with
+ * @param prefix_len how long the prefix is, 0 to visit every record
+ * @param visit called with each record found, returning non-0 to stop
+ * @param ctx handed to visit
+ *
+ * @return the backend's return code
+ */
+int kv_scan(const void* prefix, int prefix_len, kv_visitor visit, void* ctx){
+	kv_lock_read();
+	int rc = kv->scan(prefix, prefix_len, visit, ctx);
+	pthread_rwlock_unlock(&db_lock);
+	return rc;
+}
+
+/**
+ * FNV-1a hash over an arbitrary block of memory
+ *
+ * @param data the bytes to hash
+ * @param len how many bytes there are
+ *
+ * @return the 64 bit hash
+ */
+uint64_t hash_bytes(const void* data, size_t len){
+	const unsigned char* bytes = data;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++){
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Copies a path into buf without any trailing '/' (except for the root), which
+ * is the form paths are kept in file->path and in the cache.
+ *
+ * @param path the path as handed to us by FUSE
+ * @param buf a buffer of at least MY_MAX_PATH bytes
+ *
+ * @return 0 on success, -ENAMETOOLONG if the path does not fit
+ */
+int normalise_path(const char* path, char* buf){
+	size_t len = strlen(path);
+	if (len >= MY_MAX_PATH){
+		return -ENAMETOOLONG;
+	}
+	memcpy(buf, path, len + 1);
+	while (len > 1 && buf[len-1] == '/'){
+		buf[--len] = '\0';
+	}
+	return 0;
+}
+
+/**
+ * Gets the last component of a path, eg: c.txt for /a/b/c.txt
+ *
+ * @param path a normalised path
+ *
+ * @return a pointer into path
+ */
+const char* path_name(const char* path){
+	const char* name = strrchr(path, '/');
+	return (name == NULL) ? path : name + 1;
+}
+
+/**
+ * Gets the name a file is stored under: the last component of its path, or
+ * "/" for the root.
+ *
+ * @param path a normalised path, or just a name
+ *
+ * @return a pointer into path
+ */
+const char* file_name(const char* path){
+	return (strcmp(path, "/") == 0) ? path : path_name(path);
+}
+
+/**
+ * Puts together the path of a directory's child.
+ *
+ * @param dir the directory's path, or just its name if the path is not known
+ * @param name the child's name
+ * @param buf a buffer of at least MY_MAX_PATH bytes, set to the child's full
+ *				path, or to just its name if the directory's path is not known
+ *
+ * @return 0 on success, -ENAMETOOLONG if it does not fit
+ */
+int path_join(const char* dir, const char* name, char* buf){
+	int len;
+	if (dir[0] != '/'){
+		len = snprintf(buf, MY_MAX_PATH, "%s", name);
+	}else{
+		len = snprintf(buf, MY_MAX_PATH, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, \
+									 name);
+	}
+	return (len >= MY_MAX_PATH) ? -ENAMETOOLONG : 0;
+}
+
+/**
+ * Copies a name into a fixed size name field, which is always left terminated.
+ *
+ * @param buf a buffer of MY_MAX_PATH bytes
+ * @param name the name
+ *
+ * @return 0 on success, -ENAMETOOLONG if the name does not fit
+ */
+int name_copy(char* buf, const char* name){
+	size_t len = strlen(name);
+	if (len >= MY_MAX_PATH){
+		return -ENAMETOOLONG;
+	}
+	memcpy(buf, name, len + 1);
+	return 0;
+}
+
+/*
+ ***************
+	Transactions
+ ***************
+*/
+
+//Everything a callback changes is committed together, so a crash can never
+//leave half of an operation in the DB (eg: a child that its parent does not
+//list). Callbacks run concurrently and unqlite has a single transaction, so
+//callbacks hold the transaction gate shared while they change the DB, and a
+//commit holds it exclusively. Commits therefore only happen between
+//operations, and one commit covers every operation that finished before it.
+//
+//By default each operation commits before returning, though one that finds
+//its changes already committed by someone else does not commit again. In group
+//commit mode a background thread commits instead, once the oldest uncommitted
+//operation has waited txn_window_us or txn_batch operations are waiting, and
+//operations return once their changes are committed.
+//
+//That is the strict sync mode. Mounts that can afford to lose their last few
+//changes in a crash can relax it: in the periodic mode operations return
+//without waiting and the background thread commits every txn_window_us, or
+//sooner once txn_sync_bytes are waiting, and in the fsync mode nothing is
+//committed until something calls fsync(2). fsync and fsyncdir always return
+//once everything finished before them is committed, as does unmounting.
+//
+//A commit that fails rolls back everything since the last one, and the caches
+//built from the DB are emptied, so nothing shows changes the DB dropped. Each
+//waiting operation it covered is handed the failure, never the result of a
+//later commit. Operations that did not wait hear of it from fsync or fsyncdir
+//instead, once on every file and directory that was open at the time.
+#ifndef MYFS_TXN_BATCH
+#define MYFS_TXN_BATCH 64
+#endif
+
+//How often the periodic sync mode commits by default, and how many bytes
+//waiting make it commit early
+#ifndef MYFS_SYNC_MS
+#define MYFS_SYNC_MS 1000
+#endif
+#ifndef MYFS_SYNC_KB
+#define MYFS_SYNC_KB 4096
+#endif
+
+typedef enum txn_sync {
+	TXN_SYNC_STRICT,
+	TXN_SYNC_PERIODIC,
+	TXN_SYNC_FSYNC,
+	TXN_SYNC_MODES
+} txn_sync;
+
+static const char* txn_sync_names[TXN_SYNC_MODES] = {
+	"strict", "periodic", "fsync"
+};
+
+static pthread_rwlock_t txn_gate;
+static pthread_once_t txn_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t txn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t txn_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t txn_work_cond = PTHREAD_COND_INITIALIZER;
+//Operations that changed the DB are numbered as they finish. Those up to
+//txn_settled have been committed, or rolled back by a failed commit.
+static uint64_t txn_finished = 0;
+static uint64_t txn_settled = 0;
+static int txn_open = 0;
+static long txn_commits = 0;
+static long txn_window_us = 0;
+static int txn_batch = MYFS_TXN_BATCH;
+static int txn_committer_running = 0;
+static pthread_t txn_committer;
+static txn_sync txn_sync_mode = TXN_SYNC_STRICT;
+//Bytes stored since the last commit, and how many make the committer commit
+//early (0 for never)
+static uint64_t txn_pending = 0;
+static uint64_t txn_sync_bytes = 0;
+//How many commits have failed. An open file keeps the count it has been told
+//about, so that fsync reports a failure once to every open file, even one that
+//the failed operations had already returned before (as they do in the relaxed
+//sync modes). Later commits going through do not hide it.
+static uint64_t txn_errseq = 0;
+//The count fsync has told about for paths without an open file
+static uint64_t txn_errseq_seen = 0;
+
+//An operation waiting for the commit that covers it, which hands it its result
+typedef struct txn_waiter {
+	uint64_t ticket;
+	int done;
+	int rc;
+	struct txn_waiter* next;
+} txn_waiter;
+
+static txn_waiter* txn_waiters = NULL;
+
+int seg_sync();
+void inode_lock_all();
+void inode_unlock_all();
+void dcache_clear();
+void paged_cache_clear();
+void block_map_clear();
+void wb_discard_all();
+void ra_clear();
+
+static void txn_init(){
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	//A commit must not wait behind a steady stream of new operations
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&txn_gate, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+/**
+ * Starts an operation that may change the DB. If it fails the operation must
+ * not go ahead, and is not finished with txn_end().
+ *
+ * @return 0 on success, -EIO if the DB could not start a transaction
+ */
+int txn_begin(){
+	pthread_once(&txn_once, txn_init);
+	pthread_rwlock_rdlock(&txn_gate);
+	txn_wrote = 0;
+	txn_bytes = 0;
+
+	int rc = UNQLITE_OK;
+	pthread_rwlock_wrlock(&db_lock);
+	if (!txn_open){
+		rc = kv->begin();
+		txn_open = rc == UNQLITE_OK;
+	}
+	pthread_rwlock_unlock(&db_lock);
+	if (rc != UNQLITE_OK){
+		log_error("Could not start a transaction: %d\n", rc);
+		pthread_rwlock_unlock(&txn_gate);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Throws away everything since the last commit, after it failed, along with
+ * whatever the caches built from it. Nothing may be reading or writing a file
+ * meanwhile, so every inode lock is taken; the caller holds the gate.
+ */
+static void txn_rollback(){
+	inode_lock_all();
+	pthread_rwlock_wrlock(&db_lock);
+	kv->rollback();
+	txn_open = 0;
+	pthread_rwlock_unlock(&db_lock);
+	wb_discard_all();
+	block_map_clear();
+	ra_clear();
+	paged_cache_clear();
+	dcache_clear();
+	inode_unlock_all();
+}
+
+/**
+ * Commits everything up to and including a finished operation, unless that
+ * has already been done. Once this returns, the operation's waiter (if it has
+ * one) has its result.
+ *
+ * @param ticket the operation's number
+ */
+static void txn_commit_upto(uint64_t ticket){
+	pthread_mutex_lock(&txn_lock);
+	int covered = txn_settled >= ticket;
+	pthread_mutex_unlock(&txn_lock);
+	if (covered){
+		return;
+	}
+
+	pthread_rwlock_wrlock(&txn_gate);
+	pthread_mutex_lock(&txn_lock);
+	uint64_t target = txn_finished;
+	covered = txn_settled >= ticket;
+	pthread_mutex_unlock(&txn_lock);
+
+	if (!covered){
+		//The data log has to be on disk before any block pointing into it
+		int rc = seg_sync();
+		uint64_t start = stats_now();
+		pthread_rwlock_wrlock(&db_lock);
+		if (rc == UNQLITE_OK){
+			rc = kv->commit();
+			txn_open = 0;
+		}
+		pthread_rwlock_unlock(&db_lock);
+		stats_record(STATS_KV_COMMIT, start, rc != UNQLITE_OK, 0);
+		if (rc != UNQLITE_OK){
+			log_error("Commit failed: %d, rolling back\n", rc);
+			txn_rollback();
+		}
+
+		pthread_mutex_lock(&txn_lock);
+		if (rc != UNQLITE_OK){
+			txn_errseq++;
+		}
+		txn_settled = target;
+		txn_commits++;
+		txn_pending = 0;
+		txn_waiter** link = &txn_waiters;
+		while (*link != NULL){
+			txn_waiter* w = *link;
+			if (w->ticket <= target){
+				w->rc = rc;
+				w->done = 1;
+				*link = w->next;
+			}else{
+				link = &w->next;
+			}
+		}
+		pthread_cond_broadcast(&txn_done_cond);
+		pthread_mutex_unlock(&txn_lock);
+	}
+	pthread_rwlock_unlock(&txn_gate);
+}
+
+/**
+ * Finishes an operation started with txn_begin().
+ *
+ * @param result what the operation is going to return
+ * @param durable non-0 to wait for everything finished so far to be committed
+ *				whatever the sync mode
+ *
+ * @return result, or -EIO if the commit failed
+ */
+static int txn_finish(int result, int durable){
+	if (!txn_wrote && !durable){
+		pthread_rwlock_unlock(&txn_gate);
+		return result;
+	}
+
+	//The number is handed out, and the waiter added, before leaving the gate,
+	//so the next commit is sure to include this operation's changes and to hand
+	//it the result.
+	pthread_mutex_lock(&txn_lock);
+	if (txn_wrote){
+		txn_finished++;
+		txn_pending += txn_bytes;
+	}
+	txn_waiter w = {txn_finished, txn_finished <= txn_settled, UNQLITE_OK, NULL};
+	int group = txn_committer_running;
+	//The committer is woken to start the window, and again once it is full
+	uint64_t waiting = txn_finished - txn_settled;
+	int full = waiting >= (uint64_t)txn_batch || \
+						 (txn_sync_bytes > 0 && txn_pending >= txn_sync_bytes);
+	if (group && txn_wrote && (waiting == 1 || full)){
+		pthread_cond_signal(&txn_work_cond);
+	}
+	int wait = durable || txn_sync_mode == TXN_SYNC_STRICT;
+	if (wait && !w.done){
+		w.next = txn_waiters;
+		txn_waiters = &w;
+	}
+	pthread_mutex_unlock(&txn_lock);
+	pthread_rwlock_unlock(&txn_gate);
+
+	if (!wait){
+		return result;
+	}
+
+	if (group && !durable){
+		pthread_mutex_lock(&txn_lock);
+		while (!w.done && txn_committer_running){
+			pthread_cond_wait(&txn_done_cond, &txn_lock);
+		}
+		pthread_mutex_unlock(&txn_lock);
+	}
+	//Commits unless the committer already has (or was switched off first)
+	txn_commit_upto(w.ticket);
+
+	pthread_mutex_lock(&txn_lock);
+	int rc = w.rc;
+	pthread_mutex_unlock(&txn_lock);
+	if (rc != UNQLITE_OK && result >= 0){
+		return -EIO;
+	}
+	return result;
+}
+
+/**
+ * Finishes an operation started with txn_begin(), returning once whatever it
+ * changed has been committed, or straight away in the relaxed sync modes.
+ *
+ * @param result what the operation is going to return
+ *
+ * @return result, or -EIO if the commit failed
+ */
+int txn_end(int result){
+	return txn_finish(result, 0);
+}
+
+/**
+ * Finishes an operation started with txn_begin(), returning once it and every
+ * operation that finished before it have been committed, whatever the sync
+ * mode. For fsync(2).
+ *
+ * @param result what the operation is going to return
+ *
+ * @return result, or -EIO if the commit failed
+ */
+int txn_end_sync(int result){
+	return txn_finish(result, 1);
+}
+
+/**
+ * Waits for the operations in progress to finish, without committing them.
+ *
+ * @return the number of the last operation to finish, for txn_settled_upto()
+ */
+uint64_t txn_ticket(){
+	pthread_once(&txn_once, txn_init);
+	pthread_rwlock_wrlock(&txn_gate);
+	pthread_mutex_lock(&txn_lock);
+	uint64_t ticket = txn_finished;
+	pthread_mutex_unlock(&txn_lock);
+	pthread_rwlock_unlock(&txn_gate);
+	return ticket;
+}
+
+/**
+ * Tells whether an operation has been committed (or rolled back by a failed
+ * commit) without making it happen, for work that can wait for whatever
+ * commits next.
+ *
+ * @param ticket from txn_ticket() once the operation has finished
+ *
+ * @return non-0 if it has
+ */
+int txn_settled_upto(uint64_t ticket){
+	pthread_mutex_lock(&txn_lock);
+	int settled = txn_settled >= ticket;
+	pthread_mutex_unlock(&txn_lock);
+	return settled;
+}
+
+/**
+ * @return how many commits have failed so far, for a newly open file to start
+ *				 from
+ */
+uint64_t txn_errseq_sample(){
+	pthread_mutex_lock(&txn_lock);
+	uint64_t seq = txn_errseq;
+	pthread_mutex_unlock(&txn_lock);
+	return seq;
+}
+
+/**
+ * Finishes an fsync(2) or fsyncdir(2) started with txn_begin(), like
+ * txn_end_sync(), and also reports any commit that has failed since the open
+ * file was last told, once.
+ *
+ * @param result what the operation is going to return
+ * @param seen the open file's count of failed commits, which is brought up to
+ *				date, or NULL if there is no open file
+ *
+ * @return result, or -EIO if a commit failed
+ */
+int txn_end_fsync(int result, uint64_t* seen){
+	result = txn_end_sync(result);
+	pthread_mutex_lock(&txn_lock);
+	if (seen == NULL){
+		seen = &txn_errseq_seen;
+	}
+	int failed = *seen != txn_errseq;
+	*seen = txn_errseq;
+	pthread_mutex_unlock(&txn_lock);
+	return (failed && result >= 0) ? -EIO : result;
+}
+
+/**
+ * The group commit thread.
+ */
+static void* txn_committer_main(void* arg){
+	(void) arg;
+	pthread_mutex_lock(&txn_lock);
+	while (txn_committer_running){
+		if (txn_finished == txn_settled){
+			pthread_cond_wait(&txn_work_cond, &txn_lock);
+			continue;
+		}
+
+		//Give other operations the window to join the batch
+		if (txn_finished - txn_settled < (uint64_t)txn_batch && \
+				(txn_sync_bytes == 0 || txn_pending < txn_sync_bytes)){
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += (txn_window_us % 1000000) * 1000;
+			deadline.tv_sec += txn_window_us / 1000000 + deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&txn_work_cond, &txn_lock, &deadline);
+		}
+
+		uint64_t target = txn_finished;
+		pthread_mutex_unlock(&txn_lock);
+		txn_commit_upto(target);
+		pthread_mutex_lock(&txn_lock);
+	}
+	pthread_mutex_unlock(&txn_lock);
+	return NULL;
+}
+
+/**
+ * Turns group commit on or off.
+ *
+ * @param window_us how long an operation may wait for others to share its
+ *				commit, in microseconds. 0 turns group commit off.
+ * @param batch commit as soon as this many operations are waiting
+ *
+ * @return 0 on success
+ */
+int txn_set_group_commit(long window_us, int batch){
+	pthread_mutex_lock(&txn_lock);
+	int running = txn_committer_running;
+	txn_window_us = window_us;
+	txn_batch = (batch > 0) ? batch : MYFS_TXN_BATCH;
+	if (window_us > 0 && !running){
+		txn_committer_running = 1;
+		if (pthread_create(&txn_committer, NULL, txn_committer_main, NULL) != 0){
+			txn_committer_running = 0;
+			pthread_mutex_unlock(&txn_lock);
+			return -1;
+		}
+	}else if (window_us <= 0 && running){
+		txn_committer_running = 0;
+		pthread_cond_broadcast(&txn_work_cond);
+		pthread_cond_broadcast(&txn_done_cond);
+	}
+	pthread_mutex_unlock(&txn_lock);
+
+	if (window_us <= 0 && running){
+		pthread_join(txn_committer, NULL);
+	}
+	return 0;
+}
+
+/**
+ * Finds a sync mode by its name.
+ *
+ * @param name strict, periodic or fsync
+ *
+ * @return the mode, or -1 if there is no such mode
+ */
+int txn_sync_parse(const char* name){
+	for (int mode = 0; mode < TXN_SYNC_MODES; mode++){
+		if (strcmp(name, txn_sync_names[mode]) == 0){
+			return mode;
+		}
+	}
+	log_error("Unknown sync mode \"%s\"\n", name);
+	return -1;
+}
+
+/**
+ * Chooses when changes are committed. Changes already waiting are committed by
+ * the next commit whatever the new mode.
+ *
+ * @param mode the sync mode
+ * @param period_ms how often the periodic mode commits, in milliseconds
+ * @param bytes how many bytes waiting make the periodic mode commit early (0
+ *				for never)
+ *
+ * @return 0 on success
+ */
+int txn_set_sync(txn_sync mode, long period_ms, uint64_t bytes){
+	if (mode == TXN_SYNC_PERIODIC && period_ms <= 0){
+		log_error("The periodic sync mode needs a period\n");
+		return -1;
+	}
+
+	//The committer is restarted, so that it picks up the new period
+	int rc = txn_set_group_commit(0, 0);
+	pthread_mutex_lock(&txn_lock);
+	txn_sync_mode = mode;
+	txn_sync_bytes = (mode == TXN_SYNC_PERIODIC) ? bytes : 0;
+	pthread_mutex_unlock(&txn_lock);
+	if (rc == 0 && mode == TXN_SYNC_PERIODIC){
+		rc = txn_set_group_commit(period_ms * 1000, INT_MAX);
+	}
+	return rc;
+}
+
+/*
+ ***************
+	Inode Locks
+ ***************
+*/
+
+//Inodes are mapped onto a fixed table of reader/writer locks by their UUID.
+//Two inodes may share a lock, which only costs some concurrency.
+#ifndef MYFS_INODE_LOCKS
+#define MYFS_INODE_LOCKS 256
+#endif
+
+static pthread_rwlock_t inode_locks[MYFS_INODE_LOCKS];
+static pthread_once_t inode_locks_once = PTHREAD_ONCE_INIT;
+
+static void inode_locks_init(){
+	for (int i = 0; i < MYFS_INODE_LOCKS; i++){
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	}
+}
+
+/**
+ * @return which lock in the table protects an inode
+ */
+int inode_lock_index(const uuid_t id){
+	return hash_bytes(id, sizeof(uuid_t)) % MYFS_INODE_LOCKS;
+}
+
+/**
+ * Locks an inode.
+ *
+ * @param id the inode's meta data UUID
+ * @param exclusive non-0 for a write lock, 0 for a read lock
+ *
+ * @return the lock index, to be handed to inode_unlock()
+ */
+int inode_lock(const uuid_t id, int exclusive){
+	pthread_once(&inode_locks_once, inode_locks_init);
+	int index = inode_lock_index(id);
+	if (exclusive){
+		pthread_rwlock_wrlock(&inode_locks[index]);
+	}else{
+		pthread_rwlock_rdlock(&inode_locks[index]);
+	}
+	return index;
+}
+
+/**
+ * Tries to write lock an inode without waiting.
+ *
+ * @param id the inode's meta data UUID
+ *
+ * @return the lock index, or -1 if someone else holds the lock
+ */
+int inode_trylock(const uuid_t id){
+	pthread_once(&inode_locks_once, inode_locks_init);
+	int index = inode_lock_index(id);
+	if (pthread_rwlock_trywrlock(&inode_locks[index]) != 0){
+		return -1;
+	}
+	return index;
+}
+
+void inode_unlock(int index){
+	pthread_rwlock_unlock(&inode_locks[index]);
+}
+
+/**
+ * Write locks two inodes in the global order. If they share a lock it is only
+ * taken once, and *second is set to -1.
+ *
+ * @param a the first inode (eg: a parent)
+ * @param b the second inode (eg: its child)
+ * @param first set to a's lock index
+ * @param second set to b's lock index, or -1
+ */
+void inode_lock_pair(const uuid_t a, const uuid_t b, int* first, int* second){
+	pthread_once(&inode_locks_once, inode_locks_init);
+	*first = inode_lock_index(a);
+	*second = inode_lock_index(b);
+	if (*first == *second){
+		*second = -1;
+		pthread_rwlock_wrlock(&inode_locks[*first]);
+	}else if (*first < *second){
+		pthread_rwlock_wrlock(&inode_locks[*first]);
+		pthread_rwlock_wrlock(&inode_locks[*second]);
+	}else{
+		pthread_rwlock_wrlock(&inode_locks[*second]);
+		pthread_rwlock_wrlock(&inode_locks[*first]);
+	}
+}
+
+void inode_unlock_pair(int first, int second){
+	if (second >= 0){
+		inode_unlock(second);
+	}
+	inode_unlock(first);
+}
+
+/**
+ * Write locks several inodes in the global order. Inodes that share a lock
+ * only take it once.
+ *
+ * @param ids the inodes' meta data UUIDs
+ * @param count how many there are
+ * @param locks room for count lock indexes, set to the ones taken
+ *
+ * @return how many locks were taken, to be handed to inode_unlock_set()
+ */
+int inode_lock_set(const unsigned char* ids[], int count, int* locks){
+	pthread_once(&inode_locks_once, inode_locks_init);
+	int taken = 0;
+	for (int i = 0; i < count; i++){
+		int index = inode_lock_index(ids[i]);
+		int at = taken;
+		while (at > 0 && locks[at - 1] > index){
+			at--;
+		}
+		if (at > 0 && locks[at - 1] == index){
+			continue;
+		}
+		memmove(&locks[at + 1], &locks[at], (taken - at) * sizeof(int));
+		locks[at] = index;
+		taken++;
+	}
+	for (int i = 0; i < taken; i++){
+		pthread_rwlock_wrlock(&inode_locks[locks[i]]);
+	}
+	return taken;
+}
+
+void inode_unlock_set(const int* locks, int taken){
+	for (int i = taken - 1; i >= 0; i--){
+		inode_unlock(locks[i]);
+	}
+}
+
+/**
+ * Write locks every inode, in index order, so that no file is being read or
+ * written. Only for throwing away state after a failed commit.
+ */
+void inode_lock_all(){
+	pthread_once(&inode_locks_once, inode_locks_init);
+	for (int i = 0; i < MYFS_INODE_LOCKS; i++){
+		pthread_rwlock_wrlock(&inode_locks[i]);
+	}
+}
+
+void inode_unlock_all(){
+	for (int i = MYFS_INODE_LOCKS - 1; i >= 0; i--){
+		inode_unlock(i);
+	}
+}
+
+//Taken before any inode lock by renames between directories
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ ***************
+	Inode Records
+ ***************
+
+	A file's meta data is stored under its meta_data_id as a small versioned
+	header followed by its name, rather than as a whole file struct. Only the
+	name is kept, not the whole path, so moving a directory does not touch
+	anything below it. A file read by UUID alone therefore only knows its name;
+	the path is filled in by whoever found it by path. Which
+	children a directory has is kept in its own pages instead (see
+	Directories), so only the number of them is in the header.
+
+	Small regular files keep their data in the record too, after the name, and
+	have no file_data_id (see File Data). In memory the data is kept where a
+	directory's children would be, so it is cached along with the meta data.
+
+	Records written before this are whole file structs. They are still read,
+	with the path cut down to the name, and are rewritten in the new format the
+	next time they are stored.
+*/
+
+#define INODE_MAGIC 0x494e594d //Reads "MYNI"; a path never starts with 'M'
+#define INODE_VERSION 1
+
+//How much data a file can keep inline: what is left of children[]
+#define INLINE_ROOM ((MY_MAX_CHILDREN - REST_POS) * sizeof(uuid_t))
+
+typedef struct inode_record {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t name_len; //The name follows the header, without its terminator
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	int32_t number_children;
+	int64_t size;
+	int64_t mtime;
+	int64_t ctime;
+	uuid_t file_data_id;
+	uuid_t parent_id;
+} inode_record;
+
+//What an inode record is read into and written from: the name, then any
+//inline data
+typedef struct inode_buffer {
+	inode_record header;
+	char tail[MY_MAX_PATH + INLINE_ROOM];
+} inode_buffer;
+
+/**
+ * @return where a regular file's inline data is kept in memory (INLINE_ROOM
+ *				 bytes)
+ */
+static inline uint8_t* file_inline(const file* f){
+	return (uint8_t*)f->children[REST_POS];
+}
+
+/**
+ * @return non-0 if a file keeps its data in its meta data record
+ */
+static inline int file_is_inline(const file* f){
+	return S_ISREG(f->mode) && uuid_is_null(f->file_data_id);
+}
+
+/**
+ * Tells whether a record fetched into a file struct is in the old layout.
+ *
+ * @param f what was fetched
+ * @param size how much was fetched
+ */
+static int inode_is_legacy(const file* f, unqlite_int64 size){
+	return size == sizeof(file) && f->path[0] == '/';
+}
+
+/**
+ * Reads a file's meta data. Its path is set to its name. Directories read from
+ * the old layout come back with their children filled in, which is how they get
+ * migrated; otherwise only children[SELF_POS] and children[PARENT_POS] mean
+ * anything.
+ *
+ * @param id the file's meta data UUID
+ * @param out where to place the file
+ *
+ * @return the unqlite return code, UNQLITE_CORRUPT if the record is not one
+ *				 we know how to read
+ */
+int inode_fetch(const uuid_t id, file* out){
+	//Either sort of record is fetched into the same place, and told apart after
+	union {
+		file legacy;
+		inode_buffer record;
+	} buf;
+	unqlite_int64 size = sizeof(buf);
+	int rc = kv_fetch(id, KEY_SIZE, &buf, &size);
+	if (rc != UNQLITE_OK){
+		return rc;
+	}else if (inode_is_legacy(&buf.legacy, size)){
+		memcpy(out, &buf.legacy, sizeof(file));
+		const char* name = file_name(out->path);
+		memmove(out->path, name, strlen(name) + 1);
+		return rc;
+	}
+
+	inode_buffer* record = &buf.record;
+	if (size < (unqlite_int64)sizeof(inode_record) \
+			|| size > (unqlite_int64)sizeof(inode_buffer)){
+		log_error("Meta data record of %lld bytes is corrupt\n", (long long)size);
+		return UNQLITE_CORRUPT;
+	}
+	//The lengths come off the disk, so every check is done in size_t and the
+	//name is known to fit before the inline length is worked out from it
+	size_t record_len = (size_t)size;
+	size_t name_len = record->header.name_len;
+	if (record->header.magic != INODE_MAGIC \
+			|| record->header.version != INODE_VERSION || name_len >= MY_MAX_PATH \
+			|| name_len > record_len - sizeof(inode_record)){
+		log_error("Meta data record is corrupt or of an unknown version\n");
+		return UNQLITE_CORRUPT;
+	}
+	size_t inline_len = record_len - sizeof(inode_record) - name_len;
+	if (inline_len > INLINE_ROOM){
+		log_error("Meta data record has %zu bytes of inline data\n", inline_len);
+		return UNQLITE_CORRUPT;
+	}
+
+	//The name has no terminator in the record, and inline data may follow it
+	memcpy(out->path, record->tail, name_len);
+	out->path[name_len] = '\0';
+	memcpy(out->file_data_id, record->header.file_data_id, sizeof(uuid_t));
+	memcpy(out->meta_data_id, id, sizeof(uuid_t));
+	out->uid = record->header.uid;
+	out->gid = record->header.gid;
+	out->mode = record->header.mode;
+	out->mtime = record->header.mtime;
+	out->ctime = record->header.ctime;
+	out->size = record->header.size;
+	out->number_children = record->header.number_children;
+	memcpy(out->children[SELF_POS], id, sizeof(uuid_t));
+	memcpy(out->children[PARENT_POS], record->header.parent_id, sizeof(uuid_t));
+	//The rest of children[] holds any inline data, and must not look like old
+	//children otherwise
+	uint8_t* data = file_inline(out);
+	memcpy(data, record->tail + name_len, inline_len);
+	memset(data + inline_len, 0, INLINE_ROOM - inline_len);
+	return UNQLITE_OK;
+}
+
+/**
+ * Writes a file's meta data in the current format. store_file() should be
+ * used instead, which also keeps the caches and directory entries right.
+ *
+ * @param f the file
+ *
+ * @return the unqlite return code
+ */
+int inode_store(const file* f){
+	inode_buffer record;
+	memset(&record.header, 0, sizeof(inode_record));
+	const char* name = file_name(f->path);
+	size_t name_len = strnlen(name, MY_MAX_PATH - 1);
+	record.header.magic = INODE_MAGIC;
+	record.header.version = INODE_VERSION;
+	record.header.name_len = name_len;
+	record.header.mode = f->mode;
+	record.header.uid = f->uid;
+	record.header.gid = f->gid;
+	record.header.number_children = f->number_children;
+	record.header.size = f->size;
+	record.header.mtime = f->mtime;
+	record.header.ctime = f->ctime;
+	memcpy(record.header.file_data_id, f->file_data_id, sizeof(uuid_t));
+	memcpy(record.header.parent_id, f->children[PARENT_POS], sizeof(uuid_t));
+	memcpy(record.tail, name, name_len);
+	size_t inline_len = 0;
+	if (file_is_inline(f)){
+		//An inline file's size is never negative, but is checked before it is
+		//taken as a length
+		size_t size = (f->size > 0) ? (size_t)f->size : 0;
+		inline_len = (size < INLINE_ROOM) ? size : INLINE_ROOM;
+		memcpy(record.tail + name_len, file_inline(f), inline_len);
+	}
+	return kv_store(f->meta_data_id, KEY_SIZE, &record, \
+									sizeof(inode_record) + name_len + inline_len);
+}
+
+/*
+ ***************
+	Dentry Cache
+ ***************
+*/
+
+//The number of files the dentry cache holds before it starts evicting the
+//least recently used ones. Can be changed with dcache_set_capacity().
+#ifndef MYFS_DCACHE_SIZE
+#define MYFS_DCACHE_SIZE 4096
+#endif
+
+//A cached copy of a file's meta data, keyed by its full path (file->path).
+//Entries live in a hash bucket chain by path, another by meta data UUID (a
+//file is cached under one path at most) and in an LRU list.
+typedef struct dcache_entry {
+	file f;
+	uint64_t hash;
+	struct dcache_entry* bucket_next;
+	struct dcache_entry* id_next;
+	struct dcache_entry* lru_prev;
+	struct dcache_entry* lru_next;
+} dcache_entry;
+
+//Everything below is protected by dcache_lock
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dcache_entry** dcache_buckets = NULL;
+static dcache_entry** dcache_id_buckets = NULL;
+static size_t dcache_bucket_count = 0;
+static size_t dcache_capacity = MYFS_DCACHE_SIZE;
+static size_t dcache_count = 0;
+//Most recently used entry is at the head, the eviction candidate at the tail
+static dcache_entry* dcache_lru_head = NULL;
+static dcache_entry* dcache_lru_tail = NULL;
+//Lookups of paths that were cached, and of paths that were not
+static uint64_t dcache_hits = 0;
+static uint64_t dcache_misses = 0;
+
+//Writers bump the generation of the paths they change. A lookup that read a
+//file from the DB only caches it if the generation has not moved since, so it
+//cannot overwrite a newer copy or bring back a deleted file.
+#define DCACHE_GENERATIONS 1024
+static uint64_t dcache_generations[DCACHE_GENERATIONS];
+//Writers that only know a file by UUID bump the generation of its UUID instead.
+//A lookup adds that to its ticket once it knows which file a name leads to,
+//before reading the file.
+static uint64_t dcache_id_generations[DCACHE_GENERATIONS];
+//Bumped when paths change in ways we cannot name one by one, eg: everything
+//below a directory that was moved. Part of every ticket.
+static uint64_t dcache_epoch = 0;
+
+//Paths that were looked up and found not to exist, so that looking them up
+//again (editors checking for swap files, compilers searching include paths)
+//does not walk the tree to the same dead end. Direct mapped by path hash, and
+//also protected by dcache_lock. A path is forgotten as soon as a file is
+//cached or created under it. Whatever makes paths appear that cannot be named
+//one by one (a directory moving, or a file created in a directory found by
+//UUID) forgets them all.
+#ifndef MYFS_NCACHE_SIZE
+#define MYFS_NCACHE_SIZE 1024
+#endif
+
+typedef struct ncache_entry {
+	uint64_t hash;
+	char path[MY_MAX_PATH]; //Empty if the slot is free
+} ncache_entry;
+
+static ncache_entry ncache[MYFS_NCACHE_SIZE];
+//Lookups of missing paths: answered from the cache, and walked in the DB
+static uint64_t ncache_hits = 0;
+static uint64_t ncache_misses = 0;
+
+static ncache_entry* ncache_find(const char* path, uint64_t hash){
+	ncache_entry* entry = &ncache[hash % MYFS_NCACHE_SIZE];
+	if (entry->hash == hash && strcmp(entry->path, path) == 0){
+		return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Forgets that a path is missing. Must be called with dcache_lock held.
+ */
+static void ncache_forget(const char* path){
+	ncache_entry* entry = ncache_find(path, hash_bytes(path, strlen(path)));
+	if (entry != NULL){
+		entry->path[0] = '\0';
+	}
+}
+
+/**
+ * Forgets every missing path. Must be called with dcache_lock held.
+ */
+static void ncache_clear(){
+	for (int i = 0; i < MYFS_NCACHE_SIZE; i++){
+		ncache[i].path[0] = '\0';
+	}
+}
+
+/**
+ * Sets up the cache's hash table. Called lazily so that the cache does not
+ * depend on any particular initialisation order.
+ */
+static void dcache_init(){
+	if (dcache_buckets != NULL){
+		return;
+	}
+	//Keep the load factor at or below one
+	dcache_bucket_count = 1;
+	while (dcache_bucket_count < dcache_capacity){
+		dcache_bucket_count <<= 1;
+	}
+	dcache_buckets = calloc(dcache_bucket_count, sizeof(dcache_entry*));
+	dcache_id_buckets = calloc(dcache_bucket_count, sizeof(dcache_entry*));
+	if (dcache_buckets == NULL || dcache_id_buckets == NULL){
+		log_error("Could not allocate the dentry cache\n");
+		free(dcache_buckets);
+		free(dcache_id_buckets);
+		dcache_buckets = NULL;
+		dcache_id_buckets = NULL;
+		dcache_bucket_count = 0;
+	}
+}
+
+static void dcache_lru_unlink(dcache_entry* entry){
+	if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+	else dcache_lru_head = entry->lru_next;
+	if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+	else dcache_lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void dcache_lru_push_front(dcache_entry* entry){
+	entry->lru_prev = NULL;
+	entry->lru_next = dcache_lru_head;
+	if (dcache_lru_head != NULL) dcache_lru_head->lru_prev = entry;
+	dcache_lru_head = entry;
+	if (dcache_lru_tail == NULL) dcache_lru_tail = entry;
+}
+
+/**
+ * Finds the slot in the bucket chain that points at the entry for path.
+ *
+ * @return a pointer to the link pointing at the entry, or to the NULL link at
+ * the end of the chain if the path is not cached
+ */
+static dcache_entry** dcache_find_slot(const char* path, uint64_t hash){
+	dcache_entry** slot = &dcache_buckets[hash & (dcache_bucket_count - 1)];
+	while (*slot != NULL){
+		if ((*slot)->hash == hash && strcmp((*slot)->f.path, path) == 0){
+			break;
+		}
+		slot = &(*slot)->bucket_next;
+	}
+	return slot;
+}
+
+/**
+ * Finds the slot in the UUID chain that points at the entry for a file.
+ *
+ * @return a pointer to the link pointing at the entry, or to the NULL link at
+ * the end of the chain if the file is not cached
+ */
+static dcache_entry** dcache_find_id_slot(const uuid_t id){
+	dcache_entry** slot = &dcache_id_buckets[hash_bytes(id, sizeof(uuid_t)) & \
+																					 (dcache_bucket_count - 1)];
+	while (*slot != NULL && uuid_compare((*slot)->f.meta_data_id, id) != 0){
+		slot = &(*slot)->id_next;
+	}
+	return slot;
+}
+
+/**
+ * Removes an entry from the hash tables and the LRU list and frees it.
+ */
+static void dcache_drop(dcache_entry** slot){
+	dcache_entry* entry = *slot;
+	*slot = entry->bucket_next;
+	dcache_entry** id_slot = dcache_find_id_slot(entry->f.meta_data_id);
+	while (*id_slot != entry){
+		id_slot = &(*id_slot)->id_next;
+	}
+	*id_slot = entry->id_next;
+	dcache_lru_unlink(entry);
+	dcache_count--;
+	free(entry);
+}
+
+/**
+ * Looks a path up, making a hit the most recently used entry.
+ * Must be called with dcache_lock held.
+ *
+ * @return the entry, or NULL on a miss
+ */
+static dcache_entry* dcache_find(const char* path){
+	dcache_init();
+	if (dcache_bucket_count == 0){
+		return NULL;
+	}
+	dcache_entry* entry = *dcache_find_slot(path, hash_bytes(path, strlen(path)));
+	if (entry != NULL){
+		dcache_lru_unlink(entry);
+		dcache_lru_push_front(entry);
+	}
+	return entry;
+}
+
+/**
+ * Inserts or refreshes an entry. Must be called with dcache_lock held.
+ */
+static void dcache_insert(file* f){
+	dcache_init();
+	if (dcache_bucket_count == 0 || dcache_capacity == 0){
+		return;
+	}
+	uint64_t hash = hash_bytes(f->path, strlen(f->path));
+
+	//The file may still be cached under the path it had before a rename, and
+	//the path may still have another file cached under it
+	dcache_entry* other = *dcache_find_id_slot(f->meta_data_id);
+	if (other != NULL && (other->hash != hash || strcmp(other->f.path, f->path) != 0)){
+		dcache_drop(dcache_find_slot(other->f.path, other->hash));
+	}
+	dcache_entry** slot = dcache_find_slot(f->path, hash);
+	if (*slot != NULL && uuid_compare((*slot)->f.meta_data_id, f->meta_data_id) != 0){
+		dcache_drop(slot);
+		slot = dcache_find_slot(f->path, hash);
+	}
+	dcache_entry* entry = *slot;
+
+	if (entry == NULL){
+		//Make room by throwing away the least recently used file
+		if (dcache_count >= dcache_capacity){
+			dcache_entry* victim = dcache_lru_tail;
+			dcache_drop(dcache_find_slot(victim->f.path, victim->hash));
+		}
+		entry = malloc(sizeof(dcache_entry));
+		if (entry == NULL){
+			return;
+		}
+		entry->hash = hash;
+		entry->bucket_next = dcache_buckets[hash & (dcache_bucket_count - 1)];
+		dcache_buckets[hash & (dcache_bucket_count - 1)] = entry;
+		memcpy(entry->f.meta_data_id, f->meta_data_id, sizeof(uuid_t));
+		dcache_entry** id_slot = dcache_find_id_slot(f->meta_data_id);
+		entry->id_next = NULL;
+		*id_slot = entry;
+		dcache_count++;
+	}else{
+		dcache_lru_unlink(entry);
+	}
+	memcpy(&entry->f, f, sizeof(file));
+	dcache_lru_push_front(entry);
+}
+
+static uint64_t* dcache_generation(const char* path){
+	return &dcache_generations[hash_bytes(path, strlen(path)) % \
+																												DCACHE_GENERATIONS];
+}
+
+static uint64_t* dcache_id_generation(const uuid_t id){
+	return &dcache_id_generations[hash_bytes(id, sizeof(uuid_t)) % \
+																		DCACHE_GENERATIONS];
+}
+
+/**
+ * Looks a path up in the dentry cache.
+ *
+ * @param path a normalised path
+ * @param out where to copy the cached file
+ *
+ * @return 0 on a hit, -1 on a miss
+ */
+int dcache_get(const char* path, file* out){
+	pthread_mutex_lock(&dcache_lock);
+	dcache_entry* entry = dcache_find(path);
+	if (entry != NULL){
+		memcpy(out, &entry->f, sizeof(file));
+		dcache_hits++;
+	}else{
+		dcache_misses++;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return (entry != NULL) ? 0 : -1;
+}
+
+/**
+ * Reports how often files were found in the cache.
+ *
+ * @param hits set to how many lookups were answered from it
+ * @param misses set to how many were not
+ *
+ * @return the hit rate, from 0 to 1
+ */
+double dcache_stats(uint64_t* hits, uint64_t* misses){
+	pthread_mutex_lock(&dcache_lock);
+	*hits = dcache_hits;
+	*misses = dcache_misses;
+	pthread_mutex_unlock(&dcache_lock);
+	return (*hits + *misses > 0) ? (double)*hits / (*hits + *misses) : 0;
+}
+
+/**
+ * Looks a file up in the dentry cache by its meta data UUID.
+ *
+ * @param id the file's meta data UUID
+ * @param out where to copy the cached file, with the path it is cached under
+ *
+ * @return 0 on a hit, -1 on a miss
+ */
+int dcache_get_by_id(const uuid_t id, file* out){
+	pthread_mutex_lock(&dcache_lock);
+	dcache_init();
+	dcache_entry* entry = (dcache_bucket_count != 0) ? *dcache_find_id_slot(id) : \
+												NULL;
+	if (entry != NULL){
+		memcpy(out, &entry->f, sizeof(file));
+		dcache_lru_unlink(entry);
+		dcache_lru_push_front(entry);
+		dcache_hits++;
+	}else{
+		dcache_misses++;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return (entry != NULL) ? 0 : -1;
+}
+
+/**
+ * Like dcache_get() but only copies out the meta data UUID.
+ */
+int dcache_get_id(const char* path, uuid_t out){
+	pthread_mutex_lock(&dcache_lock);
+	dcache_entry* entry = dcache_find(path);
+	if (entry != NULL){
+		memcpy(out, entry->f.meta_data_id, sizeof(uuid_t));
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return (entry != NULL) ? 0 : -1;
+}
+
+/**
+ * Called by lookups before reading a file from the DB.
+ *
+ * @param path the path the file will be cached under
+ *
+ * @return a ticket to hand to dcache_fill()
+ */
+uint64_t dcache_ticket(const char* path){
+	pthread_mutex_lock(&dcache_lock);
+	//Both only ever go up, so the sum only stays the same if neither moves
+	uint64_t ticket = *dcache_generation(path) + dcache_epoch;
+	pthread_mutex_unlock(&dcache_lock);
+	return ticket;
+}
+
+/**
+ * Called by lookups once they know which file they are about to read from the
+ * DB, before reading it.
+ *
+ * @param id the file's meta data UUID
+ *
+ * @return what to add to the ticket from dcache_ticket()
+ */
+uint64_t dcache_id_ticket(const uuid_t id){
+	pthread_mutex_lock(&dcache_lock);
+	uint64_t ticket = *dcache_id_generation(id);
+	pthread_mutex_unlock(&dcache_lock);
+	return ticket;
+}
+
+/**
+ * Caches a file a lookup read from the DB, unless a writer has changed its
+ * path or the file itself since the ticket was taken.
+ *
+ * @param f the file, a copy is taken
+ * @param ticket from dcache_ticket() plus dcache_id_ticket()
+ */
+void dcache_fill(file* f, uint64_t ticket){
+	pthread_mutex_lock(&dcache_lock);
+	if (*dcache_generation(f->path) + *dcache_id_generation(f->meta_data_id) + \
+			dcache_epoch == ticket){
+		ncache_forget(f->path);
+		dcache_insert(f);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Tells whether a path is known not to exist.
+ *
+ * @param path a normalised path
+ *
+ * @return non-0 if it is cached as missing
+ */
+int dcache_missing(const char* path){
+	pthread_mutex_lock(&dcache_lock);
+	int missing = ncache_find(path, hash_bytes(path, strlen(path))) != NULL;
+	if (missing){
+		ncache_hits++;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return missing;
+}
+
+/**
+ * Remembers that a lookup found nothing at a path, unless a writer has changed
+ * it since the ticket was taken.
+ *
+ * @param path a normalised path
+ * @param ticket from dcache_ticket()
+ */
+void dcache_fill_missing(const char* path, uint64_t ticket){
+	pthread_mutex_lock(&dcache_lock);
+	ncache_misses++;
+	if (*dcache_generation(path) + dcache_epoch == ticket && dcache_capacity > 0){
+		uint64_t hash = hash_bytes(path, strlen(path));
+		ncache_entry* entry = &ncache[hash % MYFS_NCACHE_SIZE];
+		entry->hash = hash;
+		strcpy(entry->path, path);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Reports how often lookups of missing paths were answered from the cache.
+ *
+ * @param hits set to how many were
+ * @param misses set to how many had to look in the DB
+ *
+ * @return the hit rate, from 0 to 1
+ */
+double dcache_missing_stats(uint64_t* hits, uint64_t* misses){
+	pthread_mutex_lock(&dcache_lock);
+	*hits = ncache_hits;
+	*misses = ncache_misses;
+	pthread_mutex_unlock(&dcache_lock);
+	return (*hits + *misses > 0) ? (double)*hits / (*hits + *misses) : 0;
+}
+
+/**
+ * Inserts or refreshes the cached copy of a file. The key is the file's own
+ * path. If only its name is known (it was found by UUID), whatever is cached
+ * for it is refreshed under the path it already has. Writers call this
+ * (through store_file()) while holding the file's inode lock.
+ *
+ * @param f the file to cache, a copy is taken
+ */
+void dcache_put(file* f){
+	pthread_mutex_lock(&dcache_lock);
+	if (f->path[0] == '/'){
+		(*dcache_generation(f->path))++;
+		ncache_forget(f->path);
+		dcache_insert(f);
+	}else{
+		//A lookup of whatever its path is may be about to cache the old copy
+		(*dcache_id_generation(f->meta_data_id))++;
+	}
+	if (f->path[0] != '/' && dcache_bucket_count != 0){
+		dcache_entry* entry = *dcache_find_id_slot(f->meta_data_id);
+		if (entry != NULL){
+			(*dcache_generation(entry->f.path))++;
+			char path[MY_MAX_PATH];
+			strcpy(path, entry->f.path);
+			memcpy(&entry->f, f, sizeof(file));
+			strcpy(entry->f.path, path);
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Forgets a file, eg: because it has been deleted.
+ *
+ * @param f the file, found by path or by UUID
+ */
+void dcache_remove(const file* f){
+	pthread_mutex_lock(&dcache_lock);
+	if (f->path[0] == '/'){
+		(*dcache_generation(f->path))++;
+	}else{
+		(*dcache_id_generation(f->meta_data_id))++;
+	}
+	if (dcache_bucket_count != 0){
+		dcache_entry** slot = dcache_find_id_slot(f->meta_data_id);
+		if (*slot != NULL){
+			(*dcache_generation((*slot)->f.path))++;
+			dcache_drop(dcache_find_slot((*slot)->f.path, (*slot)->hash));
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Forgets that a path is missing, because a file was just created or moved
+ * there.
+ *
+ * @param path the file's path. If its directory was found by UUID this is
+ *				 not the whole path, and every missing path is forgotten.
+ */
+void dcache_appeared(const char* path){
+	pthread_mutex_lock(&dcache_lock);
+	if (path[0] == '/'){
+		ncache_forget(path);
+	}else{
+		ncache_clear();
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Forgets a directory and everything below it, eg: because it was moved.
+ *
+ * @param dir the directory, found by path or by UUID. If its path is not
+ *				known the whole cache is emptied.
+ */
+void dcache_remove_tree(const file* dir){
+	pthread_mutex_lock(&dcache_lock);
+	dcache_epoch++;
+	//Wherever it went, paths below it now exist
+	ncache_clear();
+	size_t len = strlen(dir->path);
+	dcache_entry* entry = dcache_lru_head;
+	while (entry != NULL){
+		dcache_entry* next = entry->lru_next;
+		if (dir->path[0] != '/' || (strncmp(entry->f.path, dir->path, len) == 0 && \
+				(entry->f.path[len] == '\0' || entry->f.path[len] == '/'))){
+			dcache_drop(dcache_find_slot(entry->f.path, entry->hash));
+		}
+		entry = next;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Empties the dentry cache. Must be called with dcache_lock held.
+ */
+static void dcache_clear_locked(){
+	while (dcache_lru_head != NULL){
+		dcache_entry* entry = dcache_lru_head;
+		dcache_drop(dcache_find_slot(entry->f.path, entry->hash));
+	}
+	for (int i = 0; i < DCACHE_GENERATIONS; i++){
+		dcache_generations[i]++;
+	}
+	ncache_clear();
+}
+
+/**
+ * Empties the dentry cache.
+ */
+void dcache_clear(){
+	pthread_mutex_lock(&dcache_lock);
+	dcache_clear_locked();
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Changes how many files the dentry cache may hold. The cache is emptied and
+ * rebuilt at the new size.
+ *
+ * @param capacity the maximum number of cached files, 0 disables the cache
+ */
+void dcache_set_capacity(size_t capacity){
+	pthread_mutex_lock(&dcache_lock);
+	dcache_clear_locked();
+	free(dcache_buckets);
+	free(dcache_id_buckets);
+	dcache_buckets = NULL;
+	dcache_id_buckets = NULL;
+	dcache_bucket_count = 0;
+	dcache_capacity = capacity;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+static int has_legacy_children(const file* dir);
+static int dir_upgrade(file* dir);
+
+/**
+ * Writes a file's meta data to the DB and keeps the dentry cache coherent with
+ * what was written. The caller must hold the file's inode lock exclusively.
+ *
+ * @param f the file to store
+ *
+ * @return the unqlite return code
+ */
+int store_file(file* f){
+	//A directory's children have to be paged before the old layout goes
+	int rc = UNQLITE_OK;
+	if (has_legacy_children(f)){
+		rc = dir_upgrade(f);
+	}
+	if (rc == UNQLITE_OK){
+		rc = inode_store(f);
+	}
+	if (rc == UNQLITE_OK){
+		dcache_put(f);
+	}else{
+		//Whatever is cached may no longer match the DB
+		dcache_remove(f);
+	}
+	return rc;
+}
+
+/*
+ ***************
+	Directories
+ ***************
+
+	A directory's entries (each child's UUID, type and name) are kept in pages
+	of DIR_PAGE_SLOTS slots. Its head record says how many pages there are and
+	starts a list of the pages that have a free slot, so adding a child fills a
+	slot in one page and removing one empties a slot in one page, however big
+	the directory is. The head only changes when a page fills up, gets a slot
+	back or is added.
+
+	Next to the pages is a name index, buckets keyed by the hash of a name,
+	which says which child has a name and which slot its entry is in. Looking a
+	child up, adding it and removing it each take a fetch of one bucket.
+
+	Directories read from the old layout, with their children in their own
+	record, are read as they are and are paged by the first operation that adds
+	or removes one of their children.
+*/
+
+//Records other than a file's meta data are stored under composite keys made up
+//of the UUID they belong to, the kind of record and a number (eg: a hash).
+typedef struct myfs_key {
+	uuid_t id;
+	uint32_t kind;
+	uint32_t reserved; //Always 0, keeps the layout free of padding
+	uint64_t number;
+} myfs_key;
+
+#define KEY_KIND_DENTRY 5 //Name hash -> child UUID and slot bucket
+#define KEY_KIND_DIR_HEAD 6 //Number of pages and the first with a free slot
+#define KEY_KIND_DIR_PAGE 7 //A page of entries, by page number
+
+#define DIR_PAGE_SLOTS 32
+#define DIR_PAGE_NONE 0xffffffff
+
+//How many colliding names we expect to fit in a bucket fetched on the stack
+#define DENTRY_BUCKET_SLOTS 4
+
+//A child in a page of its directory's entries. Free slots have a null id.
+typedef struct dir_entry {
+	uuid_t id;
+	uint32_t type; //The child's S_IFMT bits
+	char name[MY_MAX_PATH];
+} dir_entry;
+
+typedef struct dir_page {
+	uint32_t used;
+	uint32_t next_free; //The next page with a free slot, if this one has one
+	dir_entry slots[DIR_PAGE_SLOTS];
+} dir_page;
+
+typedef struct dir_head {
+	uint32_t pages;
+	uint32_t free; //The first page with a free slot, or DIR_PAGE_NONE
+} dir_head;
+
+//One child in a directory's name index. Several of these are stored back to
+//back when names in the same directory share a hash.
+typedef struct dentry {
+	uuid_t child;
+	uint32_t page;
+	uint32_t slot;
+	char name[MY_MAX_PATH];
+} dentry;
+
+//Directories recently seen to be paged, so that looking up a name that does
+//not exist does not have to check for the head again every time. Direct
+//mapped by UUID hash.
+#define PAGED_CACHE_SLOTS 1024
+static uuid_t paged_cache[PAGED_CACHE_SLOTS];
+static pthread_mutex_t paged_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Fills in a composite key.
+ *
+ * @param key the key to fill in
+ * @param id the UUID the record belongs to
+ * @param kind what sort of record it is (KEY_KIND_*)
+ * @param number the record's number within its owner
+ */
+void make_key(myfs_key* key, const uuid_t id, uint32_t kind, uint64_t number){
+	memset(key, 0, sizeof(myfs_key));
+	memcpy(key->id, id, sizeof(uuid_t));
+	key->kind = kind;
+	key->number = number;
+}
+
+/**
+ * @return non-0 if the directory was read from the old layout and its children
+ *				 are still in its own record
+ */
+static int has_legacy_children(const file* dir){
+	return S_ISDIR(dir->mode) && dir->number_children > REST_POS && \
+				 !uuid_is_null(dir->children[REST_POS]);
+}
+
+static void paged_cache_set(const uuid_t id, int paged){
+	uuid_t* slot = &paged_cache[hash_bytes(id, sizeof(uuid_t)) % PAGED_CACHE_SLOTS];
+	pthread_mutex_lock(&paged_cache_lock);
+	if (paged){
+		memcpy(*slot, id, sizeof(uuid_t));
+	}else if (uuid_compare(*slot, id) == 0){
+		uuid_clear(*slot);
+	}
+	pthread_mutex_unlock(&paged_cache_lock);
+}
+
+/**
+ * Forgets which directories are paged.
+ */
+void paged_cache_clear(){
+	pthread_mutex_lock(&paged_cache_lock);
+	memset(paged_cache, 0, sizeof(paged_cache));
+	pthread_mutex_unlock(&paged_cache_lock);
+}
+
+static int dir_head_fetch(file* dir, dir_head* head){
+	myfs_key key;
+	make_key(&key, dir->meta_data_id, KEY_KIND_DIR_HEAD, 0);
+	unqlite_int64 size = sizeof(dir_head);
+	int rc = kv_fetch(&key, sizeof(myfs_key), head, &size);
+	if (rc == UNQLITE_OK && size != sizeof(dir_head)){
+		rc = UNQLITE_CORRUPT;
+	}
+	return rc;
+}
+
+static int dir_head_store(file* dir, const dir_head* head){
+	myfs_key key;
+	make_key(&key, dir->meta_data_id, KEY_KIND_DIR_HEAD, 0);
+	return kv_store(&key, sizeof(myfs_key), head, sizeof(dir_head));
+}
+
+static int dir_page_fetch(file* dir, uint32_t number, dir_page* page){
+	myfs_key key;
+	make_key(&key, dir->meta_data_id, KEY_KIND_DIR_PAGE, number);
+	unqlite_int64 size = sizeof(dir_page);
+	int rc = kv_fetch(&key, sizeof(myfs_key), page, &size);
+	if (rc == UNQLITE_OK && size != sizeof(dir_page)){
+		rc = UNQLITE_CORRUPT;
+	}
+	return rc;
+}
+
+static int dir_page_store(file* dir, uint32_t number, const dir_page* page){
+	myfs_key key;
+	make_key(&key, dir->meta_data_id, KEY_KIND_DIR_PAGE, number);
+	return kv_store(&key, sizeof(myfs_key), page, sizeof(dir_page));
+}
+
+/**
+ * @return non-0 if the directory is paged, 0 if it is from the old layout
+ */
+static int dir_is_paged(file* dir){
+	uuid_t* slot = &paged_cache[hash_bytes(dir->meta_data_id, sizeof(uuid_t)) \
+																								% PAGED_CACHE_SLOTS];
+	pthread_mutex_lock(&paged_cache_lock);
+	int paged = uuid_compare(*slot, dir->meta_data_id) == 0;
+	pthread_mutex_unlock(&paged_cache_lock);
+	if (paged){
+		return 1;
+	}
+
+	dir_head head;
+	if (dir_head_fetch(dir, &head) != UNQLITE_OK){
+		return 0;
+	}
+	paged_cache_set(dir->meta_data_id, 1);
+	return 1;
+}
+
+/**
+ * Gives a new directory its (empty) head.
+ *
+ * @param dir the directory
+ *
+ * @return the unqlite return code
+ */
+int dir_init(file* dir){
+	dir_head head = {0, DIR_PAGE_NONE};
+	int rc = dir_head_store(dir, &head);
+	if (rc == UNQLITE_OK){
+		paged_cache_set(dir->meta_data_id, 1);
+	}
+	return rc;
+}
+
+/**
+ * Deletes everything an empty directory has left in the DB.
+ *
+ * @param dir the directory
+ */
+void dir_drop(file* dir){
+	paged_cache_set(dir->meta_data_id, 0);
+	myfs_key key;
+	dir_head head;
+	if (dir_head_fetch(dir, &head) == UNQLITE_OK){
+		for (uint32_t i = 0; i < head.pages; i++){
+			make_key(&key, dir->meta_data_id, KEY_KIND_DIR_PAGE, i);
+			kv_delete(&key, sizeof(myfs_key));
+		}
+		make_key(&key, dir->meta_data_id, KEY_KIND_DIR_HEAD, 0);
+		kv_delete(&key, sizeof(myfs_key));
+	}
+}
+
+/**
+ * Fetches the bucket of a directory's name index that name hashes into.
+ *
+ * @param dir the directory
+ * @param name the child's name
+ * @param stack_bucket space for DENTRY_BUCKET_SLOTS entries
+ * @param bucket set to stack_bucket, or to a malloc'd buffer if the bucket was
+ *				 too large for it (the caller must free that)
+ * @param count set to the number of entries in the bucket
+ *
+ * @return UNQLITE_OK, UNQLITE_NOTFOUND if the bucket is empty, or another
+ *				 unqlite error
+ */
+static int dentry_fetch_bucket(file* dir, const char* name, \
+					dentry* stack_bucket, dentry** bucket, int* count){
+	myfs_key key;
+	make_key(&key, dir->meta_data_id, KEY_KIND_DENTRY, \
+						hash_bytes(name, strlen(name)));
+	*bucket = stack_bucket;
+	*count = 0;
+
+	const unqlite_int64 stack_size = DENTRY_BUCKET_SLOTS * sizeof(dentry);
+	unqlite_int64 size = stack_size;
+	int rc = kv_fetch(&key, sizeof(myfs_key), stack_bucket, &size);
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+
+	//A full buffer means there might be more, ask for the real size
+	if (size == stack_size){
+		rc = kv_fetch(&key, sizeof(myfs_key), NULL, &size);
+		if (rc != UNQLITE_OK){
+			return rc;
+		}
+		if (size > stack_size){
+			*bucket = malloc(size);
+			if (*bucket == NULL){
+				return UNQLITE_NOMEM;
+			}
+			rc = kv_fetch(&key, sizeof(myfs_key), *bucket, &size);
+			if (rc != UNQLITE_OK){
+				free(*bucket);
+				*bucket = stack_bucket;
+				return rc;
+			}
+		}
+	}
+	if (size < 0 || (size_t)size % sizeof(dentry) != 0){
+		log_error("A name index bucket of %s is corrupt\n", dir->path);
+		if (*bucket != stack_bucket){
+			free(*bucket);
+			*bucket = stack_bucket;
+		}
+		return UNQLITE_CORRUPT;
+	}
+	*count = size / sizeof(dentry);
+	return UNQLITE_OK;
+}
+
+/**
+ * Adds a child to its directory's name index.
+ *
+ * @param dir the directory
+ * @param name the child's name
+ * @param child the child's meta data UUID
+ * @param page the page its entry is in
+ * @param slot the slot its entry is in
+ *
+ * @return the unqlite return code, UNQLITE_INVALID if the name is too long
+ *				 for an entry
+ */
+static int dentry_add(file* dir, const char* name, const uuid_t child, \
+											uint32_t page, uint32_t slot){
+	myfs_key key;
+	make_key(&key, dir->meta_data_id, KEY_KIND_DENTRY, \
+						hash_bytes(name, strlen(name)));
+	dentry entry;
+	memset(&entry, 0, sizeof(dentry));
+	if (name_copy(entry.name, name) != 0){
+		log_error("%s is too long to index in %s\n", name, dir->path);
+		return UNQLITE_INVALID;
+	}
+	memcpy(entry.child, child, sizeof(uuid_t));
+	entry.page = page;
+	entry.slot = slot;
+	return kv_append(&key, sizeof(myfs_key), &entry, sizeof(dentry));
+}
+
+/**
+ * Removes a child from its directory's name index.
+ *
+ * @param dir the directory
+ * @param name the child's name
+ * @param removed set to the child's index entry
+ *
+ * @return the unqlite return code, UNQLITE_NOTFOUND if there is no such child
+ */
+static int dentry_remove(file* dir, const char* name, dentry* removed){
+	dentry stack_bucket[DENTRY_BUCKET_SLOTS];
+	dentry* bucket;
+	int count;
+	int rc = dentry_fetch_bucket(dir, name, stack_bucket, &bucket, &count);
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+
+	//Keep every other name that shares the hash
+	int kept = 0;
+	for (int i = 0; i < count; i++){
+		if (strcmp(bucket[i].name, name) != 0){
+			memcpy(&bucket[kept++], &bucket[i], sizeof(dentry));
+		}else{
+			memcpy(removed, &bucket[i], sizeof(dentry));
+		}
+	}
+
+	myfs_key key;
+	make_key(&key, dir->meta_data_id, KEY_KIND_DENTRY, \
+						hash_bytes(name, strlen(name)));
+	if (kept == count){
+		rc = UNQLITE_NOTFOUND;
+	}else if (kept == 0){
+		rc = kv_delete(&key, sizeof(myfs_key));
+	}else{
+		rc = kv_store(&key, sizeof(myfs_key), bucket, kept * sizeof(dentry));
+	}
+
+	if (bucket != stack_bucket){
+		free(bucket);
+	}
+	return rc;
+}
+
+/**
+ * Gets the entries of a directory that is not paged yet from the children in
+ * its own record. Nothing is written.
+ *
+ * @param dir the directory
+ * @param out set to a malloc'd array with an entry per child (NULL if there
+ *				are none), which the caller must free
+ * @param count set to the number of entries
+ *
+ * @return the unqlite return code
+ */
+static int dir_old_entries(file* dir, dir_entry** out, int* count){
+	*out = NULL;
+	*count = dir->number_children - REST_POS;
+	if (*count <= 0){
+		*count = 0;
+		return UNQLITE_OK;
+	}
+
+	if (!has_legacy_children(dir)){
+		log_error("%s has children but no pages\n", dir->path);
+		*count = 0;
+		return UNQLITE_CORRUPT;
+	}
+
+	dir_entry* entries = malloc(*count * sizeof(dir_entry));
+	file* child = malloc(sizeof(file));
+	if (entries == NULL || child == NULL){
+		free(entries);
+		free(child);
+		return UNQLITE_NOMEM;
+	}
+	int rc = UNQLITE_OK;
+	for (int i = 0; i < *count && rc == UNQLITE_OK; i++){
+		rc = inode_fetch(dir->children[REST_POS + i], child);
+		memset(&entries[i], 0, sizeof(dir_entry));
+		memcpy(entries[i].id, dir->children[REST_POS + i], sizeof(uuid_t));
+		entries[i].type = child->mode & S_IFMT;
+		if (rc == UNQLITE_OK && name_copy(entries[i].name, path_name(child->path)) != 0){
+			log_error("A child of %s has a name that is too long\n", dir->path);
+			rc = UNQLITE_CORRUPT;
+		}
+	}
+	free(child);
+
+	if (rc != UNQLITE_OK){
+		free(entries);
+		return rc;
+	}
+	*out = entries;
+	return UNQLITE_OK;
+}
+
+/**
+ * Looks a child up in a directory that is not paged yet by going through its
+ * entries.
+ *
+ * @return 0 on success, -ENOENT if there is no such child, -EIO on DB errors
+ */
+static int dentry_lookup_unpaged(file* dir, const char* name, uuid_t child){
+	dir_entry* entries;
+	int count;
+	if (dir_old_entries(dir, &entries, &count) != UNQLITE_OK){
+		return -EIO;
+	}
+	int found = -ENOENT;
+	for (int i = 0; i < count && found != 0; i++){
+		if (strcmp(entries[i].name, name) == 0){
+			memcpy(child, entries[i].id, sizeof(uuid_t));
+			found = 0;
+		}
+	}
+	free(entries);
+	return found;
+}
+
+/**
+ * Looks a child up by name in its directory's name index. This takes a single
+ * fetch however many children the directory has.
+ *
+ * @param dir the directory
+ * @param name the child's name
+ * @param child set to the child's meta data UUID when found
+ *
+ * @return 0 on success, -ENOENT if there is no such child, -EIO on DB errors
+ */
+int dentry_lookup(file* dir, const char* name, uuid_t child){
+	dentry stack_bucket[DENTRY_BUCKET_SLOTS];
+	dentry* bucket;
+	int count;
+	int rc = dentry_fetch_bucket(dir, name, stack_bucket, &bucket, &count);
+
+	if (rc == UNQLITE_NOTFOUND && dir->number_children > REST_POS && \
+			!dir_is_paged(dir)){
+		return dentry_lookup_unpaged(dir, name, child);
+	}
+	if (rc == UNQLITE_NOTFOUND){
+		return -ENOENT;
+	}else if (rc != UNQLITE_OK){
+		return -EIO;
+	}
+
+	int found = -ENOENT;
+	for (int i = 0; i < count; i++){
+		if (strcmp(bucket[i].name, name) == 0){
+			memcpy(child, bucket[i].child, sizeof(uuid_t));
+			found = 0;
+			break;
+		}
+	}
+	if (bucket != stack_bucket){
+		free(bucket);
+	}
+	return found;
+}
+
+/**
+ * Pages a directory read from the old layout. Does nothing for any other file. The caller holds the
+ * directory's lock exclusively.
+ *
+ * @param dir the directory, whose children in its own record are cleared
+ *
+ * @return the unqlite return code
+ */
+static int dir_upgrade(file* dir){
+	if (!S_ISDIR(dir->mode) || dir_is_paged(dir)){
+		return UNQLITE_OK;
+	}
+	log_info("Paging the entries of %s\n", dir->path);
+
+	dir_entry* entries;
+	int count;
+	int rc = dir_old_entries(dir, &entries, &count);
+	dir_page* page = calloc(1, sizeof(dir_page));
+	if (rc != UNQLITE_OK || page == NULL){
+		free(entries);
+		free(page);
+		return (rc != UNQLITE_OK) ? rc : UNQLITE_NOMEM;
+	}
+
+	dir_head head = {0, DIR_PAGE_NONE};
+	for (int i = 0; i < count && rc == UNQLITE_OK; i++){
+		uint32_t slot = i % DIR_PAGE_SLOTS;
+		memcpy(&page->slots[slot], &entries[i], sizeof(dir_entry));
+		page->used++;
+		rc = dentry_add(dir, entries[i].name, entries[i].id, head.pages, slot);
+
+		if (rc == UNQLITE_OK && (page->used == DIR_PAGE_SLOTS || i == count - 1)){
+			page->next_free = DIR_PAGE_NONE;
+			if (page->used < DIR_PAGE_SLOTS){
+				head.free = head.pages;
+			}
+			rc = dir_page_store(dir, head.pages++, page);
+			memset(page, 0, sizeof(dir_page));
+		}
+	}
+	free(page);
+	free(entries);
+
+	if (rc == UNQLITE_OK){
+		rc = dir_head_store(dir, &head);
+	}
+	if (rc == UNQLITE_OK){
+		paged_cache_set(dir->meta_data_id, 1);
+		if (count > 0){
+			uuid_clear(dir->children[REST_POS]);
+		}
+	}
+	return rc;
+}
+
+/**
+ * Adds a child to a directory. This changes one page, and the head if that
+ * page fills up or a page has to be added. The caller holds the directory's
+ * lock exclusively.
+ *
+ * @param dir the directory
+ * @param name the child's name
+ * @param child the child's meta data UUID
+ * @param mode the child's mode
+ *
+ * @return the unqlite return code, UNQLITE_INVALID if the name is too long
+ *				 for an entry
+ */
+int dir_insert(file* dir, const char* name, const uuid_t child, mode_t mode){
+	int rc = dir_upgrade(dir);
+	dir_head head;
+	if (rc == UNQLITE_OK){
+		rc = dir_head_fetch(dir, &head);
+	}
+	dir_page* page = malloc(sizeof(dir_page));
+	if (rc != UNQLITE_OK || page == NULL){
+		free(page);
+		return (rc != UNQLITE_OK) ? rc : UNQLITE_NOMEM;
+	}
+
+	//Use the first page with room, or start a new one
+	int head_changed = 0;
+	uint32_t number = head.free;
+	if (number == DIR_PAGE_NONE){
+		number = head.pages++;
+		memset(page, 0, sizeof(dir_page));
+		page->next_free = DIR_PAGE_NONE;
+		head.free = number;
+		head_changed = 1;
+	}else{
+		rc = dir_page_fetch(dir, number, page);
+	}
+
+	uint32_t slot = 0;
+	while (rc == UNQLITE_OK && slot < DIR_PAGE_SLOTS && \
+				 !uuid_is_null(page->slots[slot].id)){
+		slot++;
+	}
+	if (rc == UNQLITE_OK && slot == DIR_PAGE_SLOTS){
+		log_error("Page %u of %s is on the free list but full\n", number, dir->path);
+		rc = UNQLITE_CORRUPT;
+	}
+
+	if (rc == UNQLITE_OK){
+		dir_entry* entry = &page->slots[slot];
+		memset(entry, 0, sizeof(dir_entry));
+		memcpy(entry->id, child, sizeof(uuid_t));
+		entry->type = mode & S_IFMT;
+		if (name_copy(entry->name, name) != 0){
+			log_error("%s is too long for an entry of %s\n", name, dir->path);
+			free(page);
+			return UNQLITE_INVALID;
+		}
+		if (++page->used == DIR_PAGE_SLOTS){
+			head.free = page->next_free;
+			page->next_free = DIR_PAGE_NONE;
+			head_changed = 1;
+		}
+		rc = dir_page_store(dir, number, page);
+	}
+	free(page);
+	if (rc == UNQLITE_OK && head_changed){
+		rc = dir_head_store(dir, &head);
+	}
+	if (rc == UNQLITE_OK){
+		rc = dentry_add(dir, name, child, number, slot);
+	}
+	return rc;
+}
+
+/**
+ * Removes a child from a directory. This changes one page, and the head if
+ * that page was full. The caller holds the directory's lock exclusively.
+ *
+ * @param dir the directory
+ * @param name the child's name
+ *
+ * @return the unqlite return code, UNQLITE_NOTFOUND if there is no such child
+ */
+int dir_remove(file* dir, const char* name){
+	int rc = dir_upgrade(dir);
+	dentry removed;
+	if (rc == UNQLITE_OK){
+		rc = dentry_remove(dir, name, &removed);
+	}
+	dir_page* page = malloc(sizeof(dir_page));
+	if (rc != UNQLITE_OK || page == NULL){
+		free(page);
+		return (rc != UNQLITE_OK) ? rc : UNQLITE_NOMEM;
+	}
+
+	rc = dir_page_fetch(dir, removed.page, page);
+	if (rc == UNQLITE_OK && removed.slot >= DIR_PAGE_SLOTS){
+		log_error("The name index of %s points past a page\n", dir->path);
+		rc = UNQLITE_CORRUPT;
+	}
+	if (rc == UNQLITE_OK){
+		memset(&page->slots[removed.slot], 0, sizeof(dir_entry));
+
+		//A page that was full goes back on the free list
+		if (page->used-- == DIR_PAGE_SLOTS){
+			dir_head head;
+			rc = dir_head_fetch(dir, &head);
+			if (rc == UNQLITE_OK){
+				page->next_free = head.free;
+				head.free = removed.page;
+				rc = dir_head_store(dir, &head);
+			}
+		}
+		if (rc == UNQLITE_OK){
+			rc = dir_page_store(dir, removed.page, page);
+		}
+	}
+	free(page);
+	return rc;
+}
+
+//Called by dir_iterate() for each entry with its name, its meta data UUID
+//(NULL for "." and ".."), its type and the offset of the entry after it.
+//Returns non-0 to stop, and negative if that is an error.
+typedef int (*dir_filler)(void* ctx, const char* name, const unsigned char* child, \
+													mode_t type, off_t next);
+
+/**
+ * Goes through a directory's children from an offset handed out by an earlier
+ * call. Offsets 0 to 2 are left for "." and "..", after that they say which
+ * slot of which page to carry on from, so they stay put while children come
+ * and go. The caller holds the directory's lock.
+ *
+ * @param dir the directory
+ * @param offset 0 to start at the beginning, otherwise the next offset of the
+ *				last entry already seen
+ * @param fill called for each entry
+ * @param ctx handed to fill
+ *
+ * @return 0 on success, fill's error, or -EIO
+ */
+int dir_iterate(file* dir, off_t offset, dir_filler fill, void* ctx){
+	uint64_t start = (offset > 2) ? offset - 2 : 0;
+	if (dir->number_children <= REST_POS){
+		return 0;
+	}
+
+	int full = 0;
+	if (!dir_is_paged(dir)){
+		dir_entry* entries;
+		int count;
+		if (dir_old_entries(dir, &entries, &count) != UNQLITE_OK){
+			return -EIO;
+		}
+		for (uint64_t i = start; i < (uint64_t)count && full == 0; i++){
+			full = fill(ctx, entries[i].name, entries[i].id, entries[i].type, i + 3);
+		}
+		free(entries);
+		return (full < 0) ? full : 0;
+	}
+
+	dir_head head;
+	dir_page* page = malloc(sizeof(dir_page));
+	if (page == NULL || dir_head_fetch(dir, &head) != UNQLITE_OK){
+		free(page);
+		return -EIO;
+	}
+	int rc = UNQLITE_OK;
+	for (uint64_t number = start / DIR_PAGE_SLOTS; \
+			 number < head.pages && full == 0 && rc == UNQLITE_OK; number++){
+		rc = dir_page_fetch(dir, number, page);
+		uint32_t slot = (number == start / DIR_PAGE_SLOTS) ? start % DIR_PAGE_SLOTS : 0;
+		for (; rc == UNQLITE_OK && slot < DIR_PAGE_SLOTS && full == 0; slot++){
+			dir_entry* entry = &page->slots[slot];
+			if (!uuid_is_null(entry->id)){
+				full = fill(ctx, entry->name, entry->id, entry->type, \
+										number * DIR_PAGE_SLOTS + slot + 3);
+			}
+		}
+	}
+	free(page);
+	if (rc != UNQLITE_OK){
+		return -EIO;
+	}
+	return (full < 0) ? full : 0;
+}
+
+/*
+ ***************
+	Compression
+ ***************
+*/
+
+//With "-o compress=lz4" (or zstd, if built with MYFS_ZSTD and linked with
+//-lzstd) each block is compressed on its own before it is stored, so a read
+//only has to expand the blocks it covers. A compressed block starts with a
+//pack_header saying how it was compressed and how long it was. Blocks that
+//would not shrink by at least a PACK_MIN_SAVING-th are stored as they are, and
+//which blocks are compressed is kept in the block map, so data stored before
+//(or with compression off) reads as it always did.
+#define PACK_NONE 0
+#define PACK_LZ4 1
+#define PACK_ZSTD 2
+
+#define PACK_MIN_SAVING 8
+
+#ifndef MYFS_ZSTD_LEVEL
+#define MYFS_ZSTD_LEVEL 1
+#endif
+
+typedef struct pack_header {
+	uint8_t codec;
+	uint8_t reserved;
+	uint16_t length; //Before compression
+} pack_header;
+
+static int pack_codec = PACK_NONE;
+
+//Since mounting, for the stats: bytes given to the compressor and what they
+//were stored as (compressed or not), bytes expanded, and the time taken
+static uint64_t pack_in = 0;
+static uint64_t pack_out = 0;
+static uint64_t pack_ns = 0;
+static uint64_t unpack_bytes = 0;
+static uint64_t unpack_ns = 0;
+
+/*
+	LZ4
+
+	Blocks are compressed in the LZ4 block format: a run of sequences, each a
+	token (literal count, match length - 4), the literals, and a 2 byte offset
+	back to the match. The last 5 bytes are always literals and no match starts
+	in the last 12, which is what the format asks of an encoder. Matches are
+	found with a single hash table of where each 4 bytes were last seen.
+*/
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+
+static inline uint32_t lz4_read32(const uint8_t* p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(uint32_t));
+	return v;
+}
+
+//Lengths of 15 and over carry on in bytes of 255 and a remainder
+static uint8_t* lz4_put_length(uint8_t* op, size_t len){
+	while (len >= 255){
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/**
+ * Compresses data in the LZ4 block format.
+ *
+ * @param src the data (at most 64 KiB)
+ * @param len how much there is
+ * @param dst where to put the result
+ * @param cap how much room there is there
+ *
+ * @return the compressed length, or 0 if it does not fit in cap
+ */
+static size_t lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, \
+													 size_t cap){
+	uint16_t seen[1 << LZ4_HASH_BITS];
+	memset(seen, 0, sizeof(seen));
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* end = src + len;
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + cap;
+
+	if (len > LZ4_MATCH_LIMIT){
+		const uint8_t* match_limit = end - LZ4_MATCH_LIMIT;
+		const uint8_t* extend_limit = end - LZ4_LAST_LITERALS;
+		//The longer nothing matches the further ahead we skip, so that data that
+		//will not compress is given up on quickly
+		unsigned misses = 0;
+		while (ip < match_limit){
+			uint32_t seq = lz4_read32(ip);
+			uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+			const uint8_t* ref = src + seen[h];
+			seen[h] = ip - src;
+			if (ref >= ip || lz4_read32(ref) != seq){
+				ip += 1 + (misses++ >> 5);
+				continue;
+			}
+			misses = 0;
+
+			//Make the match as long as it goes, both ways, a word at a time
+			const uint8_t* mp = ip + LZ4_MIN_MATCH;
+			const uint8_t* rp = ref + LZ4_MIN_MATCH;
+			for (;;){
+				if (mp + sizeof(uint64_t) > extend_limit){
+					while (mp < extend_limit && *mp == *rp){
+						mp++;
+						rp++;
+					}
+					break;
+				}
+				uint64_t a;
+				uint64_t b;
+				memcpy(&a, mp, sizeof(uint64_t));
+				memcpy(&b, rp, sizeof(uint64_t));
+				if (a != b){
+					mp += __builtin_ctzll(a ^ b) / 8;
+					break;
+				}
+				mp += sizeof(uint64_t);
+				rp += sizeof(uint64_t);
+			}
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]){
+				ip--;
+				ref--;
+			}
+
+			size_t literals = ip - anchor;
+			size_t match = mp - ip - LZ4_MIN_MATCH;
+			if (op + 1 + literals + literals / 255 + 1 + 2 + match / 255 + 1 > op_end){
+				return 0;
+			}
+			uint8_t* token = op++;
+			*token = ((literals < 15) ? literals : 15) << 4 | ((match < 15) ? match : 15);
+			if (literals >= 15){
+				op = lz4_put_length(op, literals - 15);
+			}
+			memcpy(op, anchor, literals);
+			op += literals;
+			op[0] = (ip - ref) & 0xff;
+			op[1] = (ip - ref) >> 8;
+			op += 2;
+			if (match >= 15){
+				op = lz4_put_length(op, match - 15);
+			}
+			ip = mp;
+			anchor = ip;
+		}
+	}
+
+	size_t literals = end - anchor;
+	if (op + 1 + literals + literals / 255 + 1 > op_end){
+		return 0;
+	}
+	*op++ = ((literals < 15) ? literals : 15) << 4;
+	if (literals >= 15){
+		op = lz4_put_length(op, literals - 15);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+	return op - dst;
+}
+
+/**
+ * Expands data compressed in the LZ4 block format, checking every length and
+ * offset as it goes.
+ *
+ * @param src the compressed data
+ * @param len how much there is
+ * @param dst where to put the result
+ * @param cap how much room there is there
+ *
+ * @return the expanded length, or -1 if the data is corrupt or too long
+ */
+static int lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, \
+													size_t cap){
+	const uint8_t* ip = src;
+	const uint8_t* end = src + len;
+	uint8_t* op = dst;
+	while (ip < end){
+		uint8_t token = *ip++;
+		size_t literals = token >> 4;
+		if (literals == 15){
+			uint8_t more;
+			do {
+				if (ip == end){
+					return -1;
+				}
+				more = *ip++;
+				literals += more;
+			} while (more == 255);
+		}
+		if ((size_t)(end - ip) < literals || (size_t)(dst + cap - op) < literals){
+			return -1;
+		}
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+		//The last sequence has no match
+		if (ip == end){
+			break;
+		}
+
+		if (end - ip < 2){
+			return -1;
+		}
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		size_t match = token & 15;
+		if (match == 15){
+			uint8_t more;
+			do {
+				if (ip == end){
+					return -1;
+				}
+				more = *ip++;
+				match += more;
+			} while (more == 255);
+		}
+		match += LZ4_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - dst) \
+				|| (size_t)(dst + cap - op) < match){
+			return -1;
+		}
+		//Matches may overlap what they produce, eg: a run of one byte
+		const uint8_t* ref = op - offset;
+		if (offset >= match){
+			memcpy(op, ref, match);
+		}else{
+			for (size_t i = 0; i < match; i++){
+				op[i] = ref[i];
+			}
+		}
+		op += match;
+	}
+	return op - dst;
+}
+
+/**
+ * Chooses how new blocks are compressed. Blocks already stored stay the way
+ * they are.
+ *
+ * @param name "lz4", "zstd" or "none"
+ *
+ * @return 0 upon success, -1 if there is no such codec (or it was not built in)
+ */
+int pack_set_codec(const char* name){
+	if (strcmp(name, "none") == 0){
+		pack_codec = PACK_NONE;
+	}else if (strcmp(name, "lz4") == 0){
+		pack_codec = PACK_LZ4;
+#ifdef MYFS_ZSTD
+	}else if (strcmp(name, "zstd") == 0){
+		pack_codec = PACK_ZSTD;
+#endif
+	}else{
+		log_error("Unknown compression \"%s\"\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Compresses a block, if that is turned on and is worth it.
+ *
+ * @param src the block's data
+ * @param len how much of it is in use
+ * @param dst len bytes for the compressed block, header and all
+ *
+ * @return the compressed block's length, or 0 if it should be stored as it is
+ */
+size_t pack_block(const uint8_t* src, size_t len, uint8_t* dst){
+	int codec = pack_codec;
+	if (codec == PACK_NONE){
+		return 0;
+	}
+	uint64_t start = stats_now();
+	size_t room = len - len / PACK_MIN_SAVING;
+	size_t packed = 0;
+	if (room > sizeof(pack_header)){
+		room -= sizeof(pack_header);
+		uint8_t* body = dst + sizeof(pack_header);
+		if (codec == PACK_LZ4){
+			packed = lz4_compress(src, len, body, room);
+#ifdef MYFS_ZSTD
+		}else if (codec == PACK_ZSTD){
+			packed = ZSTD_compress(body, room, src, len, MYFS_ZSTD_LEVEL);
+			packed = ZSTD_isError(packed) ? 0 : packed;
+#endif
+		}
+	}
+	if (packed > 0){
+		pack_header header = {codec, 0, len};
+		memcpy(dst, &header, sizeof(pack_header));
+		packed += sizeof(pack_header);
+	}
+
+	__atomic_fetch_add(&pack_ns, stats_now() - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pack_in, len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pack_out, (packed > 0) ? packed : len, __ATOMIC_RELAXED);
+	return packed;
+}
+
+/**
+ * Expands a compressed block.
+ *
+ * @param src the compressed block, header and all
+ * @param len its length
+ * @param dst where to put the data
+ * @param cap how much room there is there
+ *
+ * @return the length of the data, or UNQLITE_CORRUPT
+ */
+int unpack_block(const uint8_t* src, size_t len, uint8_t* dst, size_t cap){
+	pack_header header;
+	if (len < sizeof(pack_header)){
+		return UNQLITE_CORRUPT;
+	}
+	memcpy(&header, src, sizeof(pack_header));
+	if (header.length > cap){
+		return UNQLITE_CORRUPT;
+	}
+
+	uint64_t start = stats_now();
+	const uint8_t* body = src + sizeof(pack_header);
+	len -= sizeof(pack_header);
+	long got = -1;
+	if (header.codec == PACK_LZ4){
+		got = lz4_decompress(body, len, dst, header.length);
+#ifdef MYFS_ZSTD
+	}else if (header.codec == PACK_ZSTD){
+		size_t n = ZSTD_decompress(dst, header.length, body, len);
+		got = ZSTD_isError(n) ? -1 : (long)n;
+#endif
+	}else{
+		log_error("Block compressed with unknown codec %d\n", header.codec);
+	}
+	if (got != header.length){
+		return UNQLITE_CORRUPT;
+	}
+	__atomic_fetch_add(&unpack_ns, stats_now() - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&unpack_bytes, header.length, __ATOMIC_RELAXED);
+	return header.length;
+}
+
+/**
+ * Reports how compression has done since mounting.
+ *
+ * @param pack_mbps if not NULL, set to how fast blocks were compressed (MB/s)
+ * @param unpack_mbps if not NULL, set to how fast they were expanded (MB/s)
+ *
+ * @return the compression ratio: bytes given to the compressor over the bytes
+ *				 stored for them (1 if nothing was)
+ */
+double pack_stats(double* pack_mbps, double* unpack_mbps){
+	uint64_t in = __atomic_load_n(&pack_in, __ATOMIC_RELAXED);
+	uint64_t out = __atomic_load_n(&pack_out, __ATOMIC_RELAXED);
+	uint64_t ns = __atomic_load_n(&pack_ns, __ATOMIC_RELAXED);
+	uint64_t expanded = __atomic_load_n(&unpack_bytes, __ATOMIC_RELAXED);
+	uint64_t expand_ns = __atomic_load_n(&unpack_ns, __ATOMIC_RELAXED);
+	if (pack_mbps != NULL){
+		*pack_mbps = (ns > 0) ? in * 1000.0 / ns : 0;
+	}
+	if (unpack_mbps != NULL){
+		*unpack_mbps = (expand_ns > 0) ? expanded * 1000.0 / expand_ns : 0;
+	}
+	return (out > 0) ? (double)in / out : 1.0;
+}
+
+/*
+ ***************
+	Block Storage
+ ***************
+*/
+
+//File data is split into fixed size blocks, each stored under
+//(file_data_id, KEY_KIND_BLOCK, block number). Reads and writes only touch the
+//blocks covering the requested range.
+//
+//Which blocks are stored is kept in the file's block map, a sorted list of
+//extents under (file_data_id, KEY_KIND_BLOCK_MAP, 0). Blocks the map does not
+//have read as zeros without going to the DB, and truncating or deleting a file
+//only visits the blocks it really has, so holes cost nothing. Files from before
+//there were maps are taken to have every block up to their size, which is
+//never wrong, only slower.
+//
+//With a data log a block's data goes to the log instead, and its record only
+//says where (see Segments).
+#ifndef MYFS_BLOCK_SIZE
+#define MYFS_BLOCK_SIZE 4096
+#endif
+
+#define KEY_KIND_BLOCK 3
+#define KEY_KIND_BLOCK_MAP 8
+
+//How many files' block maps are kept in memory. Direct mapped by UUID hash.
+#define BLOCK_MAP_SLOTS 256
+
+//Blocks [start, end) are stored. Shared blocks (see Deduplication) have
+//EXTENT_SHARED set in start, compressed ones EXTENT_PACKED and ones in the data
+//log (see Segments) EXTENT_LOGGED, and an extent only holds blocks that are
+//stored the same way.
+typedef struct block_extent {
+	uint64_t start;
+	uint64_t end;
+} block_extent;
+
+#define EXTENT_SHARED (1ULL << 63)
+#define EXTENT_PACKED (1ULL << 62)
+#define EXTENT_LOGGED (1ULL << 61)
+#define EXTENT_FLAGS (EXTENT_SHARED | EXTENT_PACKED | EXTENT_LOGGED)
+
+//How a block is stored: a hole, or BLOCK_OWN or BLOCK_SHARED, either of which
+//may be BLOCK_PACKED too. Own blocks may be BLOCK_LOGGED.
+#define BLOCK_HOLE 0
+#define BLOCK_OWN 1
+#define BLOCK_SHARED 2
+#define BLOCK_PACKED 4
+#define BLOCK_LOGGED 8
+
+static inline uint64_t extent_start(const block_extent* e){
+	return e->start & ~EXTENT_FLAGS;
+}
+
+//A file's block map. It is only changed by a writer holding the file's inode
+//lock exclusively, so anyone holding the lock may read it; the references
+//only keep it alive when it is thrown out of the cache.
+typedef struct block_map {
+	uuid_t id; //The file_data_id it belongs to
+	int refs;
+	int dirty; //Changed since it was stored
+	uint64_t count;
+	uint64_t room;
+	block_extent* extents;
+} block_map;
+
+static pthread_mutex_t block_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_map* block_maps[BLOCK_MAP_SLOTS];
+
+static void block_map_unref(block_map* m){
+	if (--m->refs == 0){
+		free(m->extents);
+		free(m);
+	}
+}
+
+/**
+ * Lets go of a map that was only read.
+ */
+void block_map_put(block_map* m){
+	pthread_mutex_lock(&block_map_lock);
+	block_map_unref(m);
+	pthread_mutex_unlock(&block_map_lock);
+}
+
+/**
+ * Empties the cache of block maps. Maps still being used live on until they
+ * are handed back.
+ */
+void block_map_clear(){
+	pthread_mutex_lock(&block_map_lock);
+	for (int i = 0; i < BLOCK_MAP_SLOTS; i++){
+		if (block_maps[i] != NULL){
+			block_map_unref(block_maps[i]);
+			block_maps[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&block_map_lock);
+}
+
+/**
+ * Gets a file's block map, loading it if it is not cached. The caller holds
+ * the file's inode lock and hands the map back with block_map_put() or
+ * block_map_release().
+ *
+ * @param f the file
+ *
+ * @return the map, or NULL on failure
+ */
+block_map* block_map_get(file* f){
+	block_map** slot = &block_maps[hash_bytes(f->file_data_id, sizeof(uuid_t)) % \
+																	BLOCK_MAP_SLOTS];
+	pthread_mutex_lock(&block_map_lock);
+	block_map* m = *slot;
+	if (m != NULL && uuid_compare(m->id, f->file_data_id) == 0){
+		m->refs++;
+		pthread_mutex_unlock(&block_map_lock);
+		return m;
+	}
+	pthread_mutex_unlock(&block_map_lock);
+
+	m = calloc(1, sizeof(block_map));
+	if (m == NULL){
+		return NULL;
+	}
+	memcpy(m->id, f->file_data_id, sizeof(uuid_t));
+	myfs_key key;
+	make_key(&key, f->file_data_id, KEY_KIND_BLOCK_MAP, 0);
+	unqlite_int64 size;
+	int rc = kv_fetch(&key, sizeof(myfs_key), NULL, &size);
+	if (rc == UNQLITE_NOTFOUND){
+		//From before there were maps, so any block up to the size may be stored
+		uint64_t blocks = (f->size + MYFS_BLOCK_SIZE - 1) / MYFS_BLOCK_SIZE;
+		m->room = 1;
+		m->extents = malloc(sizeof(block_extent));
+		if (m->extents != NULL){
+			m->extents[0].start = 0;
+			m->extents[0].end = blocks;
+			m->count = (blocks > 0) ? 1 : 0;
+		}
+		rc = (m->extents != NULL) ? UNQLITE_OK : UNQLITE_NOMEM;
+	}else if (rc == UNQLITE_OK && size % sizeof(block_extent) != 0){
+		log_error("The block map of %s is corrupt\n", f->path);
+		rc = UNQLITE_CORRUPT;
+	}else if (rc == UNQLITE_OK && size > 0){
+		m->room = size / sizeof(block_extent);
+		m->extents = malloc(size);
+		rc = (m->extents != NULL) ? \
+				 kv_fetch(&key, sizeof(myfs_key), m->extents, &size) : UNQLITE_NOMEM;
+		m->count = size / sizeof(block_extent);
+	}
+	if (rc != UNQLITE_OK){
+		free(m->extents);
+		free(m);
+		return NULL;
+	}
+
+	//Someone else may have loaded it in the meantime
+	pthread_mutex_lock(&block_map_lock);
+	if (*slot != NULL && uuid_compare((*slot)->id, f->file_data_id) == 0){
+		free(m->extents);
+		free(m);
+		m = *slot;
+	}else{
+		if (*slot != NULL){
+			block_map_unref(*slot);
+		}
+		*slot = m;
+		m->refs = 1; //The cache's own
+	}
+	m->refs++;
+	pthread_mutex_unlock(&block_map_lock);
+	return m;
+}
+
+/**
+ * Lets go of a map a writer has been changing, storing it if it was changed.
+ * If anything went wrong the cached copy is thrown away, so that the map is
+ * read again from the DB.
+ *
+ * @param f the file
+ * @param m its map
+ * @param rc how the writer got on (an unqlite return code)
+ *
+ * @return rc, or the unqlite return code of storing the map
+ */
+int block_map_release(file* f, block_map* m, int rc){
+	if (rc == UNQLITE_OK && m->dirty){
+		myfs_key key;
+		make_key(&key, f->file_data_id, KEY_KIND_BLOCK_MAP, 0);
+		rc = kv_store(&key, sizeof(myfs_key), m->extents, \
+									m->count * sizeof(block_extent));
+		m->dirty = 0;
+	}
+
+	pthread_mutex_lock(&block_map_lock);
+	block_map** slot = &block_maps[hash_bytes(m->id, sizeof(uuid_t)) % \
+																	BLOCK_MAP_SLOTS];
+	if (rc != UNQLITE_OK && *slot == m){
+		//The writer still holds its own reference, so dropping the cache's
+		//can never free the map, and only the last unref below may
+		*slot = NULL;
+		m->refs--;
+	}
+	block_map_unref(m);
+	pthread_mutex_unlock(&block_map_lock);
+	return rc;
+}
+
+/**
+ * Gives a new file an empty block map, so that it is not taken to be from
+ * before there were maps.
+ *
+ * @param f the file
+ *
+ * @return the unqlite return code
+ */
+int block_map_create(file* f){
+	myfs_key key;
+	make_key(&key, f->file_data_id, KEY_KIND_BLOCK_MAP, 0);
+	return kv_store(&key, sizeof(myfs_key), "", 0);
+}
+
+/**
+ * Deletes a file's block map once it has no blocks left.
+ *
+ * @param f the file
+ *
+ * @return the unqlite return code
+ */
+int block_map_delete(file* f){
+	pthread_mutex_lock(&block_map_lock);
+	block_map** slot = &block_maps[hash_bytes(f->file_data_id, sizeof(uuid_t)) % \
+																	BLOCK_MAP_SLOTS];
+	if (*slot != NULL && uuid_compare((*slot)->id, f->file_data_id) == 0){
+		block_map_unref(*slot);
+		*slot = NULL;
+	}
+	pthread_mutex_unlock(&block_map_lock);
+
+	myfs_key key;
+	make_key(&key, f->file_data_id, KEY_KIND_BLOCK_MAP, 0);
+	int rc = kv_delete(&key, sizeof(myfs_key));
+	return (rc == UNQLITE_NOTFOUND) ? UNQLITE_OK : rc;
+}
+
+/**
+ * @return the position of the first extent that ends after index
+ */
+static uint64_t block_map_find(const block_map* m, uint64_t index){
+	uint64_t lo = 0;
+	uint64_t hi = m->count;
+	while (lo < hi){
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (m->extents[mid].end <= index){
+			lo = mid + 1;
+		}else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**
+ * Tells whether a block is stored, and how.
+ *
+ * @param m the file's map
+ * @param index the block number
+ * @param run if not NULL, set to how many blocks from index on are the same
+ *
+ * @return BLOCK_HOLE, or BLOCK_OWN or BLOCK_SHARED with BLOCK_PACKED if it is
+ *				 compressed and BLOCK_LOGGED if it is in the data log
+ */
+int block_map_has(const block_map* m, uint64_t index, uint64_t* run){
+	uint64_t at = block_map_find(m, index);
+	int stored = at < m->count && extent_start(&m->extents[at]) <= index;
+	if (run != NULL){
+		if (stored){
+			*run = m->extents[at].end - index;
+		}else{
+			*run = (at < m->count) ? extent_start(&m->extents[at]) - index : \
+															 UINT64_MAX - index;
+		}
+	}
+	if (!stored){
+		return BLOCK_HOLE;
+	}
+	uint64_t flags = m->extents[at].start & EXTENT_FLAGS;
+	return ((flags & EXTENT_SHARED) ? BLOCK_SHARED : BLOCK_OWN) | \
+				 ((flags & EXTENT_PACKED) ? BLOCK_PACKED : 0) | \
+				 ((flags & EXTENT_LOGGED) ? BLOCK_LOGGED : 0);
+}
+
+/**
+ * Takes the blocks [start, end) out of a map.
+ *
+ * @return the unqlite return code
+ */
+static int block_map_remove(block_map* m, uint64_t start, uint64_t end){
+	uint64_t at = block_map_find(m, start);
+	if (at == m->count || extent_start(&m->extents[at]) >= end){
+		return UNQLITE_OK;
+	}
+	m->dirty = 1;
+
+	//An extent that covers the whole range on both sides is split in two
+	block_extent* e = &m->extents[at];
+	if (extent_start(e) < start && e->end > end){
+		if (m->count == m->room){
+			block_extent* extents = realloc(m->extents, \
+																			m->room * 2 * sizeof(block_extent));
+			if (extents == NULL){
+				return UNQLITE_NOMEM;
+			}
+			m->extents = extents;
+			m->room *= 2;
+			e = &m->extents[at];
+		}
+		memmove(e + 1, e, (m->count - at) * sizeof(block_extent));
+		m->count++;
+		e[0].end = start;
+		e[1].start = end | (e[0].start & EXTENT_FLAGS);
+		return UNQLITE_OK;
+	}
+
+	//Otherwise the first may lose its tail, the last its head, and any in
+	//between go altogether
+	if (extent_start(e) < start){
+		e->end = start;
+		at++;
+	}
+	uint64_t gone = at;
+	while (gone < m->count && m->extents[gone].end <= end){
+		gone++;
+	}
+	if (gone < m->count && extent_start(&m->extents[gone]) < end){
+		m->extents[gone].start = end | (m->extents[gone].start & EXTENT_FLAGS);
+	}
+	memmove(&m->extents[at], &m->extents[gone], \
+					(m->count - gone) * sizeof(block_extent));
+	m->count -= gone - at;
+	return UNQLITE_OK;
+}
+
+/**
+ * Adds a block to a map, or changes how it is stored.
+ *
+ * @param m the file's map
+ * @param index the block number
+ * @param how BLOCK_OWN or BLOCK_SHARED, with BLOCK_PACKED if it is compressed
+ *				and BLOCK_LOGGED if it is in the data log
+ *
+ * @return the unqlite return code
+ */
+static int block_map_add(block_map* m, uint64_t index, int how){
+	int was = block_map_has(m, index, NULL);
+	if (was == how){
+		return UNQLITE_OK;
+	}else if (was != BLOCK_HOLE){
+		int rc = block_map_remove(m, index, index + 1);
+		if (rc != UNQLITE_OK){
+			return rc;
+		}
+	}
+	m->dirty = 1;
+	uint64_t flag = ((how & BLOCK_SHARED) ? EXTENT_SHARED : 0) | \
+									((how & BLOCK_PACKED) ? EXTENT_PACKED : 0) | \
+									((how & BLOCK_LOGGED) ? EXTENT_LOGGED : 0);
+	uint64_t at = block_map_find(m, index);
+
+	//Join on to the extents either side where they are stored the same way
+	int before = at > 0 && m->extents[at - 1].end == index \
+							 && (m->extents[at - 1].start & EXTENT_FLAGS) == flag;
+	int after = at < m->count && extent_start(&m->extents[at]) == index + 1 \
+							&& (m->extents[at].start & EXTENT_FLAGS) == flag;
+	if (before && after){
+		m->extents[at - 1].end = m->extents[at].end;
+		memmove(&m->extents[at], &m->extents[at + 1], \
+						(m->count - at - 1) * sizeof(block_extent));
+		m->count--;
+		return UNQLITE_OK;
+	}else if (before){
+		m->extents[at - 1].end = index + 1;
+		return UNQLITE_OK;
+	}else if (after){
+		m->extents[at].start = index | flag;
+		return UNQLITE_OK;
+	}
+
+	if (m->count == m->room){
+		uint64_t room = (m->room > 0) ? m->room * 2 : 4;
+		block_extent* extents = realloc(m->extents, room * sizeof(block_extent));
+		if (extents == NULL){
+			return UNQLITE_NOMEM;
+		}
+		m->extents = extents;
+		m->room = room;
+	}
+	memmove(&m->extents[at + 1], &m->extents[at], \
+					(m->count - at) * sizeof(block_extent));
+	m->extents[at].start = index | flag;
+	m->extents[at].end = index + 1;
+	m->count++;
+	return UNQLITE_OK;
+}
+
+/*
+	Deduplication
+
+	With dedup turned on ("-o dedup") blocks are stored by their content: the
+	data goes under (hash, KEY_KIND_CHUNK, 0) once however many blocks hold it,
+	with a count of those blocks under (hash, KEY_KIND_CHUNK_REFS, 0), and the
+	block itself only holds the hash. Writing a block that is already stored
+	somewhere is then just two small stores. Hashes are checked against the
+	data before sharing it, and a block whose hash is taken by different data
+	is stored as its own. Blocks of nothing but zeros become holes.
+	Compressed blocks (see Compression) are shared separately from the others,
+	under 1 in place of 0.
+
+	Whether a block is shared is kept in its file's block map, so files and
+	blocks from before (or with dedup off) are read as they always were.
+*/
+
+#define KEY_KIND_CHUNK 9
+#define KEY_KIND_CHUNK_REFS 10
+
+//What a shared block holds: the hash of its data
+typedef struct chunk_id {
+	unsigned char hash[sizeof(uuid_t)];
+} chunk_id;
+
+//Reference counts are read, changed and written back under this
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dedup_enabled = 0;
+
+//Since mounting: bytes written as shared blocks, and how many of them had to
+//be stored because nothing had them yet
+static uint64_t dedup_written = 0;
+static uint64_t dedup_stored = 0;
+
+/**
+ * Turns storing new blocks by content on or off. Blocks already stored stay
+ * the way they are.
+ *
+ * @param on non-0 to turn it on
+ */
+void dedup_set_enabled(int on){
+	pthread_mutex_lock(&dedup_lock);
+	dedup_enabled = on;
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+/**
+ * Reports how well dedup has done since mounting.
+ *
+ * @param written set to the bytes written as shared blocks
+ * @param stored set to the bytes of those that had to be stored
+ *
+ * @return the dedup ratio, written / stored (1 if nothing was written)
+ */
+double dedup_stats(uint64_t* written, uint64_t* stored){
+	pthread_mutex_lock(&dedup_lock);
+	uint64_t w = dedup_written;
+	uint64_t s = dedup_stored;
+	pthread_mutex_unlock(&dedup_lock);
+	if (written != NULL){
+		*written = w;
+	}
+	if (stored != NULL){
+		*stored = s;
+	}
+	return (s > 0) ? (double)w / s : 1.0;
+}
+
+/**
+ * Hashes a block's data. Two FNV-1a hashes with different starting points,
+ * each mixed down, make up the 128 bits.
+ */
+static void chunk_hash(const uint8_t* buf, size_t len, chunk_id* out){
+	uint64_t h[2] = {14695981039346656037ULL, 0x9e3779b97f4a7c15ULL};
+	for (size_t i = 0; i < len; i++){
+		h[0] = (h[0] ^ buf[i]) * 1099511628211ULL;
+		h[1] = (h[1] ^ buf[i]) * 0x100000001b3ULL + (h[1] >> 29);
+	}
+	for (int i = 0; i < 2; i++){
+		h[i] ^= len;
+		h[i] ^= h[i] >> 33;
+		h[i] *= 0xff51afd7ed558ccdULL;
+		h[i] ^= h[i] >> 33;
+		h[i] *= 0xc4ceb9fe1a85ec53ULL;
+		h[i] ^= h[i] >> 33;
+	}
+	memcpy(out->hash, h, sizeof(chunk_id));
+}
+
+/**
+ * Takes a reference to the chunk holding some data, storing it if there is
+ * none. The caller holds dedup_lock.
+ *
+ * @param buf the data, as it is stored
+ * @param len how much of it there is
+ * @param packed non-0 if it is compressed
+ * @param id set to the chunk's hash
+ *
+ * @return UNQLITE_OK, UNQLITE_EXISTS if the hash belongs to different data, or
+ *				 another unqlite error
+ */
+static int chunk_ref(const uint8_t* buf, size_t len, int packed, chunk_id* id){
+	chunk_hash(buf, len, id);
+	myfs_key key;
+	make_key(&key, id->hash, KEY_KIND_CHUNK_REFS, packed);
+	uint64_t refs = 0;
+	unqlite_int64 size = sizeof(uint64_t);
+	int rc = kv_fetch(&key, sizeof(myfs_key), &refs, &size);
+	if (rc == UNQLITE_OK){
+		//Only share it if it really is the same
+		myfs_key data_key;
+		make_key(&data_key, id->hash, KEY_KIND_CHUNK, packed);
+		uint8_t stored[MYFS_BLOCK_SIZE];
+		size = MYFS_BLOCK_SIZE;
+		rc = kv_fetch(&data_key, sizeof(myfs_key), stored, &size);
+		if (rc == UNQLITE_NOTFOUND || (rc == UNQLITE_OK \
+				&& ((size_t)size != len || memcmp(stored, buf, len) != 0))){
+			log_info("A block's hash is taken by other data, storing it unshared\n");
+			return UNQLITE_EXISTS;
+		}
+	}else if (rc == UNQLITE_NOTFOUND){
+		myfs_key data_key;
+		make_key(&data_key, id->hash, KEY_KIND_CHUNK, packed);
+		rc = kv_store(&data_key, sizeof(myfs_key), buf, len);
+		refs = 0;
+		dedup_stored += len;
+	}
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+	refs++;
+	dedup_written += len;
+	return kv_store(&key, sizeof(myfs_key), &refs, sizeof(uint64_t));
+}
+
+/**
+ * Lets go of a reference to a chunk, deleting it once nothing refers to it.
+ * The caller holds dedup_lock.
+ *
+ * @param id the chunk's hash
+ * @param packed non-0 if it is compressed
+ *
+ * @return the unqlite return code
+ */
+static int chunk_unref(const chunk_id* id, int packed){
+	myfs_key key;
+	make_key(&key, id->hash, KEY_KIND_CHUNK_REFS, packed);
+	uint64_t refs = 0;
+	unqlite_int64 size = sizeof(uint64_t);
+	int rc = kv_fetch(&key, sizeof(myfs_key), &refs, &size);
+	if (rc == UNQLITE_NOTFOUND){
+		log_error("A shared block refers to a chunk that is not there\n");
+		return UNQLITE_OK;
+	}else if (rc != UNQLITE_OK){
+		return rc;
+	}
+	if (refs > 1){
+		refs--;
+		return kv_store(&key, sizeof(myfs_key), &refs, sizeof(uint64_t));
+	}
+	rc = kv_delete(&key, sizeof(myfs_key));
+	if (rc == UNQLITE_OK){
+		make_key(&key, id->hash, KEY_KIND_CHUNK, packed);
+		rc = kv_delete(&key, sizeof(myfs_key));
+	}
+	return (rc == UNQLITE_NOTFOUND) ? UNQLITE_OK : rc;
+}
+
+/**
+ * Reads which chunk a shared block refers to.
+ *
+ * @return the unqlite return code
+ */
+static int block_chunk(file* f, uint64_t index, chunk_id* id){
+	myfs_key key;
+	make_key(&key, f->file_data_id, KEY_KIND_BLOCK, index);
+	unqlite_int64 size = sizeof(chunk_id);
+	int rc = kv_fetch(&key, sizeof(myfs_key), id, &size);
+	if (rc == UNQLITE_OK && size != sizeof(chunk_id)){
+		log_error("Shared block %llu of %s is corrupt\n", index, f->path);
+		rc = UNQLITE_CORRUPT;
+	}
+	return rc;
+}
+
+/*
+	Segments
+
+	With a data log ("-o segments=DIR") blocks a file has to itself are not
+	stored in the DB. Their data is appended to the end of the current segment,
+	a file of up to MYFS_SEGMENT_SIZE bytes in DIR, and the block's record only
+	says where: which segment, how far into it, and how long. Writes go to disk
+	in order however they arrive, so random writes cost what sequential ones
+	do. A block whose data is in the log is EXTENT_LOGGED in its file's map.
+
+	Each piece of data in a segment follows a header saying which block it was
+	written for. Overwriting or deleting the block leaves the old data dead, and
+	a background compactor reclaims it, at no more than compact_mbps of reads
+	and writes: it picks the sealed segment that is most dead, copies whatever
+	of it is still live to the end of the log, and deletes it once the new
+	locations are committed. It never commits for that itself, so in the
+	relaxed sync modes the segment waits for the next commit (with
+	"-o sync_mode=fsync", the next fsync(2)). Segments left from an earlier
+	mount are first read through once to find out how much of them is dead.
+
+	Appends are gathered in a buffer and the current segment is synced before
+	every commit, so a committed block always points at data on disk.
+*/
+
+#ifndef MYFS_SEGMENT_SIZE
+#define MYFS_SEGMENT_SIZE (64 * 1024 * 1024)
+#endif
+#ifndef MYFS_COMPACT_MBPS
+#define MYFS_COMPACT_MBPS 16
+#endif
+
+#define SEG_NAME "seg%08x"
+#define SEG_RECORD_MAGIC 0x4d595347 //MYSG
+#define SEG_BUFFER_SIZE (1024 * 1024)
+//How often the compactor wakes, and how dead (in percent) a segment must be
+//before it is worth compacting
+#define COMPACT_TICK_MS 100
+#define COMPACT_MIN_DEAD 30
+
+//What a logged block's record holds
+typedef struct block_loc {
+	uint32_t segment;
+	uint32_t length;
+	uint64_t offset; //Of the data, just after its header
+} block_loc;
+
+//What comes before each piece of data in a segment
+typedef struct seg_record {
+	uint32_t magic;
+	uint32_t length;
+	uuid_t id; //The file_data_id
+	uint64_t index;
+} seg_record;
+
+typedef struct segment {
+	int fd; //-1 if there is no such segment (any more)
+	int known; //0 until it is known how much of it is dead
+	int readers; //Reads in progress, which keep fd open
+	int doomed; //Waiting for its readers to go so that it can be deleted
+	uint64_t size;
+	uint64_t dead;
+} segment;
+
+//Everything below is under seg_lock, apart from the compactor's own state
+static pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seg_cond = PTHREAD_COND_INITIALIZER;
+static char* seg_dir = NULL;
+static segment* segs = NULL;
+static uint32_t seg_count = 0;
+static uint32_t seg_active = 0;
+//Appends to the current segment not yet written, which start at seg_flushed
+static uint8_t* seg_buffer = NULL;
+static size_t seg_buffered = 0;
+static uint64_t seg_flushed = 0;
+static int seg_unsynced = 0;
+//Since mounting: bytes appended, and bytes freed by deleting segments
+static uint64_t seg_appended = 0;
+static uint64_t seg_reclaimed = 0;
+
+static long seg_budget = MYFS_COMPACT_MBPS;
+static int seg_compacting = 0;
+//Set while seg_close() waits for the compactor, so a read meanwhile does not
+//start another one
+static int seg_closing = 0;
+static pthread_t seg_compactor;
+
+/**
+ * @return non-0 if new blocks go to the data log
+ */
+static inline int seg_enabled(){
+	return seg_dir != NULL;
+}
+
+/**
+ * Sets how much reading and writing the compactor may do. This must be done
+ * before the data log is opened.
+ *
+ * @param mbps MB per second, 0 to never compact
+ */
+void seg_set_budget(long mbps){
+	seg_budget = (mbps > 0) ? mbps : 0;
+}
+
+/**
+ * Reports what the data log has done since mounting.
+ *
+ * @param appended set to the bytes appended to it
+ * @param reclaimed set to the bytes freed by compacting it
+ */
+void seg_stats(uint64_t* appended, uint64_t* reclaimed){
+	pthread_mutex_lock(&seg_lock);
+	*appended = seg_appended;
+	*reclaimed = seg_reclaimed;
+	pthread_mutex_unlock(&seg_lock);
+}
+
+/**
+ * Puts together the path of a segment.
+ *
+ * @param number the segment
+ * @param buf PATH_MAX bytes
+ */
+static void seg_path(uint32_t number, char* buf){
+	snprintf(buf, PATH_MAX, "%s/" SEG_NAME, seg_dir, number);
+}
+
+/**
+ * Makes sure the table has room for a segment.
+ *
+ * @return 0 on success
+ */
+static int seg_slot(uint32_t number){
+	if (number < seg_count){
+		return 0;
+	}
+	uint32_t count = (number + 1 > 2 * seg_count) ? number + 1 : 2 * seg_count;
+	segment* grown = realloc(segs, count * sizeof(segment));
+	if (grown == NULL){
+		return -1;
+	}
+	for (uint32_t i = seg_count; i < count; i++){
+		memset(&grown[i], 0, sizeof(segment));
+		grown[i].fd = -1;
+	}
+	segs = grown;
+	seg_count = count;
+	return 0;
+}
+
+static int seg_pread(int fd, void* buf, size_t len, uint64_t offset){
+	size_t done = 0;
+	while (done < len){
+		ssize_t got = pread(fd, (uint8_t*)buf + done, len - done, offset + done);
+		if (got <= 0){
+			if (got < 0 && errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		done += got;
+	}
+	return 0;
+}
+
+/**
+ * Writes out the append buffer. The caller holds seg_lock.
+ *
+ * @return the unqlite return code
+ */
+static int seg_flush(){
+	size_t done = 0;
+	while (done < seg_buffered){
+		ssize_t put = pwrite(segs[seg_active].fd, seg_buffer + done, \
+												 seg_buffered - done, seg_flushed + done);
+		if (put < 0 && errno == EINTR){
+			continue;
+		}else if (put < 0){
+			log_error("Could not write to the data log: %s\n", strerror(errno));
+			//Whatever did go out is written again next time
+			return UNQLITE_IOERR;
+		}
+		done += put;
+	}
+	seg_flushed += seg_buffered;
+	seg_buffered = 0;
+	return UNQLITE_OK;
+}
+
+/**
+ * Makes everything appended so far durable. Called before every commit.
+ *
+ * @return the unqlite return code
+ */
+int seg_sync(){
+	if (!seg_enabled()){
+		return UNQLITE_OK;
+	}
+	pthread_mutex_lock(&seg_lock);
+	int rc = UNQLITE_OK;
+	if (seg_unsynced){
+		rc = seg_flush();
+		if (rc == UNQLITE_OK && fdatasync(segs[seg_active].fd) != 0){
+			log_error("Could not sync the data log: %s\n", strerror(errno));
+			rc = UNQLITE_IOERR;
+		}
+		seg_unsynced = (rc != UNQLITE_OK);
+	}
+	pthread_mutex_unlock(&seg_lock);
+	return rc;
+}
+
+/**
+ * Makes a new, empty segment the one appended to. The caller holds seg_lock.
+ *
+ * @param number the segment
+ *
+ * @return the unqlite return code
+ */
+static int seg_start(uint32_t number){
+	char path[PATH_MAX];
+	seg_path(number, path);
+	if (seg_slot(number) != 0){
+		return UNQLITE_NOMEM;
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0){
+		log_error("Could not create %s: %s\n", path, strerror(errno));
+		return UNQLITE_IOERR;
+	}
+	//The new name has to last as long as the blocks that will point into it
+	int dir = open(seg_dir, O_RDONLY | O_DIRECTORY);
+	if (dir >= 0){
+		fsync(dir);
+		close(dir);
+	}
+	segs[number].fd = fd;
+	segs[number].known = 1;
+	segs[number].size = 0;
+	segs[number].dead = 0;
+	seg_active = number;
+	seg_flushed = 0;
+	return UNQLITE_OK;
+}
+
+/**
+ * Appends a block's data to the log. The caller holds seg_lock.
+ *
+ * @param id the file_data_id
+ * @param index the block number
+ * @param data the data, as it is stored
+ * @param len how long it is
+ * @param loc set to where it went
+ *
+ * @return the unqlite return code
+ */
+static int seg_append(const uuid_t id, uint64_t index, const uint8_t* data, \
+											size_t len, block_loc* loc){
+	size_t need = sizeof(seg_record) + len;
+	int rc = UNQLITE_OK;
+	if (segs[seg_active].size + need > MYFS_SEGMENT_SIZE){
+		//The full segment is sealed: written, synced, and only ever read now
+		rc = seg_flush();
+		if (rc == UNQLITE_OK && fdatasync(segs[seg_active].fd) != 0){
+			rc = UNQLITE_IOERR;
+		}
+		if (rc == UNQLITE_OK){
+			rc = seg_start(seg_active + 1);
+		}
+	}else if (seg_buffered + need > SEG_BUFFER_SIZE){
+		rc = seg_flush();
+	}
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+
+	seg_record header = {SEG_RECORD_MAGIC, len, {0}, index};
+	memcpy(header.id, id, sizeof(uuid_t));
+	memcpy(seg_buffer + seg_buffered, &header, sizeof(seg_record));
+	memcpy(seg_buffer + seg_buffered + sizeof(seg_record), data, len);
+	seg_buffered += need;
+
+	loc->segment = seg_active;
+	loc->length = len;
+	loc->offset = segs[seg_active].size + sizeof(seg_record);
+	segs[seg_active].size += need;
+	seg_appended += need;
+	seg_unsynced = 1;
+	txn_bytes += need;
+	return UNQLITE_OK;
+}
+
+/**
+ * Fetches where a logged block's data is.
+ *
+ * @return the unqlite return code
+ */
+static int seg_locate(const uuid_t id, uint64_t index, block_loc* loc){
+	myfs_key key;
+	make_key(&key, id, KEY_KIND_BLOCK, index);
+	unqlite_int64 size = sizeof(block_loc);
+	int rc = kv_fetch(&key, sizeof(myfs_key), loc, &size);
+	if (rc == UNQLITE_OK && (size != sizeof(block_loc) || loc->segment >= seg_count)){
+		rc = UNQLITE_CORRUPT;
+	}
+	return rc;
+}
+
+/**
+ * Counts a piece of data as dead. The caller holds seg_lock.
+ */
+static void seg_kill(const block_loc* loc){
+	segs[loc->segment].dead += sizeof(seg_record) + loc->length;
+}
+
+static void seg_start_compactor();
+
+/**
+ * Stores a block's data in the log.
+ *
+ * @param f the file
+ * @param index the block number
+ * @param data the data, as it is stored
+ * @param len how long it is
+ * @param logged non-0 if the block is already in the log
+ *
+ * @return the unqlite return code
+ */
+int seg_put(file* f, uint64_t index, const uint8_t* data, size_t len, \
+						int logged){
+	pthread_mutex_lock(&seg_lock);
+	seg_start_compactor();
+	block_loc old;
+	int rc = logged ? seg_locate(f->file_data_id, index, &old) : UNQLITE_NOTFOUND;
+	int replaced = rc == UNQLITE_OK;
+	block_loc loc;
+	rc = seg_append(f->file_data_id, index, data, len, &loc);
+	if (rc == UNQLITE_OK){
+		myfs_key key;
+		make_key(&key, f->file_data_id, KEY_KIND_BLOCK, index);
+		rc = kv_store(&key, sizeof(myfs_key), &loc, sizeof(block_loc));
+	}
+	if (rc == UNQLITE_OK && replaced){
+		seg_kill(&old);
+	}
+	pthread_mutex_unlock(&seg_lock);
+	return rc;
+}
+
+/**
+ * Deletes a logged block, leaving its data dead.
+ *
+ * @return the unqlite return code
+ */
+int seg_delete(file* f, uint64_t index){
+	pthread_mutex_lock(&seg_lock);
+	block_loc loc;
+	int rc = seg_locate(f->file_data_id, index, &loc);
+	if (rc == UNQLITE_OK || rc == UNQLITE_CORRUPT){
+		myfs_key key;
+		make_key(&key, f->file_data_id, KEY_KIND_BLOCK, index);
+		if (kv_delete(&key, sizeof(myfs_key)) == UNQLITE_OK && rc == UNQLITE_OK){
+			seg_kill(&loc);
+		}
+		rc = UNQLITE_OK;
+	}
+	pthread_mutex_unlock(&seg_lock);
+	return (rc == UNQLITE_NOTFOUND) ? UNQLITE_OK : rc;
+}
+
+/**
+ * Lets a segment go once a read from it is over, so that it can be deleted.
+ *
+ * @param segment the block_loc's segment
+ */
+void seg_unpin(uint32_t segment){
+	pthread_mutex_lock(&seg_lock);
+	//segs may have moved, but not this segment's entry
+	if (--segs[segment].readers == 0 && segs[segment].doomed){
+		pthread_cond_broadcast(&seg_cond);
+	}
+	pthread_mutex_unlock(&seg_lock);
+}
+
+/**
+ * Reads a logged block's data.
+ *
+ * @param f the file
+ * @param index the block number
+ * @param buf where to read it to
+ * @param len how much room buf has, set to how much was read
+ *
+ * @return the unqlite return code
+ */
+int seg_get(file* f, uint64_t index, uint8_t* buf, unqlite_int64* len){
+	pthread_mutex_lock(&seg_lock);
+	seg_start_compactor();
+	block_loc loc;
+	int rc = seg_locate(f->file_data_id, index, &loc);
+	if (rc == UNQLITE_OK && (loc.length > *len || segs[loc.segment].fd < 0)){
+		rc = UNQLITE_CORRUPT;
+	}
+	if (rc != UNQLITE_OK){
+		pthread_mutex_unlock(&seg_lock);
+		if (rc == UNQLITE_CORRUPT){
+			log_error("Block %llu of %s points nowhere in the data log\n", index, \
+								f->path);
+		}
+		return rc;
+	}
+	*len = loc.length;
+
+	//Still in the append buffer
+	if (loc.segment == seg_active && loc.offset >= seg_flushed){
+		memcpy(buf, seg_buffer + (loc.offset - seg_flushed), loc.length);
+		pthread_mutex_unlock(&seg_lock);
+		return UNQLITE_OK;
+	}
+	segment* s = &segs[loc.segment];
+	s->readers++;
+	int fd = s->fd;
+	pthread_mutex_unlock(&seg_lock);
+
+	if (seg_pread(fd, buf, loc.length, loc.offset) != 0){
+		log_error("Could not read block %llu of %s from the data log\n", index, \
+							f->path);
+		rc = UNQLITE_IOERR;
+	}
+
+	seg_unpin(loc.segment);
+	return rc;
+}
+
+/**
+ * Finds a logged block's data in its segment file, so that it can be spliced
+ * straight out of it. The segment is kept until seg_unpin() is called, so the
+ * data stays where it is even if the block is overwritten or moved meanwhile.
+ *
+ * @param f the file
+ * @param index the block number
+ * @param loc set to where the data is
+ * @param fd set to the segment file
+ *
+ * @return UNQLITE_OK, or UNQLITE_NOTFOUND if it is not in a segment file (it
+ *				 may still be in the append buffer)
+ */
+int seg_pin(file* f, uint64_t index, block_loc* loc, int* fd){
+	pthread_mutex_lock(&seg_lock);
+	int rc = seg_locate(f->file_data_id, index, loc);
+	if (rc == UNQLITE_OK && (segs[loc->segment].fd < 0 || \
+			(loc->segment == seg_active && loc->offset >= seg_flushed))){
+		rc = UNQLITE_NOTFOUND;
+	}
+	if (rc == UNQLITE_OK){
+		segs[loc->segment].readers++;
+		*fd = segs[loc->segment].fd;
+	}
+	pthread_mutex_unlock(&seg_lock);
+	return (rc == UNQLITE_OK) ? rc : UNQLITE_NOTFOUND;
+}
+
+/*
+	The compactor
+*/
+
+//The segment being worked through, how far it has got, and whether it is
+//only finding out how much is dead (1) or moving what is live (0)
+static uint32_t compact_segment;
+static uint64_t compact_at;
+static uint64_t compact_live;
+static int compact_probing;
+static int compact_busy = 0;
+//Set once everything live in the segment has moved, until the move is
+//committed, along with the last operation that has to be (the move, or one
+//that overwrote or deleted a block in the segment). If any commit failed
+//since the segment was chosen the move may have been rolled back, so it starts
+//again instead.
+static int compact_moved = 0;
+static uint64_t compact_ticket;
+static uint64_t compact_errseq;
+
+/**
+ * Deletes a segment once nothing is reading it. The caller holds seg_lock.
+ */
+static void seg_retire(uint32_t number){
+	segs[number].doomed = 1;
+	while (segs[number].readers > 0){
+		pthread_cond_wait(&seg_cond, &seg_lock);
+	}
+	char path[PATH_MAX];
+	seg_path(number, path);
+	close(segs[number].fd);
+	if (unlink(path) != 0){
+		log_error("Could not delete %s: %s\n", path, strerror(errno));
+	}
+	seg_reclaimed += segs[number].size;
+	memset(&segs[number], 0, sizeof(segment));
+	segs[number].fd = -1;
+}
+
+/**
+ * Chooses what the compactor does next. The caller holds seg_lock.
+ *
+ * @return 0 if there is something, -1 if not
+ */
+static int seg_choose(){
+	if (compact_busy){
+		return 0;
+	}
+	uint32_t best = seg_active;
+	for (uint32_t i = 0; i < seg_count; i++){
+		segment* s = &segs[i];
+		if (s->fd < 0 || i == seg_active){
+			continue;
+		}
+		if (!s->known){
+			compact_probing = 1;
+			best = i;
+			break;
+		}
+		if (s->dead * 100 >= s->size * COMPACT_MIN_DEAD && \
+				(best == seg_active || s->dead > segs[best].dead)){
+			best = i;
+		}
+	}
+	if (best == seg_active){
+		return -1;
+	}
+	compact_segment = best;
+	compact_at = 0;
+	if (!compact_probing && segs[best].dead >= segs[best].size){
+		//Nothing to copy, so there is no need to read it
+		compact_at = segs[best].size;
+	}
+	compact_live = 0;
+	compact_busy = 1;
+	compact_errseq = txn_errseq_sample();
+	return 0;
+}
+
+/**
+ * Works through the chosen segment until it is done or the allowance is spent.
+ * The caller is in a transaction.
+ *
+ * @param allowance how many bytes may be read and written, less what was
+ * @param record room for a header and a block
+ *
+ * @return 1 once the segment is done, 0 if there is more, or an unqlite error
+ */
+static int seg_compact_some(long* allowance, uint8_t* record){
+	pthread_mutex_lock(&seg_lock);
+	int fd = segs[compact_segment].fd;
+	uint64_t size = segs[compact_segment].size;
+	pthread_mutex_unlock(&seg_lock);
+
+	while (*allowance > 0){
+		if (compact_at + sizeof(seg_record) > size){
+			return 1;
+		}
+		size_t want = sizeof(seg_record) + MYFS_BLOCK_SIZE;
+		if (compact_at + want > size){
+			want = size - compact_at;
+		}
+		seg_record header;
+		if (seg_pread(fd, record, want, compact_at) != 0){
+			log_error("Could not read segment " SEG_NAME "\n", compact_segment);
+			return UNQLITE_IOERR;
+		}
+		memcpy(&header, record, sizeof(seg_record));
+		if (header.magic != SEG_RECORD_MAGIC || header.length > MYFS_BLOCK_SIZE || \
+				sizeof(seg_record) + header.length > want){
+			//A torn append from a crash: nothing after it was ever committed
+			return 1;
+		}
+		uint64_t offset = compact_at + sizeof(seg_record);
+		compact_at = offset + header.length;
+		*allowance -= sizeof(seg_record) + header.length;
+
+		pthread_mutex_lock(&seg_lock);
+		block_loc loc;
+		int rc = seg_locate(header.id, header.index, &loc);
+		int live = rc == UNQLITE_OK && loc.segment == compact_segment && \
+							 loc.offset == offset;
+		rc = UNQLITE_OK;
+		if (live && compact_probing){
+			compact_live += sizeof(seg_record) + header.length;
+		}else if (live){
+			rc = seg_append(header.id, header.index, record + sizeof(seg_record), \
+											header.length, &loc);
+			if (rc == UNQLITE_OK){
+				myfs_key key;
+				make_key(&key, header.id, KEY_KIND_BLOCK, header.index);
+				rc = kv_store(&key, sizeof(myfs_key), &loc, sizeof(block_loc));
+			}
+			*allowance -= sizeof(seg_record) + header.length;
+		}
+		pthread_mutex_unlock(&seg_lock);
+		if (rc != UNQLITE_OK){
+			return rc;
+		}
+	}
+	return 0;
+}
+
+/**
+ * The compactor thread.
+ */
+static void* seg_compactor_main(void* arg){
+	(void) arg;
+	uint8_t* record = malloc(sizeof(seg_record) + MYFS_BLOCK_SIZE);
+	long allowance = 0;
+	struct timespec last;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	//Whether to go straight on to the next segment rather than wait
+	int more = 0;
+	pthread_mutex_lock(&seg_lock);
+	while (seg_compacting && record != NULL){
+		if (!more){
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += COMPACT_TICK_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&seg_cond, &seg_lock, &deadline);
+		}
+		more = 0;
+		//The budget is earned as time passes, and what is not spent is kept, up
+		//to a second's worth
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long ms = (now.tv_sec - last.tv_sec) * 1000 + \
+							(now.tv_nsec - last.tv_nsec) / 1000000;
+		if (ms > 0){
+			allowance += ms * seg_budget * 1000;
+			last = now;
+		}
+		if (allowance > seg_budget * 1000000){
+			allowance = seg_budget * 1000000;
+		}
+		if (!seg_compacting){
+			continue;
+		}
+		if (compact_moved){
+			if (txn_settled_upto(compact_ticket)){
+				compact_moved = 0;
+				compact_busy = 0;
+				more = allowance > 0;
+				if (txn_errseq_sample() == compact_errseq){
+					seg_retire(compact_segment);
+				}
+			}
+			continue;
+		}
+		if (allowance <= 0 || seg_choose() != 0){
+			continue;
+		}
+		pthread_mutex_unlock(&seg_lock);
+
+		int rc = txn_begin();
+		if (rc == 0){
+			rc = txn_end(seg_compact_some(&allowance, record));
+		}
+		//Whatever made the rest of the segment dead has to be committed too
+		uint64_t ticket = (rc == 1 && !compact_probing) ? txn_ticket() : 0;
+
+		pthread_mutex_lock(&seg_lock);
+		if (rc < 0){
+			//Tried again from the start next time
+			compact_busy = 0;
+		}else if (rc == 1 && compact_probing){
+			compact_busy = 0;
+			more = allowance > 0;
+			segment* s = &segs[compact_segment];
+			s->known = 1;
+			s->dead = (compact_live < s->size) ? s->size - compact_live : 0;
+			compact_probing = 0;
+		}else if (rc == 1){
+			//Only once the new locations are committed can the old ones go
+			compact_moved = 1;
+			compact_ticket = ticket;
+			more = 1;
+		}
+	}
+	pthread_mutex_unlock(&seg_lock);
+	free(record);
+	return NULL;
+}
+
+/**
+ * Starts the compactor, if it is wanted and not running yet. It is started on
+ * first use rather than at mount so that it is not lost when FUSE forks into
+ * the background. The caller holds seg_lock.
+ */
+static void seg_start_compactor(){
+	if (seg_compacting || seg_closing || seg_budget == 0){
+		return;
+	}
+	seg_compacting = 1;
+	if (pthread_create(&seg_compactor, NULL, seg_compactor_main, NULL) != 0){
+		log_error("Could not start the compactor\n");
+		seg_budget = 0;
+		seg_compacting = 0;
+	}
+}
+
+/**
+ * Stops the compactor, writes out what is buffered and closes the data log.
+ */
+void seg_close(){
+	pthread_mutex_lock(&seg_lock);
+	int running = seg_compacting;
+	seg_compacting = 0;
+	seg_closing = 1;
+	pthread_cond_broadcast(&seg_cond);
+	pthread_mutex_unlock(&seg_lock);
+	if (running){
+		pthread_join(seg_compactor, NULL);
+	}
+
+	if (seg_sync() != UNQLITE_OK){
+		log_error("Could not write out the data log\n");
+	}
+	pthread_mutex_lock(&seg_lock);
+	for (uint32_t i = 0; i < seg_count; i++){
+		if (segs[i].fd >= 0){
+			close(segs[i].fd);
+		}
+	}
+	free(segs);
+	free(seg_buffer);
+	free(seg_dir);
+	segs = NULL;
+	seg_buffer = NULL;
+	seg_dir = NULL;
+	seg_count = 0;
+	seg_buffered = 0;
+	compact_busy = 0;
+	compact_probing = 0;
+	compact_moved = 0;
+	seg_closing = 0;
+	pthread_mutex_unlock(&seg_lock);
+}
+
+/**
+ * Opens the data log, so that blocks written from now on go to it. Segments
+ * already in the directory are kept, and new data goes to a new one.
+ *
+ * @param dir the directory the segments are in
+ *
+ * @return 0 on success, -1 if the directory cannot be used
+ */
+int seg_open(const char* dir){
+	DIR* d = opendir(dir);
+	if (d == NULL){
+		log_error("Could not open the data log %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	pthread_mutex_lock(&seg_lock);
+	seg_dir = strdup(dir);
+	seg_buffer = malloc(SEG_BUFFER_SIZE);
+	int rc = (seg_dir != NULL && seg_buffer != NULL) ? 0 : -1;
+	uint32_t next = 0;
+	struct dirent* entry;
+	while (rc == 0 && (entry = readdir(d)) != NULL){
+		unsigned int number;
+		int used = 0;
+		if (sscanf(entry->d_name, SEG_NAME "%n", &number, &used) != 1 || \
+				entry->d_name[used] != '\0'){
+			continue;
+		}
+		char path[PATH_MAX];
+		seg_path(number, path);
+		struct stat st;
+		int fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) != 0 || seg_slot(number) != 0){
+			log_error("Could not open %s\n", path);
+			if (fd >= 0){
+				close(fd);
+			}
+			rc = -1;
+			break;
+		}
+		segs[number].fd = fd;
+		segs[number].size = st.st_size;
+		next = (number >= next) ? number + 1 : next;
+	}
+	closedir(d);
+	if (rc == 0 && seg_start(next) != UNQLITE_OK){
+		rc = -1;
+	}
+	pthread_mutex_unlock(&seg_lock);
+	if (rc != 0){
+		seg_close();
+	}
+	return rc;
+}
+
+/**
+ * Reads one block of a file. Anything not stored (a hole in the map, a missing
+ * block, or the part past the end of a short block) reads as zeros.
+ *
+ * @param f the file
+ * @param m the file's block map
+ * @param index the block number
+ * @param buf MYFS_BLOCK_SIZE bytes to read into
+ *
+ * @return the number of bytes that were stored, or an unqlite error (< 0)
+ */
+int block_read(file* f, const block_map* m, uint64_t index, uint8_t* buf){
+	int how = block_map_has(m, index, NULL);
+	if (how == BLOCK_HOLE){
+		memset(buf, 0, MYFS_BLOCK_SIZE);
+		return 0;
+	}
+	myfs_key key;
+	make_key(&key, f->file_data_id, KEY_KIND_BLOCK, index);
+	if (how & BLOCK_SHARED){
+		chunk_id id;
+		int rc = block_chunk(f, index, &id);
+		if (rc == UNQLITE_NOTFOUND){
+			memset(buf, 0, MYFS_BLOCK_SIZE);
+			return 0;
+		}else if (rc != UNQLITE_OK){
+			return rc;
+		}
+		make_key(&key, id.hash, KEY_KIND_CHUNK, (how & BLOCK_PACKED) != 0);
+	}
+
+	//Compressed blocks are fetched to one side and expanded into buf
+	uint8_t packed[MYFS_BLOCK_SIZE];
+	uint8_t* into = (how & BLOCK_PACKED) ? packed : buf;
+	unqlite_int64 size = MYFS_BLOCK_SIZE;
+	int rc = (how & BLOCK_LOGGED) ? seg_get(f, index, into, &size) : \
+					 kv_fetch(&key, sizeof(myfs_key), into, &size);
+	if (rc == UNQLITE_NOTFOUND){
+		size = 0;
+	}else if (rc != UNQLITE_OK){
+		return rc;
+	}else if (how & BLOCK_PACKED){
+		size = unpack_block(packed, size, buf, MYFS_BLOCK_SIZE);
+		if (size < 0){
+			log_error("Block %llu of %s does not decompress\n", index, f->path);
+			return (int)size;
+		}
+	}
+	memset(buf + size, 0, MYFS_BLOCK_SIZE - size);
+	return (int)size;
+}
+
+void ra_forget(const uuid_t id, uint64_t start, uint64_t end);
+
+/**
+ * Deletes the blocks [start, end) of a file that its map has, and takes them
+ * out of the map.
+ *
+ * @param f the file
+ * @param m the file's block map
+ * @param start the first block number
+ * @param end the block number after the last
+ *
+ * @return the unqlite return code
+ */
+int block_delete(file* f, block_map* m, uint64_t start, uint64_t end){
+	myfs_key key;
+	int rc = UNQLITE_OK;
+	ra_forget(f->file_data_id, start, end);
+	for (uint64_t at = block_map_find(m, start); rc == UNQLITE_OK \
+			 && at < m->count && extent_start(&m->extents[at]) < end; at++){
+		uint64_t first = extent_start(&m->extents[at]);
+		uint64_t from = (first > start) ? first : start;
+		uint64_t to = (m->extents[at].end < end) ? m->extents[at].end : end;
+		int shared = (m->extents[at].start & EXTENT_SHARED) != 0;
+		int packed = (m->extents[at].start & EXTENT_PACKED) != 0;
+		int logged = (m->extents[at].start & EXTENT_LOGGED) != 0;
+		for (uint64_t index = from; index < to && rc == UNQLITE_OK; index++){
+			if (logged){
+				rc = seg_delete(f, index);
+				continue;
+			}
+			if (shared){
+				chunk_id id;
+				rc = block_chunk(f, index, &id);
+				if (rc == UNQLITE_OK){
+					pthread_mutex_lock(&dedup_lock);
+					rc = chunk_unref(&id, packed);
+					pthread_mutex_unlock(&dedup_lock);
+				}
+				rc = (rc == UNQLITE_NOTFOUND) ? UNQLITE_OK : rc;
+			}
+			if (rc == UNQLITE_OK){
+				make_key(&key, f->file_data_id, KEY_KIND_BLOCK, index);
+				rc = kv_delete(&key, sizeof(myfs_key));
+				//Maps from before there were maps may have more than was stored
+				rc = (rc == UNQLITE_NOTFOUND) ? UNQLITE_OK : rc;
+			}
+		}
+	}
+	return (rc == UNQLITE_OK) ? block_map_remove(m, start, end) : rc;
+}
+
+/**
+ * Stores a block's data as the file's own, in the data log if there is one.
+ *
+ * @param f the file
+ * @param index the block number
+ * @param data the data, as it is stored
+ * @param size how long it is
+ * @param was how the block was stored until now
+ * @param how set to how it is stored now: BLOCK_OWN, and BLOCK_LOGGED if it
+ *				went to the log
+ *
+ * @return the unqlite return code
+ */
+static int block_store_own(file* f, uint64_t index, const uint8_t* data, \
+													 size_t size, int was, int* how){
+	if (seg_enabled()){
+		*how = BLOCK_OWN | BLOCK_LOGGED;
+		return seg_put(f, index, data, size, (was & BLOCK_LOGGED) != 0);
+	}
+	*how = BLOCK_OWN;
+	//Mounted without the log this time, so its old data is left dead
+	int rc = (was & BLOCK_LOGGED) ? seg_delete(f, index) : UNQLITE_OK;
+	if (rc == UNQLITE_OK){
+		myfs_key key;
+		make_key(&key, f->file_data_id, KEY_KIND_BLOCK, index);
+		rc = kv_store(&key, sizeof(myfs_key), data, size);
+	}
+	return rc;
+}
+
+/**
+ * Stores one block of a file, replacing whatever was there, and adds it to the
+ * file's map. It is compressed and stored by its content if the mount says so.
+ *
+ * @param f the file
+ * @param m the file's block map
+ * @param index the block number
+ * @param buf the data
+ * @param len how much of the block is in use (at most MYFS_BLOCK_SIZE)
+ *
+ * @return the unqlite return code
+ */
+int block_write(file* f, block_map* m, uint64_t index, const uint8_t* buf, \
+								size_t len){
+	myfs_key key;
+	make_key(&key, f->file_data_id, KEY_KIND_BLOCK, index);
+
+	//Zeros need not be stored at all, short blocks read as zeros past their end
+	size_t used = len;
+	while (used > 0 && buf[used - 1] == 0){
+		used--;
+	}
+	if (used == 0){
+		return block_delete(f, m, index, index + 1);
+	}
+	ra_forget(f->file_data_id, index, index + 1);
+
+	uint8_t packed[MYFS_BLOCK_SIZE];
+	const uint8_t* data = buf;
+	int packing = 0;
+	size_t size = pack_block(buf, used, packed);
+	if (size > 0){
+		data = packed;
+		packing = BLOCK_PACKED;
+	}else{
+		size = used;
+	}
+
+	pthread_mutex_lock(&dedup_lock);
+	int dedup = dedup_enabled;
+	pthread_mutex_unlock(&dedup_lock);
+	int was = block_map_has(m, index, NULL);
+	int how;
+	if (!dedup && !(was & BLOCK_SHARED)){
+		int rc = block_store_own(f, index, data, size, was, &how);
+		return (rc == UNQLITE_OK) ? block_map_add(m, index, how | packing) : rc;
+	}
+
+	//The old chunk is only let go of once the new one is in place
+	chunk_id old;
+	int shared = (was & BLOCK_SHARED) != 0;
+	int rc = shared ? block_chunk(f, index, &old) : UNQLITE_OK;
+	if (rc == UNQLITE_NOTFOUND){
+		shared = 0;
+		rc = UNQLITE_OK;
+	}
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+
+	chunk_id id;
+	pthread_mutex_lock(&dedup_lock);
+	rc = dedup ? chunk_ref(data, size, packing != 0, &id) : UNQLITE_EXISTS;
+	if (rc == UNQLITE_OK){
+		rc = (was & BLOCK_LOGGED) ? seg_delete(f, index) : UNQLITE_OK;
+		if (rc == UNQLITE_OK){
+			rc = kv_store(&key, sizeof(myfs_key), &id, sizeof(chunk_id));
+		}
+		if (rc == UNQLITE_OK){
+			rc = block_map_add(m, index, BLOCK_SHARED | packing);
+		}
+	}else if (rc == UNQLITE_EXISTS){
+		rc = block_store_own(f, index, data, size, was, &how);
+		if (rc == UNQLITE_OK){
+			rc = block_map_add(m, index, how | packing);
+		}
+	}
+	if (rc == UNQLITE_OK && shared){
+		rc = chunk_unref(&old, (was & BLOCK_PACKED) != 0);
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return rc;
+}
+
+/**
+ * Files written before data was split into blocks keep all of it in a single
+ * value under file_data_id. This moves such data into blocks; it is a no-op for
+ * any other file.
+ *
+ * @param f the file
+ *
+ * @return the unqlite return code
+ */
+int data_migrate_legacy(file* f){
+	if (file_is_inline(f)){
+		return UNQLITE_OK;
+	}
+	unqlite_int64 nBytes;
+	int rc = kv_fetch(f->file_data_id, KEY_SIZE, NULL, &nBytes);
+	if (rc == UNQLITE_NOTFOUND){
+		return UNQLITE_OK;
+	}else if (rc != UNQLITE_OK){
+		return rc;
+	}
+	write_log("Moving %lld bytes of %s into blocks\n", nBytes, f->path);
+
+	if (nBytes > 0){
+		uint8_t* data = malloc(nBytes);
+		block_map* m = block_map_get(f);
+		if (data == NULL || m == NULL){
+			free(data);
+			if (m != NULL){
+				block_map_put(m);
+			}
+			return UNQLITE_NOMEM;
+		}
+		rc = kv_fetch(f->file_data_id, KEY_SIZE, data, &nBytes);
+		for (unqlite_int64 done = 0; rc == UNQLITE_OK && done < nBytes; \
+																								done += MYFS_BLOCK_SIZE){
+			size_t len = (nBytes - done < MYFS_BLOCK_SIZE) ? nBytes - done : \
+																											MYFS_BLOCK_SIZE;
+			rc = block_write(f, m, done / MYFS_BLOCK_SIZE, data + done, len);
+		}
+		free(data);
+		rc = block_map_release(f, m, rc);
+		if (rc != UNQLITE_OK){
+			return rc;
+		}
+	}
+	return kv_delete(f->file_data_id, KEY_SIZE);
+}
+
+/*
+ ***************
+	Write-back Cache
+ ***************
+*/
+
+//Writes are buffered per file, block by block, and only reach the DB when the
+//file is flushed, released or fsync'd, or when there is more dirty data than
+//the limit below. Repeated and sequential writes to the same blocks are merged
+//in memory, and the file's meta data is stored once per write back rather than
+//once per write. Setting the limit to 0 makes every write go straight through.
+#ifndef MYFS_DIRTY_LIMIT
+#define MYFS_DIRTY_LIMIT (32 * 1024 * 1024)
+#endif
+
+//Write-back is off unless the mount asks for it ("-o write_back"). Writing a
+//large file back in one go when it is closed has measured slower against
+//unqlite than writing it through (myfs_bench -w seq_write), so it is not the
+//default until it is a win there.
+#ifndef MYFS_WRITE_BACK
+#define MYFS_WRITE_BACK 0
+#endif
+#define WB_DEFAULT_LIMIT (MYFS_WRITE_BACK ? MYFS_DIRTY_LIMIT : 0)
+
+#define WB_TABLE_SIZE 256
+#define WB_BUCKETS 256
+
+typedef struct wb_block {
+	uint64_t index;
+	//Which part of data has been written. Once complete, all of data is valid.
+	uint32_t lo;
+	uint32_t hi;
+	int complete;
+	struct wb_block* next;
+	uint8_t data[MYFS_BLOCK_SIZE];
+} wb_block;
+
+//A file's dirty blocks, and the meta data that goes with them. The blocks are
+//only changed while holding the file's inode lock exclusively, so readers
+//holding it shared can use them without the write-back cache lock.
+typedef struct wb_inode {
+	uuid_t id;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+	//How big the file was in the DB when it was first dirtied. Blocks past this
+	//have nothing stored under them yet.
+	off_t stored_size;
+	size_t nblocks;
+	wb_block* blocks[WB_BUCKETS];
+	struct wb_inode* next;
+} wb_inode;
+
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static wb_inode* wb_table[WB_TABLE_SIZE];
+static int wb_files = 0;
+static int wb_cursor = 0;
+static size_t wb_dirty_bytes = 0;
+static size_t wb_dirty_limit = WB_DEFAULT_LIMIT;
+
+/**
+ * Finds a file's dirty state. The caller holds wb_lock.
+ *
+ * @param id the file's meta data UUID
+ *
+ * @return the dirty state, or NULL if the file has none
+ */
+static wb_inode* wb_find(const uuid_t id){
+	wb_inode* wb = wb_table[hash_bytes(id, sizeof(uuid_t)) % WB_TABLE_SIZE];
+	while (wb != NULL && uuid_compare(wb->id, id) != 0){
+		wb = wb->next;
+	}
+	return wb;
+}
+
+/**
+ * Takes a file's dirty state out of the table. The caller holds wb_lock.
+ */
+static void wb_unlink(wb_inode* wb){
+	wb_inode** slot = &wb_table[hash_bytes(wb->id, sizeof(uuid_t)) % WB_TABLE_SIZE];
+	while (*slot != wb){
+		slot = &(*slot)->next;
+	}
+	*slot = wb->next;
+	wb_files--;
+}
+
+static wb_block* wb_block_find(wb_inode* wb, uint64_t index){
+	wb_block* b = wb->blocks[index % WB_BUCKETS];
+	while (b != NULL && b->index != index){
+		b = b->next;
+	}
+	return b;
+}
+
+/**
+ * Changes how much dirty data may be held before writers have to write it
+ * back themselves.
+ *
+ * @param bytes the new limit. 0 turns write-back caching off.
+ */
+void wb_set_dirty_limit(size_t bytes){
+	pthread_mutex_lock(&wb_lock);
+	wb_dirty_limit = bytes;
+	pthread_mutex_unlock(&wb_lock);
+}
+
+/**
+ * @return non-0 if writes should be buffered
+ */
+int wb_enabled(){
+	pthread_mutex_lock(&wb_lock);
+	int enabled = wb_dirty_limit > 0;
+	pthread_mutex_unlock(&wb_lock);
+	return enabled;
+}
+
+/**
+ * Gets a file's dirty state so that its blocks can be read. The caller holds
+ * the file's inode lock, which keeps the state from going away.
+ *
+ * @param id the file's meta data UUID
+ *
+ * @return the dirty state, or NULL if nothing is buffered for the file
+ */
+wb_inode* wb_get(const uuid_t id){
+	pthread_mutex_lock(&wb_lock);
+	wb_inode* wb = (wb_files > 0) ? wb_find(id) : NULL;
+	pthread_mutex_unlock(&wb_lock);
+	return wb;
+}
+
+/**
+ * Brings a file's meta data up to date with any writes that are still
+ * buffered, so that its size is right before the data is written back.
+ *
+ * @param f the file as it is in the DB or the dentry cache
+ */
+void wb_overlay(file* f){
+	pthread_mutex_lock(&wb_lock);
+	wb_inode* wb = (wb_files > 0) ? wb_find(f->meta_data_id) : NULL;
+	if (wb != NULL){
+		f->size = wb->size;
+		f->mtime = wb->mtime;
+		f->ctime = wb->ctime;
+	}
+	pthread_mutex_unlock(&wb_lock);
+}
+
+/**
+ * Puts together the whole of a dirty block: what is stored for it with the
+ * buffered writes on top.
+ *
+ * @param f the file
+ * @param m the file's block map
+ * @param wb the file's dirty state
+ * @param b the dirty block
+ * @param out MYFS_BLOCK_SIZE bytes to put the block in
+ *
+ * @return the number of bytes of the block in use, or an unqlite error (< 0)
+ */
+static int wb_load_block(file* f, const block_map* m, wb_inode* wb, \
+												 wb_block* b, uint8_t* out){
+	if (b->complete){
+		memcpy(out, b->data, MYFS_BLOCK_SIZE);
+		return MYFS_BLOCK_SIZE;
+	}
+
+	int stored = 0;
+	if ((off_t)b->index * MYFS_BLOCK_SIZE < wb->stored_size){
+		stored = block_read(f, m, b->index, out);
+		if (stored < 0){
+			return stored;
+		}
+	}else{
+		memset(out, 0, MYFS_BLOCK_SIZE);
+	}
+	memcpy(out + b->lo, b->data + b->lo, b->hi - b->lo);
+	return ((uint32_t)stored > b->hi) ? stored : (int)b->hi;
+}
+
+/**
+ * Writes all of a file's buffered data and its meta data to the DB, and
+ * forgets the dirty state. The caller holds the file's inode lock exclusively.
+ *
+ * @param f the file, as returned by a lookup (with its buffered size)
+ *
+ * @return the unqlite return code. On failure whatever was not written stays
+ *				 buffered.
+ */
+int wb_flush(file* f){
+	wb_inode* wb = wb_get(f->meta_data_id);
+	if (wb == NULL){
+		return UNQLITE_OK;
+	}
+	write_log("Writing back %zu dirty blocks of %s\n", wb->nblocks, f->path);
+
+	uint8_t bounce[MYFS_BLOCK_SIZE];
+	size_t freed = 0;
+	block_map* m = block_map_get(f);
+	int rc = (m != NULL) ? UNQLITE_OK : UNQLITE_NOMEM;
+	for (int i = 0; i < WB_BUCKETS && rc == UNQLITE_OK; i++){
+		wb_block* b;
+		while ((b = wb->blocks[i]) != NULL){
+			off_t base = (off_t)b->index * MYFS_BLOCK_SIZE;
+			if (base < wb->size){
+				//Whole blocks are written as they are, others are filled in first
+				const uint8_t* data = b->data;
+				int used = MYFS_BLOCK_SIZE;
+				if (!b->complete){
+					used = wb_load_block(f, m, wb, b, bounce);
+					data = bounce;
+				}
+				if (used < 0){
+					rc = used;
+					break;
+				}
+				//Nothing past the end of the file is kept
+				if (base + used > wb->size){
+					used = wb->size - base;
+				}
+				rc = block_write(f, m, b->index, data, used);
+				if (rc != UNQLITE_OK){
+					break;
+				}
+			}
+			wb->blocks[i] = b->next;
+			wb->nblocks--;
+			freed += MYFS_BLOCK_SIZE;
+			free(b);
+		}
+	}
+	if (m != NULL){
+		rc = block_map_release(f, m, rc);
+	}
+
+	pthread_mutex_lock(&wb_lock);
+	wb_dirty_bytes -= freed;
+	f->size = wb->size;
+	f->mtime = wb->mtime;
+	f->ctime = wb->ctime;
+	if (rc == UNQLITE_OK){
+		wb_unlink(wb);
+	}
+	pthread_mutex_unlock(&wb_lock);
+
+	if (rc != UNQLITE_OK){
+		log_error("wb_flush - error %d writing back %s\n", rc, f->path);
+		return rc;
+	}
+	free(wb);
+	return store_file(f);
+}
+
+/**
+ * Writes back a file we only know the UUID of. The caller holds the file's
+ * inode lock exclusively.
+ *
+ * @param id the file's meta data UUID
+ *
+ * @return the unqlite return code
+ */
+static int wb_flush_id(const uuid_t id){
+	file* f = malloc(sizeof(file));
+	if (f == NULL){
+		return UNQLITE_NOMEM;
+	}
+	int rc = inode_fetch(id, f);
+	if (rc == UNQLITE_OK){
+		wb_overlay(f);
+		rc = wb_flush(f);
+	}
+	free(f);
+	return rc;
+}
+
+/**
+ * Throws away whatever is buffered for a file that is being deleted. The
+ * caller holds the file's inode lock exclusively.
+ *
+ * @param id the file's meta data UUID
+ */
+void wb_discard(const uuid_t id){
+	pthread_mutex_lock(&wb_lock);
+	wb_inode* wb = (wb_files > 0) ? wb_find(id) : NULL;
+	if (wb != NULL){
+		wb_unlink(wb);
+		wb_dirty_bytes -= wb->nblocks * MYFS_BLOCK_SIZE;
+	}
+	pthread_mutex_unlock(&wb_lock);
+	if (wb == NULL){
+		return;
+	}
+
+	for (int i = 0; i < WB_BUCKETS; i++){
+		while (wb->blocks[i] != NULL){
+			wb_block* b = wb->blocks[i];
+			wb->blocks[i] = b->next;
+			free(b);
+		}
+	}
+	free(wb);
+}
+
+/**
+ * Picks a dirty file to write back, going round the table so that a file whose
+ * lock is busy does not keep being picked.
+ *
+ * @param skip a file not to pick
+ * @param out set to the file's meta data UUID
+ *
+ * @return 0 if one was found
+ */
+static int wb_pick(const uuid_t skip, uuid_t out){
+	int found = -1;
+	pthread_mutex_lock(&wb_lock);
+	for (int i = 0; i < WB_TABLE_SIZE && found != 0; i++){
+		int slot = (wb_cursor + i) % WB_TABLE_SIZE;
+		for (wb_inode* wb = wb_table[slot]; wb != NULL; wb = wb->next){
+			if (uuid_compare(wb->id, skip) != 0){
+				memcpy(out, wb->id, sizeof(uuid_t));
+				wb_cursor = slot + 1;
+				found = 0;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&wb_lock);
+	return found;
+}
+
+/**
+ * @return non-0 if there is more dirty data than the limit allows
+ */
+static int wb_over_limit(){
+	pthread_mutex_lock(&wb_lock);
+	int over = wb_dirty_bytes > wb_dirty_limit;
+	pthread_mutex_unlock(&wb_lock);
+	return over;
+}
+
+/**
+ * Gets the amount of dirty data back under the limit, starting with the file
+ * that was just written to. Other files are only written back if their locks
+ * are free, so a writer never waits on another file here.
+ *
+ * @param f the file just written to, locked exclusively by the caller
+ *
+ * @return the unqlite return code
+ */
+static int wb_balance(file* f){
+	if (!wb_over_limit()){
+		return UNQLITE_OK;
+	}
+	int rc = wb_flush(f);
+
+	int own_lock = inode_lock_index(f->meta_data_id);
+	for (int tries = 0; rc == UNQLITE_OK && tries < WB_TABLE_SIZE && \
+											wb_over_limit(); tries++){
+		uuid_t victim;
+		if (wb_pick(f->meta_data_id, victim) != 0){
+			break;
+		}
+		//We may already hold the lock it shares with our own file
+		int lock = -1;
+		if (inode_lock_index(victim) != own_lock){
+			lock = inode_trylock(victim);
+			if (lock < 0){
+				continue;
+			}
+		}
+		rc = wb_flush_id(victim);
+		if (lock >= 0){
+			inode_unlock(lock);
+		}
+	}
+	return rc;
+}
+
+/**
+ * Buffers a write, like pwrite(2). The caller holds the file's inode lock
+ * exclusively and has already set its new times; the file's size is updated.
+ * Nothing needs storing afterwards: the meta data is written back with the
+ * data.
+ *
+ * @param f the file
+ * @param buf the data
+ * @param size how many bytes to write
+ * @param offset where in the file to start
+ *
+ * @return the number of bytes written, -ENOMEM or -EIO
+ */
+int wb_write(file* f, const char* buf, size_t size, off_t offset){
+	pthread_mutex_lock(&wb_lock);
+	wb_inode* wb = wb_find(f->meta_data_id);
+	if (wb == NULL){
+		wb = calloc(1, sizeof(wb_inode));
+		if (wb == NULL){
+			pthread_mutex_unlock(&wb_lock);
+			return -ENOMEM;
+		}
+		memcpy(wb->id, f->meta_data_id, sizeof(uuid_t));
+		wb->stored_size = f->size;
+		wb->size = f->size;
+		int slot = hash_bytes(wb->id, sizeof(uuid_t)) % WB_TABLE_SIZE;
+		wb->next = wb_table[slot];
+		wb_table[slot] = wb;
+		wb_files++;
+	}
+	pthread_mutex_unlock(&wb_lock);
+
+	size_t added = 0;
+	size_t done = 0;
+	int rc = 0;
+	while (done < size){
+		uint64_t index = (offset + done) / MYFS_BLOCK_SIZE;
+		uint32_t in_block = (offset + done) % MYFS_BLOCK_SIZE;
+		uint32_t len = MYFS_BLOCK_SIZE - in_block;
+		if (len > size - done){
+			len = size - done;
+		}
+
+		wb_block* b = wb_block_find(wb, index);
+		if (b == NULL){
+			b = malloc(sizeof(wb_block));
+			if (b == NULL){
+				rc = -ENOMEM;
+				break;
+			}
+			b->index = index;
+			b->lo = in_block;
+			b->hi = in_block + len;
+			b->complete = 0;
+			b->next = wb->blocks[index % WB_BUCKETS];
+			wb->blocks[index % WB_BUCKETS] = b;
+			wb->nblocks++;
+			added += MYFS_BLOCK_SIZE;
+		}else if (!b->complete && (in_block > b->hi || in_block + len < b->lo)){
+			//Only one written range is kept per block, so fill in the gap
+			uint8_t bounce[MYFS_BLOCK_SIZE];
+			block_map* m = block_map_get(f);
+			int used = (m != NULL) ? wb_load_block(f, m, wb, b, bounce) : -1;
+			if (m != NULL){
+				block_map_put(m);
+			}
+			if (used < 0){
+				write_log("wb_write - EIO reading block %llu\n", index);
+				rc = -EIO;
+				break;
+			}
+			memcpy(b->data, bounce, MYFS_BLOCK_SIZE);
+			b->complete = 1;
+		}else{
+			if (in_block < b->lo){
+				b->lo = in_block;
+			}
+			if (in_block + len > b->hi){
+				b->hi = in_block + len;
+			}
+		}
+		if (b->lo == 0 && b->hi == MYFS_BLOCK_SIZE){
+			b->complete = 1;
+		}
+		memcpy(b->data + in_block, buf + done, len);
+		done += len;
+	}
+
+	if (offset + (off_t)done > f->size){
+		f->size = offset + done;
+	}
+	pthread_mutex_lock(&wb_lock);
+	wb->size = f->size;
+	wb->mtime = f->mtime;
+	wb->ctime = f->ctime;
+	wb_dirty_bytes += added;
+	pthread_mutex_unlock(&wb_lock);
+
+	if (rc == 0 && wb_balance(f) != UNQLITE_OK){
+		write_log("wb_write - EIO writing back\n");
+		rc = -EIO;
+	}
+	return (rc < 0) ? rc : (int)size;
+}
+
+/**
+ * Writes back every dirty file, eg: when unmounting.
+ *
+ * @return the unqlite return code
+ */
+int wb_flush_all(){
+	uuid_t none;
+	uuid_t id;
+	uuid_clear(none);
+	int rc = UNQLITE_OK;
+	while (rc == UNQLITE_OK && wb_pick(none, id) == 0){
+		int lock = inode_lock(id, 1);
+		rc = wb_flush_id(id);
+		inode_unlock(lock);
+	}
+	return rc;
+}
+
+/**
+ * Throws away every file's dirty data. The caller holds every inode lock
+ * exclusively (see inode_lock_all()).
+ */
+void wb_discard_all(){
+	uuid_t none;
+	uuid_t id;
+	uuid_clear(none);
+	while (wb_pick(none, id) == 0){
+		wb_discard(id);
+	}
+}
+
+/*
+ ***************
+	Readahead
+ ***************
+*/
+
+//Each open file keeps track of where its reads have got to. While its reads
+//carry on from where the last one stopped, the blocks after them are read in
+//the background into a read cache, where the reads that follow find them. The
+//window read ahead starts at twice the size of a read and doubles each time the
+//reader gets half way through it, up to the limit; a read anywhere else shuts
+//it again, so random readers cost nothing extra. Blocks a sequential reader
+//gets to before the thread does are kept too, so that they are not read twice.
+//
+//The cache holds blocks as block_read() gives them, by file_data_id and block
+//number. Blocks only go in while their file's inode lock is held shared, and
+//block_write() and block_delete() take them out again while it is held
+//exclusively, so a cached block is never older than the DB. Dirty blocks in the
+//write-back cache are looked for first.
+#ifndef MYFS_RA_BLOCKS
+#define MYFS_RA_BLOCKS 2048
+#endif
+#ifndef MYFS_READAHEAD_KB
+#define MYFS_READAHEAD_KB 1024
+#endif
+
+//The smallest window, in blocks, and how many requests may wait for the thread
+#define RA_MIN_WINDOW 4
+#define RA_QUEUE 64
+
+//Where one open file's reads have got to. The kernel's file handle points at
+//it (see myfs_open()).
+typedef struct ra_stream {
+	uint64_t next; //The block after the last one read
+	uint64_t ahead; //The block after the last one asked for
+	uint64_t window; //In blocks, 0 while the reads are random
+} ra_stream;
+
+typedef struct ra_slot {
+	uuid_t id; //The file_data_id
+	uint64_t index;
+	int used;
+} ra_slot;
+
+//Blocks [start, end) of a file to be read ahead
+typedef struct ra_job {
+	file f;
+	uint64_t start;
+	uint64_t end;
+} ra_job;
+
+//Everything below is under ra_lock
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t ra_max_window = MYFS_READAHEAD_KB * 1024 / MYFS_BLOCK_SIZE;
+static ra_slot* ra_slots = NULL;
+static uint8_t* ra_data = NULL;
+static ra_job ra_jobs[RA_QUEUE];
+static int ra_head = 0;
+static int ra_queued = 0;
+//The job the thread is on; set ra_cancelled to make it stop
+static ra_job ra_current;
+static int ra_busy = 0;
+static int ra_cancelled = 0;
+//The block of it being read, which readers wait for rather than read again
+static int ra_reading = 0;
+static uint64_t ra_reading_index;
+static pthread_cond_t ra_read_cond = PTHREAD_COND_INITIALIZER;
+static int ra_running = 0;
+static pthread_t ra_thread;
+static uint64_t ra_prefetched = 0;
+static uint64_t ra_hits = 0;
+static uint64_t ra_misses = 0;
+
+/**
+ * Sets how far ahead of a sequential reader blocks are read.
+ *
+ * @param kb the most to read ahead, in KiB (0 for never)
+ */
+void ra_set_window(long kb){
+	pthread_mutex_lock(&ra_lock);
+	ra_max_window = (kb > 0) ? kb * 1024 / MYFS_BLOCK_SIZE : 0;
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/**
+ * Reports how well reading ahead has done since mounting.
+ *
+ * @param prefetched set to how many blocks were read ahead
+ * @param hits set to how many blocks reads found in the cache
+ * @param misses set to how many they did not
+ */
+void ra_stats(uint64_t* prefetched, uint64_t* hits, uint64_t* misses){
+	pthread_mutex_lock(&ra_lock);
+	*prefetched = ra_prefetched;
+	*hits = ra_hits;
+	*misses = ra_misses;
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/**
+ * @return a new open file's read state, or NULL if there is no memory for it
+ *				 (its reads are then never read ahead of)
+ */
+ra_stream* ra_stream_new(){
+	return calloc(1, sizeof(ra_stream));
+}
+
+void ra_stream_free(ra_stream* ra){
+	free(ra);
+}
+
+/**
+ * @return the slot a block would be cached in
+ */
+static inline uint64_t ra_slot_of(const uuid_t id, uint64_t index){
+	return (hash_bytes(id, sizeof(uuid_t)) + index) % MYFS_RA_BLOCKS;
+}
+
+/**
+ * @return non-0 if a block is in the cache. The caller holds ra_lock.
+ */
+static int ra_cached(const uuid_t id, uint64_t index){
+	ra_slot* slot = &ra_slots[ra_slot_of(id, index)];
+	return slot->used && slot->index == index && uuid_compare(slot->id, id) == 0;
+}
+
+/**
+ * Puts a block in the cache. The caller holds ra_lock and the file's inode
+ * lock.
+ */
+static void ra_insert(const uuid_t id, uint64_t index, const uint8_t* buf){
+	uint64_t at = ra_slot_of(id, index);
+	memcpy(ra_slots[at].id, id, sizeof(uuid_t));
+	ra_slots[at].index = index;
+	ra_slots[at].used = 1;
+	memcpy(ra_data + at * MYFS_BLOCK_SIZE, buf, MYFS_BLOCK_SIZE);
+}
+
+/**
+ * Copies a block out of the cache, waiting for it if the thread is reading it
+ * right now. The caller holds the file's inode lock.
+ *
+ * @param f the file
+ * @param index the block number
+ * @param buf MYFS_BLOCK_SIZE bytes to copy it into
+ *
+ * @return non-0 if the block was cached
+ */
+int ra_lookup(file* f, uint64_t index, uint8_t* buf){
+	pthread_mutex_lock(&ra_lock);
+	while (ra_reading && ra_reading_index == index && \
+				 uuid_compare(ra_current.f.file_data_id, f->file_data_id) == 0){
+		pthread_cond_wait(&ra_read_cond, &ra_lock);
+	}
+	int found = ra_slots != NULL && ra_cached(f->file_data_id, index);
+	if (found){
+		memcpy(buf, ra_data + ra_slot_of(f->file_data_id, index) * MYFS_BLOCK_SIZE, \
+					 MYFS_BLOCK_SIZE);
+		ra_hits++;
+	}else{
+		ra_misses++;
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return found;
+}
+
+/**
+ * Keeps a block a sequential reader had to read itself, so that the thread
+ * does not read it again. The caller holds the file's inode lock.
+ *
+ * @param f the file
+ * @param index the block number
+ * @param buf the block, as block_read() gave it
+ */
+void ra_keep(file* f, uint64_t index, const uint8_t* buf){
+	pthread_mutex_lock(&ra_lock);
+	if (ra_slots != NULL){
+		ra_insert(f->file_data_id, index, buf);
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/**
+ * Takes blocks [start, end) of a file out of the cache, and stops them being
+ * read ahead. Called by anyone changing them, holding the file's inode lock
+ * exclusively.
+ *
+ * @param id the file's file_data_id
+ * @param start the first block number
+ * @param end the block number after the last
+ */
+void ra_forget(const uuid_t id, uint64_t start, uint64_t end){
+	pthread_mutex_lock(&ra_lock);
+	if (ra_slots != NULL && end - start < MYFS_RA_BLOCKS){
+		for (uint64_t index = start; index < end; index++){
+			ra_slot* slot = &ra_slots[ra_slot_of(id, index)];
+			if (slot->used && slot->index == index && uuid_compare(slot->id, id) == 0){
+				slot->used = 0;
+			}
+		}
+	}else if (ra_slots != NULL){
+		for (uint64_t at = 0; at < MYFS_RA_BLOCKS; at++){
+			ra_slot* slot = &ra_slots[at];
+			if (slot->used && slot->index >= start && slot->index < end && \
+					uuid_compare(slot->id, id) == 0){
+				slot->used = 0;
+			}
+		}
+	}
+	for (int i = 0; i < ra_queued; i++){
+		ra_job* job = &ra_jobs[(ra_head + i) % RA_QUEUE];
+		if (job->start < end && start < job->end && \
+				uuid_compare(job->f.file_data_id, id) == 0){
+			job->end = job->start;
+		}
+	}
+	if (ra_busy && ra_current.start < end && start < ra_current.end && \
+			uuid_compare(ra_current.f.file_data_id, id) == 0){
+		ra_cancelled = 1;
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/**
+ * Empties the read cache and drops every block waiting to be read ahead.
+ */
+void ra_clear(){
+	pthread_mutex_lock(&ra_lock);
+	if (ra_slots != NULL){
+		for (uint64_t at = 0; at < MYFS_RA_BLOCKS; at++){
+			ra_slots[at].used = 0;
+		}
+	}
+	for (int i = 0; i < ra_queued; i++){
+		ra_job* job = &ra_jobs[(ra_head + i) % RA_QUEUE];
+		job->end = job->start;
+	}
+	if (ra_busy){
+		ra_cancelled = 1;
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/**
+ * Reads one block ahead into the cache, unless it is there already or the job
+ * has been cancelled.
+ *
+ * @param job the job
+ * @param index the block number
+ * @param buf MYFS_BLOCK_SIZE bytes to read into
+ *
+ * @return non-0 to go on with the job
+ */
+static int ra_fetch(ra_job* job, uint64_t index, uint8_t* buf){
+	//The lock is only held a block at a time, so that writers need not wait
+	//for the whole window
+	int lock = inode_lock(job->f.meta_data_id, 0);
+	pthread_mutex_lock(&ra_lock);
+	int go = !ra_cancelled;
+	int cached = ra_cached(job->f.file_data_id, index);
+	if (go && !cached){
+		ra_reading = 1;
+		ra_reading_index = index;
+	}
+	pthread_mutex_unlock(&ra_lock);
+	if (!go || cached){
+		inode_unlock(lock);
+		return go;
+	}
+
+	block_map* m = block_map_get(&job->f);
+	int rc = (m == NULL) ? UNQLITE_NOMEM : \
+					 (block_map_has(m, index, NULL) == BLOCK_HOLE) ? 0 : \
+					 block_read(&job->f, m, index, buf);
+	if (m != NULL){
+		block_map_put(m);
+	}
+	//Holes are as quick to read as to copy, so they are not cached
+	pthread_mutex_lock(&ra_lock);
+	if (rc > 0){
+		ra_insert(job->f.file_data_id, index, buf);
+		ra_prefetched++;
+	}
+	ra_reading = 0;
+	pthread_cond_broadcast(&ra_read_cond);
+	pthread_mutex_unlock(&ra_lock);
+	inode_unlock(lock);
+	return rc >= 0;
+}
+
+/**
+ * The readahead thread: works through the queue until ra_stop().
+ */
+static void* ra_main(void* arg){
+	(void) arg;
+	uint8_t* buf = malloc(MYFS_BLOCK_SIZE);
+	pthread_mutex_lock(&ra_lock);
+	while (ra_running && buf != NULL){
+		if (ra_queued == 0){
+			pthread_cond_wait(&ra_cond, &ra_lock);
+			continue;
+		}
+		ra_current = ra_jobs[ra_head];
+		ra_head = (ra_head + 1) % RA_QUEUE;
+		ra_queued--;
+		ra_busy = 1;
+		ra_cancelled = 0;
+		pthread_mutex_unlock(&ra_lock);
+
+		for (uint64_t index = ra_current.start; index < ra_current.end; index++){
+			if (!ra_fetch(&ra_current, index, buf)){
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&ra_lock);
+		ra_busy = 0;
+	}
+	pthread_mutex_unlock(&ra_lock);
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Asks for blocks [start, end) of a file to be read ahead, starting the thread
+ * and allocating the cache on first use (so that neither is lost when FUSE
+ * forks into the background). If the queue is full they are not. The caller
+ * holds ra_lock.
+ */
+static void ra_queue(file* f, uint64_t start, uint64_t end){
+	if (!ra_running){
+		ra_slots = calloc(MYFS_RA_BLOCKS, sizeof(ra_slot));
+		ra_data = malloc((size_t)MYFS_RA_BLOCKS * MYFS_BLOCK_SIZE);
+		if (ra_slots == NULL || ra_data == NULL){
+			log_error("No memory to read ahead\n");
+		}else{
+			ra_running = pthread_create(&ra_thread, NULL, ra_main, NULL) == 0;
+			if (!ra_running){
+				log_error("Could not start reading ahead\n");
+			}
+		}
+		if (!ra_running){
+			free(ra_slots);
+			free(ra_data);
+			ra_slots = NULL;
+			ra_data = NULL;
+			ra_max_window = 0;
+			return;
+		}
+	}
+	if (ra_queued == RA_QUEUE){
+		return;
+	}
+	ra_job* job = &ra_jobs[(ra_head + ra_queued) % RA_QUEUE];
+	memcpy(&job->f, f, sizeof(file));
+	job->start = start;
+	job->end = end;
+	ra_queued++;
+	pthread_cond_signal(&ra_cond);
+}
+
+/**
+ * Notes a read of blocks [first, last) and, if the file is being read
+ * sequentially, asks for the blocks after them to be read ahead. The caller
+ * holds the file's inode lock.
+ *
+ * @param f the file
+ * @param ra the open file's read state, or NULL
+ * @param first the first block being read
+ * @param last the block after the last
+ *
+ * @return non-0 if the file is being read ahead of
+ */
+int ra_advise(file* f, ra_stream* ra, uint64_t first, uint64_t last){
+	if (ra == NULL){
+		return 0;
+	}
+	pthread_mutex_lock(&ra_lock);
+	//Reading the rest of the last block counts as carrying on
+	int sequential = first == ra->next || first + 1 == ra->next;
+	ra->next = last;
+	if (!sequential || ra_max_window == 0){
+		ra->window = 0;
+		ra->ahead = 0;
+		pthread_mutex_unlock(&ra_lock);
+		return 0;
+	}
+	//More is only asked for once the reader is half way through the window, so
+	//that each request is for many blocks
+	if (ra->window > 0 && ra->ahead > last && ra->ahead - last > ra->window / 2){
+		pthread_mutex_unlock(&ra_lock);
+		return 1;
+	}
+	uint64_t window = (ra->window > 0) ? ra->window * 2 : (last - first) * 2;
+	window = (window > RA_MIN_WINDOW) ? window : RA_MIN_WINDOW;
+	ra->window = (window < ra_max_window) ? window : ra_max_window;
+
+	uint64_t blocks = (f->size + MYFS_BLOCK_SIZE - 1) / MYFS_BLOCK_SIZE;
+	uint64_t from = (ra->ahead > last) ? ra->ahead : last;
+	uint64_t to = (last + ra->window < blocks) ? last + ra->window : blocks;
+	if (from < to){
+		ra_queue(f, from, to);
+		ra->ahead = to;
+	}
+	int ahead = ra_max_window > 0;
+	pthread_mutex_unlock(&ra_lock);
+	return ahead;
+}
+
+/**
+ * Stops the readahead thread and empties the cache.
+ */
+void ra_stop(){
+	pthread_mutex_lock(&ra_lock);
+	int running = ra_running;
+	ra_running = 0;
+	ra_queued = 0;
+	pthread_cond_broadcast(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	if (running){
+		pthread_join(ra_thread, NULL);
+	}
+	pthread_mutex_lock(&ra_lock);
+	free(ra_slots);
+	free(ra_data);
+	ra_slots = NULL;
+	ra_data = NULL;
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/*
+ ***************
+	File Data
+ ***************
+*/
+
+//Regular files no bigger than this keep their data inline in their meta data
+//record (see Inode Records), so that reading one is a single fetch and
+//creating and deleting one touches a single record. They are moved out into
+//blocks when they grow past it. 0 gives every new file blocks of its own.
+#ifndef MYFS_INLINE_MAX
+#define MYFS_INLINE_MAX 512
+#endif
+
+static size_t inline_max = MYFS_INLINE_MAX;
+
+int data_write(file* f, const char* buf, size_t size, off_t offset);
+
+/**
+ * Changes how big a file's data can be and still be kept inline. Files that
+ * are already inline stay so until they are next written.
+ *
+ * @param bytes the new threshold, at most INLINE_ROOM
+ */
+void data_set_inline_max(size_t bytes){
+	inline_max = (bytes < INLINE_ROOM) ? bytes : INLINE_ROOM;
+}
+
+/**
+ * @return non-0 if new files are created with their data inline
+ */
+int data_inline_enabled(){
+	return inline_max > 0;
+}
+
+/**
+ * Makes sure a file's data can grow to a new size: an inline file that would
+ * be too big is moved out into blocks of its own. The caller stores the file's
+ * meta data afterwards.
+ *
+ * @param f the file
+ * @param newsize the size it is growing to
+ *
+ * @return the unqlite return code
+ */
+int data_grow(file* f, off_t newsize){
+	if (!file_is_inline(f) || newsize <= (off_t)inline_max){
+		return UNQLITE_OK;
+	}
+	write_log("Moving %s out of its meta data\n", f->path);
+	uint8_t data[INLINE_ROOM];
+	size_t len = (f->size > 0) ? (size_t)f->size : 0;
+	len = (len < INLINE_ROOM) ? len : INLINE_ROOM;
+	memcpy(data, file_inline(f), len);
+	memset(file_inline(f), 0, INLINE_ROOM);
+	uuid_generate(f->file_data_id);
+
+	int rc = block_map_create(f);
+	if (rc == UNQLITE_OK && len > 0 && data_write(f, (char*)data, len, 0) < 0){
+		rc = UNQLITE_IOERR;
+	}
+	return rc;
+}
+
+//A read put together for fuse_reply_data(). Blocks in the data log's segment
+//files are spliced straight out of them, and everything else is read into mem.
+typedef struct data_splice {
+	struct fuse_bufvec* vec;
+	char* mem;
+	uint32_t* pinned; //The segments that the spliced parts are in
+	size_t pins;
+} data_splice;
+
+/**
+ * Adds part of a read to a data_splice, merging it with the part before if
+ * they are next to each other.
+ *
+ * @param fd the segment file, or -1 if the part is in mem
+ * @param pos where it is in the segment file, or in mem
+ */
+static void data_splice_add(data_splice* ds, int fd, off_t pos, size_t len){
+	struct fuse_bufvec* v = ds->vec;
+	struct fuse_buf* last = &v->buf[v->count - 1];
+	int last_fd = (last->flags & FUSE_BUF_IS_FD) ? last->fd : -1;
+	off_t last_end = (last_fd >= 0) ? last->pos + (off_t)last->size : \
+									 ((char*)last->mem - ds->mem) + (off_t)last->size;
+	if (last_fd == fd && last_end == pos){
+		last->size += len;
+		return;
+	}
+	if (last->size > 0){
+		last = &v->buf[v->count++];
+	}
+	memset(last, 0, sizeof(struct fuse_buf));
+	last->size = len;
+	if (fd >= 0){
+		last->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		last->fd = fd;
+		last->pos = pos;
+	}else{
+		last->fd = -1;
+		last->mem = ds->mem + pos;
+	}
+}
+
+/**
+ * Reads part of a file, like pread(2).
+ *
+ * @param f the file
+ * @param buf where to put the data
+ * @param size how many bytes to read
+ * @param offset where in the file to start
+ * @param ra the open file's read state, or NULL not to read ahead
+ * @param ds NULL, or the data_splice that buf is the mem of, to splice what
+ *				can be spliced rather than read it
+ *
+ * @return the number of bytes read (short at the end of the file), -EINVAL
+ *				 if offset is negative, or -EIO
+ */
+static int data_read_into(file* f, char* buf, size_t size, off_t offset, \
+													ra_stream* ra, data_splice* ds){
+	if (offset < 0){
+		return -EINVAL;
+	}else if (offset >= f->size){
+		return 0;
+	}
+	//Both are known to be positive now, so the rest is done in size_t
+	size_t left = (size_t)(f->size - offset);
+	if (size > left){
+		size = left;
+	}
+	if (file_is_inline(f)){
+		size_t have = (offset < (off_t)INLINE_ROOM) ? INLINE_ROOM - offset : 0;
+		have = (have < size) ? have : size;
+		memcpy(buf, file_inline(f) + offset, have);
+		memset(buf + have, 0, size - have);
+		if (ds != NULL){
+			data_splice_add(ds, -1, 0, size);
+		}
+		return size;
+	}
+	block_map* m = block_map_get(f);
+	if (m == NULL){
+		write_log("data_read - EIO reading the block map of %s\n", f->path);
+		return -EIO;
+	}
+
+	int ahead = ra_advise(f, ra, offset / MYFS_BLOCK_SIZE, \
+												(offset + size + MYFS_BLOCK_SIZE - 1) / MYFS_BLOCK_SIZE);
+
+	//Writes that are still buffered are read from the write-back cache, then
+	//logged blocks are spliced if they can be, then blocks read ahead come from
+	//the read cache, and holes are just zeros
+	wb_inode* wb = wb_get(f->meta_data_id);
+	uint8_t bounce[MYFS_BLOCK_SIZE];
+	size_t done = 0;
+	while (done < size){
+		uint64_t index = (offset + done) / MYFS_BLOCK_SIZE;
+		size_t in_block = (offset + done) % MYFS_BLOCK_SIZE;
+		size_t len = MYFS_BLOCK_SIZE - in_block;
+		if (len > size - done){
+			len = size - done;
+		}
+
+		//Whole blocks can go straight into the caller's buffer
+		uint8_t* target = (len == MYFS_BLOCK_SIZE) ? (uint8_t*)buf + done : bounce;
+		wb_block* dirty = (wb != NULL) ? wb_block_find(wb, index) : NULL;
+		block_loc loc;
+		int fd;
+		int rc;
+		if (dirty != NULL){
+			rc = wb_load_block(f, m, wb, dirty, target);
+		}else if (ds != NULL && block_map_has(m, index, NULL) == \
+							(BLOCK_OWN | BLOCK_LOGGED) && seg_pin(f, index, &loc, &fd) == \
+							UNQLITE_OK){
+			//Stored as it is, so the kernel can have it without it being read.
+			//Anything past the end of a short block is zeros and is read as such.
+			if (in_block + len <= loc.length){
+				ds->pinned[ds->pins++] = loc.segment;
+				data_splice_add(ds, fd, loc.offset + in_block, len);
+				done += len;
+				continue;
+			}
+			seg_unpin(loc.segment);
+			rc = block_read(f, m, index, target);
+		}else if (ra_lookup(f, index, target)){
+			rc = 0;
+		}else{
+			rc = block_read(f, m, index, target);
+			if (ahead && rc > 0){
+				ra_keep(f, index, target);
+			}
+		}
+		if (rc < 0){
+			write_log("data_read - EIO reading block %llu\n", index);
+			block_map_put(m);
+			return -EIO;
+		}
+		if (target == bounce){
+			memcpy(buf + done, bounce + in_block, len);
+		}
+		if (ds != NULL){
+			data_splice_add(ds, -1, done, len);
+		}
+		done += len;
+	}
+	block_map_put(m);
+	return size;
+}
+
+/**
+ * Reads part of a file, like pread(2).
+ *
+ * @param f the file
+ * @param buf where to put the data
+ * @param size how many bytes to read
+ * @param offset where in the file to start
+ * @param ra the open file's read state, or NULL not to read ahead
+ *
+ * @return the number of bytes read (short at the end of the file), -EINVAL
+ *				 if offset is negative, or -EIO
+ */
+int data_read(file* f, char* buf, size_t size, off_t offset, ra_stream* ra){
+	return data_read_into(f, buf, size, offset, ra, NULL);
+}
+
+/**
+ * Lets go of a read put together by data_read_buf(), once it has been sent.
+ */
+void data_splice_free(data_splice* ds){
+	for (size_t i = 0; i < ds->pins; i++){
+		seg_unpin(ds->pinned[i]);
+	}
+	free(ds->vec);
+	free(ds->mem);
+	free(ds->pinned);
+	memset(ds, 0, sizeof(data_splice));
+}
+
+/**
+ * Reads part of a file for fuse_reply_data(), splicing the blocks that are in
+ * the data log's segment files rather than copying them. What is spliced is
+ * what the file held at the time of the call, even once the file is unlocked.
+ *
+ * @param f the file
+ * @param size how many bytes to read
+ * @param offset where in the file to start
+ * @param ra the open file's read state, or NULL not to read ahead
+ * @param ds set to the read, which the caller frees with data_splice_free()
+ *
+ * @return the number of bytes read (short at the end of the file), or
+ *				 -EINVAL, -ENOMEM or -EIO
+ */
+int data_read_buf(file* f, size_t size, off_t offset, ra_stream* ra, \
+									data_splice* ds){
+	//Every block adds a part at most
+	size_t parts = size / MYFS_BLOCK_SIZE + 2;
+	ds->vec = malloc(sizeof(struct fuse_bufvec) + parts * sizeof(struct fuse_buf));
+	ds->mem = malloc((size > 0) ? size : 1);
+	ds->pinned = malloc(parts * sizeof(uint32_t));
+	ds->pins = 0;
+	if (ds->vec == NULL || ds->mem == NULL || ds->pinned == NULL){
+		data_splice_free(ds);
+		return -ENOMEM;
+	}
+	*ds->vec = FUSE_BUFVEC_INIT(0);
+	ds->vec->buf[0].mem = ds->mem;
+
+	int read = data_read_into(f, ds->mem, size, offset, ra, ds);
+	if (read < 0){
+		data_splice_free(ds);
+	}
+	return read;
+}
+
+/**
+ * Writes part of a file, like pwrite(2). Only blocks that are partially
+ * overwritten have to be read first. The caller is responsible for storing
+ * the file's meta data (its size may have grown).
+ *
+ * @param f the file
+ * @param buf the data
+ * @param size how many bytes to write
+ * @param offset where in the file to start
+ *
+ * @return the number of bytes written, or -EIO
+ */
+int data_write(file* f, const char* buf, size_t size, off_t offset){
+	off_t end = offset + size;
+	if (data_grow(f, (end > f->size) ? end : f->size) != UNQLITE_OK){
+		write_log("data_write - EIO moving %s out of its meta data\n", f->path);
+		return -EIO;
+	}
+	if (file_is_inline(f)){
+		memcpy(file_inline(f) + offset, buf, size);
+		if (end > f->size){
+			f->size = end;
+		}
+		return size;
+	}
+
+	block_map* m = block_map_get(f);
+	if (m == NULL){
+		write_log("data_write - EIO reading the block map of %s\n", f->path);
+		return -EIO;
+	}
+	uint8_t bounce[MYFS_BLOCK_SIZE];
+	size_t done = 0;
+	int rc = UNQLITE_OK;
+	while (done < size){
+		uint64_t index = (offset + done) / MYFS_BLOCK_SIZE;
+		size_t in_block = (offset + done) % MYFS_BLOCK_SIZE;
+		size_t len = MYFS_BLOCK_SIZE - in_block;
+		if (len > size - done){
+			len = size - done;
+		}
+
+		if (len == MYFS_BLOCK_SIZE){
+			rc = block_write(f, m, index, (const uint8_t*)buf + done, len);
+		}else{
+			//Read-modify-write, keeping whatever else the block holds
+			int stored = 0;
+			if ((off_t)index * MYFS_BLOCK_SIZE < f->size){
+				stored = block_read(f, m, index, bounce);
+				if (stored < 0){
+					write_log("data_write - EIO reading block %llu\n", index);
+					rc = stored;
+					break;
+				}
+			}else{
+				memset(bounce, 0, MYFS_BLOCK_SIZE);
+			}
+			memcpy(bounce + in_block, buf + done, len);
+			size_t used = (in_block + len > (size_t)stored) ? in_block + len : \
+										(size_t)stored;
+			rc = block_write(f, m, index, bounce, used);
+		}
+
+		if (rc != UNQLITE_OK){
+			write_log("data_write - EIO writing block %llu\n", index);
+			break;
+		}
+		done += len;
+	}
+	if (block_map_release(f, m, rc) != UNQLITE_OK){
+		return -EIO;
+	}
+
+	if (offset + (off_t)size > f->size){
+		f->size = offset + size;
+	}
+	return size;
+}
+
+/**
+ * Cuts a file's data down to a new size so that nothing past it can reappear
+ * if the file grows again. The caller updates the file's size.
+ *
+ * @param f the file, with its old size
+ * @param newsize the size it is being cut to
+ *
+ * @return the unqlite return code
+ */
+int data_shrink(file* f, off_t newsize){
+	if (file_is_inline(f)){
+		if (newsize < (off_t)INLINE_ROOM){
+			memset(file_inline(f) + newsize, 0, INLINE_ROOM - newsize);
+		}
+		return UNQLITE_OK;
+	}
+	block_map* m = block_map_get(f);
+	if (m == NULL){
+		return UNQLITE_NOMEM;
+	}
+	//Only the blocks the map has are visited, however big the file was
+	uint64_t first_unused = (newsize + MYFS_BLOCK_SIZE - 1) / MYFS_BLOCK_SIZE;
+	int rc = block_delete(f, m, first_unused, UINT64_MAX);
+
+	//The block the file now ends in keeps only what is before the end
+	//(newsize is never negative, the kernel refuses to truncate to that)
+	size_t tail = (size_t)(newsize % MYFS_BLOCK_SIZE);
+	if (rc == UNQLITE_OK && tail != 0){
+		uint8_t bounce[MYFS_BLOCK_SIZE];
+		uint64_t index = newsize / MYFS_BLOCK_SIZE;
+		int stored = block_read(f, m, index, bounce);
+		if (stored < 0){
+			rc = stored;
+		}else if ((size_t)stored > tail){
+			rc = block_write(f, m, index, bounce, tail);
+		}
+	}
+	return block_map_release(f, m, rc);
+}
+
+/**
+ * Punches a hole in a file, like fallocate(2) with FALLOC_FL_PUNCH_HOLE: the
+ * range reads as zeros afterwards, and the blocks wholly inside it are freed.
+ * The caller has written back anything buffered for the file.
+ *
+ * @param f the file
+ * @param offset where the hole starts
+ * @param len how long it is
+ *
+ * @return the unqlite return code
+ */
+int data_punch(file* f, off_t offset, off_t len){
+	off_t end = (offset + len < f->size) ? offset + len : f->size;
+	if (offset >= end){
+		return UNQLITE_OK;
+	}
+	if (file_is_inline(f)){
+		end = (end < (off_t)INLINE_ROOM) ? end : (off_t)INLINE_ROOM;
+		if (offset < end){
+			memset(file_inline(f) + offset, 0, end - offset);
+		}
+		return UNQLITE_OK;
+	}
+	block_map* m = block_map_get(f);
+	if (m == NULL){
+		return UNQLITE_NOMEM;
+	}
+	uint64_t first = (offset + MYFS_BLOCK_SIZE - 1) / MYFS_BLOCK_SIZE;
+	uint64_t last = end / MYFS_BLOCK_SIZE;
+	int rc = (first < last) ? block_delete(f, m, first, last) : UNQLITE_OK;
+
+	//The blocks at either end are zeroed where the hole overlaps them
+	uint64_t edges[2] = {offset / MYFS_BLOCK_SIZE, end / MYFS_BLOCK_SIZE};
+	for (int i = 0; i < 2 && rc == UNQLITE_OK; i++){
+		if (i == 1 && edges[1] == edges[0]){
+			break;
+		}
+		off_t base = (off_t)edges[i] * MYFS_BLOCK_SIZE;
+		size_t lo = (offset > base) ? offset - base : 0;
+		size_t hi = (end < base + MYFS_BLOCK_SIZE) ? end - base : MYFS_BLOCK_SIZE;
+		if (hi <= lo || hi - lo == MYFS_BLOCK_SIZE || !block_map_has(m, edges[i], NULL)){
+			continue;
+		}
+		uint8_t bounce[MYFS_BLOCK_SIZE];
+		int stored = block_read(f, m, edges[i], bounce);
+		if (stored < 0){
+			rc = stored;
+		}else if ((size_t)stored > lo){
+			memset(bounce + lo, 0, (hi < (size_t)stored ? hi : (size_t)stored) - lo);
+			rc = block_write(f, m, edges[i], bounce, stored);
+		}
+	}
+	return block_map_release(f, m, rc);
+}
+
+/**
+ * Deletes all of a file's data. Inline data goes with the meta data record.
+ *
+ * @param f the file
+ *
+ * @return the unqlite return code
+ */
+int data_delete(file* f){
+	if (file_is_inline(f)){
+		return UNQLITE_OK;
+	}
+	block_map* m = block_map_get(f);
+	if (m == NULL){
+		return UNQLITE_NOMEM;
+	}
+	int rc = block_delete(f, m, 0, UINT64_MAX);
+	if (rc == UNQLITE_OK){
+		m->dirty = 0; //The map is about to go too
+	}
+	rc = block_map_release(f, m, rc);
+	if (rc == UNQLITE_OK){
+		rc = block_map_delete(f);
+	}
+	if (rc != UNQLITE_OK){
+		return rc;
+	}
+	rc = kv_delete(f->file_data_id, KEY_SIZE);
+	return (rc == UNQLITE_NOTFOUND) ? UNQLITE_OK : rc;
+}
+
+/*
+ ***************
+	Helper Methods
+ ***************
+*/
+
+/**
+ * Retrieves the file object for a specific path.
+ *
+ * @param path the path to find the file struct for
+ * @param parent the UUID of the directory to start walking from
+ * @param parent_path that directory's path, which must be a prefix of path
+ *				 (the root's always is)
+ * @param out where to place the file
+ *
+ * @return 0 on success, -ENOENT if there is no such file, -EIO on DB errors
+ */
+int traverse_to_file(const char* path, uuid_t parent, const char* parent_path, \
+										 file* out){
+	char i_path[MY_MAX_PATH];
+	write_log("-- Traversing to File --\n");
+
+	//Sometimes /b can be passed in as /b/ which will skew results.
+	if (normalise_path(path, i_path) != 0){
+		return -ENOENT;
+	}
+	write_log("Internal path: %s path: %s\n", i_path, path);
+
+	//We want to iterate from our parent directory throughout the tree which it
+	//is the head of to see if we can find our file
+	file* current_file = malloc(sizeof(file));
+	if (current_file == NULL){
+		return -EIO;
+	}
+	//Because we start from the parent UUID  we do not always need to traverse
+	//the entire tree. We only start from somewhere other than the root when it
+	//was found in the cache, so the root is the only start worth caching.
+	uint64_t root_ticket = dcache_ticket("/") + dcache_id_ticket(parent);
+	int rc = inode_fetch(parent, current_file);
+
+	//Sanity check
+	if (rc != UNQLITE_OK){
+		log_error("DB error in traversing to file\n");
+		free(current_file);
+		return -EIO;
+	}
+	//Records only hold names, the path is ours to fill in
+	strcpy(current_file->path, parent_path);
+	if (strcmp(current_file->path, "/") == 0){
+		dcache_fill(current_file, root_ticket);
+	}
+
+	//Special case
+	if (strcmp(i_path, "/")==0){
+		write_log("Returning root!\n");
+		memcpy(out, current_file, sizeof(file));
+		free(current_file);
+		return 0;
+	}
+
+	//We need to build up the directory as we go.
+	//eg: for a/b/c/d.txt we need to traverse through a to find b, then b to find
+	//c and finally c to find d.txt. We are unable to jump from a -> d.txt.
+	//The directory we start in already covers the first part of the path.
+	char current_path[MY_MAX_PATH];
+	memset(current_path,'\0', MY_MAX_PATH);
+	if (strcmp(current_file->path, "/") != 0){
+		strcpy(current_path, current_file->path);
+	}
+
+	//We also want to avoid warnings about const char* path with the const being
+	//omitted, so we have to split our own copy of what is left.
+	char internal_path[MY_MAX_PATH];
+	strcpy(internal_path, i_path + strlen(current_path));
+
+	//This will hold the sub directory we are current in eg: when we split
+	//a/b/c/d.txt we will be in sub directories: a, b, c and d.txt. This holds
+	//where which one we are currently on.
+	char* saveptr;
+	char* subdir = strtok_r(internal_path, "/", &saveptr);
+
+	uuid_t child; //the child we need to move to.
+
+	while (subdir != NULL){
+		write_log("Current token: %s \n", subdir);
+
+		//We need to add our deliminator to our current path (/) and then add
+		//the current directory we are looking at (eg a,b etc.) so we can build up
+		//as we traverse through the tree
+		strcat(current_path, "/");
+		strcat(current_path, subdir);
+		write_log("Current path: %s\n", current_path);
+
+		uint64_t ticket = dcache_ticket(current_path);
+
+		//Safety first
+		rc = dentry_lookup(current_file, subdir, child);
+		if (rc != 0){
+			write_log("File not found (traverse to file)\n");
+			free(current_file);
+			return rc;
+		}
+
+		//Update and allow us to traverse further down the tree
+		ticket += dcache_id_ticket(child);
+		rc = inode_fetch(child, current_file);
+		if (rc != UNQLITE_OK){
+			log_error("DB error in traversing to file\n");
+			free(current_file);
+			return -EIO;
+		}
+		strcpy(current_file->path, current_path);
+
+		//Every directory on the way is worth remembering, the next lookup in the
+		//same directory can then start from here.
+		dcache_fill(current_file, ticket);
+		subdir = strtok_r(NULL, "/", &saveptr); //Split again until we cannot
+	}
+
+	memcpy(out, current_file, sizeof(file));
+	write_log("File found! Requested ID: %x\n", out->meta_data_id);
+	free(current_file);
+	return 0;
+}
+
+/**
+ * Returns the path of the parent folder
+ *
+ * @param path the path we want to find the parent of
+ * @param file_dir the buffer we want to place the parent's path into
+ */
+void traverse_to_folder(const char* path, char* file_dir){
+	write_log("-- Attempting to find folder --\n");
+	memset(file_dir, 0, MY_MAX_PATH); //Avoids weird errors
+	char delim = '/';
+	char* fname = strrchr(path,(int)delim);
+	write_log("fname %s\n", fname);
+	int length_dname = strlen(path) - strlen(fname) +1; //Offset for null
+	 																										//terminator
+	strncpy(file_dir, path, length_dname);
+	write_log("Path: %s File Name: %s Searching for: %s\n", path, fname, \
+						file_dir);
+}
+
+/**
+ * Loads the parent of a file
+ *
+ * @param child the child whose parent should be found
+ * @param out where to place the parent
+ *
+ * @return 0 on success, -ENOENT if the file could not be located (generally
+ * this should never happen).
+ */
+int cache_parent(file* child, file* out){
+	write_log("--Attempting to cache parent --\n");
+
+	if(uuid_compare(child->children[PARENT_POS], zero_uuid)==0){
+		write_log("File has no parent!\n");
+		return -ENOENT;
+	}
+
+	int rc = inode_fetch(child->children[PARENT_POS], out);
+	if (rc != UNQLITE_OK){
+		write_log("Problem with caching parent\n");
+		return -ENOENT;
+	}
+	write_log("Parent loaded: %s\n", out->path);
+	return 0;
+}
+
+/**
+ * Deletes a child from its parent, also updates the number of children that
+ * the parent has.
+ *
+ * @param parent the parent directory
+ * @param child the node to be deleted
+ *
+ * @return the unqlite return code
+ */
+int delete_child(file* parent, file* child){
+	write_log("-- Attempting to delete a child --\n");
+	int rc = dir_remove(parent, path_name(child->path));
+	if (rc != UNQLITE_OK){
+		log_error("Could not remove %s from %s\n", child->path, parent->path);
+		return rc;
+	}
+	parent->number_children = parent->number_children - 1;
+	write_log("Parent should now have: %d children\n", parent->number_children);
+	return UNQLITE_OK;
+}
+
+/**
+ * Looks a file up, from the dentry cache if possible. Should minimise DB
+ * calls.
+ *
+ * @param path the path of the file we wish to find
+ * @param out where to place the file
+ *
+ * @return 0 on success, -ENOENT on file not found
+ */
+int do_caching(const char* path, file* out){
+	write_log("-- Attempting to cache--\n");
+	char i_path[MY_MAX_PATH];
+	if (normalise_path(path, i_path) != 0){
+		return -ENOENT;
+	}
+
+	//Checks to see if it is cached already making checking cache effectively
+	//"free" in comparison to making a DB call.
+	if (dcache_get(i_path, out) == 0){
+		write_log("%s is already cached\n", i_path);
+		wb_overlay(out);
+		return 0;
+	}
+	if (dcache_missing(i_path)){
+		write_log("%s is cached as missing\n", i_path);
+		return -ENOENT;
+	}
+	write_log("%s is not cached\n", i_path);
+	uint64_t ticket = dcache_ticket(i_path);
+
+	//We do not need to start from the root if one of the file's ancestors is
+	//cached, so look for the deepest one.
+	uuid_t start;
+	memcpy(start, root_directory->meta_data_id, sizeof(uuid_t));
+	char ancestor[MY_MAX_PATH];
+	strcpy(ancestor, i_path);
+	char* slash;
+	while ((slash = strrchr(ancestor, '/')) != NULL && slash != ancestor){
+		*slash = '\0';
+		if (dcache_get_id(ancestor, start) == 0){
+			break;
+		}
+	}
+	if (slash == ancestor || slash == NULL){
+		strcpy(ancestor, "/");
+	}
+
+	int rc = traverse_to_file(i_path, start, ancestor, out);
+	if (rc != 0){
+		write_log("Do caching: File not found\n");
+		if (rc == -ENOENT){
+			dcache_fill_missing(i_path, ticket);
+		}
+		return -ENOENT;
+	}
+	write_log("File exists at: %s and %x\n", out->path, out->meta_data_id);
+	wb_overlay(out);
+	return 0;
+}
+
+/**
+ * Looks a file up and locks it. Whatever was looked up before the lock was
+ * taken is read again afterwards, so the caller gets the file as it is while
+ * the lock is held.
+ *
+ * @param path the path of the file
+ * @param out where to place the file
+ * @param exclusive non-0 to lock for writing
+ *
+ * @return the lock index to hand to inode_unlock(), or -ENOENT
+ */
+int lookup_locked(const char* path, file* out, int exclusive){
+	uuid_t id;
+	for (;;){
+		if (do_caching(path, out) != 0){
+			return -ENOENT;
+		}
+		memcpy(id, out->meta_data_id, sizeof(uuid_t));
+		int lock = inode_lock(id, exclusive);
+
+		//The path may have been unlinked and reused in the meantime
+		if (do_caching(path, out) == 0 && uuid_compare(id, out->meta_data_id) == 0){
+			return lock;
+		}
+		inode_unlock(lock);
+	}
+}
+
+/**
+ * Looks a file up by its meta data UUID. This is a single fetch.
+ *
+ * @param id the file's meta data UUID
+ * @param out where to place the file
+ *
+ * @return 0 on success, -ENOENT if there is no such file, -EIO on DB errors
+ */
+int inode_get(const uuid_t id, file* out){
+	int rc = inode_fetch(id, out);
+	if (rc == UNQLITE_NOTFOUND){
+		return -ENOENT;
+	}else if (rc != UNQLITE_OK){
+		return -EIO;
+	}
+	wb_overlay(out);
+	return 0;
+}
+
+/**
+ * Looks a file up by its meta data UUID and locks it.
+ *
+ * @param id the file's meta data UUID
+ * @param out where to place the file
+ * @param exclusive non-0 to lock for writing
+ *
+ * @return the lock index, to be handed to inode_unlock(), or -ENOENT/-EIO
+ */
+int inode_get_locked(const uuid_t id, file* out, int exclusive){
+	int lock = inode_lock(id, exclusive);
+	int rc = inode_get(id, out);
+	if (rc != 0){
+		inode_unlock(lock);
+		return rc;
+	}
+	return lock;
+}
+
+/**
+ * Writes back anything buffered for a file.
+ *
+ * @param id the file's meta data UUID
+ *
+ * @return 0 on success, -EIO on failure
+ */
+int sync_id(const uuid_t id){
+	//Most files being closed were never written to
+	if (wb_get(id) == NULL){
+		return 0;
+	}
+
+	int lock = inode_lock(id, 1);
+	int rc = wb_flush_id(id);
+	inode_unlock(lock);
+	return (rc == UNQLITE_OK) ? 0 : -EIO;
+}
+
+/**
+ * Writes back anything buffered for a file.
+ *
+ * @param path the path of the file
+ *
+ * @return 0 on success, -ENOENT or -EIO
+ */
+int sync_file(const char* path){
+	file f;
+	if (do_caching(path, &f) != 0){
+		return -ENOENT;
+	}
+	return sync_id(f.meta_data_id);
+}
+
+/*
+ ***************
+	File Operations
+ ***************
+*/
+
+//What each callback does once the files it works on have been found, and
+//locked where needed. Both the path based and the inode based frontends are
+//built on these, so they only differ in how they find files.
+
+/**
+ * Fills in a stat struct from a file's meta data.
+ *
+ * @param f the file
+ * @param stbuf the stat struct its data has to be put into
+ */
+void file_stat(const file* f, struct stat* stbuf){
+	//Set all of the data in stbuf to zero
+	memset(stbuf, 0, sizeof(struct stat));
+	//Then transfer all of it to the buffer
+	stbuf->st_mode = f->mode;
+	write_log("Mode (IS DIR) %d\n", (stbuf->st_mode & S_IFMT) == S_IFDIR);
+	stbuf->st_nlink = f->number_children - 1; //Include itself
+	stbuf->st_uid = f->uid;
+	stbuf->st_gid = f->gid;
+	stbuf->st_mtime = f->mtime;
+	stbuf->st_ctime = f->ctime;
+	stbuf->st_size = f->size;
+	write_log("size: %d\n", f->size);
+}
+
+/**
+ * Lists a directory: ".", ".." and then every child by name, starting from an
+ * offset handed out by an earlier call. The caller holds the directory's lock.
+ *
+ * @param dir the directory
+ * @param offset 0 to start at the beginning, otherwise the next offset of the
+ *				last entry already listed
+ * @param fill called for each entry
+ * @param ctx handed to fill
+ *
+ * @return 0 on success, or a negative error number
+ */
+int file_readdir(file* dir, off_t offset, dir_filler fill, void* ctx){
+	//Fill the buffer with the current directory and its parent directory
+	int full = 0;
+	if (offset < 1){
+		full = fill(ctx, ".", NULL, S_IFDIR, 1);
+	}
+	if (full == 0 && offset < 2){
+		full = fill(ctx, "..", NULL, S_IFDIR, 2);
+	}
+	if (full != 0){
+		return (full < 0) ? full : 0;
+	}
+
+	//Then the children, whose offsets follow on from there
+	write_log("Number of children: %d\n", dir->number_children);
+	full = dir_iterate(dir, offset, fill, ctx);
+	if (full == -EIO){
+		log_error("Could not list %s\n", dir->path);
+	}
+	return full;
+}
+
+/**
+ * Creates a file in a directory. The caller holds the directory's lock
+ * exclusively.
+ *
+ * @param parent the directory
+ * @param name the new file's name
+ * @param mode the file's type and permissions
+ * @param uid the owner
+ * @param gid the owner's group
+ * @param out where to put the new file's meta data (may be NULL)
+ *
+ * @return 0 upon success, -ENAMETOOLONG, -EEXIST, -ENOMEM or -EIO
+ */
+int file_create(file* parent, const char* name, mode_t mode, uid_t uid, \
+								gid_t gid, file* out){
+	//The new file's path is its parent's with its name on the end
+	char path[MY_MAX_PATH];
+	if (path_join(parent->path, name, path) != 0){
+		write_log("file_create - ENAMETOOLONG");
+		return -ENAMETOOLONG;
+	}
+	write_log("Mode: %d IS FILE: %d\n", mode, S_ISREG(mode));
+
+	uuid_t existing;
+	if (dentry_lookup(parent, name, existing) == 0){
+		write_log("file_create - EEXIST\n");
+		return -EEXIST;
+	}
+
+	file* new_file = calloc(1, sizeof(file));
+	if (new_file == NULL){
+		log_error("Error mallocing!\n");
+		return -ENOMEM;
+	}
+	write_log("Parent: %s\n", parent->path);
+	//Copy the file's address to its FCB
+	strcpy(new_file->path, path);
+
+	//Generate it new UUIDs. Small files keep their data inline to begin with,
+	//so have no file_data_id.
+	if (!S_ISREG(mode) || !data_inline_enabled()){
+		uuid_generate(new_file->file_data_id);
+	}
+	uuid_generate(new_file->meta_data_id);
+	write_log("Meta ID: %x\t File ID: %x\n", new_file->file_data_id, \
+						new_file->meta_data_id);
+
+	write_log("New file with UUID: %x\n", new_file->file_data_id);
+	new_file->uid = uid;
+	new_file->gid = gid;
+	new_file->size = 0;
+	//Default permissions are: F, USER: R/W, GROUP: R/W, ALL: R
+	new_file->mode = mode;
+	new_file->number_children = REST_POS;
+	new_file->mtime = time(0);
+	new_file->ctime = time(0);
+	parent->ctime = time(0);
+	//Write the two mandatory children to it
+	memcpy(new_file->children[SELF_POS], new_file->meta_data_id, sizeof(uuid_t));
+	memcpy(new_file->children[PARENT_POS], parent->meta_data_id, sizeof(uuid_t));
+
+	//Add it to the parent's entries, and give new directories theirs.
+	//wi = write index, wc = write child, wp = write parent
+	int wi = dir_insert(parent, name, new_file->meta_data_id, mode);
+	if (wi == UNQLITE_OK){
+		dcache_appeared(path);
+	}
+	//The parent only counts it, the UUID goes in one of its pages
+	parent->number_children = parent->number_children + 1;
+	write_log("Parent has %d children\n", parent->number_children);
+	if (wi == UNQLITE_OK && S_ISDIR(mode)){
+		wi = dir_init(new_file);
+	}
+	//Its data blocks are only stored once something is written, until then its
+	//block map is empty
+	if (wi == UNQLITE_OK && S_ISREG(mode) && !file_is_inline(new_file)){
+		wi = block_map_create(new_file);
+	}
+	//Notice we are updating their META DATA.
+	int wc = store_file(new_file);
+	int wp = store_file(parent);
+	if (out != NULL){
+		memcpy(out, new_file, sizeof(file));
+	}
+	free(new_file);
+
+	//Same sanity checks - make sure writes to DB went through correctly
+	if (wi == UNQLITE_INVALID){
+		write_log("file_create - ENAMETOOLONG");
+		return -ENAMETOOLONG;
+	}else if( wc != UNQLITE_OK || wp != UNQLITE_OK || wi != UNQLITE_OK){
+		write_log("file_create - EIO. WC: %d WP: %d WI: %d\n",wc,wp, wi);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Deletes a file, or an empty directory, from its parent. The caller holds
+ * both their locks exclusively.
+ *
+ * @param parent the directory
+ * @param f the file
+ *
+ * @return 0 upon success, -ENOTEMPTY, -ENOENT or -EIO
+ */
+int file_unlink(file* parent, file* f){
+	//rmdir checks this too, but only now can nothing be added behind our back
+	if (S_ISDIR(f->mode) && f->number_children > REST_POS){
+		write_log("Directory not empty\n");
+		return -ENOTEMPTY;
+	}
+
+	//Delete that child
+	if (delete_child(parent, f) != UNQLITE_OK){
+		return -EIO;
+	}
+	write_log("\nParent (%s) now has %d children\n",parent->path, \
+						parent->number_children);
+	//Write back to DB
+	int wp = store_file(parent);
+	if (wp != UNQLITE_OK){
+		log_error("Error writing parent back to DB\n");
+		return -EIO;
+	}
+
+	//Delete.
+	//dmd = delete meta data
+	//dfd = delete file data
+	wb_discard(f->meta_data_id);
+	int dmd = kv_delete(&f->meta_data_id, KEY_SIZE);
+	int dfd = data_delete(f);
+	dcache_remove(f);
+	if (S_ISDIR(f->mode)){
+		dir_drop(f);
+	}
+
+	if (dmd != UNQLITE_OK || dfd != UNQLITE_OK){
+		write_log("DMD: %d DFD: %d\n", dmd, dfd);
+		return -EIO;
+	}
+	write_log("Deleted child from DB\n");
+	return 0;
+}
+
+/**
+ * Tells whether a directory is another one or somewhere below it, by going up
+ * through its parents.
+ *
+ * @param id the meta data UUID of the directory that may be above
+ * @param dir the directory to start from
+ *
+ * @return 1 if it is, 0 if it is not, -EIO on DB errors
+ */
+static int file_is_below(const uuid_t id, const file* dir){
+	uuid_t current;
+	memcpy(current, dir->meta_data_id, sizeof(uuid_t));
+	file* f = malloc(sizeof(file));
+	if (f == NULL){
+		return -EIO;
+	}
+	while (uuid_compare(current, id) != 0){
+		if (uuid_compare(current, root_directory->meta_data_id) == 0 || \
+				uuid_is_null(current)){
+			free(f);
+			return 0;
+		}
+		if (inode_fetch(current, f) != UNQLITE_OK){
+			free(f);
+			return -EIO;
+		}
+		memcpy(current, f->children[PARENT_POS], sizeof(uuid_t));
+	}
+	free(f);
+	return 1;
+}
+
+/**
+ * Moves a file to a new name, in the same directory or another one, replacing
+ * whatever already had that name. Only the two directories' entries and the
+ * file's own record are written; nothing below a directory that moves is
+ * touched, since records do not hold paths. The caller holds the locks of
+ * both directories, the file and whatever is replaced exclusively, and the
+ * rename lock if the directories differ.
+ *
+ * @param parent the directory the file is in
+ * @param name the file's name in it
+ * @param f the file
+ * @param new_parent the directory it is moving to (may be parent)
+ * @param new_name its new name
+ * @param target whatever new_name refers to now, or NULL
+ *
+ * @return 0 upon success, -ENAMETOOLONG, -ENOTDIR, -EISDIR, -ENOTEMPTY,
+ *				 -EINVAL or -EIO
+ */
+int file_rename(file* parent, const char* name, file* f, file* new_parent, \
+								const char* new_name, file* target){
+	//Both may have been handed in as copies of the same directory
+	if (uuid_compare(parent->meta_data_id, new_parent->meta_data_id) == 0){
+		new_parent = parent;
+	}
+	char path[MY_MAX_PATH];
+	if (path_join(new_parent->path, new_name, path) != 0){
+		return -ENAMETOOLONG;
+	}
+	if (!S_ISDIR(new_parent->mode)){
+		return -ENOTDIR;
+	}
+
+	//Check everything before changing anything
+	if (target != NULL){
+		if (uuid_compare(target->meta_data_id, f->meta_data_id) == 0){
+			return 0; //Already called that
+		}else if (S_ISDIR(target->mode) && !S_ISDIR(f->mode)){
+			return -EISDIR;
+		}else if (!S_ISDIR(target->mode) && S_ISDIR(f->mode)){
+			return -ENOTDIR;
+		}else if (S_ISDIR(target->mode) && target->number_children > REST_POS){
+			return -ENOTEMPTY;
+		}
+	}
+	if (S_ISDIR(f->mode) && new_parent != parent){
+		int below = file_is_below(f->meta_data_id, new_parent);
+		if (below != 0){
+			write_log("file_rename - %s would be inside itself\n", f->path);
+			return (below < 0) ? below : -EINVAL;
+		}
+	}
+
+	//Whatever has the new name goes, just as if it was unlinked
+	if (target != NULL){
+		int rc = file_unlink(new_parent, target);
+		if (rc != 0){
+			return rc;
+		}
+	}
+
+	//Then the file's entry moves, which clears one slot and fills another
+	int rc = dir_remove(parent, name);
+	if (rc == UNQLITE_OK){
+		rc = dir_insert(new_parent, new_name, f->meta_data_id, f->mode);
+	}
+	if (rc != UNQLITE_OK){
+		log_error("Could not move %s to %s\n", f->path, path);
+		return (rc == UNQLITE_INVALID) ? -ENAMETOOLONG : -EIO;
+	}
+	dcache_appeared(path);
+	parent->number_children = parent->number_children - 1;
+	new_parent->number_children = new_parent->number_children + 1;
+	parent->ctime = time(0);
+	new_parent->ctime = parent->ctime;
+
+	//Nothing cached under the old path is right any more
+	if (S_ISDIR(f->mode)){
+		dcache_remove_tree(f);
+	}else{
+		dcache_remove(f);
+	}
+	strcpy(f->path, path);
+	memcpy(f->children[PARENT_POS], new_parent->meta_data_id, sizeof(uuid_t));
+	f->ctime = parent->ctime;
+
+	//wf = write file, wp = write parent, wn = write new parent
+	int wf = store_file(f);
+	int wp = store_file(parent);
+	int wn = (new_parent != parent) ? store_file(new_parent) : UNQLITE_OK;
+	if (wf != UNQLITE_OK || wp != UNQLITE_OK || wn != UNQLITE_OK){
+		write_log("file_rename - EIO. WF: %d WP: %d WN: %d\n", wf, wp, wn);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Writes to a file. The caller holds its lock exclusively.
+ *
+ * @param f the file
+ * @param buf the data to be written
+ * @param size the size of the data to be written
+ * @param offset the offset
+ *
+ * @return the amount of bytes written, or -EFBIG, -ENOMEM or -EIO
+ */
+int file_write(file* f, const char* buf, size_t size, off_t offset){
+	write_log("Child size at start: %d\n", f->size);
+
+	if (offset + size > MY_MAX_FILE_SIZE){
+		write_log("file_write - EFBIG\n");
+		return -EFBIG;
+	}
+
+	// Update the fcb in-memory.
+	time_t now = time(NULL);
+	f->mtime=now;
+	f->ctime=now;
+
+	//With write-back on the write is only buffered, and the data and meta data
+	//reach the DB together when the file is flushed. Inline data is part of the
+	//meta data, so is written straight away (moving out first if it has to).
+	if (wb_enabled() && !file_is_inline(f)){
+		int written = wb_write(f, buf, size, offset);
+		write_log("Buffered write, size now: %d\n", f->size);
+		return written;
+	}
+
+	// Write the data blocks to the store.
+	int written = (wb_flush(f) == UNQLITE_OK) ? \
+								data_write(f, buf, size, offset) : -EIO;
+	if (written < 0){
+		write_log("file_write - EIO");
+		return written;
+	}
+
+	write_log("Successfully written to DB\n");
+	write_log("Current size: %d\n", f->size);
+
+	//Write metadata back to DB too
+	write_log("Meta data ID: %x\n", f->meta_data_id);
+	if (store_file(f) != UNQLITE_OK){
+		log_error("DB Error in file write\n");
+		return -EIO;
+	}
+	write_log("Successfully written meta data to DB\n");
+	return written;
+}
+
+/**
+ * Changes the size of a file. The caller holds its lock exclusively.
+ *
+ * @param f the file
+ * @param newsize the new size of the file
+ *
+ * @return 0 upon success, -EFBIG or -EIO
+ */
+int file_truncate(file* f, off_t newsize){
+	//Mustn't be larger than is allowed in size
+	if(newsize >= MY_MAX_FILE_SIZE){
+		write_log("file_truncate - EFBIG");
+		return -EFBIG;
+	}
+
+	//Buffered writes carry their own size, so get them out of the way first
+	if (wb_flush(f) != UNQLITE_OK){
+		write_log("file_truncate - EIO");
+		return -EIO;
+	}
+
+	//Anything cut off must not reappear if the file grows again
+	int dc = UNQLITE_OK;
+	if (newsize < f->size){
+		dc = data_migrate_legacy(f);
+		if (dc == UNQLITE_OK){
+			dc = data_shrink(f, newsize);
+		}
+	}else{
+		dc = data_grow(f, newsize);
+	}
+	if (dc != UNQLITE_OK){
+		write_log("file_truncate - EIO");
+		return -EIO;
+	}
+	f->size = newsize;
+
+	// Write the fcb to the store.
+	if (store_file(f) != UNQLITE_OK){
+		write_log("file_truncate - EIO");
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Allocates or deallocates part of a file, like fallocate(2). The caller holds
+ * its lock exclusively.
+ *
+ * Nothing can be reserved ahead of time in the DB, so allocating only grows
+ * the file (unless FALLOC_FL_KEEP_SIZE is given) and leaves the range a hole.
+ * FALLOC_FL_PUNCH_HOLE and FALLOC_FL_ZERO_RANGE free the blocks in the range.
+ *
+ * @param f the file
+ * @param mode 0 or a combination of FALLOC_FL_* flags
+ * @param offset where the range starts
+ * @param len how long it is
+ *
+ * @return 0 upon success, -EINVAL, -EOPNOTSUPP, -EISDIR, -ENODEV, -EFBIG or -EIO
+ */
+int file_fallocate(file* f, int mode, off_t offset, off_t len){
+	int clear = mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE);
+	if (offset < 0 || len <= 0){
+		write_log("file_fallocate - EINVAL\n");
+		return -EINVAL;
+	}
+	//A hole has to keep the size, and cannot be zeroed as well
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) \
+			|| clear == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE) \
+			|| ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))){
+		write_log("file_fallocate - EOPNOTSUPP\n");
+		return -EOPNOTSUPP;
+	}
+	if (!S_ISREG(f->mode)){
+		write_log("file_fallocate - not a regular file\n");
+		return S_ISDIR(f->mode) ? -EISDIR : -ENODEV;
+	}
+	if (offset + len >= MY_MAX_FILE_SIZE || offset + len < offset){
+		write_log("file_fallocate - EFBIG\n");
+		return -EFBIG;
+	}
+
+	//Buffered writes carry their own size, so get them out of the way first
+	int rc = wb_flush(f);
+	if (rc == UNQLITE_OK && clear){
+		rc = data_migrate_legacy(f);
+		if (rc == UNQLITE_OK){
+			rc = data_punch(f, offset, len);
+		}
+		f->mtime = time(0);
+		f->ctime = f->mtime;
+	}
+	if (rc == UNQLITE_OK && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > f->size){
+		rc = data_grow(f, offset + len);
+		f->size = offset + len;
+		f->ctime = time(0);
+	}
+
+	if (rc == UNQLITE_OK){
+		rc = store_file(f);
+	}
+	if (rc != UNQLITE_OK){
+		write_log("file_fallocate - EIO\n");
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Sets a file's modification time. The caller holds its lock exclusively.
+ *
+ * @param f the file
+ * @param mtime the new modification time
+ *
+ * @return 0 upon success, -EIO on failure
+ */
+int file_utime(file* f, time_t mtime){
+	//Buffered writes carry their own times, so get them out of the way first
+	int rc = wb_flush(f);
+
+	//Otherwise update the time
+	f->mtime = mtime;
+	//And then write to our DB
+	if (rc == UNQLITE_OK){
+		rc = store_file(f);
+	}
+	if( rc != UNQLITE_OK ){
+		write_log("file_utime - EIO");
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Changes a file's permissions. The caller holds its lock exclusively.
+ *
+ * @param f the file
+ * @param mode the new permissions
+ *
+ * @return 0 upon success, -EIO on failure
+ */
+int file_chmod(file* f, mode_t mode){
+	f->mode = mode;
+	if (store_file(f) != UNQLITE_OK){
+		write_log("file_chmod - EIO");
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Changes a file's owner. The caller holds its lock exclusively.
+ *
+ * @param f the file
+ * @param uid the user-id of the new owner
+ * @param gid the group id of the new owner
+ *
+ * @return 0 upon success, -EIO on failure
+ */
+int file_chown(file* f, uid_t uid, gid_t gid){
+	f->uid = uid;
+	f->gid = gid;
+	if (store_file(f) != UNQLITE_OK){
+		write_log("file_chown - EIO");
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Opens a file. The caller holds its lock exclusively.
+ *
+ * @param f the file
+ *
+ * @return 0 if it may be opened, -EACCES or -EIO
+ */
+int file_open(file* f){
+	//Files written before data was kept in blocks are converted on first use
+	int rc = S_ISREG(f->mode) ? data_migrate_legacy(f) : UNQLITE_OK;
+	if (rc != UNQLITE_OK){
+		log_error("Could not convert the file's data\n");
+		return -EIO;
+	}
+
+	int mode = f->mode;
+	write_log("Mode: %d\n", mode);
+	if ((mode & S_IRUSR) == S_IRUSR){
+		write_log("Permission granted!\n");
+		return 0;
+	}else{
+		write_log("Permission denied!\n");
+		return -EACCES;
+	}
+}
+
+/*
+ ***************
+	Control Files
+ ***************
+*/
+
+//The file system describes itself through a few files under /.myfs, which are
+//not kept in the DB and cannot be created, changed or deleted:
+//
+//	stats       counts and latencies (see Statistics) and cache hit rates
+//	stats.json  the same as JSON, with the raw histograms, for graphing
+//	reset       writing anything to it starts everything again from 0
+//
+//A report is put together when its file is opened, so a reader sees one
+//consistent report however it reads it. The files claim to be empty and are
+//opened with direct I/O, so that the kernel asks us for all of it. /.myfs
+//hides anything of that name that was made before it was reserved.
+#define CTL_NAME ".myfs"
+
+//Which of the files a path or inode number is
+#define CTL_NONE 0
+#define CTL_DIR 1
+#define CTL_STATS 2
+#define CTL_JSON 3
+#define CTL_RESET 4
+#define CTL_NODES 5
+
+//The low level frontend gives them the inode numbers just after the root's
+#define CTL_INO(node) (FUSE_ROOT_ID + (node))
+
+static const char* ctl_names[CTL_NODES] = {NULL, CTL_NAME, "stats", "stats.json", \
+																					 "reset"};
+
+//What the caches had counted when everything was last reset
+typedef struct ctl_counts {
+	uint64_t dcache_hits;
+	uint64_t dcache_misses;
+	uint64_t missing_hits;
+	uint64_t missing_misses;
+	uint64_t ra_prefetched;
+	uint64_t ra_hits;
+	uint64_t ra_misses;
+} ctl_counts;
+
+static pthread_mutex_t ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static ctl_counts ctl_base;
+static time_t ctl_reset_time = 0;
+
+//A report, as handed out to one open file
+typedef struct ctl_report {
+	size_t len;
+	size_t room;
+	char* text;
+} ctl_report;
+
+/**
+ * @return which of the files a path is, or CTL_NONE
+ */
+int ctl_node(const char* path){
+	char name[MY_MAX_PATH];
+	if (normalise_path(path, name) != 0 || strncmp(name, "/" CTL_NAME, \
+																								sizeof(CTL_NAME)) != 0){
+		return CTL_NONE;
+	}
+	const char* rest = name + sizeof(CTL_NAME);
+	if (*rest == '\0'){
+		return CTL_DIR;
+	}
+	for (int node = CTL_STATS; *rest == '/' && node < CTL_NODES; node++){
+		if (strcmp(rest + 1, ctl_names[node]) == 0){
+			return node;
+		}
+	}
+	return CTL_NONE;
+}
+
+/**
+ * @return non-0 if a path is /.myfs or anything in it, which nothing may
+ *				 create, change or delete
+ */
+int ctl_reserved(const char* path){
+	char name[MY_MAX_PATH];
+	return normalise_path(path, name) == 0 && \
+				 strncmp(name, "/" CTL_NAME, sizeof(CTL_NAME)) == 0 && \
+				 (name[sizeof(CTL_NAME)] == '\0' || name[sizeof(CTL_NAME)] == '/');
+}
+
+/**
+ * @return which of the files an inode number is, or CTL_NONE
+ */
+int ctl_node_ino(fuse_ino_t ino){
+	return (ino > FUSE_ROOT_ID && ino < CTL_INO(CTL_NODES)) ? \
+				 (int)(ino - FUSE_ROOT_ID) : CTL_NONE;
+}
+
+/**
+ * Finds a file by the directory it is in, for the low level frontend.
+ *
+ * @param parent the directory's inode number
+ * @param name the file's name
+ *
+ * @return which of the files it is, or CTL_NONE
+ */
+int ctl_child(fuse_ino_t parent, const char* name){
+	if (parent == FUSE_ROOT_ID){
+		return (strcmp(name, CTL_NAME) == 0) ? CTL_DIR : CTL_NONE;
+	}
+	for (int node = CTL_STATS; parent == CTL_INO(CTL_DIR) && node < CTL_NODES; \
+																																node++){
+		if (strcmp(name, ctl_names[node]) == 0){
+			return node;
+		}
+	}
+	return CTL_NONE;
+}
+
+/**
+ * Describes one of the files. They belong to whoever mounted the file system.
+ */
+void ctl_stat(int node, struct stat* st){
+	memset(st, 0, sizeof(struct stat));
+	if (node == CTL_DIR){
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	}else{
+		st->st_mode = S_IFREG | ((node == CTL_RESET) ? 0200 : 0444);
+		st->st_nlink = 1;
+	}
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mtime = ctl_reset_time;
+	st->st_ctime = ctl_reset_time;
+}
+
+/**
+ * Lists /.myfs, like file_readdir().
+ */
+int ctl_readdir(off_t offset, dir_filler fill, void* ctx){
+	const char* names[CTL_NODES] = {".", "..", ctl_names[CTL_STATS], \
+																	ctl_names[CTL_JSON], ctl_names[CTL_RESET]};
+	for (off_t at = offset; at < CTL_NODES; at++){
+		mode_t type = (at < 2) ? S_IFDIR : S_IFREG;
+		if (fill(ctx, names[at], NULL, type, at + 1)){
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Gets what the caches have counted since mounting.
+ */
+static void ctl_counts_now(ctl_counts* c){
+	dcache_stats(&c->dcache_hits, &c->dcache_misses);
+	dcache_missing_stats(&c->missing_hits, &c->missing_misses);
+	ra_stats(&c->ra_prefetched, &c->ra_hits, &c->ra_misses);
+}
+
+/**
+ * Starts every count again from 0.
+ */
+void ctl_reset(){
+	pthread_mutex_lock(&ctl_lock);
+	stats_reset();
+	ctl_counts_now(&ctl_base);
+	ctl_reset_time = time(NULL);
+	pthread_mutex_unlock(&ctl_lock);
+}
+
+static void ctl_printf(ctl_report* r, const char* format, ...){
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(r->text + r->len, r->room - r->len, format, ap);
+	va_end(ap);
+	if (len >= 0 && r->len + len >= r->room){
+		size_t room = (r->room + len) * 2;
+		char* text = realloc(r->text, room);
+		if (text == NULL){
+			return;
+		}
+		r->text = text;
+		r->room = room;
+		va_start(ap, format);
+		vsnprintf(r->text + r->len, r->room - r->len, format, ap);
+		va_end(ap);
+	}
+	r->len += (len > 0) ? len : 0;
+}
+
+static double ctl_rate(uint64_t hits, uint64_t misses){
+	return (hits + misses > 0) ? (double)hits / (hits + misses) : 0;
+}
+
+/**
+ * Puts a report together.
+ *
+ * @param json non-0 for JSON, 0 for text
+ *
+ * @return the report, or NULL if there is no memory for it
+ */
+static ctl_report* ctl_report_new(int json){
+	ctl_report* r = malloc(sizeof(ctl_report));
+	stats_counter* ops = malloc(STATS_OPS * sizeof(stats_counter));
+	if (r != NULL){
+		r->len = 0;
+		r->room = 8192;
+		r->text = malloc(r->room);
+	}
+	if (r == NULL || r->text == NULL || ops == NULL){
+		if (r != NULL){
+			free(r->text);
+		}
+		free(r);
+		free(ops);
+		return NULL;
+	}
+
+	ctl_counts c;
+	pthread_mutex_lock(&ctl_lock);
+	stats_snapshot(ops);
+	ctl_counts_now(&c);
+	for (size_t i = 0; i < sizeof(ctl_counts) / sizeof(uint64_t); i++){
+		((uint64_t*)&c)[i] -= ((uint64_t*)&ctl_base)[i];
+	}
+	pthread_mutex_unlock(&ctl_lock);
+
+	if (json){
+		ctl_printf(r, "{\"since\": %lld, \"ops\": {", (long long)ctl_reset_time);
+	}else{
+		ctl_printf(r, "%-10s %10s %8s %14s %10s %10s %10s %10s\n", "op", "count", \
+							 "errors", "bytes", "avg_us", "p50_us", "p90_us", "p99_us");
+	}
+	int listed = 0;
+	for (int op = 0; op < STATS_OPS; op++){
+		stats_counter* s = &ops[op];
+		double avg = (s->count > 0) ? (double)s->ns / s->count : 0;
+		if (json){
+			ctl_printf(r, "%s\"%s\": {\"count\": %llu, \"errors\": %llu, " \
+								 "\"bytes\": %llu, \"total_ns\": %llu, \"p50_ns\": %.0f, " \
+								 "\"p90_ns\": %.0f, \"p99_ns\": %.0f, \"buckets\": [", \
+								 (op > 0) ? ", " : "", stats_names[op], \
+								 (unsigned long long)s->count, (unsigned long long)s->errors, \
+								 (unsigned long long)s->bytes, (unsigned long long)s->ns, \
+								 stats_percentile(s, 0.5), stats_percentile(s, 0.9), \
+								 stats_percentile(s, 0.99));
+			for (int i = 0; i < STATS_BUCKETS; i++){
+				ctl_printf(r, "%s%llu", (i > 0) ? ", " : "", \
+									 (unsigned long long)s->buckets[i]);
+			}
+			ctl_printf(r, "]}");
+		}else if (s->count > 0){
+			ctl_printf(r, "%-10s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f\n", \
+								 stats_names[op], (unsigned long long)s->count, \
+								 (unsigned long long)s->errors, (unsigned long long)s->bytes, \
+								 avg / 1000, stats_percentile(s, 0.5) / 1000, \
+								 stats_percentile(s, 0.9) / 1000, \
+								 stats_percentile(s, 0.99) / 1000);
+			listed++;
+		}
+	}
+
+	//The caches, by what they hold
+	const char* caches[3] = {"dentry", "missing", "readahead"};
+	uint64_t hits[3] = {c.dcache_hits, c.missing_hits, c.ra_hits};
+	uint64_t misses[3] = {c.dcache_misses, c.missing_misses, c.ra_misses};
+	if (json){
+		ctl_printf(r, "}, \"caches\": {");
+		for (int i = 0; i < 3; i++){
+			ctl_printf(r, "%s\"%s\": {\"hits\": %llu, \"misses\": %llu}", \
+								 (i > 0) ? ", " : "", caches[i], (unsigned long long)hits[i], \
+								 (unsigned long long)misses[i]);
+		}
+		ctl_printf(r, "}, \"blocks_read_ahead\": %llu}\n", \
+							 (unsigned long long)c.ra_prefetched);
+	}else{
+		if (listed == 0){
+			ctl_printf(r, "(nothing yet)\n");
+		}
+		ctl_printf(r, "\n%-10s %10s %10s %10s\n", "cache", "hits", "misses", \
+							 "hit_rate");
+		for (int i = 0; i < 3; i++){
+			ctl_printf(r, "%-10s %10llu %10llu %9.1f%%\n", caches[i], \
+								 (unsigned long long)hits[i], (unsigned long long)misses[i], \
+								 ctl_rate(hits[i], misses[i]) * 100);
+		}
+		ctl_printf(r, "\n%llu blocks read ahead\n", \
+							 (unsigned long long)c.ra_prefetched);
+	}
+	free(ops);
+	return r;
+}
+
+/**
+ * Opens one of the files. The stats files are read only and reset is write
+ * only.
+ *
+ * @param node which file
+ * @param flags the open(2) flags
+ * @param report set to the report to read, if it is a stats file
+ *
+ * @return 0 on success, or a negative error number
+ */
+int ctl_open(int node, int flags, ctl_report** report){
+	int mode = flags & O_ACCMODE;
+	*report = NULL;
+	if (node == CTL_RESET){
+		return (mode == O_WRONLY) ? 0 : -EACCES;
+	}else if (node == CTL_DIR || mode != O_RDONLY){
+		return -EACCES;
+	}
+	ctl_report* r = ctl_report_new(node == CTL_JSON);
+	if (r == NULL){
+		return -ENOMEM;
+	}
+	*report = r;
+	return 0;
+}
+
+/**
+ * Reads an open stats file.
+ *
+ * @return how many bytes were read
+ */
+int ctl_read(const ctl_report* r, char* buf, size_t size, off_t offset){
+	if (r == NULL || offset >= (off_t)r->len){
+		return 0;
+	}
+	size = (offset + size > r->len) ? r->len - offset : size;
+	memcpy(buf, r->text + offset, size);
+	return size;
+}
+
+/**
+ * Writes to one of the files, which only reset allows.
+ *
+ * @return how many bytes were written, or -EACCES
+ */
+int ctl_write(int node, size_t size){
+	if (node != CTL_RESET){
+		return -EACCES;
+	}
+	ctl_reset();
+	return size;
+}
+
+/**
+ * Frees a report once the file it was opened for is closed.
+ */
+void ctl_report_free(ctl_report* r){
+	if (r != NULL){
+		free(r->text);
+		free(r);
+	}
+}
+
+/*
+ ***************
+	Open Files
+ ***************
+*/
+
+//What a file keeps while it is open, in the fh of its fuse_file_info. It is
+//found by its meta data UUID from then on, so reading and writing it does not
+//look its path up again, however deep it is, and it stays the same file if it
+//is renamed meanwhile.
+typedef struct open_file {
+	uuid_t id;
+	int ctl; //Which control file it is, or CTL_NONE
+	ctl_report* report; //What a stats file was opened with
+	ra_stream* ra;
+	uint64_t errseq; //The failed commits fsync has reported to it
+} open_file;
+
+/**
+ * Sets up an open file.
+ *
+ * @param id the file's meta data UUID (ignored for control files)
+ * @param ctl which control file it is, or CTL_NONE
+ *
+ * @return the open file, or NULL if there is no memory for it
+ */
+open_file* open_file_new(const uuid_t id, int ctl){
+	open_file* of = calloc(1, sizeof(open_file));
+	if (of == NULL){
+		return NULL;
+	}
+	of->ctl = ctl;
+	of->errseq = txn_errseq_sample();
+	if (ctl == CTL_NONE){
+		memcpy(of->id, id, sizeof(uuid_t));
+		of->ra = ra_stream_new();
+	}
+	return of;
+}
+
+void open_file_free(open_file* of){
+	if (of != NULL){
+		ctl_report_free(of->report);
+		ra_stream_free(of->ra);
+		free(of);
+	}
+}
+
+/**
+ * @return the open file a callback was handed, or NULL if there is none
+ */
+open_file* open_file_of(const struct fuse_file_info* fi){
+	return (fi != NULL) ? (open_file*)(uintptr_t)fi->fh : NULL;
+}
+
+/**
+ * @return the failed commits an open file has been told about, for
+ *				 txn_end_fsync(), or NULL if there is no open file
+ */
+uint64_t* open_file_errseq(open_file* of){
+	return (of != NULL) ? &of->errseq : NULL;
+}
+
+/**
+ * Gets an open file's meta data and locks it, from the dentry cache if it is
+ * there, and otherwise with a single fetch.
+ *
+ * @param of the open file
+ * @param out where to place the file
+ * @param exclusive non-0 to lock for writing
+ *
+ * @return the lock index, to be handed to inode_unlock(), or -ENOENT/-EIO
+ */
+int open_file_get(const open_file* of, file* out, int exclusive){
+	int lock = inode_lock(of->id, exclusive);
+	if (dcache_get_by_id(of->id, out) == 0){
+		wb_overlay(out);
+		return lock;
+	}
+	int rc = inode_get(of->id, out);
+	if (rc != 0){
+		inode_unlock(lock);
+		return rc;
+	}
+	return lock;
+}
+
+/*
+ *************************
+	Myfs System Call Methods
+ *************************
+*/
+
+/**
+ * Finds the file a callback is about and locks it: through the open file it
+ * was handed if there is one, and by its path if not.
+ *
+ * @return the lock index, to be handed to inode_unlock(), or -ENOENT/-EIO
+ */
+static int open_or_lookup(const char* path, struct fuse_file_info* fi, \
+													file* out, int exclusive){
+	open_file* of = open_file_of(fi);
+	return (of != NULL) ? open_file_get(of, out, exclusive) : \
+												lookup_locked(path, out, exclusive);
+}
+
+// Get file and directory attributes (meta-data).
+// Read 'man 2 stat' and 'man 2 chmod'.
+/**
+ * Gets the attributes of a file (its inode)
+ * @param path the path of the file
+ * @param stbuf the stat struct its data has to be put into
+ * @return 0 on success, non-0 on failure
+ */
+static int myfs_getattr(const char *path, struct stat* stbuf){
+	write_log("\n== ATTEMPTING GETATTR ==\n");
+	write_log("myfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
+
+	//Anything else under /.myfs is hidden by it
+	if (ctl_reserved(path)){
+		int node = ctl_node(path);
+		if (node == CTL_NONE){
+			return -ENOENT;
+		}
+		ctl_stat(node, stbuf);
+		return 0;
+	}
+
+	//Attempt caching.
+	file f;
+	if (do_caching(path, &f) == -ENOENT){
+		write_log("Getattr file not found\n");
+		return -ENOENT;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	file_stat(&f, stbuf);
+	return 0;
+}
+
+//What myfs_readdir() hands to file_readdir()
+typedef struct readdir_ctx {
+	void* buf;
+	fuse_fill_dir_t filler;
+} readdir_ctx;
+
+//The filler is used in its offset mode, so that a listing too big for one
+//buffer carries on from where it stopped, and the type goes in so that
+//callers like ls and find need not stat every entry.
+static int readdir_fill(void* ctx, const char* name, const unsigned char* child, \
+												mode_t type, off_t next){
+	(void) child;
+	readdir_ctx* rd = ctx;
+	struct stat st;
+	memset(&st, 0, sizeof(struct stat));
+	st.st_mode = type;
+	return rd->filler(rd->buf, name, &st, next);
 }
 
 // Read a directory.
 // Read 'man 2 readdir'.
 /**
- * Reads a file path into the buffer
- * @param path the file path to be read into the buffer
- * @param buf the buffer where this data should be stored
- * @param filler the function that writes data into the buffer
- * @param offset the offset compared to the base address
- * @param fi information on the state of the open files
- * @return 0 on success, non-zero on failure
+ * Reads a file path into the buffer
+ * @param path the file path to be read into the buffer
+ * @param buf the buffer where this data should be stored
+ * @param filler the function that writes data into the buffer
+ * @param offset the offset compared to the base address
+ * @param fi information on the state of the open files
+ * @return 0 on success, non-zero on failure
+ */
+static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, \
+												off_t offset, struct fuse_file_info *fi)
+{
+	write_log("\n== ATTEMPTING READDIR ==\n");
+	//Cast our inputs to void because these parameters are not needed yet
+	(void) fi;
+	//Logging
+	write_log("myfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, \
+	offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
+
+	readdir_ctx rd = {buf, filler};
+	int node = ctl_node(path);
+	if (node != CTL_NONE){
+		return (node == CTL_DIR) ? ctl_readdir(offset, readdir_fill, &rd) : -ENOTDIR;
+	}
+
+	//Find the directory and lock it, so that its listing cannot change under us
+	file f;
+	int lock = lookup_locked(path, &f, 0);
+	if (lock < 0){
+		write_log("Getattr file not found");
+		return -ENOENT;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	int rc = file_readdir(&f, offset, readdir_fill, &rd);
+	inode_unlock(lock);
+	write_log("readdir terminated \n");
+	return rc;
+}
+
+// Read a file.
+// Read 'man 2 read'.
+/**
+ * Reads a file into memory
+ * @param path the file path
+ * @param buf the buffer it has to be stored in.
+ * @param the size of the buffer to be read into
+ * @param the offset to where it should be stored in memory
+ * @parm fi information on the state of the open files
+ * @return the number of bytes read into memory
+ */
+static int myfs_read(const char *path, char *buf, size_t size, off_t offset, \
+	 										struct fuse_file_info *fi)
+{
+	write_log("\n== ATTEMPTING READ ==\n");
+	//Logging
+	write_log("myfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, \
+	 						fi=0x%08x)\n", path, buf, size, offset, fi);
+
+	open_file* of = open_file_of(fi);
+	if (((of != NULL) ? of->ctl : ctl_node(path)) != CTL_NONE){
+		return ctl_read((of != NULL) ? of->report : NULL, buf, size, offset);
+	}
+
+	//Find the file and lock it
+	file f;
+	int lock = open_or_lookup(path, fi, &f, 0);
+	if (lock < 0){
+		write_log("Getattr file not found");
+		return lock;
+	}
+	write_log("File should be cached: %s\n", f.path);
+	write_log("File size: %d\n", f.size);
+
+	//Only the blocks covering the requested range are fetched, unless they
+	//were read ahead
+	int read = data_read(&f, buf, size, offset, (of != NULL) ? of->ra : NULL);
+	inode_unlock(lock);
+	return read;
+}
+
+/**
+* Creates a file at a specified location
+* @param path the path where the file should be located at
+* @param the mode affiliated with this file
+* @param fi information on the state of the open files
+* @return 0 upon success, non-zero upon failure
+*/
+static int myfs_create(const char *path, mode_t mode, \
+												struct fuse_file_info *fi)
+{
+	write_log("\n== ATTEMPTING CREATE ==\n");
+  write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
+
+	//If the path length is too long
+	int pathlen = strlen(path);
+	if(pathlen>=MY_MAX_PATH){
+		write_log("myfs_create - ENAMETOOLONG");
+		return -ENAMETOOLONG;
+	}
+	if (ctl_reserved(path)){
+		return -EPERM;
+	}
+	//Find path excluding name
+	char file_dir[MY_MAX_PATH];
+	traverse_to_folder(path, file_dir); //Get us its parent's address
+	write_log("Folder found %s\n",file_dir);
+
+	file* parent = malloc(sizeof(file));
+	if (parent == NULL){
+		log_error("Error mallocing!\n");
+		return -ENOMEM;
+	}
+
+	//Its parent should be a directory and thus we want its meta data. The
+	//dentry cache usually has it already. Holding the parent's lock keeps
+	//anyone else from changing its children until we are done.
+	int lock = lookup_locked(file_dir, parent, 1);
+	if (lock < 0){
+		write_log("myfs create directory (parent) not found\n");
+		free(parent);
+		return -ENOENT;
+	}
+	write_log("Parent: %s\n", parent->path);
+
+	//Context of invoking user
+	struct fuse_context* context = fuse_get_context();
+	//The new file's record can go in the parent's buffer once it is stored
+	int rc = file_create(parent, path_name(path), mode, context->uid, \
+											 context->gid, parent);
+	inode_unlock(lock);
+	if (rc == 0 && fi != NULL){
+		open_file* of = open_file_new(parent->meta_data_id, CTL_NONE);
+		fi->fh = (uintptr_t)of;
+		rc = (of != NULL) ? 0 : -ENOMEM;
+	}
+	//Housekeeping
+	free(parent);
+  return rc;
+}
+
+// Set update the times (actime, modtime) for a file.
+// This FS only supports modtime. (So far)
+// Read 'man 2 utime'.
+/**
+ * Updates the time attributes of a file
+ * @param path the file
+ * @param ubuf the utimbuf struct with the time data
+ * @return 0 on success, non-zero on failure
+ */
+static int myfs_utime(const char *path, struct utimbuf *ubuf){
+	write_log("\n== ATTEMPTING UTIME ==\n");
+  write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+
+	if (ctl_reserved(path)){
+		return -EPERM;
+	}
+
+	//Find the file and lock it
+	file f;
+	int lock = lookup_locked(path, &f, 1);
+	if (lock < 0){
+		write_log("utime file not found");
+		return -ENOENT;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	int rc = file_utime(&f, ubuf->modtime);
+	inode_unlock(lock);
+  return rc;
+}
+
+/**
+ * Gets the data that a write_buf callback was given as one run of memory. It
+ * is used where it is if it already is one, which it is unless the kernel
+ * spliced it into a pipe, so it is copied once at most.
+ *
+ * @param bufv the data
+ * @param size set to how long it is
+ * @param owned set to what the caller frees once it is written (or NULL)
+ *
+ * @return the data, or NULL if there is no memory for it
+ */
+const char* bufvec_flatten(struct fuse_bufvec* bufv, size_t* size, \
+													 char** owned){
+	*owned = NULL;
+	if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)){
+		*size = bufv->buf[0].size;
+		return bufv->buf[0].mem;
+	}
+	*size = fuse_buf_size(bufv);
+	*owned = malloc((*size > 0) ? *size : 1);
+	if (*owned == NULL){
+		return NULL;
+	}
+	struct fuse_bufvec flat = FUSE_BUFVEC_INIT(*size);
+	flat.buf[0].mem = *owned;
+	ssize_t copied = fuse_buf_copy(&flat, bufv, 0);
+	if (copied < 0){
+		free(*owned);
+		*owned = NULL;
+		return NULL;
+	}
+	*size = copied;
+	return *owned;
+}
+
+// Write to a file.
+// Read 'man 2 write'
+/**
+ * Writes data to memory.
+ * @param path the path to be written to
+ * @param buf the data to be written
+ * @param size the size of the data to be written
+ * @param offset the offset
+ * @return the amount of bytes written to disk
+ */
+static int myfs_write(const char* path, const char *buf, size_t size, \
+	 										off_t offset, struct fuse_file_info *fi)
+{
+	write_log("\n=== ATTEMPTING WRITE ===\n");
+  write_log("myfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, \
+	fi=0x%08x)\n", path, buf, size, offset, fi);
+
+	open_file* of = open_file_of(fi);
+	int node = (of != NULL) ? of->ctl : ctl_node(path);
+	if (node != CTL_NONE){
+		return ctl_write(node, size);
+	}
+
+	//Find the file and lock it
+	file f;
+	int lock = open_or_lookup(path, fi, &f, 1);
+	if (lock < 0){
+		write_log("Getattr file not found");
+		return lock;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	int written = file_write(&f, buf, size, offset);
+	inode_unlock(lock);
+  return written;
+}
+
+/**
+ * Writes data to a file straight from the buffers FUSE read it into, so that
+ * it is not copied before it is written.
+ * @param path the path to be written to
+ * @param bufv the data to be written
+ * @param offset the offset
+ * @param fi information on the state of the open file
+ * @return the amount of bytes written to disk
+ */
+static int myfs_write_buf(const char* path, struct fuse_bufvec *bufv, \
+													off_t offset, struct fuse_file_info *fi)
+{
+	size_t size;
+	char* owned;
+	const char* buf = bufvec_flatten(bufv, &size, &owned);
+	if (buf == NULL){
+		return -ENOMEM;
+	}
+	int written = myfs_write(path, buf, size, offset, fi);
+	free(owned);
+	return written;
+}
+
+// Set the size of a file.
+// Read 'man 2 truncate'.
+/**
+ * Makes a file a requested size smaller
+ * @param path the file
+ * @param newsize the new size of the file
+ * @return 0 upon success, non-zero upon failure
+ */
+int myfs_truncate(const char *path, off_t newsize){
+	write_log("\n== ATTEMPTING TRUNCATE ==\n");
+  write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
+
+	//Shells truncate what they redirect into, so reset lets them
+	int node = ctl_node(path);
+	if (node != CTL_NONE){
+		return (node == CTL_RESET) ? 0 : -EACCES;
+	}
+
+	//Find the file and lock it
+	file f;
+	int lock = lookup_locked(path, &f, 1);
+	if (lock < 0){
+		write_log("Getattr file not found");
+		return -ENOENT;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	int rc = file_truncate(&f, newsize);
+	inode_unlock(lock);
+	return rc;
+}
+
+/**
+ * Allocates or deallocates part of a file, eg: punching a hole in it.
+ * Read 'man 2 fallocate'.
+ *
+ * @param path the file
+ * @param mode 0 or a combination of FALLOC_FL_* flags
+ * @param offset where the range starts
+ * @param len how long it is
+ * @param fi the file info
+ *
+ * @return 0 upon success, non-zero upon failure
+ */
+int myfs_fallocate(const char *path, int mode, off_t offset, off_t len, \
+									 struct fuse_file_info *fi){
+	write_log("myfs_fallocate(path=\"%s\", mode=%d, offset=%lld, len=%lld)\n", \
+						path, mode, offset, len);
+
+	open_file* of = open_file_of(fi);
+	if ((of != NULL) ? of->ctl != CTL_NONE : ctl_reserved(path)){
+		return -EPERM;
+	}
+
+	//Find the file and lock it
+	file f;
+	int lock = open_or_lookup(path, fi, &f, 1);
+	if (lock < 0){
+		write_log("fallocate file not found");
+		return lock;
+	}
+
+	int rc = file_fallocate(&f, mode, offset, len);
+	inode_unlock(lock);
+	return rc;
+}
+
+/**
+ * Update's this file's permissions.
+ * @param path the path of the file
+ * @param mode the new permissions
+ * @return 0 upon success, non-zero upon failure
+ */
+int myfs_chmod(const char *path, mode_t mode){
+	write_log("\n== ATTEMPTING CHMOD ==");
+  write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+
+	if (ctl_reserved(path)){
+		return -EPERM;
+	}
+
+	//Find the file and lock it
+	file f;
+	int lock = lookup_locked(path, &f, 1);
+	if (lock < 0){
+		write_log("chmod file not found");
+		return -ENOENT;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	int rc = file_chmod(&f, mode);
+	inode_unlock(lock);
+  return rc;
+}
+
+// Set ownership.
+/**
+ * Changes the ownership of a file.
+ *
+ * @param path where the file is located
+ * @param uid the user-id of the new owner
+ * @param gid the group id of the new owner
+ */
+int myfs_chown(const char *path, uid_t uid, gid_t gid){
+	write_log("== ATTEMPTING CHOWN ==");
+  write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
+
+	if (ctl_reserved(path)){
+		return -EPERM;
+	}
+
+	//Find the file and lock it
+	file f;
+	int lock = lookup_locked(path, &f, 1);
+	if (lock < 0){
+		write_log("chown file not found");
+		return -ENOENT;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	int rc = file_chown(&f, uid, gid);
+	inode_unlock(lock);
+	return rc;
+}
+
+// Create a directory.
+/**
+ * Creates a new directory
+ *
+ * @param path where to locate the file at
+ * @param mode the permissions for the file
+ */
+int myfs_mkdir(const char *path, mode_t mode){
+	//The trick here is that creating an empty file and creating a directory are
+	//the exact same operation but with different permissions. It isn't until
+	//you do something with the file/directory that things actually differ.
+	write_log("\n== ATTEMPTING MKDIR ==\n");
+	write_log("myfs_mkdir: %s\n",path);
+	return myfs_create(path, mode|S_IFDIR, NULL);
+}
+
+/**
+ * Deletes a file.
+ *
+ * @param path the file to be deleted
+ *
+ */
+int myfs_unlink(const char* path){
+	write_log("\n== ATTEMPTING UNLINK ==\n");
+	write_log("myfs_unlink: %s\n",path);
+	if (ctl_reserved(path)){
+		return -EPERM;
+	}
+	//NOTICE: We do not implement symlinks in this file system.
+	char file_dir[MY_MAX_PATH];
+	char parent_path[MY_MAX_PATH];
+	if (normalise_path(path, parent_path) != 0){
+		return -ENOENT;
+	}
+	traverse_to_folder(parent_path, file_dir);
+	normalise_path(file_dir, parent_path);
+
+	//Create space for parent
+	file f;
+	file* parent = malloc(sizeof(file));
+	if(parent == NULL) {
+		log_error("myfs_unlink- malloc failed\n");
+		return -ENOMEM;
+	}
+
+	//Lock the parent and the child, then make sure that neither of them changed
+	//while we were waiting for the locks.
+	int parent_lock, child_lock;
+	uuid_t parent_id, child_id;
+	for (;;){
+		if (do_caching(parent_path, parent) != 0 || do_caching(path, &f) != 0){
+			write_log("unlink file not found");
+			free(parent);
+			return -ENOENT;
+		}
+		memcpy(parent_id, parent->meta_data_id, sizeof(uuid_t));
+		memcpy(child_id, f.meta_data_id, sizeof(uuid_t));
+		inode_lock_pair(parent_id, child_id, &parent_lock, &child_lock);
+
+		if (do_caching(parent_path, parent) == 0 && do_caching(path, &f) == 0 && \
+				uuid_compare(parent->meta_data_id, parent_id) == 0 && \
+				uuid_compare(f.meta_data_id, child_id) == 0){
+			break;
+		}
+		inode_unlock_pair(parent_lock, child_lock);
+	}
+	write_log("Loaded parent with path: %s\n", parent->path);
+
+	int rc = file_unlink(parent, &f);
+	inode_unlock_pair(parent_lock, child_lock);
+	free(parent);
+  return rc;
+}
+
+// Delete a directory.
+/**
+ * Deletes a directory.
+ *
+ * @param path the path of the directory
+ *
+ */
+int myfs_rmdir(const char *path){
+	//Once again, observer that deleting a file and deleting an empty directory
+	//are virtually the same thing. By making our logical in unlink a tiny bit
+	//more complex (doing 1 check to see if it is a file or a directory and doing
+	//one change base upon it) can save us from having 100s of lines of
+	//duplicated code. A discussion of why this isn't refactored into its own
+	//method is in the report.
+	write_log("\n==ATTEMPTING RMDIR==\n");
+	write_log("myfs_rmdir: %s\n",path);
+	if (ctl_reserved(path)){
+		return -EPERM;
+	}
+	//Attempt caching.
+	file f;
+	if (do_caching(path, &f) == -ENOENT){
+		write_log("unlink file not found");
+		return -ENOENT;
+	}
+
+	write_log("File should be cached: %s\n", f.path);
+	if (!S_ISDIR(f.mode)){
+		write_log("Not a directory\n");
+		return -ENOTDIR;
+	}
+
+	if (f.number_children > REST_POS){
+		write_log("Directory not empty\n");
+		return -ENOTEMPTY;
+	}
+
+	//Otherwise remove as if it was a regular file
+	return myfs_unlink(path);
+}
+
+/**
+ * Renames a file, replacing whatever was at the new path.
+ *
+ * @param from the file's path
+ * @param to its new path
+ *
+ * @return 0 upon success, or a negative error number
  */
-static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, \
-												off_t offset, struct fuse_file_info *fi)
-{
-	write_log("\n== ATTEMPTING READDIR ==\n");
-	//Cast our inputs to void because these parameters are not needed yet
-	(void) offset;
-	(void) fi;
-	//Logging
-	write_log("myfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, \
-	offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
+int myfs_rename(const char* from, const char* to){
+	write_log("\n== ATTEMPTING RENAME ==\n");
+	write_log("myfs_rename: %s -> %s\n", from, to);
+	if (ctl_reserved(from) || ctl_reserved(to)){
+		return -EPERM;
+	}
+	char old_path[MY_MAX_PATH], new_path[MY_MAX_PATH];
+	char old_dir[MY_MAX_PATH], new_dir[MY_MAX_PATH];
+	char file_dir[MY_MAX_PATH];
+	if (normalise_path(from, old_path) != 0){
+		return -ENOENT;
+	}
+	if (normalise_path(to, new_path) != 0){
+		return -ENAMETOOLONG;
+	}
+	if (strcmp(old_path, "/") == 0 || strcmp(new_path, "/") == 0){
+		return -EBUSY;
+	}
+	//A directory cannot be moved inside itself
+	size_t old_len = strlen(old_path);
+	if (strncmp(new_path, old_path, old_len) == 0 && new_path[old_len] == '/'){
+		return -EINVAL;
+	}
+	traverse_to_folder(old_path, file_dir);
+	normalise_path(file_dir, old_dir);
+	traverse_to_folder(new_path, file_dir);
+	normalise_path(file_dir, new_dir);
+
+	//The parents, and whatever is at the new path
+	file f;
+	file* dirs = malloc(3 * sizeof(file));
+	if (dirs == NULL){
+		log_error("myfs_rename - malloc failed\n");
+		return -ENOMEM;
+	}
+	file* parent = &dirs[0];
+	file* new_parent = &dirs[1];
+	file* target = &dirs[2];
+
+	int moving = strcmp(old_dir, new_dir) != 0;
+	if (moving){
+		pthread_mutex_lock(&rename_lock);
+	}
+
+	//Lock everything involved, then make sure that none of it changed while we
+	//were waiting for the locks.
+	int locks[4];
+	int taken;
+	int has_target;
+	uuid_t ids[4];
+	for (;;){
+		if (do_caching(old_dir, parent) != 0 || do_caching(new_dir, new_parent) != 0 \
+				|| do_caching(old_path, &f) != 0){
+			write_log("rename file not found");
+			if (moving){
+				pthread_mutex_unlock(&rename_lock);
+			}
+			free(dirs);
+			return -ENOENT;
+		}
+		has_target = do_caching(new_path, target) == 0;
+		memcpy(ids[0], parent->meta_data_id, sizeof(uuid_t));
+		memcpy(ids[1], new_parent->meta_data_id, sizeof(uuid_t));
+		memcpy(ids[2], f.meta_data_id, sizeof(uuid_t));
+		memcpy(ids[3], target->meta_data_id, sizeof(uuid_t));
+		const unsigned char* lock_ids[4] = {ids[0], ids[1], ids[2], ids[3]};
+		taken = inode_lock_set(lock_ids, has_target ? 4 : 3, locks);
+
+		if (do_caching(old_dir, parent) == 0 && do_caching(new_dir, new_parent) == 0 \
+				&& do_caching(old_path, &f) == 0 && \
+				(do_caching(new_path, target) == 0) == has_target && \
+				uuid_compare(parent->meta_data_id, ids[0]) == 0 && \
+				uuid_compare(new_parent->meta_data_id, ids[1]) == 0 && \
+				uuid_compare(f.meta_data_id, ids[2]) == 0 && \
+				(!has_target || uuid_compare(target->meta_data_id, ids[3]) == 0)){
+			break;
+		}
+		inode_unlock_set(locks, taken);
+	}
+
+	int rc = file_rename(parent, path_name(old_path), &f, new_parent, \
+											 path_name(new_path), has_target ? target : NULL);
+	inode_unlock_set(locks, taken);
+	if (moving){
+		pthread_mutex_unlock(&rename_lock);
+	}
+	free(dirs);
+	return rc;
+}
+
+
+// OPTIONAL - included as an example
+// Flush any cached data.
+int myfs_flush(const char *path, struct fuse_file_info *fi){
+    int retstat = 0;
+		write_log("\n==ATTEMPTING FLUSH==\n");
+
+    write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+    //close(2) is where write errors are reported
+    open_file* of = open_file_of(fi);
+    if (of != NULL){
+      retstat = (of->ctl == CTL_NONE) ? sync_id(of->id) : 0;
+    }else if (path != NULL && !ctl_reserved(path)){
+      retstat = sync_file(path);
+    }
+    return retstat;
+}
+
+// OPTIONAL - included as an example
+// Release the file. There will be one call to release for each call to open.
+int myfs_release(const char *path, struct fuse_file_info *fi){
+    int retstat = 0;
+		write_log("\n==ATTEMPTING RELEASE==\n");
+    write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+    open_file* of = open_file_of(fi);
+    if (of != NULL){
+      retstat = (of->ctl == CTL_NONE) ? sync_id(of->id) : 0;
+      open_file_free(of);
+      fi->fh = 0;
+    }else if (path != NULL && !ctl_reserved(path)){
+      retstat = sync_file(path);
+    }
+    return retstat;
+}
+
+/**
+ * Writes a file's buffered data and meta data to the DB. The caller commits
+ * it, whatever the sync mode.
+ *
+ * @param path the file
+ * @param datasync non-0 if only the data needs to be written
+ * @param fi information on the state of the open file
+ *
+ * @return 0 upon success, non-zero upon failure
+ */
+int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+	write_log("\n==ATTEMPTING FSYNC==\n");
+	write_log("myfs_fsync(path=\"%s\", datasync=%d)\n", path, datasync);
+	//The data cannot be written back without the size that goes with it, so
+	//datasync makes no difference.
+	open_file* of = open_file_of(fi);
+	if (of != NULL){
+		return (of->ctl == CTL_NONE) ? sync_id(of->id) : 0;
+	}
+	return ctl_reserved(path) ? 0 : sync_file(path);
+}
+
+/**
+ * Makes a directory's changes durable. Nothing is buffered for directories,
+ * so there is nothing to write here: the caller commits with txn_end_fsync(),
+ * which is also what reports a failed commit.
+ *
+ * @param path the directory
+ * @param datasync non-0 if only the data needs to be written
+ * @param fi information on the state of the open directory (unused, the
+ *				caller takes its failed commit count from it)
+ *
+ * @return 0, as nothing can fail before the commit
+ */
+int myfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi){
+	(void)fi;
+	write_log("\n==ATTEMPTING FSYNCDIR==\n");
+	write_log("myfs_fsyncdir(path=\"%s\", datasync=%d)\n", path, datasync);
+	return 0;
+}
+
+/**
+ * Called when the file system is unmounted. Nothing buffered may be lost.
+ *
+ * @param private_data the file system's private data
+ */
+void myfs_destroy(void* private_data){
+	(void) private_data;
+	log_info("\n==UNMOUNTING==\n");
+	if (txn_begin() != 0 || txn_end_sync(wb_flush_all()) != UNQLITE_OK){
+		log_error("Could not write back all buffered data\n");
+	}
+	txn_set_group_commit(0, 0);
+	uint64_t written;
+	uint64_t stored;
+	double ratio = dedup_stats(&written, &stored);
+	if (written > 0){
+		log_info("Dedup: %llu bytes written, %llu stored, ratio %.2f\n", \
+						 (unsigned long long)written, (unsigned long long)stored, ratio);
+	}
+	uint64_t hits;
+	uint64_t misses;
+	double rate = dcache_missing_stats(&hits, &misses);
+	if (hits + misses > 0){
+		log_info("Missing paths: %.0f%% of %llu lookups answered from the cache\n", \
+						 rate * 100, (unsigned long long)(hits + misses));
+	}
+	uint64_t prefetched;
+	ra_stop();
+	ra_stats(&prefetched, &hits, &misses);
+	if (prefetched > 0){
+		log_info("Readahead: %llu blocks read ahead, %llu reads of them\n", \
+						 (unsigned long long)prefetched, (unsigned long long)hits);
+	}
+	double pack_mbps;
+	double unpack_mbps;
+	ratio = pack_stats(&pack_mbps, &unpack_mbps);
+	if (pack_mbps > 0){
+		log_info("Compression: ratio %.2f, %.0f MB/s compressing, %.0f MB/s " \
+						 "expanding\n", ratio, pack_mbps, unpack_mbps);
+	}
+	if (seg_enabled()){
+		uint64_t appended;
+		uint64_t reclaimed;
+		seg_stats(&appended, &reclaimed);
+		log_info("Data log: %llu bytes appended, %llu reclaimed\n", \
+						 (unsigned long long)appended, (unsigned long long)reclaimed);
+		seg_close();
+	}
+	log_stop();
+}
+
+// Open a file. Open should check if the operation is permitted for the given
+// flags (fi->flags).
+// Read 'man 2 open'.
+static int myfs_open(const char *path, struct fuse_file_info *fi){
+	write_log("\n== ATTEMPTING OPEN ==\n");
+	write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+	write_log("Flags: %d\n", fi->flags);
+
+	//The reports are put together here, and read whole whatever size they
+	//claim to be
+	int node = ctl_node(path);
+	if (node != CTL_NONE){
+		open_file* of = open_file_new(zero_uuid, node);
+		int rc = (of != NULL) ? ctl_open(node, fi->flags, &of->report) : -ENOMEM;
+		if (rc != 0){
+			open_file_free(of);
+			return rc;
+		}
+		fi->direct_io = 1;
+		fi->fh = (uintptr_t)of;
+		return 0;
+	}
+
+	file f;
+	int lock = lookup_locked(path, &f, 1);
+	if (lock < 0){
+		write_log("open file not found");
+		return -ENOENT;
+	}
+	write_log("File should be cached: %s\n", f.path);
+
+	//From here on the file is found by its UUID, not its path
+	int rc = file_open(&f);
+	inode_unlock(lock);
+	if (rc == 0){
+		open_file* of = open_file_new(f.meta_data_id, CTL_NONE);
+		fi->fh = (uintptr_t)of;
+		rc = (of != NULL) ? 0 : -ENOMEM;
+	}
+	return rc;
+}
+
+// Open a directory. It gets an open file of its own only so that fsyncdir can
+// tell which failed commits it has already reported to it.
+static int myfs_opendir(const char *path, struct fuse_file_info *fi){
+	write_log("myfs_opendir(path\"%s\")\n", path);
+	if (ctl_node(path) != CTL_NONE){
+		return 0;
+	}
+
+	file f;
+	int lock = lookup_locked(path, &f, 0);
+	if (lock < 0){
+		return lock;
+	}
+	inode_unlock(lock);
+	open_file* of = open_file_new(f.meta_data_id, CTL_NONE);
+	fi->fh = (uintptr_t)of;
+	return (of != NULL) ? 0 : -ENOMEM;
+}
+
+// Release a directory. There will be one call for each call to opendir.
+static int myfs_releasedir(const char *path, struct fuse_file_info *fi){
+	write_log("myfs_releasedir(path\"%s\")\n", path);
+	open_file_free(open_file_of(fi));
+	fi->fh = 0;
+	return 0;
+}
+
+/*
+ ***************
+	Transaction Wrappers
+ ***************
+*/
+
+//The callbacks that change the DB are registered through these, so that each
+//one is a single transaction. The callbacks call each other directly (eg:
+//mkdir is a create) without starting another one. Every callback is counted
+//here too (see Statistics), including the ones that only read.
+
+static int timed_getattr(const char *path, struct stat* stbuf){
+	uint64_t start = stats_now();
+	int rc = myfs_getattr(path, stbuf);
+	stats_record(STATS_GETATTR, start, rc < 0, 0);
+	return rc;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, \
+												 off_t offset, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = myfs_readdir(path, buf, filler, offset, fi);
+	stats_record(STATS_READDIR, start, rc < 0, 0);
+	return rc;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset, \
+											struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = myfs_read(path, buf, size, offset, fi);
+	stats_record(STATS_READ, start, rc < 0, (rc > 0) ? rc : 0);
+	return rc;
+}
+
+static int timed_opendir(const char *path, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = myfs_opendir(path, fi);
+	stats_record(STATS_OPENDIR, start, rc < 0, 0);
+	return rc;
+}
+
+static int timed_releasedir(const char *path, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = myfs_releasedir(path, fi);
+	stats_record(STATS_RELEASEDIR, start, rc < 0, 0);
+	return rc;
+}
+
+//The kernel does not release a file it could not open, so the open file it
+//was given goes again if the commit fails
+static int txn_open_file(const char *path, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_open(path, fi));
+	}
+	if (rc != 0){
+		open_file_free(open_file_of(fi));
+		fi->fh = 0;
+	}
+	stats_record(STATS_OPEN, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_create(const char *path, mode_t mode, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_create(path, mode, fi));
+	}
+	if (rc != 0 && fi != NULL){
+		open_file_free(open_file_of(fi));
+		fi->fh = 0;
+	}
+	stats_record(STATS_CREATE, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_utime(const char *path, struct utimbuf *ubuf){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_utime(path, ubuf));
+	}
+	stats_record(STATS_UTIME, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_write(const char* path, const char *buf, size_t size, \
+										 off_t offset, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_write(path, buf, size, offset, fi));
+	}
+	stats_record(STATS_WRITE, start, rc < 0, (rc > 0) ? rc : 0);
+	return rc;
+}
+
+static int txn_write_buf(const char* path, struct fuse_bufvec *bufv, \
+												 off_t offset, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_write_buf(path, bufv, offset, fi));
+	}
+	stats_record(STATS_WRITE, start, rc < 0, (rc > 0) ? rc : 0);
+	return rc;
+}
+
+static int txn_truncate(const char *path, off_t newsize){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_truncate(path, newsize));
+	}
+	stats_record(STATS_TRUNCATE, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_fallocate(const char *path, int mode, off_t offset, off_t len, \
+												 struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_fallocate(path, mode, offset, len, fi));
+	}
+	stats_record(STATS_FALLOCATE, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_flush(const char *path, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_flush(path, fi));
+	}
+	stats_record(STATS_FLUSH, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_release(const char *path, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_release(path, fi));
+	}else{
+		//The kernel forgets the file whatever we return
+		open_file_free(open_file_of(fi));
+		fi->fh = 0;
+	}
+	stats_record(STATS_RELEASE, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end_fsync(myfs_fsync(path, datasync, fi), \
+												 open_file_errseq(open_file_of(fi)));
+	}
+	stats_record(STATS_FSYNC, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_fsyncdir(const char *path, int datasync, \
+												struct fuse_file_info *fi){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end_fsync(myfs_fsyncdir(path, datasync, fi), \
+												 open_file_errseq(open_file_of(fi)));
+	}
+	stats_record(STATS_FSYNCDIR, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_chmod(const char *path, mode_t mode){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_chmod(path, mode));
+	}
+	stats_record(STATS_CHMOD, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_chown(const char *path, uid_t uid, gid_t gid){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_chown(path, uid, gid));
+	}
+	stats_record(STATS_CHOWN, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_unlink(const char *path){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_unlink(path));
+	}
+	stats_record(STATS_UNLINK, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_rmdir(const char *path){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_rmdir(path));
+	}
+	stats_record(STATS_RMDIR, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_mkdir(const char *path, mode_t mode){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_mkdir(path, mode));
+	}
+	stats_record(STATS_MKDIR, start, rc < 0, 0);
+	return rc;
+}
+
+static int txn_rename(const char *from, const char *to){
+	uint64_t start = stats_now();
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end(myfs_rename(from, to));
+	}
+	stats_record(STATS_RENAME, start, rc < 0, 0);
+	return rc;
+}
+
+static struct fuse_operations myfs_oper = {
+	.getattr	= timed_getattr,
+	.readdir	= timed_readdir,
+	.open		= txn_open_file,
+	.read		= timed_read,
+	.create		= txn_create,
+	.utime 		= txn_utime,
+	.write		= txn_write,
+	.write_buf	= txn_write_buf,
+	.truncate	= txn_truncate,
+	.fallocate	= txn_fallocate,
+	.flush		= txn_flush,
+	.release	= txn_release,
+	.fsync		= txn_fsync,
+	.opendir	= timed_opendir,
+	.releasedir	= timed_releasedir,
+	.fsyncdir	= txn_fsyncdir,
+	.destroy	= myfs_destroy,
+	.chmod = txn_chmod,
+	.chown = txn_chown,
+	.unlink = txn_unlink,
+	.rmdir = txn_rmdir,
+	.mkdir = txn_mkdir,
+	.rename = txn_rename,
+};
+
+/*
+ ***************
+	Inode Numbers
+ ***************
+*/
+
+//The low level frontend talks to the kernel in inode numbers rather than
+//paths, so the kernel's own dentry cache resolves paths and each callback only
+//fetches the one record it is about. A file is given a number when the kernel
+//first looks it up and keeps it, mapped both ways to its meta data UUID, until
+//the kernel forgets it. The root is always FUSE_ROOT_ID.
+#define INO_BUCKETS 4096
+
+//What the kernel is told for a child in readdir that it has not looked up
+#define INO_UNKNOWN 0xffffffff
+
+typedef struct ino_entry {
+	fuse_ino_t ino;
+	uuid_t id;
+	uint64_t nlookup;
+	struct ino_entry* ino_next;
+	struct ino_entry* id_next;
+} ino_entry;
+
+static pthread_mutex_t ino_lock = PTHREAD_MUTEX_INITIALIZER;
+static ino_entry* ino_by_ino[INO_BUCKETS];
+static ino_entry* ino_by_id[INO_BUCKETS];
+//The numbers just after the root's belong to the control files
+static fuse_ino_t ino_next = CTL_INO(CTL_NODES);
+
+static ino_entry* ino_find_id(const uuid_t id){
+	ino_entry* e = ino_by_id[hash_bytes(id, sizeof(uuid_t)) % INO_BUCKETS];
+	while (e != NULL && uuid_compare(e->id, id) != 0){
+		e = e->id_next;
+	}
+	return e;
+}
+
+/**
+ * Finds the file an inode number stands for.
+ *
+ * @param ino the inode number
+ * @param out set to the file's meta data UUID
+ *
+ * @return 0 on success, -ESTALE if the number is not in use
+ */
+int ino_to_id(fuse_ino_t ino, uuid_t out){
+	if (ino == FUSE_ROOT_ID){
+		memcpy(out, root_directory->meta_data_id, sizeof(uuid_t));
+		return 0;
+	}
+
+	pthread_mutex_lock(&ino_lock);
+	ino_entry* e = ino_by_ino[ino % INO_BUCKETS];
+	while (e != NULL && e->ino != ino){
+		e = e->ino_next;
+	}
+	if (e != NULL){
+		memcpy(out, e->id, sizeof(uuid_t));
+	}
+	pthread_mutex_unlock(&ino_lock);
+	return (e != NULL) ? 0 : -ESTALE;
+}
+
+/**
+ * Gets a file's inode number, giving it one if it has none, and counts one
+ * more lookup of it by the kernel.
+ *
+ * @param id the file's meta data UUID
+ *
+ * @return the inode number, or 0 if we ran out of memory
+ */
+fuse_ino_t ino_remember(const uuid_t id){
+	if (uuid_compare(id, root_directory->meta_data_id) == 0){
+		return FUSE_ROOT_ID;
+	}
+
+	pthread_mutex_lock(&ino_lock);
+	ino_entry* e = ino_find_id(id);
+	if (e == NULL){
+		e = malloc(sizeof(ino_entry));
+		if (e == NULL){
+			pthread_mutex_unlock(&ino_lock);
+			return 0;
+		}
+		e->ino = ino_next++;
+		memcpy(e->id, id, sizeof(uuid_t));
+		e->nlookup = 0;
+		int slot = hash_bytes(id, sizeof(uuid_t)) % INO_BUCKETS;
+		e->id_next = ino_by_id[slot];
+		ino_by_id[slot] = e;
+		e->ino_next = ino_by_ino[e->ino % INO_BUCKETS];
+		ino_by_ino[e->ino % INO_BUCKETS] = e;
+	}
+	e->nlookup++;
+	fuse_ino_t ino = e->ino;
+	pthread_mutex_unlock(&ino_lock);
+	return ino;
+}
+
+/**
+ * @return a file's inode number if it has one, without counting a lookup, or
+ *				 INO_UNKNOWN
+ */
+fuse_ino_t ino_peek(const uuid_t id){
+	if (uuid_compare(id, root_directory->meta_data_id) == 0){
+		return FUSE_ROOT_ID;
+	}
+	pthread_mutex_lock(&ino_lock);
+	ino_entry* e = ino_find_id(id);
+	fuse_ino_t ino = (e != NULL) ? e->ino : INO_UNKNOWN;
+	pthread_mutex_unlock(&ino_lock);
+	return ino;
+}
+
+/**
+ * Counts lookups the kernel has dropped. The number is freed once there are
+ * none left.
+ *
+ * @param ino the inode number
+ * @param nlookup how many lookups were dropped
+ */
+void ino_forget(fuse_ino_t ino, uint64_t nlookup){
+	if (ino == FUSE_ROOT_ID){
+		return;
+	}
 
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("Getattr file not found");
-		return -ENOENT;
+	pthread_mutex_lock(&ino_lock);
+	ino_entry** slot = &ino_by_ino[ino % INO_BUCKETS];
+	while (*slot != NULL && (*slot)->ino != ino){
+		slot = &(*slot)->ino_next;
+	}
+	ino_entry* e = *slot;
+	if (e != NULL){
+		e->nlookup = (e->nlookup > nlookup) ? e->nlookup - nlookup : 0;
+	}
+	if (e != NULL && e->nlookup == 0){
+		*slot = e->ino_next;
+		ino_entry** id_slot = &ino_by_id[hash_bytes(e->id, sizeof(uuid_t)) % \
+																		 INO_BUCKETS];
+		while (*id_slot != e){
+			id_slot = &(*id_slot)->id_next;
+		}
+		*id_slot = e->id_next;
+		free(e);
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
+	pthread_mutex_unlock(&ino_lock);
+}
 
-	//Our file should be in the cache
-	//Fill the buffer with the current directory and its parent directory
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+/*
+ ***************
+	Low Level Frontend
+ ***************
+*/
 
-	write_log("File found at path: %s\n", requested_file->path);
-	write_log("Number of children: %d\n", requested_file->number_children);
-	for (int i=REST_POS; i<(requested_file->number_children); i++){
-		//Sadly we need to make DB calls for each child
-		file* child = malloc(sizeof(file));
-		unqlite_int64 size = sizeof(file);
-		unqlite_kv_fetch(pDb, &requested_file->children[i], KEY_SIZE, child, \
-										 &size);
+//How long the kernel may keep attributes and names it got from us. Every
+//change goes through the kernel, so this only matters for files changed
+//behind its back (eg: through the high level frontend of another mount).
+#ifndef MYFS_LL_TIMEOUT
+#define MYFS_LL_TIMEOUT 1.0
+#endif
 
-		write_log("Child: %s\n", child->path);
-		char* pathP = child->path;
-		format_path(pathP);
-		write_log("Pathp: %s\n", pathP);
+/**
+ * Finds the file an inode number stands for.
+ *
+ * @return 0 on success, or -ESTALE/-ENOENT/-EIO
+ */
+static int ll_get(fuse_ino_t ino, file* out){
+	uuid_t id;
+	int rc = ino_to_id(ino, id);
+	return (rc == 0) ? inode_get(id, out) : rc;
+}
 
-		//Add to buffer
-		if (pathP != NULL){
-			write_log("Adding %s to buffer\n",pathP);
-			//fill the buffer with the path
-			filler(buf, pathP, NULL, 0);
-		}
+/**
+ * Finds the file an inode number stands for and locks it.
+ *
+ * @return the lock index, or -ESTALE/-ENOENT/-EIO
+ */
+static int ll_get_locked(fuse_ino_t ino, file* out, int exclusive){
+	uuid_t id;
+	int rc = ino_to_id(ino, id);
+	return (rc == 0) ? inode_get_locked(id, out, exclusive) : rc;
+}
 
-		free(child); //Tidying up
+/**
+ * Finds the file a callback is about and locks it: through the open file it
+ * was handed if there is one, and by its inode number if not.
+ *
+ * @return the lock index, or -ESTALE/-ENOENT/-EIO
+ */
+static int ll_get_open(fuse_ino_t ino, struct fuse_file_info* fi, file* out, \
+											 int exclusive){
+	open_file* of = open_file_of(fi);
+	return (of != NULL) ? open_file_get(of, out, exclusive) : \
+												ll_get_locked(ino, out, exclusive);
 }
 
-		write_log("readdir terminated \n");
-		return 0;
+/**
+ * Describes a file to the kernel as the answer to a lookup, which counts as
+ * one lookup of its inode number.
+ *
+ * @return 0 on success, -ENOMEM on failure
+ */
+static int ll_entry(const file* f, struct fuse_entry_param* e){
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = ino_remember(f->meta_data_id);
+	if (e->ino == 0){
+		return -ENOMEM;
+	}
+	file_stat(f, &e->attr);
+	e->attr.st_ino = e->ino;
+	e->attr_timeout = MYFS_LL_TIMEOUT;
+	e->entry_timeout = MYFS_LL_TIMEOUT;
+	return 0;
 }
 
-// Read a file.
-// Read 'man 2 read'.
 /**
- * Reads a file into memory
- * @param path the file path
- * @param buf the buffer it has to be stored in.
- * @param the size of the buffer to be read into
- * @param the offset to where it should be stored in memory
- * @parm fi information on the state of the open files
- * @return the number of bytes read into memory
+ * Counts an operation (see Statistics) and replies with how it went, for the
+ * callbacks that reply with nothing else.
+ *
+ * @param start when the operation started
+ * @param rc 0 or a negative error number
  */
-static int myfs_read(const char *path, char *buf, size_t size, off_t offset, \
-	 										struct fuse_file_info *fi)
-{
-	write_log("\n== ATTEMPTING READ ==\n");
-	size_t len;
-	(void) fi;
-	//Logging
-	write_log("myfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, \
-	 						fi=0x%08x)\n", path, buf, size, offset, fi);
+static void ll_reply_err(fuse_req_t req, stats_op op, uint64_t start, int rc){
+	stats_record(op, start, rc < 0, 0);
+	fuse_reply_err(req, -rc);
+}
 
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("Getattr file not found");
-		return -ENOENT;
+/**
+ * @return non-0 if a directory is somewhere new files may not go, ie: the
+ *				 root for /.myfs, or /.myfs itself
+ */
+static int ll_ctl_reserved(fuse_ino_t parent, const char* name){
+	return ctl_node_ino(parent) != CTL_NONE || ctl_child(parent, name) != CTL_NONE;
+}
+
+static void myfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+	write_log("myfs_ll_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+	uint64_t start = stats_now();
+	struct fuse_entry_param e;
+	int node = ctl_child(parent, name);
+	if (node != CTL_NONE){
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.ino = CTL_INO(node);
+		ctl_stat(node, &e.attr);
+		e.attr.st_ino = e.ino;
+		stats_record(STATS_LOOKUP, start, 0, 0);
+		fuse_reply_entry(req, &e);
+		return;
+	}else if (ctl_node_ino(parent) != CTL_NONE){
+		ll_reply_err(req, STATS_LOOKUP, start, -ENOENT);
+		return;
+	}
+
+	file* dir = malloc(sizeof(file));
+	if (dir == NULL){
+		ll_reply_err(req, STATS_LOOKUP, start, -ENOMEM);
+		return;
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
 
+	uuid_t id;
+	int rc = ll_get(parent, dir);
+	if (rc == 0){
+		rc = dentry_lookup(dir, name, id);
+	}
+	if (rc == 0){
+		//The child's record can go in the same buffer
+		rc = inode_get(id, dir);
+	}
 
-	//The length of the file to be read
-	len = requested_file->size;
-	write_log("File size: %d\n", len);
-	//The data block to store the file
-	//It does not need to be larger than our buffer size
-	uint8_t data_block[size];
-	//Set all of its memory to 0
-	memset(&data_block, '\0', size);
-	//Get the UUID
-	uuid_t* data_id = &(requested_file->file_data_id);
-	write_log("File UUID: %x\n", requested_file->file_data_id);
+	if (rc == 0){
+		rc = ll_entry(dir, &e);
+	}
+	free(dir);
+	if (rc != 0){
+		ll_reply_err(req, STATS_LOOKUP, start, rc);
+	}else{
+		stats_record(STATS_LOOKUP, start, 0, 0);
+		fuse_reply_entry(req, &e);
+	}
+}
 
-	if(uuid_compare(zero_uuid,*data_id)!=0){
-		write_log("myfs_read file with non-0 UUID\n");
-		//This is similar to ORM
-		unqlite_int64 nBytes;  //Data length.
-		//Get the data stored at this key
-		//When we have NULL we are asking to get its size back
-		int rc = unqlite_kv_fetch(pDb,data_id,KEY_SIZE,NULL,&nBytes);
-		write_log("Size: %d\n",nBytes);
+static void myfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup){
+	ino_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
 
-		//Error handling
-		if( rc != UNQLITE_OK ){
-		  error_handler(rc);
+static void myfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, \
+														struct fuse_file_info *fi){
+	(void) fi;
+	write_log("myfs_ll_getattr(ino=%lu)\n", ino);
+	uint64_t start = stats_now();
+	struct stat st;
+	int node = ctl_node_ino(ino);
+	if (node != CTL_NONE){
+		ctl_stat(node, &st);
+	}else{
+		file f;
+		int rc = ll_get(ino, &f);
+		if (rc != 0){
+			ll_reply_err(req, STATS_GETATTR, start, rc);
+			return;
 		}
-
-		//Fetch the fcb the root data block from the store.
-		unqlite_kv_fetch(pDb,data_id,KEY_SIZE,&data_block,&nBytes);
+		file_stat(&f, &st);
 	}
+	st.st_ino = ino;
+	stats_record(STATS_GETATTR, start, 0, 0);
+	fuse_reply_attr(req, &st, MYFS_LL_TIMEOUT);
+}
 
-	//Place into the correct place in memory
-	if (offset < len) {
-		//If we can store this in memory then do so
-		if (offset + size > len) {
-			size = len - offset;
-			memcpy(buf, &data_block + offset, size);
+static void myfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, \
+														int to_set, struct fuse_file_info *fi){
+	(void) fi;
+	write_log("myfs_ll_setattr(ino=%lu, to_set=0x%x)\n", ino, to_set);
+	uint64_t start = stats_now();
+	struct stat st;
+	//Shells truncate what they redirect into, so reset lets them
+	int node = ctl_node_ino(ino);
+	if (node != CTL_NONE){
+		if (node != CTL_RESET || (to_set & ~FUSE_SET_ATTR_SIZE) != 0){
+			ll_reply_err(req, STATS_SETATTR, start, -EPERM);
+			return;
 		}
-	} else{
-		size = 0;
+		ctl_stat(node, &st);
+		st.st_ino = ino;
+		stats_record(STATS_SETATTR, start, 0, 0);
+		fuse_reply_attr(req, &st, MYFS_LL_TIMEOUT);
+		return;
 	}
 
-	return size;
+	if (txn_begin() != 0){
+		ll_reply_err(req, STATS_SETATTR, start, -EIO);
+		return;
+	}
+	file f;
+	int lock = ll_get_locked(ino, &f, 1);
+	if (lock < 0){
+		txn_end(lock);
+		ll_reply_err(req, STATS_SETATTR, start, lock);
+		return;
+	}
+
+	//truncate(2), chmod(2), chown(2) and utime(2) all end up here
+	int rc = 0;
+	if (rc == 0 && (to_set & FUSE_SET_ATTR_MODE)){
+		rc = file_chmod(&f, attr->st_mode);
+	}
+	if (rc == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))){
+		rc = file_chown(&f, (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : f.uid, \
+										(to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : f.gid);
+	}
+	if (rc == 0 && (to_set & FUSE_SET_ATTR_SIZE)){
+		rc = file_truncate(&f, attr->st_size);
+	}
+	if (rc == 0 && (to_set & FUSE_SET_ATTR_MTIME_NOW)){
+		rc = file_utime(&f, time(NULL));
+	}else if (rc == 0 && (to_set & FUSE_SET_ATTR_MTIME)){
+		rc = file_utime(&f, attr->st_mtime);
+	}
+	inode_unlock(lock);
+
+	rc = txn_end(rc);
+	if (rc != 0){
+		ll_reply_err(req, STATS_SETATTR, start, rc);
+		return;
+	}
+	file_stat(&f, &st);
+	st.st_ino = ino;
+	stats_record(STATS_SETATTR, start, 0, 0);
+	fuse_reply_attr(req, &st, MYFS_LL_TIMEOUT);
 }
 
 /**
-* Creates a file at a specified location
-* @param path the path where the file should be located at
-* @param the mode affiliated with this file
-* @param fi information on the state of the open files
-* @return 0 upon success, non-zero upon failure
-*/
-static int myfs_create(const char *path, mode_t mode, \
-												struct fuse_file_info *fi)
-{
-	write_log("\n== ATTEMPTING CREATE ==\n");
-  write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
-
-	//If the path length is too long
-	int pathlen = strlen(path);
-	if(pathlen>=MY_MAX_PATH){
-		write_log("myfs_create - ENAMETOOLONG");
-		return -ENAMETOOLONG;
+ * Creates a file for mkdir and create.
+ *
+ * @return 0 on success, with e filled in, or a negative error number
+ */
+static int ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, \
+										 mode_t mode, struct fuse_entry_param* e){
+	if (ll_ctl_reserved(parent, name)){
+		return -EPERM;
+	}
+	file* dir = malloc(sizeof(file));
+	if (dir == NULL){
+		return -ENOMEM;
 	}
-	write_log("Mode: %d IS FILE: %d\n", mode, mode & S_IFMT == S_IFREG);
-	//Find path excluding name
-	char file_dir[MY_MAX_PATH];
-	traverse_to_folder(path, file_dir); //Get us its parent's address
-	write_log("Folder found %s\n",file_dir);
 
-	//Create a new fcb for this new file
-	//Update in memory data structures
-	file* parent = malloc(sizeof(file));
+	if (txn_begin() != 0){
+		free(dir);
+		return -EIO;
+	}
+	//Holding the parent's lock keeps anyone else from changing its children
+	int lock = ll_get_locked(parent, dir, 1);
+	if (lock < 0){
+		free(dir);
+		return txn_end(lock);
+	}
+	const struct fuse_ctx* context = fuse_req_ctx(req);
+	//The new file's record can go in the parent's buffer once it is stored
+	int rc = file_create(dir, name, mode, context->uid, context->gid, dir);
+	inode_unlock(lock);
+
+	rc = txn_end(rc);
+	if (rc == 0){
+		rc = ll_entry(dir, e);
+	}
+	free(dir);
+	return rc;
+}
 
-	if (parent == NULL){
-		write_log("Error mallocing!\n");
-		return -1;
+static void myfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, \
+													mode_t mode){
+	write_log("myfs_ll_mkdir(parent=%lu, name=\"%s\")\n", parent, name);
+	uint64_t start = stats_now();
+	struct fuse_entry_param e;
+	int rc = ll_create(req, parent, name, mode | S_IFDIR, &e);
+	if (rc != 0){
+		ll_reply_err(req, STATS_MKDIR, start, rc);
+	}else{
+		stats_record(STATS_MKDIR, start, 0, 0);
+		fuse_reply_entry(req, &e);
 	}
+}
 
-	//Ensure we did not request the root directory
-	if (strcmp(file_dir,"/")!=0){
-		unqlite_int64 size = sizeof(file);
-		//Its parent should be a directory and thus we want its meta data
-		traverse_to_file(file_dir, root_directory->meta_data_id);
+static void myfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, \
+													 mode_t mode, struct fuse_file_info *fi){
+	write_log("myfs_ll_create(parent=%lu, name=\"%s\")\n", parent, name);
+	uint64_t start = stats_now();
+	struct fuse_entry_param e;
+	int rc = ll_create(req, parent, name, mode, &e);
+	uuid_t id;
+	open_file* of = NULL;
+	if (rc == 0 && ino_to_id(e.ino, id) == 0){
+		of = open_file_new(id, CTL_NONE);
+	}
+	if (rc == 0 && of == NULL){
+		//The kernel is not told about it, so it does not count as a lookup
+		ino_forget(e.ino, 1);
+		rc = -ENOMEM;
+	}
+	if (rc != 0){
+		ll_reply_err(req, STATS_CREATE, start, rc);
+	}else{
+		fi->fh = (uintptr_t)of;
+		stats_record(STATS_CREATE, start, 0, 0);
+		fuse_reply_create(req, &e, fi);
+	}
+}
 
-		int rc = unqlite_kv_fetch(pDb, &requested_file->meta_data_id, KEY_SIZE, \
-															parent, &size);
+/**
+ * Deletes a child of a directory for unlink and rmdir.
+ *
+ * @param dirs_only non-0 to refuse to delete anything but a directory
+ *
+ * @return 0 on success, or a negative error number
+ */
+static int ll_remove(fuse_ino_t parent, const char *name, int dirs_only){
+	if (ll_ctl_reserved(parent, name)){
+		return -EPERM;
+	}
+	file f;
+	file* dir = malloc(sizeof(file));
+	if (dir == NULL){
+		return -ENOMEM;
+	}
 
-		if (rc != UNQLITE_OK){
-			write_log("DB Error in MYFS CREATE\n");
-			return rc;
+	if (txn_begin() != 0){
+		free(dir);
+		return -EIO;
+	}
+	//Lock the parent and the child, then make sure that the name still refers
+	//to the child once we have the locks.
+	int rc, parent_lock, child_lock;
+	uuid_t parent_id, child_id, check_id;
+	for (;;){
+		rc = ino_to_id(parent, parent_id);
+		if (rc == 0){
+			rc = inode_get(parent_id, dir);
 		}
-
-		write_log("Parent: %s\n", parent->path);
-		if (parent == NULL) {
-			write_log("myfs create directory (parent) not found");
-			return UNQLITE_NOTFOUND;
+		if (rc == 0){
+			rc = dentry_lookup(dir, name, child_id);
+		}
+		if (rc != 0){
+			free(dir);
+			return txn_end(rc);
 		}
+		inode_lock_pair(parent_id, child_id, &parent_lock, &child_lock);
 
-	}else{
-		//We have putting a new file in the root directory
-		unqlite_int64 size = sizeof(file);
-		int rc = unqlite_kv_fetch(pDb, &root_directory->meta_data_id, KEY_SIZE, \
-			 												parent, &size);
-		if (rc != UNQLITE_OK){
-			write_log("DB Error in MYFS CREATE\n");
-			return rc;
+		if (inode_get(parent_id, dir) == 0 && \
+				dentry_lookup(dir, name, check_id) == 0 && \
+				uuid_compare(check_id, child_id) == 0){
+			rc = inode_get(child_id, &f);
+			break;
 		}
+		inode_unlock_pair(parent_lock, child_lock);
 	}
 
-	file* new_file = malloc(sizeof(file));
-	write_log("Written to position: %d\n", parent->number_children);
-	write_log("Parent: %s\n", parent->path);
-	//Copy the file's address to its FCB
-	strcpy(new_file->path, path);
+	if (rc == 0 && dirs_only && !S_ISDIR(f.mode)){
+		rc = -ENOTDIR;
+	}
+	if (rc == 0){
+		rc = file_unlink(dir, &f);
+	}
+	inode_unlock_pair(parent_lock, child_lock);
+	free(dir);
+	return txn_end(rc);
+}
 
-	//Generate it new UUIDs
-	uuid_generate(new_file->file_data_id);
-	uuid_generate(new_file->meta_data_id);
-	write_log("Meta ID: %x\t File ID: %x\n", new_file->file_data_id, \
-						new_file->meta_data_id);
+static void myfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+	write_log("myfs_ll_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+	uint64_t start = stats_now();
+	ll_reply_err(req, STATS_UNLINK, start, ll_remove(parent, name, 0));
+}
 
-	//Copy the metadata UUID to its parent.
-	memcpy(parent->children[parent->number_children], new_file->meta_data_id, \
-				 sizeof(uuid_t));
-	parent->number_children = parent->number_children + 1;
-	write_log("New file with UUID: %x\n", new_file->file_data_id);
-	write_log("Parent has %d children\n", parent->number_children);
-	//Context of invoking user
-	struct fuse_context* context = fuse_get_context();
-	new_file->uid = context->uid;
-	new_file->uid = context->gid;
-	new_file->size = 0;
-	//Default permissions are: F, USER: R/W, GROUP: R/W, ALL: R
-	new_file->mode = mode;
-	new_file->number_children = REST_POS;
-	new_file->mtime = time(0);
-	new_file->ctime = time(0);
-	parent->ctime = time(0);
-	//Write the two mandatory children to it
-	memcpy(new_file->children[SELF_POS], new_file->meta_data_id, sizeof(uuid_t));
-	memcpy(new_file->children[PARENT_POS], parent->meta_data_id, sizeof(uuid_t));
+static void myfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+	write_log("myfs_ll_rmdir(parent=%lu, name=\"%s\")\n", parent, name);
+	uint64_t start = stats_now();
+	ll_reply_err(req, STATS_RMDIR, start, ll_remove(parent, name, 1));
+}
 
-	//Notice we are updating their META DATA.
-	//wc = write child, wp = write parent, wd = write data
-	int wc = unqlite_kv_store(pDb, &(new_file->meta_data_id), KEY_SIZE,\
-	 													new_file, sizeof(file));
-	int wp = unqlite_kv_store(pDb, &(parent->meta_data_id), KEY_SIZE, parent, \
-														sizeof(file));
-	//Create an entry in the DB for our data
-	int wd = unqlite_kv_store(pDb, &new_file->file_data_id, KEY_SIZE, NULL, 0);
-	//Same sanity checks - make sure writes to DB went through correctly
-	if( wc != UNQLITE_OK || wp != UNQLITE_OK || wd != UNQLITE_OK){
-		write_log("myfs_create - EIO. WC: %d WP: %d WD: %d\n",wc,wp, wd);
-		return -EIO;
+/**
+ * Looks up everything a rename works on: both directories, the file and
+ * whatever has the new name (ids[3] is cleared if nothing does).
+ *
+ * @return 0 on success, or a negative error number
+ */
+static int ll_rename_find(fuse_ino_t parent, const char* name, \
+													fuse_ino_t new_parent, const char* new_name, \
+													file* dirs, uuid_t ids[4]){
+	int rc = ino_to_id(parent, ids[0]);
+	if (rc == 0){
+		rc = ino_to_id(new_parent, ids[1]);
 	}
-
-	//Copy to cache the newly created file since we probably want to use it
-	memcpy(requested_file, new_file, sizeof(file));
-	write_log("File copied to cache!\n");
-	//if parent is root
-	if (strcmp(parent->path, "/")==0){
-		write_log("Parent is root\n");
-		memcpy(root_directory, parent, sizeof(file));
+	if (rc == 0){
+		rc = inode_get(ids[0], &dirs[0]);
 	}
-	//Housekeeping
-	free(parent);
-	free(new_file);
-  return 0;
+	if (rc == 0){
+		rc = inode_get(ids[1], &dirs[1]);
+	}
+	if (rc == 0){
+		rc = dentry_lookup(&dirs[0], name, ids[2]);
+	}
+	if (rc == 0 && dentry_lookup(&dirs[1], new_name, ids[3]) != 0){
+		uuid_clear(ids[3]);
+	}
+	return rc;
 }
 
-// Set update the times (actime, modtime) for a file.
-// This FS only supports modtime. (So far)
-// Read 'man 2 utime'.
-/**
- * Updates the time attributes of a file
- * @param path the file
- * @param ubuf the utimbuf struct with the time data
- * @return 0 on success, non-zero on failure
- */
-static int myfs_utime(const char *path, struct utimbuf *ubuf){
-	write_log("\n== ATTEMPTING UTIME ==\n");
-  write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
-	//Find us the child if it exists
+static void myfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, \
+													 fuse_ino_t newparent, const char *newname){
+	write_log("myfs_ll_rename(parent=%lu, name=\"%s\", newparent=%lu, " \
+						"newname=\"%s\")\n", parent, name, newparent, newname);
+	uint64_t start = stats_now();
+	if (ll_ctl_reserved(parent, name) || ll_ctl_reserved(newparent, newname)){
+		ll_reply_err(req, STATS_RENAME, start, -EPERM);
+		return;
+	}
+	file f;
+	//The two directories, and whatever has the new name
+	file* dirs = malloc(3 * sizeof(file));
+	if (dirs == NULL){
+		ll_reply_err(req, STATS_RENAME, start, -ENOMEM);
+		return;
+	}
 
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("utime file not found");
-		return -ENOENT;
+	if (txn_begin() != 0){
+		free(dirs);
+		ll_reply_err(req, STATS_RENAME, start, -EIO);
+		return;
+	}
+	int moving = parent != newparent;
+	if (moving){
+		pthread_mutex_lock(&rename_lock);
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
 
-	//Otherwise update the time
-	requested_file->mtime=ubuf->modtime;
-	//And then write to our DB
-	// Write the fcb to the store.
-  int rc = unqlite_kv_store(pDb,&(requested_file->meta_data_id),\
-														KEY_SIZE,requested_file,sizeof(file));
-	if( rc != UNQLITE_OK ){
-		write_log("myfs_utime - EIO");
-		return -EIO;
+	//Lock everything involved, then make sure that the names still refer to
+	//the same files once we have the locks.
+	int rc, taken;
+	int locks[4];
+	uuid_t ids[4], check[4];
+	for (;;){
+		rc = ll_rename_find(parent, name, newparent, newname, dirs, ids);
+		if (rc != 0){
+			break;
+		}
+		const unsigned char* lock_ids[4] = {ids[0], ids[1], ids[2], ids[3]};
+		taken = inode_lock_set(lock_ids, uuid_is_null(ids[3]) ? 3 : 4, locks);
+
+		if (ll_rename_find(parent, name, newparent, newname, dirs, check) == 0 && \
+				memcmp(ids, check, sizeof(check)) == 0){
+			rc = inode_get(ids[2], &f);
+			if (rc == 0 && !uuid_is_null(ids[3])){
+				rc = inode_get(ids[3], &dirs[2]);
+			}
+			if (rc == 0){
+				rc = file_rename(&dirs[0], name, &f, &dirs[1], newname, \
+												 uuid_is_null(ids[3]) ? NULL : &dirs[2]);
+			}
+			inode_unlock_set(locks, taken);
+			break;
+		}
+		inode_unlock_set(locks, taken);
 	}
-  return 0;
-}
 
-// Write to a file.
-// Read 'man 2 write'
-/**
- * Writes data to memory.
- * @param path the paFile exists atth to be written to
- * @param buf the data to be written
- * @param size the size of the data to be written
- * @param offset the offset
- * @return the amount of bytes written to disk
- */
-static int myfs_write(const char* path, const char *buf, size_t size, \
-	 										off_t offset, struct fuse_file_info *fi)
-{
-	write_log("\n=== ATTEMPTING WRITE ===\n");
-  write_log("myfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, \
-	fi=0x%08x)\n", path, buf, size, offset, fi);
+	if (moving){
+		pthread_mutex_unlock(&rename_lock);
+	}
+	free(dirs);
+	ll_reply_err(req, STATS_RENAME, start, txn_end(rc));
+}
 
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("Getattr file not found");
-		return -ENOENT;
+static void myfs_ll_open(fuse_req_t req, fuse_ino_t ino, \
+												 struct fuse_file_info *fi){
+	write_log("myfs_ll_open(ino=%lu, flags=%d)\n", ino, fi->flags);
+	uint64_t start = stats_now();
+	//The reports are put together here, and read whole whatever size they
+	//claim to be
+	int node = ctl_node_ino(ino);
+	open_file* of = NULL;
+	int rc;
+	if (node != CTL_NONE){
+		of = open_file_new(zero_uuid, node);
+		rc = (of != NULL) ? ctl_open(node, fi->flags, &of->report) : -ENOMEM;
+		fi->direct_io = 1;
+	}else if ((rc = txn_begin()) == 0){
+		file f;
+		rc = ll_get_locked(ino, &f, 1);
+		if (rc >= 0){
+			int lock = rc;
+			rc = file_open(&f);
+			inode_unlock(lock);
+		}
+		rc = txn_end(rc);
+		//From here on the file is found by its UUID, not its inode number
+		if (rc == 0){
+			of = open_file_new(f.meta_data_id, CTL_NONE);
+			rc = (of != NULL) ? 0 : -ENOMEM;
+		}
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
-
-	//Find us the child if it exists
-	write_log("Child size at start: %d\n", requested_file->size);
-
-	//Get us a data block and set it to 0
-	uint8_t data_block[size];
-	memset(&data_block, '\n', size);
-	//Get us a UUID of its data
-	uuid_t* data_id = &(requested_file->file_data_id);
-	write_log("Path: %s\n", requested_file->path);
-	write_log("Reading UUID id: %x\n",*data_id);
-
-	// Is there a data block? ie have we written to this file before?
-	if(uuid_compare(zero_uuid,*data_id)==0){
-		write_log("\nFile UUID needs generating!\n\n");
-		//I don't imagine that this can actually happen, nor am I convinced that
-		//this will actually make it work again
-		// Generate a UUID for the data block. We'll write the block itself later.
-		uuid_generate(requested_file->file_data_id);
-		uuid_generate(requested_file->meta_data_id);
-		requested_file->size = 0;
+	if (rc != 0){
+		open_file_free(of);
+		ll_reply_err(req, STATS_OPEN, start, rc);
 	}else{
-		write_log("File already exists\n");
-		//First we will check the size of the obejct in the store to ensure that
-		//we won't overflow the buffer.
-		unqlite_int64 nBytes;  // Data length.
-		//Get us its size currently
-		int rc = unqlite_kv_fetch(pDb,data_id,KEY_SIZE,NULL,&nBytes);
-
-		write_log("n bytes: %zu\n", nBytes);
-		if( rc!=UNQLITE_OK){
-			write_log("myfs_write - EIO (not found)\n");
-			return -EIO;
+		fi->fh = (uintptr_t)of;
+		stats_record(STATS_OPEN, start, 0, 0);
+		fuse_reply_open(req, fi);
+	}
+}
+
+static void myfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, \
+												 off_t off, struct fuse_file_info *fi){
+	write_log("myfs_ll_read(ino=%lu, size=%zu, off=%lld)\n", ino, size, off);
+	uint64_t start = stats_now();
+	if (ctl_node_ino(ino) != CTL_NONE){
+		char* buf = malloc(size);
+		open_file* of = open_file_of(fi);
+		int rc = (buf != NULL) ? ctl_read((of != NULL) ? of->report : NULL, buf, \
+																			size, off) : -ENOMEM;
+		if (rc < 0){
+			ll_reply_err(req, STATS_READ, start, rc);
+		}else{
+			stats_record(STATS_READ, start, 0, rc);
+			fuse_reply_buf(req, buf, rc);
 		}
+		free(buf);
+		return;
 	}
 
-	// Write the data in-memory.
-  int written = snprintf(data_block, size, buf);
-	write_log("Written: %d\n", written);
-	write_log("Size: %d\n", size);
-	if (written == 0) return 0;
-	// Write the data block to the store.
-	// The key is the pointer to its UUID
-	int rc;
+	file f;
+	data_splice ds;
+	open_file* of = open_file_of(fi);
+	int rc = ll_get_open(ino, fi, &f, 0);
+	if (rc >= 0){
+		int lock = rc;
+		rc = data_read_buf(&f, size, off, (of != NULL) ? of->ra : NULL, &ds);
+		inode_unlock(lock);
+	}
+	if (rc < 0){
+		ll_reply_err(req, STATS_READ, start, rc);
+		return;
+	}
+	//What is spliced stays put until it has been sent, file lock or not
+	stats_record(STATS_READ, start, 0, rc);
+	fuse_reply_data(req, ds.vec, FUSE_BUF_SPLICE_MOVE);
+	data_splice_free(&ds);
+}
+
+static void myfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, \
+													size_t size, off_t off, struct fuse_file_info *fi){
+	write_log("myfs_ll_write(ino=%lu, size=%zu, off=%lld)\n", ino, size, off);
+	uint64_t start = stats_now();
+	int node = ctl_node_ino(ino);
+	if (node != CTL_NONE){
+		int rc = ctl_write(node, size);
+		if (rc < 0){
+			ll_reply_err(req, STATS_WRITE, start, rc);
+		}else{
+			stats_record(STATS_WRITE, start, 0, rc);
+			fuse_reply_write(req, rc);
+		}
+		return;
+	}
 
-	if (offset == 0){
-		write_log("Adding to start of file!\n");
-		rc = unqlite_kv_store(pDb, data_id, KEY_SIZE, &data_block, size);
+	if (txn_begin() != 0){
+		ll_reply_err(req, STATS_WRITE, start, -EIO);
+		return;
+	}
+	file f;
+	int rc = ll_get_open(ino, fi, &f, 1);
+	if (rc >= 0){
+		int lock = rc;
+		rc = file_write(&f, buf, size, off);
+		inode_unlock(lock);
+	}
+	rc = txn_end(rc);
+	if (rc < 0){
+		ll_reply_err(req, STATS_WRITE, start, rc);
 	}else{
-		write_log("Appending to the end of a file!\n");
-		rc = unqlite_kv_append(pDb, data_id, KEY_SIZE, &data_block, size);
+		stats_record(STATS_WRITE, start, 0, rc);
+		fuse_reply_write(req, rc);
 	}
+}
 
-	if( rc != UNQLITE_OK ){
-		write_log("myfs_write - EIO");
-		return -EIO;
+static void myfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, \
+															struct fuse_bufvec *bufv, off_t off, \
+															struct fuse_file_info *fi){
+	size_t size;
+	char* owned;
+	const char* buf = bufvec_flatten(bufv, &size, &owned);
+	if (buf == NULL){
+		ll_reply_err(req, STATS_WRITE, stats_now(), -ENOMEM);
+		return;
 	}
+	myfs_ll_write(req, ino, buf, size, off, fi);
+	free(owned);
+}
 
-	write_log("Successfully written to DB\n");
-	// Update the fcb in-memory.
-	time_t now = time(NULL);
-	requested_file->mtime=now;
-	requested_file->ctime=now;
-	requested_file->size = requested_file->size + size;
-	write_log("Current size: %d\n", requested_file->size);
-
-	//Write metadata back to DB too
-	write_log("Meta data ID: %x\n", requested_file->meta_data_id);
-	rc = unqlite_kv_store(pDb, &requested_file->meta_data_id, KEY_SIZE, \
-												requested_file, sizeof(file));
-	write_log("Successfully written meta data to DB\n");
-
-	if (rc != UNQLITE_OK){
-		write_log("DB Error in myfs write\n");
-		return rc;
+static void myfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, \
+															off_t offset, off_t length, \
+															struct fuse_file_info *fi){
+	write_log("myfs_ll_fallocate(ino=%lu, mode=%d, offset=%lld, length=%lld)\n", \
+						ino, mode, offset, length);
+	uint64_t start = stats_now();
+	if (ctl_node_ino(ino) != CTL_NONE){
+		ll_reply_err(req, STATS_FALLOCATE, start, -EPERM);
+		return;
 	}
-
-  return size;
+	if (txn_begin() != 0){
+		ll_reply_err(req, STATS_FALLOCATE, start, -EIO);
+		return;
+	}
+	file f;
+	int rc = ll_get_open(ino, fi, &f, 1);
+	if (rc >= 0){
+		int lock = rc;
+		rc = file_fallocate(&f, mode, offset, length);
+		inode_unlock(lock);
+	}
+	ll_reply_err(req, STATS_FALLOCATE, start, txn_end(rc));
 }
 
-// Set the size of a file.
-// Read 'man 2 truncate'.
 /**
- * Makes a file a requested size smaller
- * @param path the file
- * @param newsize the new size of the file
- * @return 0 upon success, non-zero upon failure
+ * Writes back a file for flush, release and fsync. fsync also waits for the
+ * commit, whatever the sync mode, and reports any earlier failed commit the
+ * open file has not been told about.
+ *
+ * @param of the open file, or NULL to find it by its inode number
+ * @param op which of them it is
  */
-int myfs_truncate(const char *path, off_t newsize){
-	write_log("\n== ATTEMPTING TRUNCATE ==\n");
-  write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
-	//Mustn't be larger than is allowed in size
-	if(newsize >= MY_MAX_FILE_SIZE){
-		write_log("myfs_truncate - EFBIG");
-		return -EFBIG;
+static void ll_sync(fuse_req_t req, fuse_ino_t ino, open_file* of, \
+										stats_op op){
+	uint64_t start = stats_now();
+	if (ctl_node_ino(ino) != CTL_NONE){
+		ll_reply_err(req, op, start, 0);
+		return;
 	}
-
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("Getattr file not found");
-		return -ENOENT;
+	if (txn_begin() != 0){
+		ll_reply_err(req, op, start, -EIO);
+		return;
+	}
+	uuid_t id;
+	int rc = 0;
+	if (of != NULL){
+		memcpy(id, of->id, sizeof(uuid_t));
+	}else{
+		rc = ino_to_id(ino, id);
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
+	if (rc == 0){
+		rc = sync_id(id);
+	}
+	rc = (op == STATS_FSYNC) ? txn_end_fsync(rc, open_file_errseq(of)) : \
+														 txn_end(rc);
+	ll_reply_err(req, op, start, rc);
+}
 
-	requested_file->size = newsize;
+static void myfs_ll_flush(fuse_req_t req, fuse_ino_t ino, \
+													struct fuse_file_info *fi){
+	write_log("myfs_ll_flush(ino=%lu)\n", ino);
+	ll_sync(req, ino, open_file_of(fi), STATS_FLUSH);
+}
 
-	// Write the fcb to the store.
-  int rc = unqlite_kv_store(pDb,&(requested_file->meta_data_id),KEY_SIZE, \
-														requested_file,sizeof(file));
+static void myfs_ll_release(fuse_req_t req, fuse_ino_t ino, \
+														struct fuse_file_info *fi){
+	write_log("myfs_ll_release(ino=%lu)\n", ino);
+	open_file* of = open_file_of(fi);
+	ll_sync(req, ino, of, STATS_RELEASE);
+	open_file_free(of);
+}
 
-	if( rc != UNQLITE_OK ){
-		write_log("myfs_write - EIO");
-		return -EIO;
-	}
+static void myfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, \
+													struct fuse_file_info *fi){
+	write_log("myfs_ll_fsync(ino=%lu, datasync=%d)\n", ino, datasync);
+	ll_sync(req, ino, open_file_of(fi), STATS_FSYNC);
+}
 
-	return 0;
+static void myfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, \
+														struct fuse_file_info *fi){
+	write_log("myfs_ll_opendir(ino=%lu)\n", ino);
+	uint64_t start = stats_now();
+	//Only for fsyncdir's count of failed commits, see myfs_opendir()
+	open_file* of = NULL;
+	int rc = 0;
+	if (ctl_node_ino(ino) == CTL_NONE){
+		uuid_t id;
+		rc = ino_to_id(ino, id);
+		if (rc == 0){
+			of = open_file_new(id, CTL_NONE);
+			rc = (of != NULL) ? 0 : -ENOMEM;
+		}
+	}
+	if (rc != 0){
+		ll_reply_err(req, STATS_OPENDIR, start, rc);
+	}else{
+		fi->fh = (uintptr_t)of;
+		stats_record(STATS_OPENDIR, start, 0, 0);
+		fuse_reply_open(req, fi);
+	}
 }
 
-/**
- * Update's this file's permissions.
- * @param path the path of the file
- * @param mode the new permissions
- * @return 0 upon success, non-zero upon failure
- */
-int myfs_chmod(const char *path, mode_t mode){
-	write_log("\n== ATTEMPTING CHMOD ==");
-  write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+static void myfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, \
+															 struct fuse_file_info *fi){
+	write_log("myfs_ll_releasedir(ino=%lu)\n", ino);
+	uint64_t start = stats_now();
+	open_file_free(open_file_of(fi));
+	ll_reply_err(req, STATS_RELEASEDIR, start, 0);
+}
 
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("chmod file not found");
-		return -ENOENT;
+static void myfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, \
+														 struct fuse_file_info *fi){
+	write_log("myfs_ll_fsyncdir(ino=%lu, datasync=%d)\n", ino, datasync);
+	uint64_t start = stats_now();
+	//Nothing is buffered for directories, so there is only the commit
+	int rc = txn_begin();
+	if (rc == 0){
+		rc = txn_end_fsync(0, open_file_errseq(open_file_of(fi)));
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
+	ll_reply_err(req, STATS_FSYNCDIR, start, rc);
+}
 
-	requested_file->mode = mode;
-	//Write back to DB - recall we only have 1 file right now
-	int rc = unqlite_kv_store(pDb, &(requested_file->meta_data_id), KEY_SIZE, \
-														requested_file, sizeof(file));
-	//Same sanity checks
-	if( rc != UNQLITE_OK ){
-		write_log("myfs_create - EIO");
-		return -EIO;
+//A reply to a readdir being put together for the kernel
+typedef struct ll_dirbuf {
+	fuse_req_t req;
+	char* buf;
+	size_t used;
+	size_t size;
+} ll_dirbuf;
+
+//Entries go straight into a buffer the size the kernel asked for, and the
+//listing stops once the next one does not fit
+static int ll_dir_add(void* ctx, const char* name, const unsigned char* child, \
+											mode_t type, off_t next){
+	ll_dirbuf* b = ctx;
+	struct stat st;
+	memset(&st, 0, sizeof(struct stat));
+	st.st_ino = (child != NULL) ? ino_peek(child) : INO_UNKNOWN;
+	st.st_mode = type;
+
+	size_t len = fuse_add_direntry(b->req, b->buf + b->used, b->size - b->used, \
+																	name, &st, next);
+	if (len > b->size - b->used){
+		return 1;
 	}
-  return 0;
+	b->used += len;
+	return 0;
 }
 
-// Set ownership.
-/**
- * Changes the ownership of a file.
- *
- * @param path where the file is located
- * @param uid the user-id of the new owner
- * @param gid the group id of the new owner
- */
-int myfs_chown(const char *path, uid_t uid, gid_t gid){
-	write_log("== ATTEMPTING CHOWN ==");
-  write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
+static void myfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, \
+														off_t off, struct fuse_file_info *fi){
+	(void) fi;
+	write_log("myfs_ll_readdir(ino=%lu, size=%zu, off=%lld)\n", ino, size, off);
+	uint64_t start = stats_now();
+	file* dir = malloc(sizeof(file));
+	ll_dirbuf b = {req, malloc(size), 0, size};
+	if (dir == NULL || b.buf == NULL){
+		free(dir);
+		free(b.buf);
+		ll_reply_err(req, STATS_READDIR, start, -ENOMEM);
+		return;
+	}
 
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("chown file not found");
-		return -ENOENT;
+	//The directory stays locked so its listing cannot change under us
+	int rc;
+	int node = ctl_node_ino(ino);
+	if (node != CTL_NONE){
+		rc = (node == CTL_DIR) ? ctl_readdir(off, ll_dir_add, &b) : -ENOTDIR;
+	}else if ((rc = ll_get_locked(ino, dir, 0)) >= 0){
+		int lock = rc;
+		rc = S_ISDIR(dir->mode) ? file_readdir(dir, off, ll_dir_add, &b) : -ENOTDIR;
+		inode_unlock(lock);
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
+	free(dir);
 
-	//Find us the child if it exists
-	requested_file->uid = uid;
-	requested_file->gid = gid;
-	//Update the database
-	int rc = unqlite_kv_store(pDb, &(requested_file->meta_data_id), KEY_SIZE, \
-														requested_file, sizeof(file));
-	return 0;
+	if (rc != 0){
+		ll_reply_err(req, STATS_READDIR, start, rc);
+	}else{
+		stats_record(STATS_READDIR, start, 0, 0);
+		fuse_reply_buf(req, b.buf, b.used);
+	}
+	free(b.buf);
 }
 
-// Create a directory.
-/**
- * Creates a new directory
- *
- * @param path where to locate the file at
- * @param mode the permissions for the file
- */
-int myfs_mkdir(const char *path, mode_t mode){
-	//The trick here is that creating an empty file and creating a directory are
-	//the exact same operation but with different permissions. It isn't until
-	//you do something with the file/directory that things actually differ.
-	write_log("\n== ATTEMPTING MKDIR ==\n");
-	write_log("myfs_mkdir: %s\n",path);
-	return myfs_create(path, mode|S_IFDIR, NULL);
+//Replies to reads are spliced from the data log's segment files if the kernel
+//lets us
+static void myfs_ll_init(void* userdata, struct fuse_conn_info* conn){
+	(void) userdata;
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE){
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	}
+}
+
+static void myfs_ll_destroy(void* userdata){
+	myfs_destroy(userdata);
 }
 
+static struct fuse_lowlevel_ops myfs_ll_oper = {
+	.init		= myfs_ll_init,
+	.destroy	= myfs_ll_destroy,
+	.lookup		= myfs_ll_lookup,
+	.forget		= myfs_ll_forget,
+	.getattr	= myfs_ll_getattr,
+	.setattr	= myfs_ll_setattr,
+	.mkdir		= myfs_ll_mkdir,
+	.unlink		= myfs_ll_unlink,
+	.rmdir		= myfs_ll_rmdir,
+	.rename		= myfs_ll_rename,
+	.open		= myfs_ll_open,
+	.read		= myfs_ll_read,
+	.write		= myfs_ll_write,
+	.write_buf	= myfs_ll_write_buf,
+	.fallocate	= myfs_ll_fallocate,
+	.flush		= myfs_ll_flush,
+	.release	= myfs_ll_release,
+	.fsync		= myfs_ll_fsync,
+	.opendir	= myfs_ll_opendir,
+	.releasedir	= myfs_ll_releasedir,
+	.fsyncdir	= myfs_ll_fsyncdir,
+	.readdir	= myfs_ll_readdir,
+	.create		= myfs_ll_create,
+};
+
+/*
+ ***************
+	Mounting
+ ***************
+*/
+
+//Mount options of our own, eg: -o lowlevel
+typedef struct myfs_config {
+	int lowlevel;
+	int write_back;
+	int log_level;
+	int dedup;
+	char* compress;
+	int inline_max;
+	char* backend;
+	char* segments;
+	int compact_mbps;
+	int readahead;
+	char* sync_mode;
+	int sync_ms;
+	int sync_kb;
+} myfs_config;
+
+static struct fuse_opt myfs_opts[] = {
+	{"lowlevel", offsetof(myfs_config, lowlevel), 1},
+	{"write_back", offsetof(myfs_config, write_back), 1},
+	{"log_level=%d", offsetof(myfs_config, log_level), 0},
+	{"dedup", offsetof(myfs_config, dedup), 1},
+	{"compress=%s", offsetof(myfs_config, compress), 0},
+	{"inline_max=%d", offsetof(myfs_config, inline_max), 0},
+	{"backend=%s", offsetof(myfs_config, backend), 0},
+	{"segments=%s", offsetof(myfs_config, segments), 0},
+	{"compact_mbps=%d", offsetof(myfs_config, compact_mbps), 0},
+	{"readahead=%d", offsetof(myfs_config, readahead), 0},
+	{"sync_mode=%s", offsetof(myfs_config, sync_mode), 0},
+	{"sync_ms=%d", offsetof(myfs_config, sync_ms), 0},
+	{"sync_kb=%d", offsetof(myfs_config, sync_kb), 0},
+	FUSE_OPT_END
+};
+
 /**
- * Deletes a file.
+ * Switches to another backend and gives it an empty root directory, for
+ * backends that start out empty (ie: memory). The root keeps its UUID and
+ * owner.
  *
- * @param path the file to be deleted
+ * @param name the backend
  *
+ * @return 0 on success
  */
-int myfs_unlink(const char* path){
-	write_log("\n== ATTEMPTING UNLINK ==\n");
-	write_log("myfs_unlink: %s\n",path);
-	//NOTICE: We do not implement symlinks in this file system.
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("unlink file not found");
-		return -ENOENT;
+static int myfs_scratch_backend(const char* name){
+	if (kv_set_backend(name) != 0){
+		return -1;
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
+	time_t now = time(NULL);
+	root_directory->mtime = now;
+	root_directory->ctime = now;
+	root_directory->size = 0;
+	root_directory->number_children = REST_POS;
+	memset(root_directory->children, 0, sizeof(root_directory->children));
+	memcpy(root_directory->children[SELF_POS], root_directory->meta_data_id, \
+				 sizeof(uuid_t));
 
-	//Create space for parent
-	file* parent = malloc(sizeof(file));
-	if(parent == NULL) {
-		write_log("myfs_unlink- malloc failed\n");
-		return UNQLITE_NOTFOUND;
-	}
-	//Load parent into local storage
-	unqlite_int64 size = sizeof(file);
-	int rc = unqlite_kv_fetch(pDb, &requested_file->children[PARENT_POS], \
-		 												KEY_SIZE, parent, &size);
-	if (rc != UNQLITE_OK){
-		write_log("DB error in myfs UNLINK\n");
-		return rc;
-	}
-	write_log("Loaded parent with path: %s\n", parent->path);
-	//Find where that child exists
-	int child_number = find_child_number(path, parent);
-	write_log("Child located at index: %d\n", child_number);
-	if (child_number < 0 ){
-		write_log("myfs unlink file not found - something has gone HORRIBLY \
-							wrong\n");
-		return -ENOENT;
+	if (txn_begin() != 0){
+		return -1;
 	}
-	//Delete that child
-	delete_child(path, parent);
-	write_log("\nParent (%s) now has %d children\n",parent->path, \
-						parent->number_children);
-	//Write back to DB
-	int wp = unqlite_kv_store(pDb, &parent->meta_data_id, KEY_SIZE, parent, \
-														sizeof(file));
-	if (wp != UNQLITE_OK){
-		write_log("Error writing parent back to DB\n");
-		return wp;
+	int rc = inode_store(root_directory);
+	if (rc == UNQLITE_OK){
+		rc = dir_init(root_directory);
 	}
+	return txn_end(rc);
+}
 
-	//Delete.
-	//dmd = delete meta data
-	//dfd = delete file data
-	int dmd = unqlite_kv_delete(pDb, &requested_file->meta_data_id, KEY_SIZE);
-	int dfd = unqlite_kv_delete(pDb, &requested_file->file_data_id, KEY_SIZE);
-	if (dmd != UNQLITE_OK || dfd != UNQLITE_OK){
-		write_log("DMD: %d DFD: %d\n", dmd, dfd);
-		return (dfd==UNQLITE_OK)?dmd:dfd;
-	 }
-
-	 write_log("Deleted child from DB\n");
-
-	//Check if root directory needs updating
-	if (strcmp(parent->path,"/")==0){
-		write_log("Root also needs updated\n");
-		memcpy(root_directory, parent, sizeof(file));
-		//Root might be cached so we need to update that too
-		memcpy(requested_file, root_directory, sizeof(file));
-		write_log("Root has %d children.\n", root_directory->number_children);
-	}else{
-		//Ensure cache remains consistent
-		memcpy(requested_file, parent, sizeof(file));
+/**
+ * Mounts the file system with the low level frontend.
+ *
+ * @param args the command line, without our own options
+ *
+ * @return the exit code
+ */
+static int myfs_mount_lowlevel(struct fuse_args* args){
+	char* mountpoint;
+	int multithreaded;
+	int foreground;
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1){
+		return 1;
 	}
 
-	//Otherwise
-	free(parent);
-  return 0;
+	int err = 1;
+	struct fuse_chan* ch = fuse_mount(mountpoint, args);
+	if (ch != NULL){
+		struct fuse_session* se = fuse_lowlevel_new(args, &myfs_ll_oper, \
+																								sizeof(myfs_ll_oper), NULL);
+		if (se != NULL){
+			if (fuse_set_signal_handlers(se) != -1){
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	return err ? 1 : 0;
 }
 
-// Delete a directory.
 /**
- * Deletes a directory.
+ * Mounts the file system once it has been initialised. By default the kernel
+ * talks to us in paths (the high level frontend), as it did before there was
+ * a choice; "-o lowlevel" mounts the inode based frontend instead, which
+ * leaves resolving paths to the kernel's dentry cache. "-o log_level=N" sets how much is
+ * logged: 0 for errors only, 1 (the default) for notable events and 2 for
+ * tracing, if it was compiled in. "-o dedup" stores new blocks by their
+ * content, so that identical blocks are only stored once. "-o compress=lz4"
+ * (or zstd) compresses new blocks. "-o inline_max=N" sets how big a file can
+ * be and still keep its data in its meta data record (0 for never).
+ * "-o backend=memory" keeps everything in memory instead of the DB, starting
+ * from an empty root, and loses it all on unmount. "-o segments=DIR" appends
+ * new blocks' data to segment files in DIR rather than storing them in the DB,
+ * and "-o compact_mbps=N" limits how fast dead data in them is reclaimed (0
+ * for never). "-o readahead=N" reads up to N KiB ahead of sequential readers
+ * (0 for never). "-o sync_mode=strict" (the default) commits every operation
+ * before it returns, "-o sync_mode=periodic" commits every "-o sync_ms=N"
+ * milliseconds or once "-o sync_kb=N" KiB are waiting (0 for no limit), and
+ * "-o sync_mode=fsync" only commits for fsync(2) and on unmount.
+ * "-o write_back" buffers writes until the file is flushed or closed.
  *
- * @param path the path of the directory
+ * @param argc the argument count main() was given
+ * @param argv the arguments main() was given
  *
+ * @return the exit code
  */
-int myfs_rmdir(const char *path){
-	//Once again, observer that deleting a file and deleting an empty directory
-	//are virtually the same thing. By making our logical in unlink a tiny bit
-	//more complex (doing 1 check to see if it is a file or a directory and doing
-	//one change base upon it) can save us from having 100s of lines of
-	//duplicated code. A discussion of why this isn't refactored into its own
-	//method is in the report.
-	write_log("\n==ATTEMPTING RMDIR==\n");
-	write_log("myfs_rmdir: %s\n",path);
-	//Attempt caching.
-	if (do_caching(path) == -ENOENT){
-		write_log("unlink file not found");
-		return -ENOENT;
+int myfs_main(int argc, char* argv[]){
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	myfs_config config;
+	memset(&config, 0, sizeof(myfs_config));
+	config.log_level = MYFS_LOG_INFO;
+	config.inline_max = MYFS_INLINE_MAX;
+	config.compact_mbps = MYFS_COMPACT_MBPS;
+	config.readahead = MYFS_READAHEAD_KB;
+	config.sync_ms = MYFS_SYNC_MS;
+	config.sync_kb = MYFS_SYNC_KB;
+	if (fuse_opt_parse(&args, &config, myfs_opts, NULL) == -1){
+		return 1;
 	}
-
-	write_log("File should be cached: %s\n", requested_file->path);
-	if (requested_file->size < 0){
-		write_log("Directory not found\n");
-		return -ENOENT;
+	log_set_level(config.log_level);
+	dedup_set_enabled(config.dedup);
+	if (config.write_back){
+		wb_set_dirty_limit(MYFS_DIRTY_LIMIT);
 	}
-
-	if (requested_file->number_children > 2){
-		write_log("Directory not empty\n");
-		return -ENOTEMPTY;
+	data_set_inline_max((config.inline_max > 0) ? config.inline_max : 0);
+	if (config.compress != NULL){
+		int bad = pack_set_codec(config.compress);
+		free(config.compress);
+		if (bad){
+			return 1;
+		}
+	}
+	if (config.backend != NULL){
+		int bad = strcmp(config.backend, "unqlite") != 0 && \
+							myfs_scratch_backend(config.backend) != 0;
+		free(config.backend);
+		if (bad){
+			return 1;
+		}
+	}
+	seg_set_budget(config.compact_mbps);
+	ra_set_window(config.readahead);
+	ctl_reset();
+	if (config.sync_mode != NULL){
+		int mode = txn_sync_parse(config.sync_mode);
+		free(config.sync_mode);
+		uint64_t bytes = (config.sync_kb > 0) ? (uint64_t)config.sync_kb * 1024 : 0;
+		if (mode < 0 || txn_set_sync(mode, config.sync_ms, bytes) != 0){
+			return 1;
+		}
+	}
+	if (config.segments != NULL){
+		int bad = seg_open(config.segments) != 0;
+		free(config.segments);
+		if (bad){
+			return 1;
+		}
 	}
 
-	//Otherwise remove as if it was a regular file
-	return myfs_unlink(path);
+	int rc;
+	if (config.lowlevel){
+		log_info("Mounting with the low level frontend\n");
+		rc = myfs_mount_lowlevel(&args);
+	}else{
+		log_info("Mounting with the high level frontend\n");
+		rc = fuse_main(args.argc, args.argv, &myfs_oper, NULL);
+	}
+	fuse_opt_free_args(&args);
+	return rc;
 }
 
+/*
+ ***************
+	Entry Point
+ ***************
+*/
 
-// OPTIONAL - included as an example
-// Flush any cached data.
-int myfs_flush(const char *path, struct fuse_file_info *fi){
-    int retstat = 0;
-		write_log("\n==ATTEMPTING FLUSH==\n");
-
-    write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+//The support code's own main() opens the DB and hands myfs_oper straight to
+//fuse_main(), so none of the mount options above would be understood. Building
+//with -DMYFS_MAIN (and leaving the support code's main() out) uses this one
+//instead, which mounts through myfs_main(). The root's meta data UUID is kept
+//under MYFS_ROOT_KEY, and an empty root is made the first time.
+#ifdef MYFS_MAIN
+#ifndef MYFS_DB_PATH
+#define MYFS_DB_PATH "myfs.db"
+#endif
 
-    return retstat;
-}
+#define MYFS_ROOT_KEY "myfs_root"
 
-// OPTIONAL - included as an example
-// Release the file. There will be one call to release for each call to open.
-int myfs_release(const char *path, struct fuse_file_info *fi){
-    int retstat = 0;
-		write_log("\n==ATTEMPTING RELEASE==\n");
-    write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+/**
+ * Loads the root directory into root_directory, making it if the DB is new.
+ *
+ * @return 0 on success
+ */
+static int myfs_load_root(){
+	root_directory = calloc(1, sizeof(file));
+	if (root_directory == NULL){
+		return -1;
+	}
+	uuid_t id;
+	unqlite_int64 len = sizeof(uuid_t);
+	int rc = kv_fetch(MYFS_ROOT_KEY, strlen(MYFS_ROOT_KEY), id, &len);
+	if (rc == UNQLITE_OK && len == sizeof(uuid_t)){
+		rc = inode_get(id, root_directory);
+		if (rc != 0){
+			log_error("The root directory is missing: %d\n", rc);
+		}
+		return rc;
+	}else if (rc != UNQLITE_NOTFOUND){
+		log_error("Could not find the root directory: %d\n", rc);
+		return -1;
+	}
 
-    return retstat;
-}
+	time_t now = time(NULL);
+	strcpy(root_directory->path, "/");
+	uuid_generate(root_directory->meta_data_id);
+	uuid_generate(root_directory->file_data_id);
+	root_directory->uid = getuid();
+	root_directory->gid = getgid();
+	root_directory->mode = S_IFDIR | 0755;
+	root_directory->mtime = now;
+	root_directory->ctime = now;
+	root_directory->number_children = REST_POS;
+	memcpy(root_directory->children[SELF_POS], root_directory->meta_data_id, \
+				 sizeof(uuid_t));
 
-// Open a file. Open should check if the operation is permitted for the given
-// flags (fi->flags).
-// Read 'man 2 open'.
-static int myfs_open(const char *path, struct fuse_file_info *fi){
-	write_log("\n== ATTEMPTING OPEN ==\n");
-	write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
-	write_log("Flags: %d\n", fi->flags);
-	if (do_caching(path) == -ENOENT){
-		write_log("unlink file not found");
-		return -ENOENT;
+	if (txn_begin() != 0){
+		return -1;
 	}
-	write_log("File should be cached: %s\n", requested_file->path);
-	if (requested_file->size < 0){
-		write_log("Directory not found\n");
-		return -ENOENT;
+	rc = inode_store(root_directory);
+	if (rc == UNQLITE_OK){
+		rc = dir_init(root_directory);
 	}
-
-	int mode = requested_file->mode;
-	write_log("Mode: %d\n", mode);
-	if ((mode & S_IRUSR) == S_IRUSR){
-		write_log("Permission granted!\n");
-		return 0;
-	}else{
-		write_log("Permission denied!\n");
-		return -EACCES;
+	if (rc == UNQLITE_OK){
+		rc = kv_store(MYFS_ROOT_KEY, strlen(MYFS_ROOT_KEY), \
+									root_directory->meta_data_id, sizeof(uuid_t));
 	}
-
-	return 0;
+	return txn_end(rc);
 }
 
-static struct fuse_operations myfs_oper = {
-	.getattr	= myfs_getattr,
-	.readdir	= myfs_readdir,
-	.open		= myfs_open,
-	.read		= myfs_read,
-	.create		= myfs_create,
-	.utime 		= myfs_utime,
-	.write		= myfs_write,
-	.truncate	= myfs_truncate,
-	.flush		= myfs_flush,
-	.release	= myfs_release,
-	.chmod = myfs_chmod,
-	.chown = myfs_chown,
-	.unlink = myfs_unlink,
-	.rmdir = myfs_rmdir,
-	.mkdir = myfs_mkdir,
-	.rmdir = myfs_rmdir,
-};
+int main(int argc, char* argv[]){
+	int rc = unqlite_open(&pDb, MYFS_DB_PATH, UNQLITE_OPEN_CREATE);
+	if (rc != UNQLITE_OK){
+		log_error("Could not open " MYFS_DB_PATH ": %d\n", rc);
+		return 1;
+	}
+	if (myfs_load_root() != 0){
+		unqlite_close(pDb);
+		return 1;
+	}
+	rc = myfs_main(argc, argv);
+	unqlite_close(pDb);
+	return rc;
+}
+#endif
@@ -0,0 +1,1219 @@
+/*
+  Microbenchmarks for myfs. These call into the file system directly, without
+	a FUSE mount, so that the cost of our own data structures is not hidden
+	behind kernel round trips.
+
+	myfs.c is included rather than linked so that its static callbacks and
+	helpers can be reached. Build it with the same support code and unqlite
+	sources as the file system itself, eg:
+
+		gcc -O2 -o myfs_bench myfs_bench.c <support sources> unqlite.c -luuid \
+			-lfuse -lpthread
+
+	Nothing is mounted; libfuse is only linked because myfs.c can mount.
+
+	Usage: myfs_bench [-w workload|micro] [-c] [-l build] [-b backend]
+									[-s segment dir] [-r readahead KiB] [database file]
+
+	With no options every microbenchmark runs, followed by every workload (see
+	the table of workloads near the end). -w runs just the one workload, or
+	just the microbenchmarks. -c prints the workloads as CSV, with -l naming
+	the build in each row, so that runs can be kept and compared. -b picks the
+	backend, eg: memory to time the file system on its own, and -s puts file
+	data in a data log in the given (empty) directory. -r sets how far ahead of
+	sequential readers to read (0 for never). The database defaults to an
+	in-memory one.
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#include "myfs.c"
+
+//There is no FUSE session, so every call is made as the benchmarking user.
+static struct fuse_context bench_context;
+
+struct fuse_context* fuse_get_context(void){
+	bench_context.uid = getuid();
+	bench_context.gid = getgid();
+	return &bench_context;
+}
+
+//Lookups timed per directory size, up to how many children, and up to how
+//many the linear scan is still timed for
+#define BENCH_LOOKUPS 2000
+#define BENCH_MAX_CHILDREN 4096
+#define BENCH_MAX_SCAN 256
+
+//Creates and unlinks timed per directory size
+#define DIR_OPS 1000
+
+/**
+ * @return the current time in nanoseconds
+ */
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//What scan_child_number() looks for
+typedef struct scan_ctx {
+	const char* path;
+	file* child;
+	int position;
+	int seen;
+} scan_ctx;
+
+static int scan_fill(void* ctx, const char* name, const unsigned char* child, \
+										 mode_t type, off_t next){
+	scan_ctx* scan = ctx;
+	(void) name;
+	(void) type;
+	(void) next;
+	if (inode_fetch(child, scan->child) != UNQLITE_OK){
+		log_error("DB error in scanning for child\n");
+		return -EIO;
+	}
+	if (strcmp(path_name(scan->path), scan->child->path) == 0){
+		scan->position = scan->seen;
+		return 1;
+	}
+	scan->seen++;
+	return 0;
+}
+
+/**
+ * Linearly searches a directory for a child by fetching every child's meta
+ * data. This is how lookups used to work before directories had a name index,
+ * and is only kept here to compare against.
+ *
+ * @param path the path of the file to be found
+ * @param dir the parent directory (exact parent)
+ *
+ * @return how many children come before it, or a < 0 number if the child
+ *				 cannot be located.
+ */
+static int scan_child_number(const char* path, file* dir){
+	scan_ctx scan = {path, malloc(sizeof(file)), -1, 0};
+	if (scan.child == NULL){
+		return -1;
+	}
+	dir_iterate(dir, 0, scan_fill, &scan);
+	free(scan.child);
+	return scan.position;
+}
+
+/**
+ * Sets up an empty file system the way the mount would.
+ *
+ * @param backend what to keep it in
+ * @param db_path where the scratch database lives, for unqlite
+ *
+ * @return 0 on success
+ */
+static int bench_init(const char* backend, const char* db_path){
+	if (kv_set_backend(backend) != 0){
+		return 1;
+	}
+	int rc = unqlite_open(&pDb, db_path, UNQLITE_OPEN_CREATE);
+	if (rc != UNQLITE_OK){
+		fprintf(stderr, "Could not open %s: %d\n", db_path, rc);
+		return rc;
+	}
+
+	root_directory = calloc(1, sizeof(file));
+	strcpy(root_directory->path, "/");
+	uuid_generate(root_directory->meta_data_id);
+	uuid_generate(root_directory->file_data_id);
+	root_directory->mode = S_IFDIR | 0755;
+	root_directory->number_children = REST_POS;
+	memcpy(root_directory->children[SELF_POS], root_directory->meta_data_id, \
+				 sizeof(uuid_t));
+	rc = kv_store(root_directory->meta_data_id, KEY_SIZE, root_directory, \
+								sizeof(file));
+	if (rc == UNQLITE_OK){
+		rc = dir_init(root_directory);
+	}
+	return rc;
+}
+
+/**
+ * Times looking children up by path in directories of growing size, once
+ * through the name index and once with the old linear scan. The dentry cache
+ * is switched off so that every lookup reaches the directory.
+ */
+static void bench_lookup(){
+	printf("# child lookup latency against directory size\n");
+	printf("%10s %14s %14s\n", "entries", "index_ns", "scan_ns");
+	myfs_mkdir("/lookup", 0755);
+
+	dcache_set_capacity(0);
+	file* dir = malloc(sizeof(file));
+	char path[MY_MAX_PATH];
+
+	for (int entries = 8; entries <= BENCH_MAX_CHILDREN; entries *= 2){
+		//Small enough that every child's path fits in MY_MAX_PATH
+		char dir_path[32];
+		snprintf(dir_path, sizeof(dir_path), "/lookup/dir%d", entries);
+		myfs_mkdir(dir_path, 0755);
+		for (int i = 0; i < entries; i++){
+			snprintf(path, MY_MAX_PATH, "%s/f%d", dir_path, i);
+			myfs_create(path, S_IFREG | 0644, NULL);
+		}
+		do_caching(dir_path, dir);
+
+		double start = now_ns();
+		uuid_t child;
+		for (int i = 0; i < BENCH_LOOKUPS; i++){
+			snprintf(path, MY_MAX_PATH, "%s/f%d", dir_path, rand() % entries);
+			dentry_lookup(dir, path_name(path), child);
+		}
+		double index_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+		if (entries > BENCH_MAX_SCAN){
+			printf("%10d %14.0f %14s\n", entries, index_ns, "-");
+			continue;
+		}
+		start = now_ns();
+		for (int i = 0; i < BENCH_LOOKUPS; i++){
+			snprintf(path, MY_MAX_PATH, "%s/f%d", dir_path, rand() % entries);
+			scan_child_number(path, dir);
+		}
+		double scan_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+		printf("%10d %14.0f %14.0f\n", entries, index_ns, scan_ns);
+	}
+
+	free(dir);
+	dcache_set_capacity(MYFS_DCACHE_SIZE);
+}
+
+//Counts what a listing hands back
+static int bench_count(void* ctx, const char* name, const unsigned char* child, \
+											 mode_t type, off_t next){
+	(void) name;
+	(void) child;
+	(void) type;
+	(void) next;
+	(*(long*)ctx)++;
+	return 0;
+}
+
+/**
+ * Times creating and unlinking a file, and listing per entry, in directories
+ * of growing size. Each of these should cost the same however many children
+ * the directory already has.
+ */
+static void bench_dir(){
+	printf("# directory operations against directory size\n");
+	printf("%10s %14s %14s %14s\n", "entries", "create_ns", "unlink_ns", \
+				 "readdir_ns");
+
+	dcache_set_capacity(0);
+	file* dir = malloc(sizeof(file));
+	char path[MY_MAX_PATH];
+	myfs_mkdir("/big", 0755);
+
+	int entries = 0;
+	for (int size = 1000; size <= 100000; size *= 10){
+		for (; entries < size - DIR_OPS; entries++){
+			snprintf(path, MY_MAX_PATH, "/big/f%d", entries);
+			myfs_create(path, S_IFREG | 0644, NULL);
+		}
+
+		//The last DIR_OPS are timed, then taken away and put back again
+		double start = now_ns();
+		for (int i = entries; i < size; i++){
+			snprintf(path, MY_MAX_PATH, "/big/f%d", i);
+			myfs_create(path, S_IFREG | 0644, NULL);
+		}
+		double create_ns = (now_ns() - start) / DIR_OPS;
+
+		start = now_ns();
+		for (int i = entries; i < size; i++){
+			snprintf(path, MY_MAX_PATH, "/big/f%d", i);
+			myfs_unlink(path);
+		}
+		double unlink_ns = (now_ns() - start) / DIR_OPS;
+
+		for (; entries < size; entries++){
+			snprintf(path, MY_MAX_PATH, "/big/f%d", entries);
+			myfs_create(path, S_IFREG | 0644, NULL);
+		}
+
+		do_caching("/big", dir);
+		long listed = 0;
+		start = now_ns();
+		file_readdir(dir, 0, bench_count, &listed);
+		double readdir_ns = (now_ns() - start) / listed;
+
+		printf("%10d %14.0f %14.0f %14.0f\n", size, create_ns, unlink_ns, \
+					 readdir_ns);
+	}
+
+	free(dir);
+	dcache_set_capacity(MYFS_DCACHE_SIZE);
+}
+
+//Renames timed per subtree size
+#define RENAMES 1000
+
+/**
+ * Times renaming a directory back and forth against how many files are below
+ * it, and renaming a temporary file over another in place.
+ */
+static void bench_rename(){
+	printf("# rename latency against subtree size\n");
+	printf("%10s %14s\n", "files", "rename_ns");
+
+	char path[MY_MAX_PATH];
+	int files = 0;
+	myfs_mkdir("/tree", 0755);
+	for (int size = 10; size <= 10000; size *= 10){
+		for (; files < size; files++){
+			snprintf(path, MY_MAX_PATH, "/tree/d%d", files % 10);
+			myfs_mkdir(path, 0755);
+			snprintf(path, MY_MAX_PATH, "/tree/d%d/f%d", files % 10, files);
+			myfs_create(path, S_IFREG | 0644, NULL);
+		}
+
+		double start = now_ns();
+		for (int i = 0; i < RENAMES; i++){
+			myfs_rename((i % 2 == 0) ? "/tree" : "/moved", \
+									(i % 2 == 0) ? "/moved" : "/tree");
+		}
+		printf("%10d %14.0f\n", size, (now_ns() - start) / RENAMES);
+	}
+
+	myfs_create("/target", S_IFREG | 0644, NULL);
+	double start = now_ns();
+	for (int i = 0; i < RENAMES; i++){
+		myfs_create("/target.tmp", S_IFREG | 0644, NULL);
+		myfs_rename("/target.tmp", "/target");
+	}
+	printf("%10s %14.0f\n", "tmp+rename", (now_ns() - start) / RENAMES);
+}
+
+/**
+ * Times finding a file the way each frontend does, against how deep the file
+ * is: by path (high level, with the dentry cache off) and by the UUID its inode
+ * number stands for (low level).
+ */
+static void bench_resolve(){
+	printf("# finding a file against its depth\n");
+	printf("%10s %14s %14s\n", "depth", "path_ns", "inode_ns");
+
+	dcache_set_capacity(0);
+	file* f = malloc(sizeof(file));
+	char path[MY_MAX_PATH] = "";
+	for (int depth = 1; depth <= 8; depth++){
+		strcat(path, "/r");
+		myfs_mkdir(path, 0755);
+		do_caching(path, f);
+		uuid_t id;
+		memcpy(id, f->meta_data_id, sizeof(uuid_t));
+
+		double start = now_ns();
+		for (int i = 0; i < BENCH_LOOKUPS; i++){
+			do_caching(path, f);
+		}
+		double path_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+		start = now_ns();
+		for (int i = 0; i < BENCH_LOOKUPS; i++){
+			inode_get(id, f);
+		}
+		double inode_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+		printf("%10d %14.0f %14.0f\n", depth, path_ns, inode_ns);
+	}
+	free(f);
+	dcache_set_capacity(MYFS_DCACHE_SIZE);
+}
+
+//How much a simulated cp(1) writes, in what size of write
+#define COPY_SIZE (16 * 1024 * 1024)
+#define COPY_IO_SIZE 4096
+
+/**
+ * Times writing a file front to back in page sized writes and closing it, the
+ * way cp(1) would through the kernel, once with the write-back cache and once
+ * with every write going straight to the DB.
+ */
+static void bench_copy(){
+	printf("# sequential %d byte writes of a %d MiB file, then close\n", \
+				 COPY_IO_SIZE, COPY_SIZE / (1024 * 1024));
+	printf("%14s %14s\n", "mode", "MiB_per_sec");
+
+	char buf[COPY_IO_SIZE];
+	memset(buf, 'c', sizeof(buf));
+	const char* modes[] = {"write-back", "write-through"};
+	for (int m = 0; m < 2; m++){
+		wb_set_dirty_limit((m == 0) ? MYFS_DIRTY_LIMIT : 0);
+		char path[MY_MAX_PATH];
+		snprintf(path, MY_MAX_PATH, "/copy%d", m);
+		myfs_create(path, S_IFREG | 0644, NULL);
+
+		double start = now_ns();
+		for (off_t offset = 0; offset < COPY_SIZE; offset += COPY_IO_SIZE){
+			myfs_write(path, buf, COPY_IO_SIZE, offset, NULL);
+		}
+		myfs_release(path, NULL);
+		double seconds = (now_ns() - start) / 1e9;
+
+		printf("%14s %14.1f\n", modes[m], COPY_SIZE / (1024.0 * 1024.0) / seconds);
+		myfs_unlink(path);
+	}
+	wb_set_dirty_limit(WB_DEFAULT_LIMIT);
+}
+
+//How big the sparse image is, and how much of it is read back
+#define SPARSE_SIZE (10LL * 1024 * 1024 * 1024)
+#define SPARSE_READ (64 * 1024 * 1024)
+#define SPARSE_IO_SIZE (128 * 1024)
+
+/**
+ * Times making a sparse disk image the way truncate(1) would, reading back
+ * holes, punching a hole in written data and deleting the image. None of these
+ * should depend on the image's size, and the hole reads should not need the DB.
+ */
+static void bench_sparse(){
+	printf("# a %lld GiB sparse file\n", SPARSE_SIZE / (1024 * 1024 * 1024));
+	printf("%14s %14s %14s\n", "operation", "usec", "db_fetches");
+
+	static char buf[SPARSE_IO_SIZE];
+	memset(buf, 's', sizeof(buf));
+	myfs_create("/image", S_IFREG | 0644, NULL);
+
+	double start = now_ns();
+	myfs_truncate("/image", SPARSE_SIZE);
+	printf("%14s %14.1f %14s\n", "truncate", (now_ns() - start) / 1e3, "-");
+
+	//One read first, so that the file and its block map are cached
+	myfs_read("/image", buf, SPARSE_IO_SIZE, 0, NULL);
+	long fetches = kv_fetches;
+	start = now_ns();
+	for (off_t done = 0; done < SPARSE_READ; done += SPARSE_IO_SIZE){
+		myfs_read("/image", buf, SPARSE_IO_SIZE, SPARSE_SIZE / 2 + done, NULL);
+	}
+	printf("%14s %14.1f %14ld\n", "read_64MiB", (now_ns() - start) / 1e3, \
+				 kv_fetches - fetches);
+
+	memset(buf, 's', sizeof(buf));
+	myfs_write("/image", buf, SPARSE_IO_SIZE, SPARSE_SIZE / 4, NULL);
+	myfs_flush("/image", NULL);
+	start = now_ns();
+	myfs_fallocate("/image", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, \
+								 SPARSE_SIZE / 4 + 100, SPARSE_IO_SIZE / 2, NULL);
+	printf("%14s %14.1f %14s\n", "punch_hole", (now_ns() - start) / 1e3, "-");
+
+	start = now_ns();
+	myfs_unlink("/image");
+	printf("%14s %14.1f %14s\n", "unlink", (now_ns() - start) / 1e3, "-");
+}
+
+/**
+ * Times writing a second copy of a file that is already stored, with and
+ * without dedup, and reports the dedup ratio afterwards. With dedup the copy
+ * only has to store which chunks it uses.
+ */
+static void bench_dedup(){
+	printf("# a second copy of a %d MiB file\n", COPY_SIZE / (1024 * 1024));
+	printf("%14s %14s %14s\n", "mode", "MiB_per_sec", "dedup_ratio");
+
+	char* data = malloc(COPY_SIZE);
+	for (int i = 0; i < COPY_SIZE; i++){
+		data[i] = rand();
+	}
+	wb_set_dirty_limit(0);
+	const char* modes[] = {"off", "dedup"};
+	for (int m = 0; m < 2; m++){
+		dedup_set_enabled(m);
+		myfs_create("/original", S_IFREG | 0644, NULL);
+		myfs_write("/original", data, COPY_SIZE, 0, NULL);
+		myfs_create("/duplicate", S_IFREG | 0644, NULL);
+
+		double start = now_ns();
+		for (off_t offset = 0; offset < COPY_SIZE; offset += COPY_IO_SIZE){
+			myfs_write("/duplicate", data + offset, COPY_IO_SIZE, offset, NULL);
+		}
+		double seconds = (now_ns() - start) / 1e9;
+
+		printf("%14s %14.1f %14.2f\n", modes[m], \
+					 COPY_SIZE / (1024.0 * 1024.0) / seconds, dedup_stats(NULL, NULL));
+		myfs_unlink("/original");
+		myfs_unlink("/duplicate");
+	}
+	dedup_set_enabled(0);
+	wb_set_dirty_limit(WB_DEFAULT_LIMIT);
+	free(data);
+}
+
+//The packed file ends half way through a block, so the tail is packed too
+#define PACK_SIZE (COPY_SIZE - MYFS_BLOCK_SIZE / 2)
+
+/**
+ * Times writing and reading back a file of log-like text with each codec, and
+ * reports the compression ratio and how fast the codec itself went. The last
+ * quarter of the file is random bytes, which do not compress. Whatever is read
+ * back has to match what was written, or the benchmark stops.
+ */
+static void bench_pack(){
+	printf("# writing and reading a %d MiB file, 3/4 text, compressed\n", \
+				 COPY_SIZE / (1024 * 1024));
+	printf("%8s %12s %12s %8s %12s %12s\n", "codec", "write_MiBps", "read_MiBps", \
+				 "ratio", "pack_MBps", "unpack_MBps");
+
+	const char* words[] = {"INFO ", "request ", "{\"id\": ", "\"status\": ", \
+												 "GET /api/v1/items ", "200", "\n"};
+	char* data = malloc(COPY_SIZE);
+	for (int i = 0; i < COPY_SIZE;){
+		const char* word = words[rand() % 7];
+		for (int k = 0; word[k] != '\0' && i < COPY_SIZE; k++){
+			data[i++] = word[k];
+		}
+		if (i < COPY_SIZE && rand() % 2){
+			data[i++] = '0' + rand() % 10;
+		}
+	}
+	for (int i = COPY_SIZE / 4 * 3; i < COPY_SIZE; i++){
+		data[i] = rand();
+	}
+	char* back = malloc(COPY_SIZE);
+
+	wb_set_dirty_limit(0);
+	const char* codecs[] = {"none", "lz4", "zstd"};
+	for (int c = 0; c < 3; c++){
+		if (pack_set_codec(codecs[c]) != 0){
+			continue;
+		}
+		myfs_create("/packed", S_IFREG | 0644, NULL);
+		double start = now_ns();
+		for (off_t offset = 0; offset < PACK_SIZE; offset += COPY_IO_SIZE){
+			size_t size = (PACK_SIZE - offset < COPY_IO_SIZE) ? \
+										PACK_SIZE - offset : COPY_IO_SIZE;
+			myfs_write("/packed", data + offset, size, offset, NULL);
+		}
+		double write_s = (now_ns() - start) / 1e9;
+		memset(back, 0, COPY_SIZE);
+		start = now_ns();
+		int got = myfs_read("/packed", back, COPY_SIZE, 0, NULL);
+		double read_s = (now_ns() - start) / 1e9;
+		if (got != PACK_SIZE || memcmp(back, data, PACK_SIZE) != 0){
+			fprintf(stderr, "%s read back %d bytes that do not match the %d written\n", \
+							codecs[c], got, PACK_SIZE);
+			exit(1);
+		}
+
+		//The stats are since mounting, so after the first codec they are totals
+		double pack_mbps;
+		double unpack_mbps;
+		double ratio = pack_stats(&pack_mbps, &unpack_mbps);
+		printf("%8s %12.1f %12.1f %8.2f %12.0f %12.0f\n", codecs[c], \
+					 PACK_SIZE / (1024.0 * 1024.0) / write_s, \
+					 PACK_SIZE / (1024.0 * 1024.0) / read_s, \
+					 ratio, pack_mbps, unpack_mbps);
+		myfs_unlink("/packed");
+	}
+	pack_set_codec("none");
+	wb_set_dirty_limit(WB_DEFAULT_LIMIT);
+	free(data);
+	free(back);
+}
+
+//How many tiny files, and how big each one is
+#define TINY_FILES 1000
+#define TINY_SIZE 200
+
+/**
+ * Times creating, reading back cold and deleting many tiny files, with their
+ * data inline in the meta data record and with it in a block of its own.
+ */
+static void bench_tiny(){
+	printf("# %d files of %d bytes\n", TINY_FILES, TINY_SIZE);
+	printf("%10s %12s %12s %12s %12s\n", "mode", "create_usec", "read_usec", \
+				 "unlink_usec", "read_fetches");
+
+	char buf[TINY_SIZE];
+	memset(buf, 't', sizeof(buf));
+	char path[MY_MAX_PATH];
+	myfs_mkdir("/tiny", 0755);
+	const char* modes[] = {"inline", "block"};
+	for (int m = 0; m < 2; m++){
+		data_set_inline_max((m == 0) ? MYFS_INLINE_MAX : 0);
+
+		double start = now_ns();
+		for (int i = 0; i < TINY_FILES; i++){
+			snprintf(path, MY_MAX_PATH, "/tiny/f%d", i);
+			myfs_create(path, S_IFREG | 0644, NULL);
+			myfs_write(path, buf, TINY_SIZE, 0, NULL);
+			myfs_release(path, NULL);
+		}
+		double create_us = (now_ns() - start) / 1e3 / TINY_FILES;
+
+		dcache_clear();
+		long fetches = kv_fetches;
+		start = now_ns();
+		for (int i = 0; i < TINY_FILES; i++){
+			snprintf(path, MY_MAX_PATH, "/tiny/f%d", i);
+			myfs_read(path, buf, TINY_SIZE, 0, NULL);
+		}
+		double read_us = (now_ns() - start) / 1e3 / TINY_FILES;
+		fetches = kv_fetches - fetches;
+
+		start = now_ns();
+		for (int i = 0; i < TINY_FILES; i++){
+			snprintf(path, MY_MAX_PATH, "/tiny/f%d", i);
+			myfs_unlink(path);
+		}
+		double unlink_us = (now_ns() - start) / 1e3 / TINY_FILES;
+
+		printf("%10s %12.2f %12.2f %12.2f %12ld\n", modes[m], create_us, read_us, \
+					 unlink_us, fetches);
+	}
+	data_set_inline_max(MYFS_INLINE_MAX);
+	myfs_rmdir("/tiny");
+}
+
+//How many times each thread creates and deletes a file when timing commits
+#define COMMIT_FILES 500
+#define COMMIT_THREADS 8
+
+typedef struct commit_thread {
+	pthread_t thread;
+	int number;
+	int round;
+} commit_thread;
+
+static void* commit_worker(void* arg){
+	commit_thread* self = arg;
+	char path[MY_MAX_PATH];
+	snprintf(path, MY_MAX_PATH, "/commit%d/t%d", self->round, self->number);
+	for (int i = 0; i < COMMIT_FILES; i++){
+		myfs_oper.create(path, S_IFREG | 0644, NULL);
+		myfs_oper.unlink(path);
+	}
+	return NULL;
+}
+
+/**
+ * Times creating and deleting files from several threads through the
+ * registered callbacks, so that each is its own transaction, with a commit per
+ * operation, with group commit and in the relaxed sync modes. The fsync mode
+ * is timed up to the one fsync that commits it all.
+ */
+static void bench_commit(){
+	printf("# %d threads each creating and deleting a file %d times\n", \
+				 COMMIT_THREADS, COMMIT_FILES);
+	printf("%14s %14s %14s\n", "mode", "ops_per_sec", "commits_per_op");
+
+	const char* modes[] = {"per-operation", "group", "periodic", "fsync"};
+	for (int m = 0; m < 4; m++){
+		char dir[MY_MAX_PATH];
+		snprintf(dir, MY_MAX_PATH, "/commit%d", m);
+		myfs_oper.mkdir(dir, 0755);
+		if (m < 2){
+			txn_set_group_commit((m == 0) ? 0 : 1000, MYFS_TXN_BATCH);
+		}else{
+			txn_set_sync((m == 2) ? TXN_SYNC_PERIODIC : TXN_SYNC_FSYNC, 10, 0);
+		}
+
+		long commits = txn_commits;
+		commit_thread workers[COMMIT_THREADS];
+		double start = now_ns();
+		for (int i = 0; i < COMMIT_THREADS; i++){
+			workers[i].number = i;
+			workers[i].round = m;
+			pthread_create(&workers[i].thread, NULL, commit_worker, &workers[i]);
+		}
+		for (int i = 0; i < COMMIT_THREADS; i++){
+			pthread_join(workers[i].thread, NULL);
+		}
+		myfs_oper.fsyncdir(dir, 0, NULL);
+		double seconds = (now_ns() - start) / 1e9;
+
+		int ops = 2 * COMMIT_THREADS * COMMIT_FILES;
+		printf("%14s %14.0f %14.3f\n", modes[m], ops / seconds, \
+					 (double)(txn_commits - commits) / ops);
+	}
+	txn_set_sync(TXN_SYNC_STRICT, 0, 0);
+}
+
+//How many records are logged per timing, which must fit in the ring
+#define LOG_CALLS (LOG_RING_SIZE / 2)
+
+/**
+ * Times a log call that is compiled out, one turned off at run time and one
+ * that goes into the ring. The records logged are written to the log.
+ */
+static void bench_log(){
+	printf("# cost of a log call with a path argument\n");
+	printf("%14s %14s\n", "mode", "ns_per_call");
+
+	const char* modes[] = {"compiled-out", "runtime-off", "ring"};
+	for (int m = 0; m < 3; m++){
+		log_set_level((m == 1) ? MYFS_LOG_ERROR : MYFS_LOG_INFO);
+		if (m == 2){
+			log_info("bench starting the logger\n");
+			usleep(10000);
+		}
+		double start = now_ns();
+		for (int i = 0; i < LOG_CALLS; i++){
+			if (m == 0){
+				write_log("bench %d of %s\n", i, "/some/path");
+			}else{
+				log_info("bench %d of %s\n", i, "/some/path");
+			}
+		}
+		printf("%14s %14.1f\n", modes[m], (now_ns() - start) / LOG_CALLS);
+	}
+	log_stop();
+	log_set_level(MYFS_LOG_INFO);
+}
+
+//Shared files every stress thread reads from, and how big they are
+#define STRESS_FILES 32
+#define STRESS_FILE_SIZE (64 * 1024)
+#define STRESS_IO_SIZE 4096
+//How long each thread count runs for, and what share of operations write
+#define STRESS_SECONDS 1.0
+#define STRESS_WRITE_PERCENT 10
+
+typedef struct stress_thread {
+	pthread_t thread;
+	int number;
+	double deadline;
+	long ops;
+} stress_thread;
+
+/**
+ * One stress thread: mostly getattr and read on the shared files, with some
+ * writes to a file of its own, until the deadline.
+ */
+static void* stress_worker(void* arg){
+	stress_thread* self = arg;
+	char path[MY_MAX_PATH];
+	char own_path[MY_MAX_PATH];
+	char buf[STRESS_IO_SIZE];
+	struct stat st;
+	unsigned int seed = self->number + 1;
+
+	memset(buf, 'w', sizeof(buf));
+	snprintf(own_path, MY_MAX_PATH, "/stress/w%d", self->number);
+	myfs_create(own_path, S_IFREG | 0644, NULL);
+
+	while (now_ns() < self->deadline){
+		for (int i = 0; i < 100; i++){
+			off_t offset = (rand_r(&seed) % (STRESS_FILE_SIZE / STRESS_IO_SIZE)) * \
+											STRESS_IO_SIZE;
+			if (rand_r(&seed) % 100 < STRESS_WRITE_PERCENT){
+				myfs_write(own_path, buf, STRESS_IO_SIZE, offset, NULL);
+			}else{
+				snprintf(path, MY_MAX_PATH, "/stress/r%d", \
+									rand_r(&seed) % STRESS_FILES);
+				myfs_getattr(path, &st);
+				myfs_read(path, buf, STRESS_IO_SIZE, offset, NULL);
+			}
+			self->ops++;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Runs N parallel readers and writers for growing N and reports throughput,
+ * to show how far the callbacks scale across threads. unqlite serialises every
+ * fetch behind the DB lock, so that backend measures the lock; "-b memory"
+ * lets fetches share it and shows the callbacks' own scaling. The speedup
+ * cannot pass the number of CPUs online, which is printed with it.
+ */
+static void bench_stress(){
+	printf("# mixed read/write throughput against thread count ");
+	printf("(%d%% writes, %d byte I/O, %s backend, %ld CPUs)\n", \
+				 STRESS_WRITE_PERCENT, STRESS_IO_SIZE, kv->name, \
+				 sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%10s %14s %10s\n", "threads", "ops_per_sec", "speedup");
+
+	char path[MY_MAX_PATH];
+	char* data = malloc(STRESS_FILE_SIZE);
+	memset(data, 'r', STRESS_FILE_SIZE);
+	myfs_mkdir("/stress", 0755);
+	for (int i = 0; i < STRESS_FILES; i++){
+		snprintf(path, MY_MAX_PATH, "/stress/r%d", i);
+		myfs_create(path, S_IFREG | 0644, NULL);
+		myfs_write(path, data, STRESS_FILE_SIZE, 0, NULL);
+	}
+	free(data);
+
+	double single = 0;
+	for (int threads = 1; threads <= 16; threads *= 2){
+		stress_thread workers[threads];
+		double start = now_ns();
+		for (int i = 0; i < threads; i++){
+			workers[i].number = i;
+			workers[i].ops = 0;
+			workers[i].deadline = start + STRESS_SECONDS * 1e9;
+			pthread_create(&workers[i].thread, NULL, stress_worker, &workers[i]);
+		}
+
+		long ops = 0;
+		for (int i = 0; i < threads; i++){
+			pthread_join(workers[i].thread, NULL);
+			ops += workers[i].ops;
+		}
+		double rate = ops / ((now_ns() - start) / 1e9);
+		if (threads == 1){
+			single = rate;
+		}
+		printf("%10d %14.0f %9.2fx\n", threads, rate, rate / single);
+	}
+}
+
+/*
+	Workloads. Unlike the microbenchmarks above, these go through the
+	registered callbacks in myfs_oper, as the kernel would, so each operation
+	is its own transaction. Every operation is timed on its own and the run is
+	summed up as operations per second and latency percentiles, either as a
+	table or as CSV for comparing one build against another.
+*/
+
+//How many files the file workloads use, how many operations are timed, and
+//how big a file the data workloads read and write, in what size of call
+#define WL_FILES 5000
+#define WL_OPS 20000
+#define WL_FILE_SIZE (16 * 1024 * 1024)
+#define WL_IO_SIZE 4096
+//How many directories deep the deep tree goes; each level is "/d", so the
+//file at the bottom only just fits in MY_MAX_PATH
+#define WL_DEPTH 45
+
+//The latency of each operation timed so far in the current workload
+static double* wl_samples;
+static int wl_count;
+
+static struct fuse_file_info wl_fi;
+
+//Times one call and keeps its latency
+#define WL_TIME(call) do { \
+	double wl_start = now_ns(); \
+	call; \
+	wl_samples[wl_count++] = now_ns() - wl_start; \
+} while (0)
+
+/**
+ * Creates /wl with a number of empty files in it, without timing anything.
+ *
+ * @param files how many files to create
+ */
+static void wl_populate(int files){
+	char path[MY_MAX_PATH];
+	myfs_oper.mkdir("/wl", 0755);
+	for (int i = 0; i < files; i++){
+		snprintf(path, MY_MAX_PATH, "/wl/f%d", i);
+		myfs_oper.create(path, S_IFREG | 0644, &wl_fi);
+		myfs_oper.release(path, &wl_fi);
+	}
+}
+
+/**
+ * Deletes what wl_populate() made.
+ *
+ * @param files how many files it was asked for
+ */
+static void wl_clear(int files){
+	char path[MY_MAX_PATH];
+	for (int i = 0; i < files; i++){
+		snprintf(path, MY_MAX_PATH, "/wl/f%d", i);
+		myfs_oper.unlink(path);
+	}
+	myfs_oper.rmdir("/wl");
+}
+
+/**
+ * Makes /wl/data WL_FILE_SIZE long, written front to back.
+ */
+static void wl_data_file(){
+	char buf[WL_IO_SIZE];
+	memset(buf, 'd', sizeof(buf));
+	myfs_oper.mkdir("/wl", 0755);
+	myfs_oper.create("/wl/data", S_IFREG | 0644, &wl_fi);
+	for (off_t offset = 0; offset < WL_FILE_SIZE; offset += WL_IO_SIZE){
+		myfs_oper.write("/wl/data", buf, WL_IO_SIZE, offset, &wl_fi);
+	}
+	myfs_oper.release("/wl/data", &wl_fi);
+}
+
+static void wl_data_clear(){
+	myfs_oper.unlink("/wl/data");
+	myfs_oper.rmdir("/wl");
+}
+
+//Creating a file and closing it again, as touch(1) would, into one directory
+static void wl_create(){
+	char path[MY_MAX_PATH];
+	myfs_oper.mkdir("/wl", 0755);
+	for (int i = 0; i < WL_FILES; i++){
+		snprintf(path, MY_MAX_PATH, "/wl/f%d", i);
+		WL_TIME(myfs_oper.create(path, S_IFREG | 0644, &wl_fi); \
+						myfs_oper.release(path, &wl_fi));
+	}
+	wl_clear(WL_FILES);
+}
+
+//getattr on random files, as ls -l or make would, with the dentry cache warm
+static void wl_stat(){
+	char path[MY_MAX_PATH];
+	struct stat st;
+	wl_populate(WL_FILES);
+	for (int i = 0; i < WL_OPS; i++){
+		snprintf(path, MY_MAX_PATH, "/wl/f%d", rand() % WL_FILES);
+		WL_TIME(myfs_oper.getattr(path, &st));
+	}
+	wl_clear(WL_FILES);
+}
+
+//getattr on random files of one big directory, with the dentry cache off so
+//that every call looks the name up in the directory
+static void wl_wide(){
+	char path[MY_MAX_PATH];
+	struct stat st;
+	wl_populate(WL_FILES);
+	dcache_set_capacity(0);
+	for (int i = 0; i < WL_OPS; i++){
+		snprintf(path, MY_MAX_PATH, "/wl/f%d", rand() % WL_FILES);
+		WL_TIME(myfs_oper.getattr(path, &st));
+	}
+	dcache_set_capacity(MYFS_DCACHE_SIZE);
+	wl_clear(WL_FILES);
+}
+
+//getattr on files that are not there, as a compiler searching its include
+//path would, over and over for the same few names
+static void wl_missing(){
+	char path[MY_MAX_PATH];
+	struct stat st;
+	wl_populate(WL_FILES);
+	for (int i = 0; i < WL_OPS; i++){
+		snprintf(path, MY_MAX_PATH, "/wl/h%d.h", rand() % 100);
+		WL_TIME(myfs_oper.getattr(path, &st));
+	}
+	wl_clear(WL_FILES);
+}
+
+//getattr at the bottom of a deep tree, with the dentry cache off so that
+//every call walks down from the root
+static void wl_deep(){
+	char path[MY_MAX_PATH] = "";
+	struct stat st;
+	for (int depth = 0; depth < WL_DEPTH; depth++){
+		strcat(path, "/d");
+		myfs_oper.mkdir(path, 0755);
+	}
+	strcat(path, "/f");
+	myfs_oper.create(path, S_IFREG | 0644, &wl_fi);
+	myfs_oper.release(path, &wl_fi);
+
+	dcache_set_capacity(0);
+	for (int i = 0; i < WL_OPS; i++){
+		WL_TIME(myfs_oper.getattr(path, &st));
+	}
+	dcache_set_capacity(MYFS_DCACHE_SIZE);
+
+	myfs_oper.unlink(path);
+	for (int depth = WL_DEPTH; depth > 0; depth--){
+		path[2 * depth] = '\0';
+		myfs_oper.rmdir(path);
+	}
+}
+
+//Writing a file front to back; closing it is timed as one more operation
+static void wl_seq_write(){
+	char buf[WL_IO_SIZE];
+	memset(buf, 'w', sizeof(buf));
+	myfs_oper.mkdir("/wl", 0755);
+	myfs_oper.create("/wl/data", S_IFREG | 0644, &wl_fi);
+	for (off_t offset = 0; offset < WL_FILE_SIZE; offset += WL_IO_SIZE){
+		WL_TIME(myfs_oper.write("/wl/data", buf, WL_IO_SIZE, offset, &wl_fi));
+	}
+	WL_TIME(myfs_oper.release("/wl/data", &wl_fi));
+	wl_data_clear();
+}
+
+//Overwriting the first blocks of a file at the bottom of the deep tree
+//through one open file, with the dentry cache turned off. It only costs more
+//than rand_write if writes look the file's path up.
+static void wl_deep_write(){
+	char path[MY_MAX_PATH] = "";
+	char buf[WL_IO_SIZE];
+	memset(buf, 'p', sizeof(buf));
+	for (int depth = 0; depth < WL_DEPTH; depth++){
+		strcat(path, "/d");
+		myfs_oper.mkdir(path, 0755);
+	}
+	strcat(path, "/f");
+	myfs_oper.create(path, S_IFREG | 0644, &wl_fi);
+
+	dcache_set_capacity(0);
+	for (int i = 0; i < WL_OPS; i++){
+		off_t offset = (off_t)(i % 256) * WL_IO_SIZE;
+		WL_TIME(myfs_oper.write(path, buf, WL_IO_SIZE, offset, &wl_fi));
+	}
+	dcache_set_capacity(MYFS_DCACHE_SIZE);
+
+	myfs_oper.release(path, &wl_fi);
+	myfs_oper.unlink(path);
+	for (int depth = WL_DEPTH; depth > 0; depth--){
+		path[2 * depth] = '\0';
+		myfs_oper.rmdir(path);
+	}
+}
+
+//Reading a file front to back, starting with nothing cached, through one
+//open file so that it is read ahead of
+static void wl_seq_read(){
+	char buf[WL_IO_SIZE];
+	wl_data_file();
+	dcache_clear();
+	myfs_oper.open("/wl/data", &wl_fi);
+	for (off_t offset = 0; offset < WL_FILE_SIZE; offset += WL_IO_SIZE){
+		WL_TIME(myfs_oper.read("/wl/data", buf, WL_IO_SIZE, offset, &wl_fi));
+	}
+	myfs_oper.release("/wl/data", &wl_fi);
+	wl_data_clear();
+}
+
+//Overwriting random blocks of a file through one open file; closing it is
+//timed as one more operation
+static void wl_rand_write(){
+	char buf[WL_IO_SIZE];
+	memset(buf, 'r', sizeof(buf));
+	wl_data_file();
+	myfs_oper.open("/wl/data", &wl_fi);
+	for (int i = 0; i < WL_OPS; i++){
+		off_t offset = (off_t)(rand() % (WL_FILE_SIZE / WL_IO_SIZE)) * WL_IO_SIZE;
+		WL_TIME(myfs_oper.write("/wl/data", buf, WL_IO_SIZE, offset, &wl_fi));
+	}
+	WL_TIME(myfs_oper.release("/wl/data", &wl_fi));
+	wl_data_clear();
+}
+
+//Reading random blocks of a file
+static void wl_rand_read(){
+	char buf[WL_IO_SIZE];
+	wl_data_file();
+	dcache_clear();
+	myfs_oper.open("/wl/data", &wl_fi);
+	for (int i = 0; i < WL_OPS; i++){
+		off_t offset = (off_t)(rand() % (WL_FILE_SIZE / WL_IO_SIZE)) * WL_IO_SIZE;
+		WL_TIME(myfs_oper.read("/wl/data", buf, WL_IO_SIZE, offset, &wl_fi));
+	}
+	myfs_oper.release("/wl/data", &wl_fi);
+	wl_data_clear();
+}
+
+typedef struct workload {
+	const char* name;
+	void (*run)();
+} workload;
+
+static const workload workloads[] = {
+	{"create", wl_create},
+	{"stat", wl_stat},
+	{"wide", wl_wide},
+	{"missing", wl_missing},
+	{"deep", wl_deep},
+	{"seq_write", wl_seq_write},
+	{"seq_read", wl_seq_read},
+	{"rand_write", wl_rand_write},
+	{"rand_read", wl_rand_read},
+	{"deep_write", wl_deep_write},
+};
+
+#define WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+//Room for the most operations any workload times
+#define WL_MAX_SAMPLES (WL_FILE_SIZE / WL_IO_SIZE + WL_OPS + 1)
+
+static int compare_samples(const void* a, const void* b){
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @param q which percentile, from 0 to 1
+ *
+ * @return the latency below which that share of the sorted samples lie
+ */
+static double wl_percentile(double q){
+	return wl_samples[(int)(q * (wl_count - 1))];
+}
+
+/**
+ * Runs one workload and prints how it did.
+ *
+ * @param w the workload
+ * @param csv non-0 to print a CSV row rather than a table row
+ * @param label what to call this build in CSV rows
+ */
+static void run_workload(const workload* w, int csv, const char* label){
+	wl_count = 0;
+	w->run();
+	double total = 0;
+	for (int i = 0; i < wl_count; i++){
+		total += wl_samples[i];
+	}
+	qsort(wl_samples, wl_count, sizeof(double), compare_samples);
+
+	double ops_per_sec = wl_count / (total / 1e9);
+	if (csv){
+		printf("%s,%s,%d,%.0f,%.0f,%.0f,%.0f,%.0f\n", label, w->name, wl_count, \
+					 ops_per_sec, wl_percentile(0.5), wl_percentile(0.9), \
+					 wl_percentile(0.99), wl_samples[wl_count - 1]);
+	}else{
+		printf("%12s %8d %12.0f %10.0f %10.0f %10.0f %10.0f\n", w->name, wl_count, \
+					 ops_per_sec, wl_percentile(0.5), wl_percentile(0.9), \
+					 wl_percentile(0.99), wl_samples[wl_count - 1]);
+	}
+	fflush(stdout);
+}
+
+/**
+ * Counts a record and its bytes into ctx, a long[2].
+ */
+static int count_record(const void* key, int key_len, const void* data, \
+												unqlite_int64 len, void* ctx){
+	(void) key;
+	(void) key_len;
+	(void) data;
+	long* counts = ctx;
+	counts[0]++;
+	counts[1] += len;
+	return 0;
+}
+
+/**
+ * Runs the workloads.
+ *
+ * @param only the one workload to run, or NULL for all of them
+ * @param csv non-0 for CSV output
+ * @param label what to call this build in CSV rows
+ *
+ * @return 0, or 1 if there is no such workload
+ */
+static int bench_workloads(const char* only, int csv, const char* label){
+	size_t first = 0;
+	size_t last = WORKLOADS;
+	if (only != NULL){
+		for (first = 0; first < WORKLOADS; first++){
+			if (strcmp(only, workloads[first].name) == 0){
+				break;
+			}
+		}
+		if (first == WORKLOADS){
+			fprintf(stderr, "No workload called %s\n", only);
+			return 1;
+		}
+		last = first + 1;
+	}
+
+	wl_samples = malloc(WL_MAX_SAMPLES * sizeof(double));
+	if (csv){
+		printf("build,workload,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,max_ns\n");
+	}else{
+		printf("# workloads through myfs_oper, latency in ns\n");
+		printf("%12s %8s %12s %10s %10s %10s %10s\n", "workload", "ops", \
+					 "ops_per_sec", "p50", "p90", "p99", "max");
+	}
+	for (size_t i = first; i < last; i++){
+		run_workload(&workloads[i], csv, label);
+	}
+	free(wl_samples);
+
+	//Each workload deletes what it made, so only the root's records should be
+	//left
+	long left[2] = {0, 0};
+	kv_scan(NULL, 0, count_record, left);
+	fprintf(csv ? stderr : stdout, "# left in the store: %ld records, %ld bytes\n", \
+					left[0], left[1]);
+	return 0;
+}
+
+/**
+ * Runs the microbenchmarks, each printing its own table.
+ */
+static void bench_micro(){
+	bench_lookup();
+	bench_dir();
+	bench_rename();
+	bench_resolve();
+	bench_copy();
+	bench_sparse();
+	bench_dedup();
+	bench_pack();
+	bench_tiny();
+	bench_commit();
+	bench_stress();
+	bench_log();
+}
+
+int main(int argc, char* argv[]){
+	const char* only = NULL;
+	const char* label = "-";
+	const char* backend = "unqlite";
+	const char* segments = NULL;
+	int csv = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:cl:b:s:r:")) != -1){
+		switch (opt){
+			case 'w':
+				only = optarg;
+				break;
+			case 'c':
+				csv = 1;
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			case 'b':
+				backend = optarg;
+				break;
+			case 's':
+				segments = optarg;
+				break;
+			case 'r':
+				ra_set_window(atol(optarg));
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-w workload|micro] [-c] [-l build] " \
+								"[-b backend] [-s segment dir] [-r readahead KiB] " \
+								"[database file]\n", argv[0]);
+				return 1;
+		}
+	}
+	const char* db_path = (optind < argc) ? argv[optind] : ":mem:";
+	if (bench_init(backend, db_path) != 0 || \
+			(segments != NULL && seg_open(segments) != 0)){
+		return 1;
+	}
+	srand(1);
+
+	int rc = 0;
+	if (only != NULL && strcmp(only, "micro") == 0){
+		bench_micro();
+	}else{
+		//CSV is only for the workloads, so the microbenchmarks are left out
+		if (only == NULL && !csv){
+			bench_micro();
+		}
+		rc = bench_workloads(only, csv, label);
+	}
+
+	ra_stop();
+	if (segments != NULL){
+		seg_close();
+	}
+	unqlite_close(pDb);
+	return rc;
+}